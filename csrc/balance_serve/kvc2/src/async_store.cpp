@@ -1,9 +1,16 @@
 
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/falloc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <deque>
 #include <filesystem>
 #include <future>
 #include <iostream>
@@ -16,6 +23,7 @@
 #include <photon/common/alog.h>
 #include <photon/common/io-alloc.h>
 #include <photon/fs/localfs.h>
+#include <photon/io/fd-events.h>
 #include <photon/photon.h>
 #include <photon/thread/thread11.h>
 #include "utils/lock_free_queue.hpp"
@@ -53,6 +61,22 @@ struct ArrayStore {
     LOG_INFO("Extend file to `, size `", to, size_in_bytes());
   }
 
+  void shrink(size_t to) {
+    if (to >= size) {
+      return;
+    }
+    file->ftruncate(to * element_size_aligned);
+    size = to;
+    LOG_INFO("Shrink file to `, size `", to, size_in_bytes());
+  }
+
+  void punch_hole(size_t index, size_t count) {
+    if (file->fallocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, index * element_size_aligned,
+                        count * element_size_aligned) != 0) {
+      LOG_WARN("Cannot punch hole of ` elements at ` in `", count, index, data_path.c_str());
+    }
+  }
+
   ArrayStore(size_t element_size, size_t size, std::filesystem::path data_path)
       : element_size(element_size),
         element_size_aligned(align_up(element_size, DeviceBlockSize)),
@@ -87,8 +111,6 @@ struct ArrayStore {
       perror("Error reading from file");
       LOG_ERROR("Error reading to file ` ` `, ret `", buffer, element_size, index * element_size_aligned, ret);
     }
-    file->fdatasync();
-    file->fsync();
   }
   void write(size_t index, void* buffer) {
     size_t ret = file->pwrite(buffer, element_size, index * element_size_aligned);
@@ -99,6 +121,28 @@ struct ArrayStore {
                 ret);
     }
   }
+
+  // Elements can be read or written with one vectored request when they are packed on disk
+  bool packed() { return element_size == element_size_aligned; }
+
+  // Reads the elements [index, index + iov.size()) into the buffers of iov
+  void readv(size_t index, const std::vector<struct iovec>& iov) {
+    size_t ret = file->preadv(iov.data(), iov.size(), index * element_size_aligned);
+    if (ret != iov.size() * element_size) {
+      perror("Error reading from file");
+      LOG_ERROR("Error reading ` elements from file at `, ret `", iov.size(), index * element_size_aligned, ret);
+    }
+  }
+
+  void writev(size_t index, const std::vector<struct iovec>& iov) {
+    size_t ret = file->pwritev(iov.data(), iov.size(), index * element_size_aligned);
+    if (ret != iov.size() * element_size) {
+      perror("Error writing to file");
+      LOG_ERROR("Error writing ` elements to file at `, ret `", iov.size(), index * element_size_aligned, ret);
+    }
+  }
+
+  void sync() { file->fdatasync(); }
 };
 
 ArrayStore* create_or_open_store(size_t element_size, size_t size, std::filesystem::path data_path) {
@@ -117,6 +161,18 @@ void extend(ArrayStore* store, size_t to) {
   store->extend(to);
 }
 
+void shrink(ArrayStore* store, size_t to) {
+  store->shrink(to);
+}
+
+void punch_hole(ArrayStore* store, size_t index, size_t count) {
+  store->punch_hole(index, count);
+}
+
+size_t element_bytes(ArrayStore* store) {
+  return store->element_size_aligned;
+}
+
 template <typename T>
 struct ArrayStoreT {
   ArrayStore store;
@@ -133,51 +189,269 @@ std::string request_to_string(IORequest* req) {
                      req->store->data_path.c_str(), req->index);
 }
 
+/*
+One photon thread takes every queued request at once, sorts the requests of each priority class and merges those on
+adjacent indices of a store into runs, each served by one preadv or pwritev on its own photon thread. The writes of a
+batch are synced once per store before their promises are set. Reads are never synced.
+
+Runs wait in one queue per class. In each round a class issues up to its weight of runs, as long as it is under its
+own depth limit and at most IO_DEPTH runs are in flight, so background write-back never takes the slots of
+foreground reads. Reads whose requests are all cancelled are dropped when they are issued.
+
+The dispatcher sleeps on an eventfd when it has nothing to issue, enqueue() and finished runs write to it only then.
+*/
 struct IODealerImpl {
-  MPSCQueue<IORequest> ioQueue;
+  std::array<MPSCQueue<IORequest>, IOPriorityCount> queues;
   uint64_t io_cnt = 0;
+  uint64_t run_cnt = 0;
+  uint64_t cancelled_cnt = 0;
   size_t io_amount = 0;
   bool use_io_uring;
   int IO_DEPTH;
 
-  bool stop = false;
-  IODealerImpl(bool use_io_uring, int IO_DEPTH) : use_io_uring(use_io_uring), IO_DEPTH(IO_DEPTH) {}
+  static constexpr size_t MaxRunBytes = 4 << 20;
+  // runs issued per round, and the share of IO_DEPTH a class may hold
+  static constexpr std::array<size_t, IOPriorityCount> Weight = {4, 1};
+  static constexpr std::array<size_t, IOPriorityCount> DepthShare = {1, 4};
 
-  void queue_consumer() {
-    while (stop == false) {
-      if (auto request = ioQueue.dequeue(); request) {
-        if (request->write) {
-          request->store->write(request->index, request->data);
-        } else {
-          request->store->read(request->index, request->data);
+  std::function<void(IOPriority, double)> latency_observer = nullptr;
+
+  int wake_fd;
+  std::atomic_bool sleeping = false;
+
+  std::atomic_bool stop = false;
+  IODealerImpl(bool use_io_uring, int IO_DEPTH) : use_io_uring(use_io_uring), IO_DEPTH(IO_DEPTH) {
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  }
+  ~IODealerImpl() { ::close(wake_fd); }
+
+  // Writes of one batch, all photon threads of the dealer run on one vcpu so this needs no lock
+  struct WriteBatch {
+    size_t pending = 0;
+    std::vector<ArrayStore*> stores;
+    std::vector<std::shared_ptr<IORequest>> requests;
+  };
+
+  // Requests on adjacent indices of one store
+  struct Run {
+    ArrayStore* store;
+    bool write;
+    size_t index;
+    std::vector<std::shared_ptr<IORequest>> requests;
+    std::shared_ptr<WriteBatch> writes = nullptr;
+  };
+
+  std::array<std::deque<Run>, IOPriorityCount> pending;
+  std::array<size_t, IOPriorityCount> inflight = {};
+  size_t total_inflight = 0;
+
+  size_t depth_limit(size_t priority) { return std::max<size_t>(1, IO_DEPTH / DepthShare[priority]); }
+
+  bool queues_empty() {
+    for (auto& queue : queues) {
+      if (queue.empty() == false) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void wake_up() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.exchange(false)) {
+      uint64_t one = 1;
+      if (::write(wake_fd, &one, sizeof(one)) < 0) {
+        LOG_ERROR("Cannot wake up IO dealer");
+      }
+    }
+  }
+
+  void wait_for_requests() {
+    sleeping.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (queues_empty() && stop == false) {
+      photon::wait_for_fd_readable(wake_fd, 1000 * 1000);
+      uint64_t count;
+      if (::read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        LOG_ERROR("Cannot read IO dealer eventfd");
+      }
+    }
+    sleeping.store(false);
+  }
+
+  void finish(std::vector<std::shared_ptr<IORequest>>& requests) {
+    auto now = std::chrono::steady_clock::now();
+    for (auto& request : requests) {
+      if (latency_observer) {
+        latency_observer(request->priority,
+                         std::chrono::duration<double, std::milli>(now - request->enqueue_time).count());
+      }
+      if (request->need_promise) {
+        request->promise->set();
+      }
+    }
+  }
+
+  static bool all_cancelled(const Run& run) {
+    for (auto& request : run.requests) {
+      if (request->cancelled == nullptr || request->cancelled->load() == false) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void serve(Run& run) {
+    auto store = run.store;
+    if (run.write == false && all_cancelled(run)) {
+      // nobody waits for this data, a partly cancelled run is still read to keep it one request
+      cancelled_cnt += run.requests.size();
+      finish(run.requests);
+      return;
+    }
+    if (run.requests.size() == 1) {
+      if (run.write) {
+        store->write(run.index, run.requests[0]->data);
+      } else {
+        store->read(run.index, run.requests[0]->data);
+      }
+    } else {
+      std::vector<struct iovec> iov;
+      for (auto& request : run.requests) {
+        iov.push_back({request->data, store->element_size});
+      }
+      if (run.write) {
+        store->writev(run.index, iov);
+      } else {
+        store->readv(run.index, iov);
+      }
+    }
+    io_cnt += run.requests.size();
+    run_cnt += 1;
+    io_amount += run.requests.size() * store->element_size_aligned;
+
+    if (run.write == false) {
+      finish(run.requests);
+      return;
+    }
+    auto& writes = *run.writes;
+    writes.requests.insert(writes.requests.end(), run.requests.begin(), run.requests.end());
+    if (--writes.pending == 0) {
+      for (auto s : writes.stores) {
+        s->sync();
+      }
+      finish(writes.requests);
+    }
+  }
+
+  // Turns the queued requests of a class into runs, returns whether there were any
+  bool take(size_t priority) {
+    std::vector<std::shared_ptr<IORequest>> batch;
+    while (auto request = queues[priority].dequeue()) {
+      batch.push_back(std::move(request));
+    }
+    if (batch.empty()) {
+      return false;
+    }
+    std::stable_sort(batch.begin(), batch.end(), [](const auto& a, const auto& b) {
+      return std::tie(a->store, a->write, a->index) < std::tie(b->store, b->write, b->index);
+    });
+    std::vector<Run> runs;
+    for (auto& request : batch) {
+      if (runs.empty() == false) {
+        auto& run = runs.back();
+        if (run.store == request->store && run.write == request->write &&
+            run.index + run.requests.size() == request->index && run.store->packed() && run.requests.size() < IOV_MAX &&
+            (run.requests.size() + 1) * run.store->element_size_aligned <= MaxRunBytes) {
+          run.requests.push_back(std::move(request));
+          continue;
         }
-        io_cnt += 1;
-        io_amount += request->store->element_size_aligned;
+      }
+      runs.push_back(Run{request->store, request->write, request->index, {std::move(request)}});
+    }
 
-        if (request->need_promise) {
-          // LOG_INFO("Set Promise `",request->promise);
-          request->promise->set();
+    std::shared_ptr<WriteBatch> writes;
+    for (auto& run : runs) {
+      if (run.write) {
+        if (writes == nullptr) {
+          writes = std::make_shared<WriteBatch>();
+        }
+        writes->pending++;
+        if (std::find(writes->stores.begin(), writes->stores.end(), run.store) == writes->stores.end()) {
+          writes->stores.push_back(run.store);
+        }
+        run.writes = writes;
+      }
+      pending[priority].push_back(std::move(run));
+    }
+    return true;
+  }
+
+  void launch(size_t priority) {
+    auto r = new Run(std::move(pending[priority].front()));
+    pending[priority].pop_front();
+    inflight[priority]++;
+    total_inflight++;
+    photon::thread_create11([this, r, priority]() {
+      serve(*r);
+      delete r;
+      inflight[priority]--;
+      total_inflight--;
+      wake_up();
+    });
+  }
+
+  // Weighted round robin over the classes, returns whether any run was issued
+  bool issue() {
+    bool issued = false;
+    for (bool progress = true; progress;) {
+      progress = false;
+      for (size_t priority = 0; priority < IOPriorityCount; priority++) {
+        for (size_t n = 0; n < Weight[priority] && pending[priority].empty() == false &&
+                           inflight[priority] < depth_limit(priority) && total_inflight < (size_t)IO_DEPTH;
+             n++) {
+          launch(priority);
+          progress = issued = true;
         }
-        // photon::thread_yield();
-      } else {
-        // 队列为空，避免忙等
-        photon::thread_usleep(10);
-        // photon::thread_yield();
       }
     }
+    return issued;
+  }
+
+  void dispatcher() {
+    while (stop == false) {
+      bool taken = false;
+      for (size_t priority = 0; priority < IOPriorityCount; priority++) {
+        taken |= take(priority);
+      }
+      if (issue() == false && taken == false) {
+        wait_for_requests();
+      }
+    }
+    // let the runs in flight finish
+    while (total_inflight > 0) {
+      photon::thread_usleep(1000);
+    }
   }
 
   void io_perf() {
     LOG_INFO("IO Depth `", IO_DEPTH);
     while (stop == false) {
       photon::thread_sleep(1);
-      if (io_cnt == 0) {
+      if (io_cnt == 0 && cancelled_cnt == 0) {
         continue;
       }
-      LOG_INFO("IO queue remaining: ` , processed ` M.  IO count: ` Kops, ` M/s",
-               (ioQueue.enqueue_count - ioQueue.dequeue_count), ioQueue.dequeue_count / 1e6, io_cnt / 1e3,
+      for (size_t priority = 0; priority < IOPriorityCount; priority++) {
+        auto& queue = queues[priority];
+        LOG_INFO("IO queue ` remaining: ` requests, ` runs, ` in flight, processed ` M", priority,
+                 (queue.enqueue_count - queue.dequeue_count), pending[priority].size(), inflight[priority],
+                 queue.dequeue_count / 1e6);
+      }
+      LOG_INFO("IO count: ` Kops in ` K requests, ` cancelled, ` M/s", io_cnt / 1e3, run_cnt / 1e3, cancelled_cnt,
                io_amount / 1e6);
       io_cnt = 0;
+      run_cnt = 0;
+      cancelled_cnt = 0;
       io_amount = 0;
     }
   }
@@ -198,9 +472,7 @@ struct IODealerImpl {
     handles.push_back(photon::thread_enable_join(photon::thread_create11([this]() { io_perf(); })));
 
     LOG_INFO("Initializing IO Dealer");
-    for (int i = 0; i < IO_DEPTH; i++) {
-      handles.push_back(photon::thread_enable_join(photon::thread_create11([this]() { queue_consumer(); })));
-    }
+    handles.push_back(photon::thread_enable_join(photon::thread_create11([this]() { dispatcher(); })));
     for (auto& handle : handles) {
       photon::thread_join(handle);
     }
@@ -217,7 +489,13 @@ IODealer::~IODealer() {
 }
 
 void IODealer::enqueue(std::shared_ptr<IORequest> req) {
-  io_impl->ioQueue.enqueue(req);
+  req->enqueue_time = std::chrono::steady_clock::now();
+  io_impl->queues[req->priority].enqueue(req);
+  io_impl->wake_up();
+}
+
+void IODealer::observe_latency(std::function<void(IOPriority, double)> observer) {
+  io_impl->latency_observer = std::move(observer);
 }
 
 std::thread IODealer::start_io_thread() {
@@ -229,6 +507,7 @@ void IODealer::stop() {
   }
   LOG_INFO("Stopping IO Dealer");
   io_impl->stop = true;
+  io_impl->wake_up();
 }
 
 }  // namespace async_store
@@ -1,6 +1,9 @@
 #pragma once
+#include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <filesystem>
+#include <functional>
 
 #define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_DEBUG
 #define FMT_HEADER_ONLY
@@ -16,18 +19,48 @@ ArrayStore* create_or_open_store(size_t element_size, size_t size, std::filesyst
 void close_store(ArrayStore* store);
 size_t capacity(ArrayStore* store);
 void extend(ArrayStore* store, size_t to);
+// Truncates the store to `to` elements if it is larger.
+void shrink(ArrayStore* store, size_t to);
+// Gives the disk space of elements [index, index + count) back to the file system, they read as zeros after.
+void punch_hole(ArrayStore* store, size_t index, size_t count);
+// Bytes one element takes on disk
+size_t element_bytes(ArrayStore* store);
 
 
 
+// Foreground requests are waited on by a query, background ones write dirty blocks back
+enum IOPriority {
+  IO_Foreground = 0,
+  IO_Background = 1,
+};
+constexpr size_t IOPriorityCount = 2;
+
+inline std::string to_string(IOPriority priority) {
+  switch (priority) {
+    case IO_Foreground:
+      return "foreground";
+    case IO_Background:
+      return "background";
+    default:
+      return "Unknown";
+  }
+}
+
 struct IORequest {
   ArrayStore* store;
   bool write;
   void* data;
   size_t index;
+  IOPriority priority = IO_Foreground;
+
+  // A queued read is dropped, and its promise set, once this is true. Writes are never dropped.
+  const std::atomic_bool* cancelled = nullptr;
 
   // for sync
   bool need_promise = false;
   BatchPromise* promise;
+
+  std::chrono::steady_clock::time_point enqueue_time;
 };
 
 std::string request_to_string(IORequest* req);
@@ -44,6 +77,8 @@ struct IODealer {
   IODealer& operator=(IODealer&&) = default;
 
   void enqueue(std::shared_ptr<IORequest> req);
+  // Called with the class and the milliseconds from enqueue to completion of every request, set before starting
+  void observe_latency(std::function<void(IOPriority, double)> observer);
   std::thread start_io_thread();
   void stop();
 };
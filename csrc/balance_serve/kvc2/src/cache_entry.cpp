@@ -32,7 +32,7 @@ bool CacheBlockEntry::alloc_on_cpu() {
   assert(data == nullptr);
   data = manager->pool->alloc(size);
   if (data == nullptr) {
-    manager->evict_for_cpu_cache();
+    manager->evict_for_cpu_cache(size);
     data = manager->pool->alloc(size);
     if (data == nullptr) {
       SPDLOG_ERROR("Not enough memory for Block Cache");
@@ -56,9 +56,15 @@ bool CacheBlockEntry::alloc_on_cpu_no_lock() {
   return true;
 }
 
-bool CacheBlockEntry::inc_ref_or_alloc_on_cpu() {
+bool CacheBlockEntry::inc_ref_or_alloc_on_cpu(std::vector<void*>* reserved) {
   std::lock_guard<CacheBlockEntry::MutexT> lg(lock);
   if (data == nullptr) {
+    if (reserved != nullptr && reserved->empty() == false) {
+      data = reserved->back();
+      reserved->pop_back();
+      cpu_cc.ref_count.fetch_add(1);
+      return true;
+    }
     if (alloc_on_cpu()) {
       cpu_cc.ref_count.fetch_add(1);
       return true;
@@ -139,6 +145,11 @@ void CacheBlockEntry::io_with(async_store::IODealer* dealer, IO_Helper<CacheBloc
   req->data = data;
   req->index = index;
   req->write = write;
+  // write-back yields to the reads and writes a query waits for
+  req->priority = option == IO_Write ? async_store::IO_Background : async_store::IO_Foreground;
+  if (write == false) {
+    req->cancelled = io_helper.cancelled;
+  }
   req->need_promise = true;
   req->promise = &batch_promise;
 
@@ -148,13 +159,14 @@ void CacheBlockEntry::io_with(async_store::IODealer* dealer, IO_Helper<CacheBloc
 
 CacheEntryManager::CacheEntryManager(CacheEntryManagerConfig config) : config(config) {}
 
-void CacheEntryManager::evict_for_cpu_cache() {
-  size_t count = 0;
+void CacheEntryManager::evict_for_cpu_cache(size_t bytes) {
+  size_t count = 0, freed = 0;
   evict(
-      [&count](const BlockPtr& block) {
+      [&count, &freed](const BlockPtr& block) {
         // here we assume each with gpu must resides on cpu
         if (block->data != nullptr && block->cpu_cc.can_desert() &&
             block->gpu_cc.can_desert() /*For now If A Cache Entry Block is on GPU, it must on cpu. */) {
+          freed += block->size;
           block->free_on_cpu();
           count += 1;
           return true;
@@ -162,81 +174,173 @@ void CacheEntryManager::evict_for_cpu_cache() {
           return false;
         }
       },
-      [&count, this]() {
-        return false;
-        // return count == this->config.evict_count;
-      });
+      [&count, &freed, bytes, this]() { return freed >= bytes && count >= this->config.evict_count; });
+}
+
+CacheEntryManager::Shard& CacheEntryManager::shard_of(const Key& key) {
+  return shards[key % Shards];
 }
 
-void CacheEntryManager::insert(BlockPtr entry) {
+void CacheEntryManager::insert(Shard& shard, BlockPtr entry) {
   assert(entry->with_key);
-  assert(key_entry_map.count(entry->hash) == 0);
-  usage_list.push_front(entry);
-  key_entry_map[entry->hash] = usage_list.begin();
+  assert(shard.entries.count(entry->hash) == 0);
+  entry->freq = 0;
+  auto ghost = shard.ghost_entries.find(entry->hash);
+  if (ghost != shard.ghost_entries.end()) {
+    // evicted from small not long ago, it is reused
+    shard.ghost.erase(ghost->second);
+    shard.ghost_entries.erase(ghost);
+    shard.main.push_back(entry);
+    shard.entries[entry->hash] = Slot{std::prev(shard.main.end()), true};
+  } else {
+    shard.small.push_back(entry);
+    shard.entries[entry->hash] = Slot{std::prev(shard.small.end()), false};
+  }
 }
 
-CacheEntryManager::BlockPtr CacheEntryManager::access(const Key& key) {
-  auto it = key_entry_map.at(key);
-  auto entry = *it;
-  usage_list.erase(it);
-  usage_list.push_front(entry);
-  key_entry_map[key] = usage_list.begin();
+CacheEntryManager::BlockPtr CacheEntryManager::access(Shard& shard, const Key& key) {
+  auto entry = *shard.entries.at(key).it;
+  if (entry->freq < MaxFreq) {
+    entry->freq++;
+  }
   return entry;
 }
 
-// void CacheEntryManager::remove(const Key& key) {
-//   auto it = key_entry_map[key];
-//   usage_list.erase(it);
-//   key_entry_map.erase(key);
-// }
+void CacheEntryManager::remember_evicted(Shard& shard, const Key& key) {
+  shard.ghost.push_back(key);
+  shard.ghost_entries[key] = std::prev(shard.ghost.end());
+  // remember as many keys as the shard holds entries
+  while (shard.ghost.size() > std::max<size_t>(shard.entries.size(), 1)) {
+    shard.ghost_entries.erase(shard.ghost.front());
+    shard.ghost.pop_front();
+  }
+}
 
-void CacheEntryManager::evict(std::function<bool(const BlockPtr&)> filter, std::function<bool()> stop_condition) {
-  auto evict_count = 0;
-  auto inspect_count = 0;
-
-  std::lock_guard<std::mutex> lg(lock);
-  for (auto it = usage_list.rbegin(); it != usage_list.rend();) {
-    inspect_count += 1;
-    // SPDLOG_DEBUG("Map Size {}, List Size {}, Evicted {} blocks, Inspected {}, {}", key_entry_map.size(),
-    //              usage_list.size(), evict_count, inspect_count, pool->debug());
-    // (*it)->debug();
-    if (stop_condition())
-      break;
-    auto entry_ul = (*it)->try_lock();
-    if (entry_ul.owns_lock() == false) {
-      ++it;  // Ensure iterator advances when locking fails
+CacheEntryManager::BlockPtr CacheEntryManager::evict_one(Shard& shard,
+                                                         const std::function<bool(const BlockPtr&)>& filter,
+                                                         EvictScan& scan) {
+  while (scan.budget > 0 && shard.entries.empty() == false) {
+    bool small_done = scan.passed_small >= shard.small.size();
+    bool main_done = scan.passed_main >= shard.main.size();
+    if (small_done && main_done) {
+      // nothing left that could be evicted now
+      return nullptr;
+    }
+    scan.budget--;
+    bool from_small = shard.main.empty() || shard.small.size() * 10 > shard.entries.size();
+    if (from_small ? small_done : main_done) {
+      // e.g. a small queue of entries in use would otherwise take every turn
+      from_small = !from_small;
+    }
+    auto& queue = from_small ? shard.small : shard.main;
+    auto& passed = from_small ? scan.passed_small : scan.passed_main;
+    auto entry = queue.front();
+    auto& slot = shard.entries.at(entry->hash);
+
+    if (from_small && entry->freq > 0) {
+      // hit again while in small
+      entry->freq = 0;
+      shard.main.splice(shard.main.end(), shard.small, slot.it);
+      slot.in_main = true;
       continue;
     }
-    if (filter(*it)) {
-      // SPDLOG_DEBUG("Evicting {}", fmt::ptr(it->get()));
-      evict_count++;
-      if ((*it)->with_key)
-        key_entry_map.erase((*it)->hash);
-      it = decltype(it)(usage_list.erase(std::next(it).base()));  // Use base() to adjust for reverse iterator
-    } else {
-      ++it;  // Ensure iterator advances when filter fails
+    if (from_small == false && entry->freq > 0) {
+      entry->freq--;
+      shard.main.splice(shard.main.end(), shard.main, slot.it);
+      continue;
+    }
+
+    bool evicted = false;
+    {
+      auto entry_ul = entry->try_lock();
+      evicted = entry_ul.owns_lock() && filter(entry);
+    }
+    if (evicted == false) {
+      queue.splice(queue.end(), queue, slot.it);
+      passed++;
+      continue;
+    }
+    passed = 0;
+    queue.erase(slot.it);
+    shard.entries.erase(entry->hash);
+    if (from_small) {
+      remember_evicted(shard, entry->hash);
     }
+    return entry;
+  }
+  return nullptr;
+}
+
+void CacheEntryManager::evict(std::function<bool(const BlockPtr&)> filter, std::function<bool()> stop_condition) {
+  size_t evict_count = 0;
+  size_t inspect_count = 0;
+
+  // every entry may be passed over once for its hits and once more before it is given up on
+  EvictScan scans[Shards];
+  for (size_t i = 0; i < Shards; i++) {
+    std::lock_guard<std::mutex> lg(shards[i].lock);
+    scans[i].budget = 2 * shards[i].entries.size();
+    inspect_count += scans[i].budget;
+  }
+  // one entry of each shard a round, so that no shard is emptied for the others
+  size_t start = evict_cursor.fetch_add(1, std::memory_order_relaxed);
+  for (bool progress = true; progress && stop_condition() == false;) {
+    progress = false;
+    for (size_t i = 0; i < Shards && stop_condition() == false; i++) {
+      size_t shard_index = (start + i) % Shards;
+      if (scans[shard_index].budget == 0) {
+        continue;
+      }
+      std::lock_guard<std::mutex> lg(shards[shard_index].lock);
+      if (evict_one(shards[shard_index], filter, scans[shard_index]) != nullptr) {
+        evict_count++;
+        progress = true;
+      }
+    }
+  }
+  for (size_t i = 0; i < Shards; i++) {
+    inspect_count -= scans[i].budget;
   }
 
   if (evict_count > 0) {
-    SPDLOG_DEBUG("Map Size {}, List Size {}, Evicted {} blocks, Inspected {}, {}", key_entry_map.size(),
-                 usage_list.size(), evict_count, inspect_count, pool->debug());
+    SPDLOG_DEBUG("Evicted {} blocks, Inspected {}, {}", evict_count, inspect_count, pool->debug());
   }
 }
 
+bool CacheEntryManager::drop(const Key& key) {
+  auto& shard = shard_of(key);
+  std::lock_guard<std::mutex> lg(shard.lock);
+  if (shard.entries.count(key) == 0) {
+    return true;
+  }
+  auto slot = shard.entries.at(key);
+  auto entry = *slot.it;  // outlives the lock below
+  auto entry_ul = entry->try_lock();
+  if (entry_ul.owns_lock() == false || entry->cpu_cc.can_desert() == false || entry->gpu_cc.can_desert() == false) {
+    return false;
+  }
+  if (entry->data != nullptr) {
+    entry->free_on_cpu();
+  }
+  shard.entries.erase(key);
+  (slot.in_main ? shard.main : shard.small).erase(slot.it);
+  return true;
+}
+
 CacheEntryManager::BlockPtr CacheEntryManager::get(bool& is_new, size_t size, std::optional<Key> key) {
-  std::unique_lock<std::mutex> ul(lock);
   if (key.has_value()) {
-    if (key_entry_map.count(key.value())) {
+    auto& shard = shard_of(key.value());
+    std::lock_guard<std::mutex> lg(shard.lock);
+    if (shard.entries.count(key.value())) {
       is_new = false;
-      return access(key.value());
+      return access(shard, key.value());
     } else {
       auto entry = std::make_shared<CacheBlockEntry>();
       entry->with_key = true;
       entry->hash = key.value();
       entry->size = size;
       entry->manager = this;
-      insert(entry);
+      insert(shard, entry);
       is_new = true;
       return entry;
     }
@@ -251,12 +355,22 @@ CacheEntryManager::BlockPtr CacheEntryManager::get(bool& is_new, size_t size, st
 }
 
 void CacheEntryManager::debug() {
-  fmt::print("Cache Manager: {} entries\n", key_entry_map.size());
+  size_t entry_count = 0;
+  for (auto& shard : shards) {
+    std::lock_guard<std::mutex> lg(shard.lock);
+    entry_count += shard.entries.size();
+  }
+  fmt::print("Cache Manager: {} entries\n", entry_count);
   pool->debug();
-  fmt::print("Layer 0 Entries in Order\n", key_entry_map.size());
-  for (auto& it : usage_list) {
-    if (it->layer == 0)
-      it->debug();
+  fmt::print("Layer 0 Entries in Order\n");
+  for (auto& shard : shards) {
+    std::lock_guard<std::mutex> lg(shard.lock);
+    for (auto queue : {&shard.small, &shard.main}) {
+      for (auto& it : *queue) {
+        if (it->layer == 0)
+          it->debug();
+      }
+    }
   }
 }
 
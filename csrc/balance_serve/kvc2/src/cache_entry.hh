@@ -11,6 +11,7 @@
 #include <atomic>
 #include <list>
 #include <memory>
+#include <unordered_map>
 #include "utils/mutex_extend.hpp"
 
 namespace kvc2 {
@@ -69,6 +70,9 @@ struct CacheBlockEntry {
   void* data = nullptr;
   size_t size = 0;
 
+  // hits since the entry was last passed over by eviction, guarded by the lock of its shard in the manager
+  uint8_t freq = 0;
+
   ConcurrentControlUnit cpu_cc;
 
   // for disk
@@ -95,7 +99,8 @@ struct CacheBlockEntry {
   void free_on_cpu();
   bool alloc_on_cpu_no_lock();
 
-  bool inc_ref_or_alloc_on_cpu();
+  // takes the pages from the back of reserved, if it has some, when the block is not in memory
+  bool inc_ref_or_alloc_on_cpu(std::vector<void*>* reserved = nullptr);
   void set_key(TokensHash key, std::shared_ptr<CacheBlockEntry> me);
 
   std::unique_lock<MutexT> try_lock();
@@ -133,6 +138,18 @@ struct CacheEntryManagerConfig {
   KVC2* kvc2_top = nullptr;
 };
 
+/*
+Keyed entries are split over Shards shards by key, each with its own lock and an S3-FIFO policy:
+
+- A new entry goes to the small FIFO, unless its key was evicted from small lately and is still remembered in the
+  ghost FIFO, then it goes to main.
+- A hit only counts in the entry, nothing moves.
+- Eviction takes from small while it holds more than a tenth of the shard. An entry hit while in small moves to main,
+  the others are evicted, so blocks read once, like those of a long one-off prompt, leave before the blocks of main.
+- Main is a CLOCK: a hit entry gets another round, with one hit less.
+
+Entries that cannot be evicted now, in use or without data, go to the back of their FIFO.
+*/
 class CacheEntryManager {
  public:
   using Key = CacheBlockKey;
@@ -141,16 +158,46 @@ class CacheEntryManager {
  private:
   friend CacheBlockEntry;
 
-  CacheEntryManagerConfig config;
+  constexpr static size_t Shards = 16;
+  constexpr static uint8_t MaxFreq = 3;
 
-  std::mutex lock;
-  std::list<BlockPtr> usage_list;
-  std::unordered_map<Key, std::list<BlockPtr>::iterator> key_entry_map;
+  struct Slot {
+    std::list<BlockPtr>::iterator it;
+    bool in_main;
+  };
 
-  void insert(BlockPtr entry);
-  BlockPtr access(const Key& key);
+  struct alignas(64) Shard {
+    std::mutex lock;
+    std::list<BlockPtr> small, main;
+    std::unordered_map<Key, Slot> entries;
+    std::list<Key> ghost;
+    std::unordered_map<Key, std::list<Key>::iterator> ghost_entries;
+  };
 
-  // void remove(const Key& key);
+  CacheEntryManagerConfig config;
+
+  Shard shards[Shards];
+  std::atomic_size_t evict_cursor = 0;
+
+  Shard& shard_of(const Key& key);
+
+  // with the lock of the shard held
+  void insert(Shard& shard, BlockPtr entry);
+  BlockPtr access(Shard& shard, const Key& key);
+  void remember_evicted(Shard& shard, const Key& key);
+  // State of one shard during an evict(): the entries it may still inspect, and the entries of each queue passed over
+  // since the last eviction from it
+  struct EvictScan {
+    size_t budget = 0;
+    size_t passed_small = 0;
+    size_t passed_main = 0;
+  };
+  // Evicts at most one entry of the shard, inspecting no more than scan.budget entries. A queue passed over in full
+  // leaves its turns to the other one. Null if none was evicted.
+  BlockPtr evict_one(Shard& shard, const std::function<bool(const BlockPtr&)>& filter, EvictScan& scan);
+
+  // Evicts the entries that pass filter, one shard after another, until stop_condition or every shard was looked
+  // through
   void evict(std::function<bool(const BlockPtr&)> filter, std::function<bool()> stop_condition);
 
 
@@ -169,7 +216,11 @@ class CacheEntryManager {
 
   void cpu_background_flush();
 
-  void evict_for_cpu_cache();
+  // Frees the memory of unused entries until at least bytes, and evict_count entries, are freed
+  void evict_for_cpu_cache(size_t bytes);
+
+  // Removes the entry of key, which points to a disk location about to be freed. False if it is still in use.
+  bool drop(const Key& key);
 
   // just get block pointers, not allocate them, will not return nullptr
   BlockPtr get(bool& is_new,size_t size, std::optional<Key> key = std::nullopt);
@@ -1,6 +1,7 @@
 #ifndef __HASHER_HPP_
 #define __HASHER_HPP_
 
+#include <algorithm>
 #include "defs.h"
 #include "xxhash.h"
 
@@ -35,6 +36,33 @@ struct TokensHasher {
   }
 
   static TokensHash hash(Token* data, TokenLength length) { return XXH64(data, length * sizeof(Token), hash_seed); }
+
+  // Hash of a block seeded with the hash of all blocks before it, so the hash of block i identifies the tokens
+  // [0, end of block i) while every token is read once.
+  static TokensHash chain(TokensHash prev, const Token* data, TokenLength length) {
+#ifdef USE_XXH3
+    return XXH3_64bits_withSeed(data, length * sizeof(Token), prev);
+#else
+    return XXH64(data, length * sizeof(Token), prev);
+#endif
+  }
+
+  // Extends the chained hashes of the blocks of `data` to cover [0, length). All the hashes already in `hashes` must
+  // be of full blocks.
+  static void append_block_hashes(std::vector<TokensHash>& hashes, const Token* data, TokenLength length,
+                                  TokenLength block_length) {
+    TokensHash prev = hashes.empty() ? hash_seed : hashes.back();
+    for (TokenLength i = hashes.size() * block_length; i < length; i += block_length) {
+      prev = chain(prev, data + i, std::min(block_length, length - i));
+      hashes.push_back(prev);
+    }
+  }
+
+  // Key of a cache block of one layer, derived from the block hash without reading the tokens again.
+  static TokensHash layer_block_key(TokensHash block_hash, size_t info_hash, size_t layer) {
+    uint64_t x[2] = {block_hash, layer};
+    return XXH64(x, sizeof(x), info_hash);
+  }
 };
 }  // namespace kvc2
 #endif
\ No newline at end of file
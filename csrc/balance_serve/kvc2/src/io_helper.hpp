@@ -102,6 +102,8 @@ struct IO_Helper {
   BatchPromise batch_promise;
   std::function<void(Unit*)> call_back_on_unit = nullptr;
   std::function<void()> call_back = nullptr;
+  // reads of this batch still queued are dropped once it is true
+  const std::atomic_bool* cancelled = nullptr;
 
   std::vector<std::shared_future<void>> futs;
   std::vector<Unit*> units_by_myself;
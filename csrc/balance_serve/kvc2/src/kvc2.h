@@ -1,5 +1,6 @@
 #pragma once
 #include <torch/torch.h>
+#include <atomic>
 #include <cstdint>
 #include <optional>
 #include <vector>
@@ -36,10 +37,15 @@ struct KVC2Config {
   std::string config_path;
   TokenLength num_token_per_page = 256;
   size_t memory_pool_size = 10e9;
+  int memory_pool_numa_node = -1;  // -1 for no binding
+  bool memory_pool_huge_pages = false;
   size_t evict_count = 20;
   std::optional<GPUPageCacheConfig> gpu_cache_config = std::nullopt;
   size_t metrics_port;
   double recompute_ratio = 0.2;
+  // Bytes the disk cache may take, 0 for no limit. The least used prefixes are evicted above it.
+  size_t disk_quota = 0;
+  std::string disk_eviction_policy = "lru";  // lru or lfu
 };
 
 class DoubleCacheHandleInterface;
@@ -86,12 +92,15 @@ This will not read from memory pool, it directly read from disk.
   id: start pointer of token array
   length: length of token array
 
+  cancelled: optional, once it is set the disk reads still queued for this lookup are dropped
+
   Return:  kvc2_handle, holds kvcache until being released.
            if not found, matched_length will return 0.
-           if memory pool is full, return nullptr
+           if memory pool is full, or the lookup is cancelled, return nullptr
   */
   virtual std::shared_ptr<DoubleCacheHandleInterface> lookup(ModelName model_name, QuantType quant_type, Token* id,
-                                                             TokenLength length, TokenLength estimated_length) = 0;
+                                                             TokenLength length, TokenLength estimated_length,
+                                                             std::shared_ptr<std::atomic_bool> cancelled = nullptr) = 0;
 
   /*
   Lookup and allocate to gpu
@@ -103,7 +112,8 @@ This will not read from memory pool, it directly read from disk.
 
   virtual void lookup_to_gpu_async(ModelName model_name, QuantType quant_type, Token* id, TokenLength length,
                                    TokenLength estimated_length,
-                                   std::function<void(std::shared_ptr<DoubleCacheHandleInterface>)> call_back) = 0;
+                                   std::function<void(std::shared_ptr<DoubleCacheHandleInterface>)> call_back,
+                                   std::shared_ptr<std::atomic_bool> cancelled = nullptr) = 0;
 
   virtual std::pair<std::vector<torch::Tensor>, std::vector<torch::Tensor>> get_kvcache() = 0;
 
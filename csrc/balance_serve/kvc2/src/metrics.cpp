@@ -18,6 +18,13 @@ Metrics::Metrics(const MetricsConfig& config)
                                         .Register(*registry_);
   prefix_block_count = &prefix_block_count_family.Add({});
 
+  // 注册 evicted_prefix_nodes Counter
+  auto& evicted_prefix_nodes_family = prometheus::BuildCounter()
+                                          .Name(std::string(METRIC_PREFIX) + "_evicted_prefix_nodes")
+                                          .Help("Number of prefix nodes evicted from disk")
+                                          .Register(*registry_);
+  evicted_prefix_nodes = &evicted_prefix_nodes_family.Add({});
+
   // 定义统一的桶大小，最大为 10000 ms (10 s)
   std::vector<double> common_buckets = {1.0, 5.0, 10.0, 50.0, 100.0, 500.0, 1000.0, 5000.0, 10000.0};
 
@@ -99,6 +106,12 @@ Metrics::Metrics(const MetricsConfig& config)
                                             .Register(*registry_);
   cpu_flush_back_time_ms = &cpu_flush_back_time_ms_family.Add({}, common_buckets);
 
+  // 注册 io_latency_ms Histogram
+  io_latency_ms_family_ = &prometheus::BuildHistogram()
+                               .Name(std::string(METRIC_PREFIX) + "_io_latency_ms")
+                               .Help("disk io latency from enqueue to completion in milliseconds")
+                               .Register(*registry_);
+
   exposer_.RegisterCollectable(registry_);
 }
 
@@ -128,6 +141,12 @@ prometheus::Gauge* Metrics::gpu_page_count(std::string type) {
   return &gpu_page_count_family_->Add({{"type", type}});
 }
 
+// 获取 io_latency_ms 指标
+prometheus::Histogram* Metrics::io_latency_ms(const std::string& priority) {
+  std::vector<double> io_buckets = {0.1, 0.5, 1.0, 5.0, 10.0, 50.0, 100.0, 500.0, 1000.0};
+  return &io_latency_ms_family_->Add({{"priority", priority}}, io_buckets);
+}
+
 TimeObserver::TimeObserver(prometheus::Histogram* h) {
   histogram_ = h;
   timer_.start();
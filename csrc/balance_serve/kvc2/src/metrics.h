@@ -36,6 +36,7 @@ class Metrics {
   // 指标指针
   prometheus::Counter* prefix_nodes;
   prometheus::Counter* prefix_block_count;
+  prometheus::Counter* evicted_prefix_nodes;
 
   prometheus::Histogram* raw_insert_time_ms;
   prometheus::Histogram* lookup_time_ms;
@@ -49,6 +50,7 @@ class Metrics {
 
   prometheus::Gauge* lru_entry_count(const std::string& type);
   prometheus::Gauge* gpu_page_count(std::string type);
+  prometheus::Histogram* io_latency_ms(const std::string& priority);
 
   prometheus::Histogram* append_tokens_time_ms;
   prometheus::Histogram* gpu_flush_back_time_ms;
@@ -62,6 +64,7 @@ class Metrics {
   prometheus::Family<prometheus::Gauge>* memory_pool_node_count_family_;
   prometheus::Family<prometheus::Gauge>* lru_entry_count_family_;
   prometheus::Family<prometheus::Gauge>* gpu_page_count_family_;
+  prometheus::Family<prometheus::Histogram>* io_latency_ms_family_;
 };
 
 class TimeObserver {
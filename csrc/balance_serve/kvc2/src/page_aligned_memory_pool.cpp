@@ -1,5 +1,10 @@
 #include "page_aligned_memory_pool.h"
 
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <new>
+
 #define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_DEBUG
 #define FMT_HEADER_ONLY
 #include "spdlog/spdlog.h"
@@ -7,25 +12,62 @@
 #include "utils/arithmetic.hpp"
 #include "utils/easy_format.hpp"
 
+static constexpr size_t HugePageSize = 2 << 20;
+// from numaif.h, so that the pool does not need libnuma
+static constexpr int MpolPreferred = 1;
+
 /// 构造函数
-PageAlignedMemoryPool::PageAlignedMemoryPool(size_t size_in_bytes) {
+PageAlignedMemoryPool::PageAlignedMemoryPool(size_t size_in_bytes, int numa_node, bool huge_pages) {
   total_size = (size_in_bytes / PageSize) * PageSize;
-  // 对齐分配。C++17 对齐方式写法，如果编译器不支持可以改用其它方法
-  data = ::operator new[](total_size, std::align_val_t(PageSize));
+  mapped_size = total_size;
+  data = MAP_FAILED;
+  if (huge_pages) {
+    mapped_size = div_up(total_size, HugePageSize) * HugePageSize;
+    // without MAP_NORESERVE the mapping fails, rather than faulting later, when too few huge pages are reserved
+    data = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (data == MAP_FAILED) {
+      SPDLOG_WARN("No huge pages reserved for the memory pool, using transparent huge pages");
+    }
+  }
+  if (data == MAP_FAILED) {
+    data = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+      SPDLOG_CRITICAL("Cannot map {} bytes for the memory pool", mapped_size);
+      throw std::bad_alloc();
+    }
+    if (huge_pages && madvise(data, mapped_size, MADV_HUGEPAGE) != 0) {
+      SPDLOG_WARN("Transparent huge pages are not available for the memory pool");
+    }
+  }
+  if (numa_node >= 0) {
+    // before the first touch, so that every page is placed on the node
+    constexpr int bits = sizeof(unsigned long) * 8;
+    std::vector<unsigned long> node_mask(numa_node / bits + 1, 0);
+    node_mask[numa_node / bits] = 1ul << (numa_node % bits);
+    // the kernel reads maxnode - 1 bits, pass one more as libnuma does
+    if (syscall(SYS_mbind, data, mapped_size, MpolPreferred, node_mask.data(), node_mask.size() * bits + 1, 0) != 0) {
+      SPDLOG_WARN("Cannot bind the memory pool to NUMA node {}", numa_node);
+    }
+  }
   total_pages = total_size / PageSize;
 
   assert(total_pages >= Blocks);
   page_per_block = total_pages / Blocks;
 
   for (size_t block_index = 0; block_index < Blocks; block_index++) {
-    first_page[block_index] = reinterpret_cast<void*>(reinterpret_cast<intptr_t>(data) +
-                                                      static_cast<intptr_t>(block_index) * page_per_block * PageSize);
-    count_page[block_index] =
-        block_index == Blocks - 1 ? (total_pages - page_per_block * (Blocks - 1)) : page_per_block;
+    auto& block = blocks[block_index];
+    block.first_page = reinterpret_cast<void*>(reinterpret_cast<intptr_t>(data) +
+                                               static_cast<intptr_t>(block_index) * page_per_block * PageSize);
+    block.count_page = block_index == Blocks - 1 ? (total_pages - page_per_block * (Blocks - 1)) : page_per_block;
     SPDLOG_DEBUG("first_page[{}] = {}, count_page[{}] = {}", block_index,
-                 reinterpret_cast<intptr_t>(first_page[block_index]) - reinterpret_cast<intptr_t>(data), block_index,
-                 count_page[block_index]);
-    bitmap[block_index].resize(count_page[block_index], 0);
+                 reinterpret_cast<intptr_t>(block.first_page) - reinterpret_cast<intptr_t>(data), block_index,
+                 block.count_page);
+    assert(block.count_page < Nil);
+    block.free_len.resize(block.count_page, 0);
+    block.next.resize(block.count_page, Nil);
+    block.prev.resize(block.count_page, Nil);
+    std::fill(block.heads, block.heads + SizeClasses, Nil);
+    insert_run(block, 0, block.count_page);
   }
   SPDLOG_INFO("PageAlignedMemoryPool with size {} Mbytes, {} pages", total_size / (1 << 20), page_count());
 }
@@ -33,8 +75,7 @@ PageAlignedMemoryPool::PageAlignedMemoryPool(size_t size_in_bytes) {
 /// 析构函数
 PageAlignedMemoryPool::~PageAlignedMemoryPool() {
   if (data) {
-    // 注意：需要与分配时的对齐方式对应
-    ::operator delete[](data, std::align_val_t(PageSize));
+    munmap(data, mapped_size);
     data = nullptr;
   }
 }
@@ -49,37 +90,116 @@ size_t PageAlignedMemoryPool::page_padded_size(size_t size) {
   return div_up(size, PageSize) * PageSize;
 }
 
-void* PageAlignedMemoryPool::alloc_in_block(size_t block_index, size_t alloc_size) {
-  std::lock_guard<std::mutex> guard(lock[block_index]);
-  size_t free_pages = 0;
-  for (size_t i = 0; i < count_page[block_index]; i++) {
-    if (bitmap[block_index][i] == 0) {
-      free_pages++;
-      if (free_pages == alloc_size) {
-        size_t page_index = i + 1 - free_pages;
-        for (size_t page = page_index; page < page_index + alloc_size; page++) {
-          bitmap[block_index][page] = 1;
-          // SPDLOG_DEBUG("alloc page {} in block {}", page, block_index);
+size_t PageAlignedMemoryPool::size_class(size_t pages) {
+  return 63 - __builtin_clzll(pages);
+}
+
+void PageAlignedMemoryPool::insert_run(Block& block, uint32_t page, uint32_t length) {
+  auto c = size_class(length);
+  block.free_len[page] = length;
+  block.free_len[page + length - 1] = length;
+  block.prev[page] = Nil;
+  block.next[page] = block.heads[c];
+  if (block.heads[c] != Nil) {
+    block.prev[block.heads[c]] = page;
+  }
+  block.heads[c] = page;
+  block.non_empty |= 1u << c;
+}
+
+void PageAlignedMemoryPool::remove_run(Block& block, uint32_t page) {
+  auto length = block.free_len[page];
+  auto c = size_class(length);
+  if (block.prev[page] != Nil) {
+    block.next[block.prev[page]] = block.next[page];
+  } else {
+    block.heads[c] = block.next[page];
+    if (block.heads[c] == Nil) {
+      block.non_empty &= ~(1u << c);
+    }
+  }
+  if (block.next[page] != Nil) {
+    block.prev[block.next[page]] = block.prev[page];
+  }
+  block.free_len[page] = 0;
+  block.free_len[page + length - 1] = 0;
+}
+
+uint32_t PageAlignedMemoryPool::alloc_pages(Block& block, size_t alloc_size) {
+  auto floor_class = size_class(alloc_size);
+  uint32_t page = Nil;
+  if (block.heads[floor_class] != Nil && block.free_len[block.heads[floor_class]] >= alloc_size) {
+    // blocks of one size free runs of that size, the head of their list fits
+    page = block.heads[floor_class];
+  } else {
+    // any run of a larger list fits
+    auto ceil_class = floor_class + (alloc_size & (alloc_size - 1) ? 1 : 0);
+    uint32_t larger = ceil_class < SizeClasses ? block.non_empty & ~((1u << ceil_class) - 1) : 0;
+    if (larger != 0) {
+      page = block.heads[__builtin_ctz(larger)];
+    } else {
+      for (auto p = block.heads[floor_class]; p != Nil; p = block.next[p]) {
+        if (block.free_len[p] >= alloc_size) {
+          page = p;
+          break;
         }
-        return reinterpret_cast<void*>(reinterpret_cast<intptr_t>(first_page[block_index]) + page_index * PageSize);
       }
-    } else {
-      free_pages = 0;
     }
   }
-  return nullptr;
+  if (page == Nil) {
+    return Nil;
+  }
+  auto length = block.free_len[page];
+  remove_run(block, page);
+  if (length > alloc_size) {
+    insert_run(block, page + alloc_size, length - alloc_size);
+  }
+  return page;
+}
+
+void PageAlignedMemoryPool::free_pages(Block& block, uint32_t page, size_t alloc_size) {
+  uint32_t length = alloc_size;
+  if (page > 0 && block.free_len[page - 1] != 0) {
+    auto left = block.free_len[page - 1];
+    page -= left;
+    length += left;
+    remove_run(block, page);
+  }
+  if (page + length < block.count_page && block.free_len[page + length] != 0) {
+    auto right = block.free_len[page + length];
+    remove_run(block, page + length);
+    length += right;
+  }
+  insert_run(block, page, length);
+}
+
+size_t PageAlignedMemoryPool::home_block() {
+  thread_local size_t home = Blocks;
+  if (home == Blocks) {
+    home = now_block.fetch_add(1, std::memory_order_relaxed) % Blocks;
+  }
+  return home;
+}
+
+void* PageAlignedMemoryPool::page_address(size_t block_index, uint32_t page) {
+  return reinterpret_cast<void*>(reinterpret_cast<intptr_t>(blocks[block_index].first_page) + page * PageSize);
 }
 
 /// 分配函数
 void* PageAlignedMemoryPool::alloc(size_t size) {
   size_t alloc_size = div_up(size, PageSize);
-  auto cnt = now_block.fetch_add(1, std::memory_order_relaxed);
+  auto home = home_block();
   for (size_t i = 0; i < Blocks; i++) {
-    auto result = alloc_in_block((i + cnt) % Blocks, alloc_size);
-    if (result != nullptr) {
+    auto block_index = (i + home) % Blocks;
+    uint32_t page;
+    {
+      std::lock_guard<std::mutex> guard(blocks[block_index].lock);
+      page = alloc_pages(blocks[block_index], alloc_size);
+    }
+    if (page != Nil) {
       allocated.fetch_add(alloc_size * PageSize, std::memory_order_relaxed);
       alloc_count.fetch_add(1, std::memory_order_relaxed);
-      return result;
+      return page_address(block_index, page);
     }
   }
   return nullptr;
@@ -88,33 +208,48 @@ void* PageAlignedMemoryPool::alloc(size_t size) {
 /// 释放函数
 void PageAlignedMemoryPool::free(void* p, size_t size) {
   auto alloc_size = div_up(size, PageSize);
-  size_t block_index = (reinterpret_cast<intptr_t>(p) - reinterpret_cast<intptr_t>(data)) / page_per_block / PageSize;
-  size_t page_index = (reinterpret_cast<intptr_t>(p) - reinterpret_cast<intptr_t>(first_page[block_index])) / PageSize;
-
-  std::lock_guard<std::mutex> guard(lock[block_index]);
+  size_t block_index = std::min(
+      (reinterpret_cast<intptr_t>(p) - reinterpret_cast<intptr_t>(data)) / page_per_block / PageSize, Blocks - 1);
+  auto& block = blocks[block_index];
+  uint32_t page = (reinterpret_cast<intptr_t>(p) - reinterpret_cast<intptr_t>(block.first_page)) / PageSize;
 
-  for (size_t page = page_index; page < page_index + alloc_size; page++)
-    bitmap[block_index][page] = 0;
+  {
+    std::lock_guard<std::mutex> guard(block.lock);
+    free_pages(block, page, alloc_size);
+  }
 
   allocated.fetch_sub(alloc_size * PageSize, std::memory_order_relaxed);
   free_count.fetch_add(1, std::memory_order_relaxed);
 }
-// TODO: too slow
+
 std::vector<void*> PageAlignedMemoryPool::alloc_multiple(size_t size, size_t count) {
+  size_t alloc_size = div_up(size, PageSize);
   std::vector<void*> result;
-  for (size_t i = 0; i < count; i++) {
-    auto p = alloc(size);
-    if (p == nullptr) {
-      for (auto ptr : result) {
-        free(ptr, size);
+  result.reserve(count);
+  auto home = home_block();
+  for (size_t i = 0; i < Blocks && result.size() < count; i++) {
+    auto block_index = (i + home) % Blocks;
+    std::lock_guard<std::mutex> guard(blocks[block_index].lock);
+    while (result.size() < count) {
+      auto page = alloc_pages(blocks[block_index], alloc_size);
+      if (page == Nil) {
+        break;
       }
-      return {};
+      result.push_back(page_address(block_index, page));
+    }
+  }
+  allocated.fetch_add(result.size() * alloc_size * PageSize, std::memory_order_relaxed);
+  alloc_count.fetch_add(result.size(), std::memory_order_relaxed);
+  if (result.size() < count) {
+    for (auto ptr : result) {
+      free(ptr, size);
     }
-    result.push_back(p);
+    return {};
   }
   return result;
 }
 
+// Freed runs are merged with their free neighbours right away, there is nothing left to move
 void PageAlignedMemoryPool::defragment() {}
 
 /// 调试打印
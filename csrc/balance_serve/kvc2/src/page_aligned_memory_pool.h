@@ -3,37 +3,66 @@
 #include <assert.h>
 #include <algorithm>  // std::sort
 #include <atomic>
-#include <bitset>
 #include <cstddef>  // size_t
+#include <cstdint>
 #include <mutex>    // std::mutex
+#include <string>
 #include <vector>
 
 constexpr size_t PageSize = 4096;
 
 /// PageAlignedMemoryPool 类的声明
+/*
+The pool is cut into Blocks independently locked blocks. Each block keeps its free page runs in segregated lists, list
+c holds the runs of [2^c, 2^(c+1)) pages, and a mask of the non empty lists. A run is taken from the head of the list
+of its size or of the first larger list and split, which is O(1) unless the size is not a power of two and no larger
+list has a run: then the list of its size is scanned for a run long enough. A freed run is merged in O(1) with its free
+neighbours found by the lengths kept at both ends of every free run. A thread starts at its own block.
+*/
 struct PageAlignedMemoryPool {
  private:
   constexpr static size_t Blocks = 16;
+  constexpr static size_t SizeClasses = 32;
+  constexpr static uint32_t Nil = UINT32_MAX;
+
+  struct alignas(64) Block {
+    std::mutex lock;
+    void* first_page = nullptr;
+    size_t count_page = 0;
+    // length of a free run at its first and last page, 0 on every other page
+    std::vector<uint32_t> free_len;
+    // free list links of a run, at its first page
+    std::vector<uint32_t> next, prev;
+    uint32_t heads[SizeClasses];
+    uint32_t non_empty = 0;
+  };
 
   void* data = nullptr;
 
-  size_t total_size = 0, total_pages = 0;
+  size_t total_size = 0, total_pages = 0, mapped_size = 0;
 
   std::atomic_size_t now_block = 0;
   std::atomic_size_t allocated = 0;  // allocated_size
   std::atomic_size_t alloc_count = 0;
   std::atomic_size_t free_count = 0;
 
-  std::mutex lock[Blocks];
   size_t page_per_block = 0;
-  void* first_page[Blocks];
-  size_t count_page[Blocks];
-  std::vector<int8_t> bitmap[Blocks];
-  void* alloc_in_block(size_t block_index, size_t alloc_size);
+  Block blocks[Blocks];
+
+  static size_t size_class(size_t pages);
+  void insert_run(Block& block, uint32_t page, uint32_t length);
+  void remove_run(Block& block, uint32_t page);
+  // both with the lock of the block held
+  uint32_t alloc_pages(Block& block, size_t alloc_size);
+  void free_pages(Block& block, uint32_t page, size_t alloc_size);
+  size_t home_block();
+  void* page_address(size_t block_index, uint32_t page);
 
  public:
   /// 构造函数和析构函数
-  explicit PageAlignedMemoryPool(size_t size_in_bytes);
+  // numa_node: bind the pages to this node, -1 for no binding. huge_pages: back the pool with huge pages, falls back
+  // to transparent huge pages when none are reserved.
+  explicit PageAlignedMemoryPool(size_t size_in_bytes, int numa_node = -1, bool huge_pages = false);
   ~PageAlignedMemoryPool();
 
   /// 禁用拷贝和移动
@@ -47,6 +76,7 @@ struct PageAlignedMemoryPool {
   size_t page_padded_size(size_t size);
 
   void* alloc(size_t size);
+  // count allocations of size, taking the lock of a block once for all it can give. All or nothing.
   std::vector<void*> alloc_multiple(size_t size, size_t count);
   void free(void* data, size_t size);
   void defragment();
@@ -2,6 +2,7 @@
 #include <tbb/concurrent_hash_map.h>
 
 #include <algorithm>
+#include <array>
 #include <cstdint>
 #include <fstream>
 #include <functional>
@@ -11,6 +12,7 @@
 #include <mutex>
 #include <nlohmann/json.hpp>
 #include <optional>
+#include <queue>
 #include <shared_mutex>
 #include <unordered_map>
 #include <vector>
@@ -32,6 +34,7 @@
 
 #include "utils/arithmetic.hpp"
 #include "utils/easy_format.hpp"
+#include "utils/journal.hpp"
 #include "utils/periodic_task.hpp"
 namespace kvc2 {
 struct KVC2;
@@ -91,6 +94,32 @@ struct std::hash<kvc2::CacheInfo> {
   std::size_t operator()(const kvc2::CacheInfo& s) const noexcept { return s.hash_value(); }
 };
 namespace kvc2 {
+
+// Binary metadata: meta.bin is the snapshot written by save(), journal.bin the records of the changes since, replayed
+// on top of the snapshot by load().
+const uint64_t meta_magic = 0x4154454d3243564b;  // "KVC2META"
+const uint32_t meta_version = 1;
+
+enum MetaRecordType : uint32_t {
+  PrefixInserted = 1,   // prefix_id, prev_id, start_length, ids
+  LocationUpdated = 2,  // prefix_id, CacheInfo, Location
+  DiskAllocated = 3,    // CacheInfo, end of the allocated blocks
+  PrefixEvicted = 4,    // prefix_id
+};
+
+void write_binary(journal::BinaryWriter& w, const CacheInfo& info) {
+  w.put_string(info.model_name);
+  w.put_string(info.quant_type);
+  w.put<uint8_t>(info.is_key_cache);
+}
+
+CacheInfo read_cache_info(journal::BinaryReader& r) {
+  CacheInfo info;
+  info.model_name = r.get_string();
+  info.quant_type = r.get_string();
+  info.is_key_cache = r.get<uint8_t>();
+  return info;
+}
 struct Location {
   size_t start_idx;  // start block index
   size_t length;     // length of blocks
@@ -189,6 +218,12 @@ struct DiskCacheAllocator {
   std::mutex lock;
   size_t now_idx;
 
+  // Freed extents below now_idx, by start and by length for best fit. Not serialized, rebuilt from the prefix
+  // locations on load.
+  std::map<size_t, size_t> free_extents;
+  std::multimap<size_t, size_t> free_by_length;
+  size_t free_count = 0;
+
   // store
   size_t capacity;
   std::vector<async_store::ArrayStore*> stores;
@@ -209,20 +244,150 @@ struct DiskCacheAllocator {
     update_capacity();
   }
 
+  void add_free_extent(size_t start, size_t length) {
+    free_extents[start] = length;
+    free_by_length.emplace(length, start);
+    free_count += length;
+  }
+
+  void remove_free_extent(std::map<size_t, size_t>::iterator it) {
+    auto [begin, end] = free_by_length.equal_range(it->second);
+    for (auto i = begin; i != end; ++i) {
+      if (i->second == it->first) {
+        free_by_length.erase(i);
+        break;
+      }
+    }
+    free_count -= it->second;
+    free_extents.erase(it);
+  }
+
+  // Coalesces with its neighbours, an extent reaching now_idx gives the tail back instead
+  void release(size_t start, size_t length) {
+    auto next = free_extents.lower_bound(start);
+    if (next != free_extents.end() && next->first == start + length) {
+      length += next->second;
+      remove_free_extent(next);
+    }
+    auto prev = free_extents.lower_bound(start);
+    if (prev != free_extents.begin() && std::prev(prev)->first + std::prev(prev)->second == start) {
+      prev = std::prev(prev);
+      start = prev->first;
+      length += prev->second;
+      remove_free_extent(prev);
+    }
+    if (start + length == now_idx) {
+      now_idx = start;
+    } else {
+      add_free_extent(start, length);
+    }
+  }
+
  public:
   async_store::ArrayStore* get_store(int i) { return stores[i]; }
   Location alloc(size_t block_count) {
     std::lock_guard<std::mutex> lg(lock);
     Location re;
-    re.start_idx = now_idx;
     re.length = block_count;
+    if (auto fit = free_by_length.lower_bound(block_count); fit != free_by_length.end()) {
+      auto [length, start] = *fit;
+      remove_free_extent(free_extents.find(start));
+      if (length > block_count) {
+        add_free_extent(start + block_count, length - block_count);
+      }
+      re.start_idx = start;
+      return re;
+    }
+    re.start_idx = now_idx;
     now_idx += block_count;
     if (now_idx >= capacity) {
-      extend(capacity * 2);
+      extend(std::max(capacity * 2, now_idx + 1));
     }
     return re;
   }
 
+  // The blocks must not be read or written any more, their disk space is given back right away
+  void free(Location location) {
+    std::lock_guard<std::mutex> lg(lock);
+    for (auto store : stores) {
+      async_store::punch_hole(store, location.start_idx, location.length);
+    }
+    release(location.start_idx, location.length);
+  }
+
+  size_t allocated() {
+    std::lock_guard<std::mutex> lg(lock);
+    return now_idx;
+  }
+
+  size_t used() {
+    std::lock_guard<std::mutex> lg(lock);
+    return now_idx - free_count;
+  }
+
+  // Disk bytes of a block over all layers
+  size_t block_bytes() {
+    size_t re = 0;
+    for (auto store : stores) {
+      re += async_store::element_bytes(store);
+    }
+    return re;
+  }
+
+  // Replays an allocation that ended at end_idx
+  void restore(size_t end_idx) {
+    std::lock_guard<std::mutex> lg(lock);
+    now_idx = std::max(now_idx, end_idx);
+    if (now_idx >= capacity) {
+      extend(std::max(capacity * 2, now_idx + 1));
+    }
+  }
+
+  // Everything below now_idx that is not in `used` is free, used locations must not overlap
+  void rebuild_free_extents(std::vector<Location> used) {
+    std::lock_guard<std::mutex> lg(lock);
+    free_extents.clear();
+    free_by_length.clear();
+    free_count = 0;
+    std::sort(used.begin(), used.end(), [](const Location& a, const Location& b) { return a.start_idx < b.start_idx; });
+    size_t end = now_idx;
+    now_idx = 0;
+    for (auto& loc : used) {
+      if (loc.start_idx > now_idx) {
+        add_free_extent(now_idx, loc.start_idx - now_idx);
+      }
+      now_idx = std::max(now_idx, loc.start_idx + loc.length);
+    }
+    if (now_idx >= capacity) {
+      extend(std::max(capacity * 2, now_idx + 1));
+    }
+    for (auto& [start, length] : free_extents) {
+      for (auto store : stores) {
+        async_store::punch_hole(store, start, length);
+      }
+    }
+    if (end > now_idx) {
+      for (auto store : stores) {
+        async_store::punch_hole(store, now_idx, end - now_idx);
+      }
+    }
+  }
+
+  // Shrinks the files when less than half of them is below now_idx, alloc() grows them back by doubling
+  void compact() {
+    std::lock_guard<std::mutex> lg(lock);
+    size_t to = std::max<size_t>(now_idx * 2, InitialCapacity);
+    if (to >= capacity) {
+      return;
+    }
+    for (auto store : stores) {
+      async_store::shrink(store, to);
+    }
+    update_capacity();
+  }
+
+  static constexpr size_t InitialCapacity = 1000;
+
   DiskCacheAllocator(std::filesystem::path path, CacheInfo info, size_t head_dim) : path(path), info(info) {
     // SPDLOG_DEBUG("Create DiskCacheAllocator {}", path.c_str());
     auto allocator_path = path / info.path();
@@ -234,7 +399,8 @@ struct DiskCacheAllocator {
 
     for (size_t i = 0; i < info.hidden_layer_count(); i++) {
       // SPDLOG_DEBUG("Create store {} for {}", (path / info.path(i)).c_str(),i);
-      auto store = async_store::create_or_open_store(info.element_size(NumTokenPerBlock, head_dim), 1000, path / info.path(i));
+      auto store = async_store::create_or_open_store(info.element_size(NumTokenPerBlock, head_dim), InitialCapacity,
+                                                     path / info.path(i));
       stores.push_back(store);
     }
     update_capacity();
@@ -251,6 +417,7 @@ struct DiskCacheManager {
   KVC2Config config;
   std::mutex lock;
   std::unordered_map<CacheInfo, std::shared_ptr<DiskCacheAllocator>> allocators;
+  journal::Journal* journal = nullptr;
 
   friend void to_json(nlohmann ::json& nlohmann_json_j, const DiskCacheManager& nlohmann_json_t) {
     nlohmann_json_j["config"] = nlohmann_json_t.config;
@@ -295,7 +462,63 @@ struct DiskCacheManager {
 
   Location allocate(CacheInfo info, size_t cache_block_count) {
     auto allocator = get_allocator(info);
-    return allocator->alloc(cache_block_count);
+    auto re = allocator->alloc(cache_block_count);
+    if (journal) {
+      journal::BinaryWriter w;
+      kvc2::write_binary(w, info);
+      w.put<uint64_t>(re.start_idx + re.length);
+      journal->append(DiskAllocated, w.data());
+    }
+    return re;
+  }
+
+  // Gives back the blocks of an evicted prefix
+  void free(CacheInfo info, Location location) { get_allocator(info)->free(location); }
+
+  size_t used_bytes() {
+    std::lock_guard<std::mutex> lg(lock);
+    size_t re = 0;
+    for (auto& [info, allocator] : allocators) {
+      re += allocator->used() * allocator->block_bytes();
+    }
+    return re;
+  }
+
+  void compact() {
+    std::lock_guard<std::mutex> lg(lock);
+    for (auto& [info, allocator] : allocators) {
+      allocator->compact();
+    }
+  }
+
+  // used holds the locations of every live prefix
+  void rebuild_free_extents(const std::unordered_map<CacheInfo, std::vector<Location>>& used) {
+    std::lock_guard<std::mutex> lg(lock);
+    for (auto& [info, allocator] : allocators) {
+      auto it = used.find(info);
+      allocator->rebuild_free_extents(it == used.end() ? std::vector<Location>{} : it->second);
+    }
+  }
+
+  void replay_allocate(journal::BinaryReader& r) {
+    auto info = read_cache_info(r);
+    get_allocator(info)->restore(r.get<uint64_t>());
+  }
+
+  void write_binary(journal::BinaryWriter& w) {
+    std::lock_guard<std::mutex> lg(lock);
+    w.put<uint64_t>(allocators.size());
+    for (auto& [info, allocator] : allocators) {
+      kvc2::write_binary(w, info);
+      w.put<uint64_t>(allocator->allocated());
+    }
+  }
+
+  void read_binary(journal::BinaryReader& r) {
+    auto count = r.get<uint64_t>();
+    for (size_t i = 0; i < count; i++) {
+      replay_allocate(r);
+    }
   }
 };
 
@@ -308,6 +531,44 @@ struct Prefix {
 
   // No serialization
   bool prev_set = false;
+  std::vector<TokensHash> hashes;  // chained hash of each local block
+
+  // For disk eviction, an evicted prefix keeps its prefix_id with no ids. Only leaves with no pins are evicted.
+  std::atomic_uint32_t pins = 0;  // handles using the prefix
+  std::atomic_bool evicted = false;
+  uint32_t children = 0;
+  std::atomic_int64_t last_access = 0;
+  std::atomic_uint64_t hits = 0;
+
+  void write_binary(journal::BinaryWriter& w) const {
+    w.put<uint64_t>(prefix_id);
+    w.put<uint64_t>(prev ? prev->prefix_id : 0);
+    w.put<uint64_t>(start_length);
+    w.put_vector(ids);
+    w.put<uint64_t>(locations.location_map.size());
+    for (auto& [info, loc] : locations.location_map) {
+      kvc2::write_binary(w, info);
+      w.put<uint64_t>(loc.start_idx);
+      w.put<uint64_t>(loc.length);
+    }
+  }
+
+  // prev_id is left in prev, the same as from_json
+  void read_binary(journal::BinaryReader& r) {
+    prefix_id = r.get<uint64_t>();
+    prev = reinterpret_cast<Prefix*>(r.get<uint64_t>());
+    prev_set = false;
+    start_length = r.get<uint64_t>();
+    ids = r.get_vector<Token>();
+    auto count = r.get<uint64_t>();
+    for (size_t i = 0; i < count; i++) {
+      auto info = read_cache_info(r);
+      Location loc;
+      loc.start_idx = r.get<uint64_t>();
+      loc.length = r.get<uint64_t>();
+      locations.location_map[info] = loc;
+    }
+  }
 
   friend void to_json(nlohmann ::json& nlohmann_json_j, const Prefix& nlohmann_json_t) {
     nlohmann_json_j["prefix_id"] = nlohmann_json_t.prefix_id;
@@ -362,34 +623,23 @@ struct Prefix {
     return now_prefix;
   }
 
-  void hash_to_with(TokenLength length, TokensHasher& hasher) {
-    TokenLength local_length = length - start_length;
-    if (prev) {
-      prev->hash_to_with(start_length, hasher);
-    }
-    hasher.update(ids.data(), local_length);
-  }
-
   void debug() {
     fmt::print("Prefix {}, start_length: {}, local_length: {}, prev: {}, \n", prefix_id, start_length, local_length(),
                (void*)prev);
   }
 };
 struct PrefixMatch {
-  Prefix* prefix;
-  TokenLength match_length;
+  Prefix* prefix = nullptr;
+  TokenLength match_length = 0;
 
-  std::vector<TokensHash> matched_hashes(CacheInfo info, Layer layer) {
+  // block_hashes are the chained hashes of the looked up tokens, the matched blocks are a prefix of them
+  std::vector<TokensHash> matched_hashes(CacheInfo info, Layer layer, const std::vector<TokensHash>& block_hashes) {
     std::vector<TokensHash> re;
     if (prefix == nullptr)
       return re;
-    TokensHasher hasher;
-    hasher.reset(info.hash_value());
-    hasher.update_raw(&layer, sizeof(layer));
-    auto ids = prefix->prefix_to(match_length);
-    for (TokenLength i = 0; i < ids.size(); i += NumTokenPerBlock) {
-      TokenLength len = std::min(NumTokenPerBlock, ids.size() - i);
-      re.push_back(hasher.update(ids.data() + i, len));
+    auto info_hash = info.hash_value();
+    for (BlockLength i = 0; i < div_up(match_length, NumTokenPerBlock); i++) {
+      re.push_back(TokensHasher::layer_block_key(block_hashes[i], info_hash, layer));
     }
     return re;
   }
@@ -454,13 +704,12 @@ struct MatchByBlock {
     std::vector<std::optional<TokensHash>> re(matches.size(), std::nullopt);
 
     for (size_t i = 0; i < matches.size(); i++) {
-      TokensHasher hasher;
-      hasher.reset(info.hash_value());
-      hasher.update_raw(&layer, sizeof(layer));
       auto& [p, idx, status] = matches[i];
       if (p) {
-        p->hash_to_with((idx + 1) * NumTokenPerBlock, hasher);
-        re[i] = hasher.get();
+        auto ids = p->prefix_to((idx + 1) * NumTokenPerBlock);
+        std::vector<TokensHash> hashes;
+        TokensHasher::append_block_hashes(hashes, ids.data(), ids.size(), NumTokenPerBlock);
+        re[i] = TokensHasher::layer_block_key(hashes.back(), info.hash_value(), layer);
       }
     }
     return re;
@@ -500,75 +749,393 @@ struct MatchByBlock {
   }
 };
 
+// Prefix nodes by prefix_id, 0 is nullptr. Nodes live in chunks that are never moved or freed, so a Prefix* stays
+// valid and readers find a node without a lock. Only the writer of the tree emplaces.
+class PrefixArena {
+ public:
+  static constexpr size_t ChunkBits = 12;
+  static constexpr size_t ChunkSize = size_t(1) << ChunkBits;
+  static constexpr size_t MaxChunks = size_t(1) << 16;
+
+  PrefixArena() : chunks_(new std::atomic<Prefix*>[MaxChunks]) {
+    for (size_t i = 0; i < MaxChunks; i++) {
+      chunks_[i].store(nullptr, std::memory_order_relaxed);
+    }
+    chunks_[0].store(new Prefix[ChunkSize], std::memory_order_release);
+  }
+  ~PrefixArena() {
+    for (size_t i = 0; i < MaxChunks; i++) {
+      delete[] chunks_[i].load(std::memory_order_relaxed);
+    }
+  }
+  PrefixArena(const PrefixArena&) = delete;
+  PrefixArena& operator=(const PrefixArena&) = delete;
+
+  Prefix* at(uint64_t prefix_id) const {
+    if (prefix_id == 0 || prefix_id >= size()) {
+      return nullptr;
+    }
+    return chunks_[prefix_id >> ChunkBits].load(std::memory_order_acquire) + (prefix_id & (ChunkSize - 1));
+  }
+
+  // The next node with its prefix_id set, at() finds it after publish()
+  Prefix* emplace() {
+    auto prefix_id = size_.load(std::memory_order_relaxed);
+    if ((prefix_id >> ChunkBits) >= MaxChunks) {
+      throw std::runtime_error("PrefixArena is full");
+    }
+    auto& chunk = chunks_[prefix_id >> ChunkBits];
+    if (chunk.load(std::memory_order_relaxed) == nullptr) {
+      chunk.store(new Prefix[ChunkSize], std::memory_order_release);
+    }
+    auto re = chunk.load(std::memory_order_relaxed) + (prefix_id & (ChunkSize - 1));
+    re->prefix_id = prefix_id;
+    return re;
+  }
+
+  void publish() { size_.fetch_add(1, std::memory_order_release); }
+
+  // One more than the last prefix_id
+  size_t size() const { return size_.load(std::memory_order_acquire); }
+
+ private:
+  std::unique_ptr<std::atomic<Prefix*>[]> chunks_;
+  std::atomic_size_t size_ = 1;
+};
+
+// Open addressing map from the chained hash of a block to the prefix holding it, packed as prefix_id << 32 |
+// block_idx. One writer, readers take no lock: a value is stored before the key that publishes it. An erased slot
+// keeps its key with a value of 0, so probe chains stay intact. A table with 3/4 of its slots used is rehashed into a
+// new one, twice the size if half of them are live. A replaced table is freed once no reader is inside the index.
+class BlockIndex {
+ public:
+  explicit BlockIndex(size_t capacity = 1024) {
+    current_.store(new Table(capacity), std::memory_order_release);
+  }
+  ~BlockIndex() {
+    delete current_.load(std::memory_order_relaxed);
+    for (auto t : retired_) {
+      delete t;
+    }
+  }
+  BlockIndex(const BlockIndex&) = delete;
+  BlockIndex& operator=(const BlockIndex&) = delete;
+
+  static uint64_t pack(uint64_t prefix_id, BlockLength block_idx) { return prefix_id << 32 | block_idx; }
+  static uint64_t prefix_id_of(uint64_t value) { return value >> 32; }
+  static BlockLength block_idx_of(uint64_t value) { return value & 0xffffffff; }
+
+  std::optional<uint64_t> find(TokensHash hash) const {
+    readers_.fetch_add(1);
+    auto key = slot_key(hash);
+    const Table* t = current_.load();
+    std::optional<uint64_t> re;
+    for (size_t i = key & t->mask;; i = (i + 1) & t->mask) {
+      auto k = t->slots[i].key.load(std::memory_order_acquire);
+      if (k == key) {
+        if (auto value = t->slots[i].value.load(std::memory_order_acquire); value != 0) {
+          re = value;
+        }
+        break;
+      }
+      if (k == 0) {
+        break;
+      }
+    }
+    readers_.fetch_sub(1, std::memory_order_release);
+    return re;
+  }
+
+  // Writer only, overwrites the value of a known hash
+  void insert(TokensHash hash, uint64_t value) {
+    assert(value != 0);
+    Table* t = current_.load(std::memory_order_relaxed);
+    auto [previous, is_new_key] = put(*t, slot_key(hash), value);
+    if (previous == 0) {
+      size_++;
+      if (is_new_key == false) {
+        erased_--;
+      } else if ((size_ + erased_) * 4 > (t->mask + 1) * 3) {
+        rehash();
+      }
+    }
+  }
+
+  // Writer only, erases hash if it still maps to value
+  void erase(TokensHash hash, uint64_t value) {
+    auto key = slot_key(hash);
+    Table* t = current_.load(std::memory_order_relaxed);
+    for (size_t i = key & t->mask;; i = (i + 1) & t->mask) {
+      auto k = t->slots[i].key.load(std::memory_order_relaxed);
+      if (k == key) {
+        if (t->slots[i].value.load(std::memory_order_relaxed) == value) {
+          t->slots[i].value.store(0, std::memory_order_release);
+          size_--;
+          erased_++;
+        }
+        return;
+      }
+      if (k == 0) {
+        return;
+      }
+    }
+  }
+
+  size_t size() const { return size_; }
+
+  template <typename F>
+  void for_each(F&& f) const {
+    const Table* t = current_.load(std::memory_order_acquire);
+    for (size_t i = 0; i <= t->mask; i++) {
+      auto k = t->slots[i].key.load(std::memory_order_acquire);
+      auto v = t->slots[i].value.load(std::memory_order_acquire);
+      if (k != 0 && v != 0) {
+        f(k, v);
+      }
+    }
+  }
+
+ private:
+  struct Slot {
+    std::atomic_uint64_t key = 0;  // 0 is empty
+    std::atomic_uint64_t value = 0;
+  };
+  struct Table {
+    size_t mask;
+    std::unique_ptr<Slot[]> slots;
+    explicit Table(size_t capacity) : mask(capacity - 1), slots(new Slot[capacity]) {
+      assert((capacity & mask) == 0);
+    }
+  };
+
+  static uint64_t slot_key(TokensHash hash) { return hash == 0 ? 1 : hash; }
+
+  // Returns the previous value of the slot and whether its key is new
+  static std::pair<uint64_t, bool> put(Table& t, uint64_t key, uint64_t value) {
+    for (size_t i = key & t.mask;; i = (i + 1) & t.mask) {
+      auto k = t.slots[i].key.load(std::memory_order_relaxed);
+      if (k == key) {
+        return {t.slots[i].value.exchange(value, std::memory_order_release), false};
+      }
+      if (k == 0) {
+        t.slots[i].value.store(value, std::memory_order_relaxed);
+        t.slots[i].key.store(key, std::memory_order_release);
+        return {0, true};
+      }
+    }
+  }
+
+  void rehash() {
+    Table* old = current_.load(std::memory_order_relaxed);
+    size_t capacity = old->mask + 1;
+    if (size_ * 2 >= capacity) {
+      capacity *= 2;
+    }
+    auto t = new Table(capacity);
+    for (size_t i = 0; i <= old->mask; i++) {
+      auto k = old->slots[i].key.load(std::memory_order_relaxed);
+      auto v = old->slots[i].value.load(std::memory_order_relaxed);
+      if (k != 0 && v != 0) {
+        put(*t, k, v);
+      }
+    }
+    erased_ = 0;
+    current_.store(t);
+    retired_.push_back(old);
+    // a reader that comes in after this sees the new table
+    if (readers_.load() == 0) {
+      for (auto r : retired_) {
+        delete r;
+      }
+      retired_.clear();
+    }
+  }
+
+  std::atomic<Table*> current_;
+  mutable std::atomic_size_t readers_ = 0;
+  std::vector<Table*> retired_;
+  size_t size_ = 0;
+  size_t erased_ = 0;
+};
+
+/*
+Block granular radix tree. A Prefix is an edge holding the tokens it adds to its prev, every block of it is indexed by
+its chained hash, so a lookup is a binary search over the hashes of the request. Look ups take no lock and never wait
+on an insert. Inserts are serialized by write_lock, a node is filled and published before its blocks are indexed,
+in block order, so a reader that finds a block also finds every block before it.
+
+Disk eviction removes leaves under write_lock, erasing their blocks from the last one. A handle pins the prefix it
+matched, so the prefix and every prefix before it stay; pin() fails on a prefix evicted since it was looked up.
+*/
 struct PrefixTree {
-  std::shared_mutex rw_lock;
+  std::mutex write_lock;
 
-  std::atomic_uint64_t prefix_id_counter = 1;
-  using MapT =
-      std::unordered_map<TokensHash, std::pair<std::shared_ptr<Prefix>, BlockLength>>;  // Prefix, start_block_idx
-  MapT prefix_map;
+  PrefixArena prefixes;
+  BlockIndex index;
 
   std::shared_ptr<Metrics> met;
-
-  std::vector<std::shared_ptr<Prefix>> prefix_refs = {nullptr};  // 0 is nullptr
+  journal::Journal* journal = nullptr;
 
   friend void to_json(nlohmann ::json& nlohmann_json_j, const PrefixTree& nlohmann_json_t) {
-    nlohmann_json_j["prefix_id_counter"] = nlohmann_json_t.prefix_id_counter.load();
+    nlohmann_json_j["prefix_id_counter"] = nlohmann_json_t.prefixes.size();
     nlohmann_json_j["prefix_refs"] = nlohmann::json::array();
-    for (auto prefix : nlohmann_json_t.prefix_refs) {
-      if (prefix == nullptr)
-        continue;
-      nlohmann_json_j["prefix_refs"].push_back(*prefix);
+    for (size_t i = 1; i < nlohmann_json_t.prefixes.size(); i++) {
+      nlohmann_json_j["prefix_refs"].push_back(*nlohmann_json_t.prefixes.at(i));
     }
   }
   friend void from_json(const nlohmann ::json& nlohmann_json_j, PrefixTree& nlohmann_json_t) {
-    nlohmann_json_t.prefix_id_counter = nlohmann_json_j.at("prefix_id_counter").get<uint64_t>();
+    auto prefix_id_counter = nlohmann_json_j.at("prefix_id_counter").get<uint64_t>();
 
-    nlohmann_json_t.prefix_refs.resize(nlohmann_json_t.prefix_id_counter);
-    for (size_t i = 1; i < nlohmann_json_t.prefix_id_counter; ++i) {
-      auto prefix = std::make_shared<Prefix>();
+    for (size_t i = 1; i < prefix_id_counter; ++i) {
+      auto prefix = nlohmann_json_t.prefixes.emplace();
       nlohmann_json_j.at("prefix_refs")[i - 1].get_to(*prefix);
-      nlohmann_json_t.prefix_refs[i] = prefix;
+      nlohmann_json_t.prefixes.publish();
     }
     nlohmann_json_t.init_prevs();
     nlohmann_json_t.init_map();
   };
 
   void init_prevs() {
-    for (auto p : prefix_refs) {
-      if (p) {
-        if (p->prev_set == false) {
-          p->prev = prefix_refs[reinterpret_cast<uint64_t>(p->prev)].get();
-          p->prev_set = true;
-        }
+    for (size_t i = 1; i < prefixes.size(); i++) {
+      auto p = prefixes.at(i);
+      if (p->prev_set == false) {
+        p->prev = prefixes.at(reinterpret_cast<uint64_t>(p->prev));
+        p->prev_set = true;
       }
+      link(p);
+    }
+  }
+
+  // A loaded prefix with no ids was evicted, new prefixes always add tokens
+  void link(Prefix* p) {
+    p->evicted = p->ids.empty();
+    if (p->evicted == false && p->prev) {
+      p->prev->children++;
     }
   }
 
   void init_map() {
-    assert(prefix_map.empty());
-    for (auto p : prefix_refs) {
-      if (p == nullptr)
-        continue;
+    assert(index.size() == 0);
+    // a prefix comes after its prev, whose hashes it chains from
+    for (size_t i = 1; i < prefixes.size(); i++) {
+      index_prefix(prefixes.at(i));
+    }
+  }
+
+  // Chained hash of the first `length` tokens of the chain ending at p, length is at a block boundary
+  static TokensHash hash_at(Prefix* p, TokenLength length) {
+    if (length == 0)
+      return hash_seed;
+    while (p->start_length >= length) {
+      p = p->prev;
+    }
+    return p->hashes[(length - p->start_length) / NumTokenPerBlock - 1];
+  }
+
+  // Hashes the local blocks of a loaded prefix and adds them to the index, reading only its own tokens
+  void index_prefix(Prefix* p) {
+    p->hashes.clear();
+    if (p->evicted)
+      return;
+    TokensHash hash = hash_at(p->prev, p->start_length);
+    for (TokenLength i = 0; i < p->local_length(); i += NumTokenPerBlock) {
+      hash = TokensHasher::chain(hash, p->ids.data() + i, std::min(NumTokenPerBlock, p->local_length() - i));
+      p->hashes.push_back(hash);
+      index.insert(hash, BlockIndex::pack(p->prefix_id, (p->start_length + i) / NumTokenPerBlock));
+    }
+  }
+
+  void update_location(Prefix* p, CacheInfo info, Location location) {
+    p->update_location(info, location);
+    if (journal) {
+      journal::BinaryWriter w;
+      w.put<uint64_t>(p->prefix_id);
+      kvc2::write_binary(w, info);
+      w.put<uint64_t>(location.start_idx);
+      w.put<uint64_t>(location.length);
+      journal->append(LocationUpdated, w.data());
+    }
+  }
 
-      auto ids = p->full();
-      for (TokenLength i = p->start_length; i < p->length(); i += NumTokenPerBlock) {
-        TokenLength end = std::min(i + NumTokenPerBlock, p->length());
-        assert(end % NumTokenPerBlock == 0);
-        auto hash = TokensHasher::hash(ids.data(), end);
-        prefix_map[hash] = {p, end / NumTokenPerBlock - 1};
+  void write_binary(journal::BinaryWriter& w) {
+    w.put<uint64_t>(prefixes.size());
+    w.put<uint64_t>(prefixes.size() - 1);
+    for (size_t i = 1; i < prefixes.size(); i++) {
+      prefixes.at(i)->write_binary(w);
+    }
+  }
+
+  void read_binary(journal::BinaryReader& r) {
+    auto prefix_id_counter = r.get<uint64_t>();
+    auto count = r.get<uint64_t>();
+    if (count + 1 != prefix_id_counter) {
+      throw std::runtime_error("meta: prefix ids are not dense");
+    }
+    for (size_t i = 0; i < count; i++) {
+      auto prefix = prefixes.emplace();
+      auto prefix_id = prefix->prefix_id;
+      prefix->read_binary(r);
+      if (prefix->prefix_id != prefix_id) {
+        throw std::runtime_error("meta: prefixes are not in id order");
       }
+      prefixes.publish();
     }
+    init_prevs();
+    init_map();
   }
 
-  // Look up prefix from the map, return the matched prefix and length.
-  // If the prefix is not found, match contains nullptr and 0.
-  PrefixMatch look_up(Token* data, TokenLength length, bool need_lock = true) {
-    std::shared_lock<std::shared_mutex> sl;
-    if (need_lock) {
-      sl = std::shared_lock<std::shared_mutex>(rw_lock);
+  void replay_insert(journal::BinaryReader& r) {
+    auto prefix_id = r.get<uint64_t>();
+    if (prefix_id < prefixes.size()) {
+      return;  // already in the snapshot
     }
+    assert(prefix_id == prefixes.size());
+    auto prefix = prefixes.emplace();
+    prefix->prev = prefixes.at(r.get<uint64_t>());
+    prefix->prev_set = true;
+    prefix->start_length = r.get<uint64_t>();
+    prefix->ids = r.get_vector<Token>();
+    prefixes.publish();
+    link(prefix);
+    index_prefix(prefix);
+  }
+
+  void replay_evict(journal::BinaryReader& r) {
+    auto prefix = prefixes.at(r.get<uint64_t>());
+    if (prefix == nullptr || prefix->evicted) {
+      return;
+    }
+    prefix->evicted = true;
+    evict(prefix);
+  }
 
+  void replay_location(journal::BinaryReader& r) {
+    auto prefix_id = r.get<uint64_t>();
+    auto info = read_cache_info(r);
+    Location loc;
+    loc.start_idx = r.get<uint64_t>();
+    loc.length = r.get<uint64_t>();
+    auto prefix = prefixes.at(prefix_id);
+    if (prefix == nullptr) {
+      throw std::out_of_range(fmt::format("journal: no prefix {}", prefix_id));
+    }
+    prefix->update_location(info, loc);
+  }
+
+  // Chained hashes of the full blocks of a request, computed once and shared by lookup, insert and the cache block
+  // keys of every layer.
+  static std::vector<TokensHash> block_hashes(Token* data, TokenLength length) {
+    std::vector<TokensHash> re;
+    re.reserve(length / NumTokenPerBlock);
+    TokensHasher::append_block_hashes(re, data, length / NumTokenPerBlock * NumTokenPerBlock, NumTokenPerBlock);
+    return re;
+  }
+
+  PrefixMatch look_up(Token* data, TokenLength length) { return look_up(block_hashes(data, length), length); }
+
+  // Look up prefix from the index, return the matched prefix and length.
+  // If the prefix is not found, match contains nullptr and 0.
+  PrefixMatch look_up(const std::vector<TokensHash>& hashes, TokenLength length) {
     // We disable full seq match because this is awful when we try to maintain the flush back.
     // auto full_seq_hash = TokensHasher::hash(data, length);
     // SPDLOG_DEBUG("Look up prefix with hash {:016x} length: {}", full_seq_hash, length);
@@ -578,14 +1145,16 @@ struct PrefixTree {
     //   return {prefix_map.at(full_seq_hash), length};
     // }
 
-    TokenLength block_length = length / NumTokenPerBlock;  // do not need the tail
+    TokenLength block_length = std::min(length / NumTokenPerBlock, hashes.size());  // do not need the tail
     TokenLength l = 0, r = block_length + 1;
+    uint64_t found = 0;
     while (l + 1 < r) {
       TokenLength mid = (l + r) / 2;  // [1,block_length]
-      auto hash = TokensHasher::hash(data, mid * NumTokenPerBlock);
-      if (prefix_map.count(hash)) {
+      auto hash = hashes[mid - 1];
+      if (auto value = index.find(hash)) {
         SPDLOG_DEBUG("Binary Prefix Search: Found prefix with hash {:016x}", hash);
         l = mid;
+        found = *value;
       } else {
         SPDLOG_DEBUG("Binary Prefix Search: Not Found prefix with hash {:016x}", hash);
         r = mid;
@@ -598,62 +1167,195 @@ struct PrefixTree {
     if (l == 0)
       return {nullptr, 0};
 
-    auto hash = TokensHasher::hash(data, l * NumTokenPerBlock);
+    return {prefixes.at(BlockIndex::prefix_id_of(found)), l * NumTokenPerBlock};
+  }
 
-    return {prefix_map.at(hash).first.get(), l * NumTokenPerBlock};
+  // A handle uses a prefix only while it holds a pin on it
+  bool pin(Prefix* p) {
+    p->pins.fetch_add(1);
+    if (p->evicted.load()) {
+      p->pins.fetch_sub(1);
+      return false;
+    }
+    return true;
   }
 
-  PrefixMatch look_up_or_insert(Token* data, TokenLength length) {
-    std::unique_lock<std::shared_mutex> ul(rw_lock);
+  void unpin(Prefix* p) { p->pins.fetch_sub(1); }
+
+  static void touch(Prefix* p) {
+    p->last_access.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    p->hits.fetch_add(1, std::memory_order_relaxed);
+  }
 
-    auto match = look_up(data, length, false);
+  // The matched prefix is pinned, the lookup is retried if it was evicted in between
+  PrefixMatch look_up_pinned(const std::vector<TokensHash>& hashes, TokenLength length) {
+    while (true) {
+      auto match = look_up(hashes, length);
+      if (match.prefix == nullptr) {
+        return match;
+      }
+      if (pin(match.prefix)) {
+        touch(match.prefix);
+        return match;
+      }
+    }
+  }
+
+  // The returned prefix is pinned
+  PrefixMatch look_up_or_insert(Token* data, TokenLength length, const std::vector<TokensHash>& hashes) {
+    std::lock_guard<std::mutex> lg(write_lock);
+
+    auto match = look_up(hashes, length);
     if (match.match_length == length) {
+      // nothing is evicted while we hold the lock
+      pin(match.prefix);
+      touch(match.prefix);
       return match;
     }
-    auto new_prefix = new_prefix_node(match.prefix, match.match_length, data, length, false);
+    auto new_prefix = new_prefix_node(match.prefix, match.match_length, data, length, hashes, false);
 
     PrefixMatch re;
-    re.prefix = new_prefix.get();
+    re.prefix = new_prefix;
     re.match_length = length;
     return re;
   }
 
-  std::shared_ptr<Prefix> new_prefix_node(Prefix* prev, TokenLength prev_match_length, Token* data, TokenLength length,
-                                          bool need_lock = true) {
-    std::unique_lock<std::shared_mutex> ul;
+  // hashes must cover the full blocks of data up to length, the new prefix is pinned
+  Prefix* new_prefix_node(Prefix* prev, TokenLength prev_match_length, Token* data, TokenLength length,
+                          const std::vector<TokensHash>& hashes, bool need_lock = true) {
+    std::unique_lock<std::mutex> ul(write_lock, std::defer_lock);
     if (need_lock)
-      ul = std::unique_lock<std::shared_mutex>(rw_lock);
-    auto new_prefix = std::make_shared<Prefix>();
-    new_prefix->prefix_id = prefix_id_counter.fetch_add(1);
+      ul.lock();
+    auto new_prefix = prefixes.emplace();
     new_prefix->start_length = prev_match_length;
     new_prefix->ids = Tokens(data + prev_match_length, data + length);
     new_prefix->prev = prev;
     new_prefix->prev_set = true;
-    prefix_refs.push_back(new_prefix);
+    new_prefix->pins = 1;
+    touch(new_prefix);
+    if (prev) {
+      prev->children++;
+    }
     met->prefix_nodes->Increment();
     met->prefix_block_count->Increment(div_up(length - prev_match_length, NumTokenPerBlock));
 
-    assert(prefix_refs.size() == prefix_id_counter.load());
+    assert(hashes.size() >= length / NumTokenPerBlock);
+    for (TokenLength i = prev_match_length; i < length; i += NumTokenPerBlock) {
+      BlockLength block_idx = i / NumTokenPerBlock;
+      auto hash = block_idx < hashes.size()
+                      ? hashes[block_idx]
+                      : TokensHasher::chain(block_idx == 0 ? hash_seed : hashes[block_idx - 1], data + i, length - i);
+      new_prefix->hashes.push_back(hash);
+    }
 
-    TokensHasher hasher;
-    hasher.update(data, prev_match_length);
+    // the node is complete before a reader can reach it from the index
+    prefixes.publish();
+    for (size_t i = 0; i < new_prefix->hashes.size(); i++) {
+      index.insert(new_prefix->hashes[i],
+                   BlockIndex::pack(new_prefix->prefix_id, prev_match_length / NumTokenPerBlock + i));
+    }
 
-    for (TokenLength i = prev_match_length; i < length; i += NumTokenPerBlock) {
-      TokenLength len = std::min(NumTokenPerBlock, length - i);
-      auto hash = hasher.update(data + i, len);
-      prefix_map[hash] = {new_prefix, i / NumTokenPerBlock};
+    // logged under the lock, so the records are in prefix_id order
+    if (journal) {
+      journal::BinaryWriter w;
+      w.put<uint64_t>(new_prefix->prefix_id);
+      w.put<uint64_t>(prev ? prev->prefix_id : 0);
+      w.put<uint64_t>(new_prefix->start_length);
+      w.put_vector(new_prefix->ids);
+      journal->append(PrefixInserted, w.data());
     }
 
     return new_prefix;
   }
 
-  void debug() {
-    fmt::print("PrefixTree with {} prefixes, prefix counter: {}\n", prefix_map.size(), prefix_id_counter.load());
-    for (auto& [hash, prefix] : prefix_map) {
-      fmt::print("Hash: {:016x}, start block {}\n", hash, prefix.second);
-      prefix.first->debug();
+  // Removes an unpinned leaf marked evicted, under write_lock. Its disk locations are returned and cleared.
+  std::vector<std::pair<CacheInfo, Location>> evict(Prefix* p) {
+    assert(p->children == 0);
+    for (size_t i = p->hashes.size(); i-- > 0;) {
+      index.erase(p->hashes[i], BlockIndex::pack(p->prefix_id, p->start_length / NumTokenPerBlock + i));
+    }
+    if (p->prev) {
+      // the prev may be a leaf now, it was used as recently as its last child
+      p->prev->children--;
+      p->prev->last_access.store(std::max(p->prev->last_access.load(), p->last_access.load()));
+      p->prev->hits.store(std::max(p->prev->hits.load(), p->hits.load()));
+    }
+    std::vector<std::pair<CacheInfo, Location>> re(p->locations.location_map.begin(),
+                                                   p->locations.location_map.end());
+    p->locations.location_map.clear();
+    Tokens().swap(p->ids);
+    std::vector<TokensHash>().swap(p->hashes);
+    p->prev = nullptr;
+    p->start_length = 0;
+    met->evicted_prefix_nodes->Increment();
+    if (journal) {
+      journal::BinaryWriter w;
+      w.put<uint64_t>(p->prefix_id);
+      journal->append(PrefixEvicted, w.data());
+    }
+    return re;
+  }
+
+  /*
+  Evicts leaves, the least recently used first or with lfu the least hit, until on_evicted returns false. A leaf is
+  skipped if it is pinned or can_evict vetoes it, a prev left with no children becomes a candidate. on_evicted gets
+  the disk locations of the evicted prefix. Must hold write_lock.
+  */
+  void evict_leaves(bool lfu, const std::function<bool(Prefix*)>& can_evict,
+                    const std::function<bool(std::vector<std::pair<CacheInfo, Location>>)>& on_evicted) {
+    auto score = [lfu](Prefix* p) {
+      return lfu ? std::make_pair<int64_t, int64_t>(p->hits.load(), p->last_access.load())
+                 : std::make_pair<int64_t, int64_t>(p->last_access.load(), 0);
+    };
+    using Candidate = std::pair<std::pair<int64_t, int64_t>, Prefix*>;
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> leaves;
+    for (size_t i = 1; i < prefixes.size(); i++) {
+      auto p = prefixes.at(i);
+      if (p->evicted == false && p->children == 0 && p->pins.load() == 0) {
+        leaves.push({score(p), p});
+      }
+    }
+
+    while (leaves.empty() == false) {
+      auto p = leaves.top().second;
+      leaves.pop();
+      if (p->pins.load() != 0 || can_evict(p) == false) {
+        continue;
+      }
+      // pairs with pin(), a handle either sees evicted or is seen here
+      p->evicted.store(true);
+      if (p->pins.load() != 0) {
+        p->evicted.store(false);
+        continue;
+      }
+      auto prev = p->prev;
+      if (on_evicted(evict(p)) == false) {
+        break;
+      }
+      if (prev && prev->children == 0 && prev->pins.load() == 0) {
+        leaves.push({score(prev), prev});
+      }
     }
   }
+
+  // Locations of every live prefix, by cache
+  std::unordered_map<CacheInfo, std::vector<Location>> disk_locations() {
+    std::unordered_map<CacheInfo, std::vector<Location>> re;
+    for (size_t i = 1; i < prefixes.size(); i++) {
+      for (auto& [info, loc] : prefixes.at(i)->locations.location_map) {
+        re[info].push_back(loc);
+      }
+    }
+    return re;
+  }
+
+  void debug() {
+    fmt::print("PrefixTree with {} prefixes, {} indexed blocks\n", prefixes.size() - 1, index.size());
+    index.for_each([this](TokensHash hash, uint64_t value) {
+      fmt::print("Hash: {:016x}, start block {}\n", hash, BlockIndex::block_idx_of(value));
+      prefixes.at(BlockIndex::prefix_id_of(value))->debug();
+    });
+  }
 };
 
 size_t locations_blocks_count(const std::vector<Location>& locations) {
@@ -692,8 +1394,15 @@ struct DoubleCacheHandle : public DoubleCacheHandleInterface {
   };
 
   Tokens ids;
+  // chained hashes of the full blocks of ids, see PrefixTree::block_hashes
+  std::vector<TokensHash> block_hashes;
   TokenLength estimated_length;
 
+  void set_ids(Token* id, TokenLength length) {
+    ids = Tokens(id, id + length);
+    block_hashes = PrefixTree::block_hashes(id, length);
+  }
+
   bool enable_alt = false;
   PrefixMatch match;
   // MatchByBlock match_by_blocks;
@@ -713,6 +1422,10 @@ struct DoubleCacheHandle : public DoubleCacheHandleInterface {
 
   std::vector<size_t> gpu_only_block_idx;
 
+  // set by the owner of the lookup, its disk reads are dropped once it is true
+  std::shared_ptr<std::atomic_bool> cancelled = nullptr;
+  bool is_cancelled() { return cancelled && cancelled->load(); }
+
   virtual ~DoubleCacheHandle();
   // interface
   TokenLength matched_length() override {
@@ -852,6 +1565,35 @@ struct DoubleCacheHandle : public DoubleCacheHandleInterface {
     }
   }
 
+  // Takes the pages of the blocks not in memory with one pool call per block size. What is not used, because another
+  // handle allocated a block meanwhile, goes back to the pool.
+  std::map<size_t, std::vector<void*>> reserve_on_cpu(std::shared_ptr<PageAlignedMemoryPool>& pool) {
+    std::map<size_t, size_t> missing;
+    CacheEntryManager* manager = nullptr;
+    for_all_cache_block_entry([&missing, &manager](std::shared_ptr<CacheBlockEntry>& block_entry) {
+      auto lg = block_entry->lock_guard();
+      if (block_entry->data == nullptr) {
+        missing[block_entry->size] += 1;
+        manager = block_entry->manager;
+      }
+      return true;
+    });
+    std::map<size_t, std::vector<void*>> reserved;
+    if (manager != nullptr) {
+      pool = manager->pool;
+    }
+    for (auto [size, count] : missing) {
+      auto pages = manager->pool->alloc_multiple(size, count);
+      if (pages.empty()) {
+        manager->evict_for_cpu_cache(size * count);
+        pages = manager->pool->alloc_multiple(size, count);
+      }
+      // the blocks left without pages allocate them one by one
+      reserved[size] = std::move(pages);
+    }
+    return reserved;
+  }
+
   // concurrent check ok
   bool alloc_on_cpu() {
     assert(cpu_releaser == nullptr);
@@ -861,9 +1603,11 @@ struct DoubleCacheHandle : public DoubleCacheHandleInterface {
           entry->cpu_cc.ref_count.fetch_sub(1);
         });
     bool ok = true;
+    std::shared_ptr<PageAlignedMemoryPool> pool;
+    auto reserved = reserve_on_cpu(pool);
 
-    for_all_cache_block_entry([&ok, &releaser](std::shared_ptr<CacheBlockEntry>& block_entry) {
-      if (block_entry->inc_ref_or_alloc_on_cpu() == false) {
+    for_all_cache_block_entry([&ok, &releaser, &reserved](std::shared_ptr<CacheBlockEntry>& block_entry) {
+      if (block_entry->inc_ref_or_alloc_on_cpu(&reserved[block_entry->size]) == false) {
         ok = false;
         return false;
       } else {
@@ -872,6 +1616,12 @@ struct DoubleCacheHandle : public DoubleCacheHandleInterface {
       return true;
     });
 
+    for (auto& [size, pages] : reserved) {
+      for (auto page : pages) {
+        pool->free(page, size);
+      }
+    }
+
     if (ok) {
       cpu_releaser = std::move(releaser);
     }
@@ -927,14 +1677,19 @@ struct DoubleCacheHandle : public DoubleCacheHandleInterface {
 
   std::shared_ptr<IO_Helper<CacheBlockEntry>> segment_io(async_store::IODealer* dealer, DiskCacheManager* manager,
                                                          BlockLength block_start, BlockLength length, IOOption option) {
-    auto io_helper = std::make_shared<IO_Helper<CacheBlockEntry>>([option](CacheBlockEntry* b) {
+    auto io_helper = std::make_shared<IO_Helper<CacheBlockEntry>>([option, cancelled = cancelled](CacheBlockEntry* b) {
       switch (option) {
         case IO_ForceRead:
           break;
         case IO_ForceWrite:
           break;
         case IO_Read: {
-          b->cpu_cc.tc.set_has_data();
+          if (cancelled && cancelled->load()) {
+            // some reads may have been dropped, whoever needs the block loads it again
+            b->cpu_cc.tc.reset();
+          } else {
+            b->cpu_cc.tc.set_has_data();
+          }
           break;
         }
         case IO_Write:
@@ -944,6 +1699,10 @@ struct DoubleCacheHandle : public DoubleCacheHandleInterface {
       }
     });
 
+    if (option == IO_Read) {
+      io_helper->cancelled = cancelled.get();
+    }
+
     auto single_segment_io = [dealer, manager, block_start, length, option, io_helper](
                                  CacheInfo info, SegmentLocations& seg_locs,
                                  std::vector<std::vector<std::shared_ptr<CacheBlockEntry>>>& layers) {
@@ -1102,12 +1861,116 @@ struct KVC2 : KVC2Interface {
   std::unique_ptr<async_store::IODealer> io_dealer;
 
   std::shared_ptr<GPUPageCache> gpu_cache;
+  std::unique_ptr<journal::Journal> journal;
+  std::unique_ptr<periodic::PeriodicTask> reclaimer;
+
+  void open_journal(bool truncate) {
+    journal = std::make_unique<journal::Journal>(root / "journal.bin", truncate);
+    tree->journal = journal.get();
+    disk_cache->journal = journal.get();
+  }
+
+  void start_reclaimer() {
+    if (reclaimer == nullptr) {
+      reclaimer = std::make_unique<periodic::PeriodicTask>([this]() { reclaim_disk(); }, std::chrono::seconds(1));
+    }
+  }
+
+  // False if a block of p is still used in memory, the entries of the others are dropped
+  bool drop_cached_blocks(Prefix* p) {
+    for (auto& entry : p->locations.location_map) {
+      CacheInfo info = entry.first;
+      auto info_hash = info.hash_value();
+      for (Layer l = 0; l < info.hidden_layer_count(); l++) {
+        for (auto hash : p->hashes) {
+          if (cache_manager->drop(TokensHasher::layer_block_key(hash, info_hash, l)) == false) {
+            return false;
+          }
+        }
+      }
+    }
+    return true;
+  }
+
+  // Evicts prefixes from disk down to 9/10 of the quota, then shrinks the cache files
+  void reclaim_disk() {
+    size_t used = disk_cache->used_bytes();
+    met->disk_usage->Set(used);
+    if (config.disk_quota != 0 && used > config.disk_quota) {
+      size_t target = config.disk_quota / 10 * 9;
+      std::vector<std::pair<CacheInfo, Location>> freed;
+      size_t evicted = 0;
+      {
+        std::lock_guard<std::mutex> lg(tree->write_lock);
+        tree->evict_leaves(
+            config.disk_eviction_policy == "lfu", [this](Prefix* p) { return drop_cached_blocks(p); },
+            [&](std::vector<std::pair<CacheInfo, Location>> locations) {
+              for (auto& [info, loc] : locations) {
+                used -= std::min(used, loc.length * disk_cache->get_allocator(info)->block_bytes());
+              }
+              freed.insert(freed.end(), locations.begin(), locations.end());
+              evicted++;
+              return used > target;
+            });
+      }
+      if (journal) {
+        // the blocks are reused only once a restart can not bring their prefixes back
+        try {
+          journal->sync();
+        } catch (const std::exception& e) {
+          SPDLOG_ERROR("Keeping {} evicted prefixes on disk: {}", evicted, e.what());
+          return;
+        }
+      }
+      for (auto& [info, loc] : freed) {
+        disk_cache->free(info, loc);
+      }
+      SPDLOG_INFO("Evicted {} prefixes from disk, {} in use, quota {}", evicted, readable_number(used),
+                  readable_number(config.disk_quota));
+    }
+    disk_cache->compact();
+  }
+
+  void replay_journal(std::filesystem::path where) {
+    auto count = journal::Journal::replay(where, [this](uint32_t type, journal::BinaryReader& r) {
+      switch (type) {
+        case PrefixInserted:
+          tree->replay_insert(r);
+          break;
+        case LocationUpdated:
+          tree->replay_location(r);
+          break;
+        case DiskAllocated:
+          disk_cache->replay_allocate(r);
+          break;
+        case PrefixEvicted:
+          tree->replay_evict(r);
+          break;
+        default:
+          SPDLOG_ERROR("Unknown journal record type {}", type);
+      }
+    });
+    if (count > 0) {
+      SPDLOG_WARN("Replayed {} records from {}", count, where.c_str());
+    }
+  }
 
  public:
   void load() override {
     load_quant_configs(root / "quant_configs.json");
     load_model_configs(root / "model_configs.json");
-    {
+    if (std::filesystem::exists(root / "meta.bin")) {
+      auto where = root / "meta.bin";
+      journal::MappedFile file(where);
+      journal::BinaryReader r(file.data(), file.size());
+      if (r.get<uint64_t>() != meta_magic || r.get<uint32_t>() != meta_version) {
+        throw std::runtime_error("Bad kvc2 metadata snapshot " + where.string());
+      }
+      tree->read_binary(r);
+      disk_cache->read_binary(r);
+      SPDLOG_WARN("Loaded from {}", where.c_str());
+    } else {
+      // metadata saved before the binary snapshot
       auto where = root / "tree.json";
       if (std::filesystem::exists(where)) {
         nlohmann::json j;
@@ -1116,9 +1979,7 @@ struct KVC2 : KVC2Interface {
         j.get_to(*tree);
         SPDLOG_WARN("Loaded from {}", where.c_str());
       }
-    }
-    {
-      auto where = root / "disk_cache.json";
+      where = root / "disk_cache.json";
       if (std::filesystem::exists(where)) {
         nlohmann::json j;
         std::ifstream i(where);
@@ -1127,6 +1988,11 @@ struct KVC2 : KVC2Interface {
         SPDLOG_WARN("Loaded from {}", where.c_str());
       }
     }
+    // journal.old only survives a save() that did not finish its snapshot
+    replay_journal(root / "journal.old");
+    replay_journal(root / "journal.bin");
+    // blocks of evicted prefixes and of allocations never given to a prefix are free
+    disk_cache->rebuild_free_extents(tree->disk_locations());
     {
       auto where = root / "config.json";
       if (std::filesystem::exists(where)) {
@@ -1137,6 +2003,10 @@ struct KVC2 : KVC2Interface {
         SPDLOG_WARN("Loaded from {}", where.c_str());
       }
     }
+    if (config.save_to_disk && journal == nullptr) {
+      open_journal(false);
+    }
+    start_reclaimer();
   }
 
   void save() override {
@@ -1145,19 +2015,24 @@ struct KVC2 : KVC2Interface {
     }
     flush_back();
     {
-      nlohmann::json j;
-      j = *tree;
-      auto where = root / "tree.json";
-      std::ofstream o(where);
-      o << j;
-      SPDLOG_WARN("Serialized to {}", where.c_str());
-    }
-    {
-      nlohmann::json j;
-      j = *disk_cache;
-      auto where = root / "disk_cache.json";
-      std::ofstream o(where);
-      o << j;
+      journal::BinaryWriter w;
+      {
+        // No prefix is inserted between the rotation and the snapshot. Records of allocations and locations racing
+        // with it may land in both, replaying them is idempotent.
+        std::lock_guard<std::mutex> lg(tree->write_lock);
+        if (journal) {
+          journal->rotate(root / "journal.old");
+        }
+        w.put<uint64_t>(meta_magic);
+        w.put<uint32_t>(meta_version);
+        tree->write_binary(w);
+        disk_cache->write_binary(w);
+      }
+      auto where = root / "meta.bin";
+      journal::write_file_atomic(where, w.data());
+      std::filesystem::remove(root / "journal.old");
+      std::filesystem::remove(root / "tree.json");
+      std::filesystem::remove(root / "disk_cache.json");
       SPDLOG_WARN("Serialized to {}", where.c_str());
     }
     {
@@ -1186,7 +2061,7 @@ struct KVC2 : KVC2Interface {
     auto h = std::make_shared<DoubleCacheHandle>();
     h->kvc2_top = this;
     h->set_cache_info(model_name, quant_type, config.k_cache_on, config.v_cache_on);
-    h->ids = Tokens(id, id + length);
+    h->set_ids(id, length);
 
     if (config.k_cache_on)
       h->set_raw_handles(true, k_cache);
@@ -1195,7 +2070,7 @@ struct KVC2 : KVC2Interface {
 
     h->check_before_insert();
 
-    h->match = tree->look_up_or_insert(id, length);
+    h->match = tree->look_up_or_insert(id, length, h->block_hashes);
 
     auto now_prefix = h->match.prefix;
     assert(config.k_cache_on);
@@ -1222,8 +2097,8 @@ struct KVC2 : KVC2Interface {
         // split it to prefix trees
         for (auto tail = h->match.prefix; tail != now_prefix->prev; tail = tail->prev) {
           TokenLength local_ids_length = tail->local_length();
-          tail->update_location(h->k_info(), k_loc.cut_tail(div_up(local_ids_length, NumTokenPerBlock)));
-          tail->update_location(h->v_info(), v_loc.cut_tail(div_up(local_ids_length, NumTokenPerBlock)));
+          tree->update_location(tail, h->k_info(), k_loc.cut_tail(div_up(local_ids_length, NumTokenPerBlock)));
+          tree->update_location(tail, h->v_info(), v_loc.cut_tail(div_up(local_ids_length, NumTokenPerBlock)));
         }
         assert(k_loc.length == 0);
         assert(v_loc.length == 0);
@@ -1235,7 +2110,7 @@ struct KVC2 : KVC2Interface {
         // split it to prefix trees
         for (auto tail = h->match.prefix; tail != now_prefix->prev; tail = tail->prev) {
           TokenLength local_ids_length = tail->local_length();
-          tail->update_location(h->k_info(), k_loc.cut_tail(div_up(local_ids_length, NumTokenPerBlock)));
+          tree->update_location(tail, h->k_info(), k_loc.cut_tail(div_up(local_ids_length, NumTokenPerBlock)));
         }
         assert(k_loc.length == 0);
       }
@@ -1245,6 +2120,10 @@ struct KVC2 : KVC2Interface {
           h->segment_io(io_dealer.get(), disk_cache.get(), now_prefix->start_length / NumTokenPerBlock,
                         div_up(new_length, NumTokenPerBlock), IO_ForceWrite);
       disk_io_helper->wait();
+      if (journal) {
+        // the insert is acknowledged only once its prefix is durable
+        journal->sync();
+      }
     }
   }
 
@@ -1254,14 +2133,14 @@ struct KVC2 : KVC2Interface {
     auto h = std::make_shared<DoubleCacheHandle>();
     h->kvc2_top = this;
     h->set_cache_info(model_name, quant_type, config.k_cache_on, config.v_cache_on);
-    h->ids = Tokens(id, id + length);
+    h->set_ids(id, length);
 
     if (config.k_cache_on)
       h->set_raw_handles(true, k_cache);
     if (config.v_cache_on)
       h->set_raw_handles(false, v_cache);
 
-    h->match = tree->look_up(id, length);
+    h->match = tree->look_up_pinned(h->block_hashes, length);
     if (h->match.prefix == nullptr) {
       SPDLOG_INFO("Not Found");
       return 0;
@@ -1276,16 +2155,18 @@ struct KVC2 : KVC2Interface {
   }
 
   std::shared_ptr<DoubleCacheHandleInterface> lookup(ModelName model_name, QuantType quant_type, Token* id,
-                                                     TokenLength length, TokenLength estimated_length) override {
+                                                     TokenLength length, TokenLength estimated_length,
+                                                     std::shared_ptr<std::atomic_bool> cancelled) override {
     TimeObserver time_observer(met->lookup_time_ms);
     auto re = std::make_shared<DoubleCacheHandle>();
     re->set_cache_info(model_name, quant_type, config.k_cache_on, config.v_cache_on);
-    re->ids = Tokens(id, id + length);
+    re->set_ids(id, length);
     re->estimated_length = estimated_length;
     re->kvc2_top = this;
+    re->cancelled = cancelled;
     SPDLOG_DEBUG("Lookup TokenLength {}", length);
     if (config.gpu_only == false) {
-      re->match = tree->look_up(id, length);
+      re->match = tree->look_up_pinned(re->block_hashes, length);
       re->get_handles();
       if (re->alloc_on_cpu() == false) {
         return nullptr;
@@ -1294,10 +2175,19 @@ struct KVC2 : KVC2Interface {
       SPDLOG_DEBUG("Found {}, Prompt Length {}, Estimated Length {}", re->match.match_length, length, estimated_length);
       if (re->match.prefix) {
         re->collect_locations();
-        auto disk_io_helper = re->segment_io(io_dealer.get(), disk_cache.get(), 0,
-                                             div_up(re->match.match_length, NumTokenPerBlock), IO_Read);
-        // TODO: async is break here, do something later
-        disk_io_helper->wait();
+        // a load joined from another lookup leaves its blocks empty if that lookup is cancelled, so go again until
+        // every block was loaded or found loaded by this one
+        for (bool joined = true; joined;) {
+          auto disk_io_helper = re->segment_io(io_dealer.get(), disk_cache.get(), 0,
+                                               div_up(re->match.match_length, NumTokenPerBlock), IO_Read);
+          // TODO: async is break here, do something later
+          disk_io_helper->wait();
+          joined = disk_io_helper->futs.empty() == false;
+          if (re->is_cancelled()) {
+            SPDLOG_INFO("Lookup cancelled");
+            return nullptr;
+          }
+        }
         SPDLOG_INFO("Loaded to mem");
       } else {
         SPDLOG_INFO("No Match, No need to load");
@@ -1309,15 +2199,17 @@ struct KVC2 : KVC2Interface {
   std::shared_ptr<DoubleCacheHandleInterface> lookup_to_gpu(ModelName model_name, QuantType quant_type, Token* id,
                                                             size_t length, size_t estimated_length) override {
     std::promise<std::shared_ptr<DoubleCacheHandleInterface>> p;
-    lookup_to_gpu_async(model_name, quant_type, id, length, estimated_length, [&p](auto re) { p.set_value(re); });
+    lookup_to_gpu_async(
+        model_name, quant_type, id, length, estimated_length, [&p](auto re) { p.set_value(re); }, nullptr);
     return p.get_future().get();
   }
 
   void lookup_to_gpu_async(ModelName model_name, QuantType quant_type, Token* id, TokenLength length,
                            TokenLength estimated_length,
-                           std::function<void(std::shared_ptr<DoubleCacheHandleInterface>)> call_back) override {
-    auto re = lookup(model_name, quant_type, id, length, estimated_length);
-    if (re == nullptr) {
+                           std::function<void(std::shared_ptr<DoubleCacheHandleInterface>)> call_back,
+                           std::shared_ptr<std::atomic_bool> cancelled) override {
+    auto re = lookup(model_name, quant_type, id, length, estimated_length, cancelled);
+    if (re == nullptr || (cancelled && cancelled->load())) {
       call_back(nullptr);
       return;
     }
@@ -1366,7 +2258,10 @@ struct KVC2 : KVC2Interface {
     tree->debug();
   }
 
-  virtual ~KVC2() { flush_back(); };
+  virtual ~KVC2() {
+    reclaimer.reset();
+    flush_back();
+  };
 
   KVC2(KVC2Config config) : config(config) {
     SPDLOG_INFO("Creating KVC2 using these config");
@@ -1378,6 +2273,9 @@ struct KVC2 : KVC2Interface {
                 readable_number(config.memory_pool_size));
     SPDLOG_INFO("    Evict Count: {}, Metrics Port: {}", config.evict_count, config.metrics_port);
     SPDLOG_INFO("    Recompute Ratio: {:.2f}", config.recompute_ratio);
+    SPDLOG_INFO("    Disk Quota: {}, Eviction Policy: {}",
+                config.disk_quota ? readable_number(config.disk_quota) : std::string("unlimited"),
+                config.disk_eviction_policy);
 
     if (config.gpu_cache_config) {
       const auto& gpu_config = *config.gpu_cache_config;
@@ -1409,15 +2307,29 @@ struct KVC2 : KVC2Interface {
       root = config.path;
       tree = std::make_unique<PrefixTree>();
       disk_cache = std::make_unique<DiskCacheManager>(config);
-      memory_pool = std::make_shared<PageAlignedMemoryPool>(config.memory_pool_size);
+      memory_pool = std::make_shared<PageAlignedMemoryPool>(config.memory_pool_size, config.memory_pool_numa_node,
+                                                            config.memory_pool_huge_pages);
       cache_manager = std::unique_ptr<CacheEntryManager>(
           new CacheEntryManager(CacheEntryManagerConfig{.evict_count = config.evict_count, .kvc2_top = this}));
       cache_manager->pool = memory_pool;
 
       io_dealer = std::make_unique<async_store::IODealer>();
+      std::array<prometheus::Histogram*, async_store::IOPriorityCount> io_latency;
+      for (size_t p = 0; p < async_store::IOPriorityCount; p++) {
+        io_latency[p] = met->io_latency_ms(async_store::to_string(static_cast<async_store::IOPriority>(p)));
+      }
+      io_dealer->observe_latency(
+          [io_latency](async_store::IOPriority priority, double ms) { io_latency[priority]->Observe(ms); });
       io_dealer->start_io_thread().detach();
 
       tree->met = met;
+      if (config.save_to_disk && config.load_from_disk == false) {
+        // starting over, load() opens the journal after replaying it otherwise
+        open_journal(true);
+      }
+      if (config.load_from_disk == false) {
+        start_reclaimer();
+      }
       if (config.gpu_cache_config.has_value()) {
         gpu_cache = std::make_shared<GPUPageCache>(config.gpu_cache_config.value());
         cache_manager->gpu_cache = gpu_cache;
@@ -1439,6 +2351,9 @@ std::shared_ptr<KVC2Interface> create_kvc2(KVC2Config config) {
 }
 
 DoubleCacheHandle::~DoubleCacheHandle() {
+  if (match.prefix) {
+    kvc2_top->tree->unpin(match.prefix);
+  }
   if (kvc2_top->config.gpu_only) {
     kvc2_top->gpu_cache->gpu_only_free_cols(gpu_only_block_idx);
   } else {
@@ -1484,7 +2399,7 @@ void DoubleCacheHandle::get_handles() {
     auto total_block_count = div_up(estimated_length, NumTokenPerBlock);
     size_t head_dim = kvc2_top->config.gpu_cache_config.value().k_head_dim;
     for (size_t l = 0; l < info.hidden_layer_count(); l++) {
-      auto hashes = match.matched_hashes(info, l);
+      auto hashes = match.matched_hashes(info, l, block_hashes);
       layers[l].resize(total_block_count, nullptr);
       for (size_t i = 0; i < total_block_count; i++) {
         std::optional<CacheEntryManager::Key> key = std::nullopt;
@@ -1568,11 +2483,12 @@ void CacheBlockEntry::set_key(TokensHash key, std::shared_ptr<CacheBlockEntry> m
   with_key = true;
   hash = key;
   // SPDLOG_DEBUG("Insert New Gen KVCache, key {}", key);
-  std::lock_guard<std::mutex> manager_lg(manager->lock);
-  if (manager->key_entry_map.contains(me->hash)) {
+  auto& shard = manager->shard_of(key);
+  std::lock_guard<std::mutex> manager_lg(shard.lock);
+  if (shard.entries.contains(me->hash)) {
     SPDLOG_WARN("Duplicate key {}", me->hash);
   } else {
-    manager->insert(me);
+    manager->insert(shard, me);
   }
 }
 
@@ -1638,9 +2554,15 @@ void DoubleCacheHandle::append_tokens(Token* all_tokens, TokenLength length) {
     new_added_block_count += 1;
   }
 
-  // update prefix tree
-  match.prefix = kvc2_top->tree->new_prefix_node(match.prefix, pre_match_length, ids.data(), match_length).get();
+  // update prefix tree, only the new blocks are hashed
+  TokensHasher::append_block_hashes(block_hashes, ids.data(), match_length, NumTokenPerBlock);
+  auto prev = match.prefix;
+  match.prefix =
+      kvc2_top->tree->new_prefix_node(match.prefix, pre_match_length, ids.data(), match_length, block_hashes);
   match.match_length = match_length;
+  if (prev) {
+    kvc2_top->tree->unpin(prev);
+  }
 
   // alloc disk location for new added prefix
   auto disk_cache = kvc2_top->disk_cache.get();
@@ -1648,32 +2570,28 @@ void DoubleCacheHandle::append_tokens(Token* all_tokens, TokenLength length) {
   if (is_k_cache_on) {
     k_loc = disk_cache->allocate(k_info(), new_added_block_count);
     k_seg_locs.add_location(match.prefix->start_length / NumTokenPerBlock, k_loc);
-    match.prefix->update_location(k_info(), k_loc);
+    kvc2_top->tree->update_location(match.prefix, k_info(), k_loc);
   }
   if (is_v_cache_on) {
     v_loc = disk_cache->allocate(v_info(), new_added_block_count);
     v_seg_locs.add_location(match.prefix->start_length / NumTokenPerBlock, v_loc);
-    match.prefix->update_location(v_info(), v_loc);
+    kvc2_top->tree->update_location(match.prefix, v_info(), v_loc);
   }
 
   // update cache handles
   auto update_cache_handles = [this, pre_match_length, length](
                                   CacheInfo info, std::vector<std::vector<std::shared_ptr<CacheBlockEntry>>>& layers,
                                   Location loc) {
-    TokensHasher hasher;
+    auto info_hash = info.hash_value();
     for (Layer l = 0; l < info.hidden_layer_count(); l++) {
-      hasher.reset(info.hash_value());
-      hasher.update_raw(&l, sizeof(l));
-      hasher.update(ids.data(), pre_match_length);
       auto page_count_start = pre_match_length / num_token_per_page;
       for (size_t i = pre_match_length; i + num_token_per_page <= length; i += num_token_per_page) {
         auto page_count = i / num_token_per_page;
-        hasher.update(ids.data() + i, num_token_per_page);
         auto block = layers[l][page_count];
         {
           auto lg = block->lock_guard();
           block->idx = loc.start_idx + page_count - page_count_start;
-          block->set_key(hasher.get(), block);
+          block->set_key(TokensHasher::layer_block_key(block_hashes[page_count], info_hash, l), block);
           if (l == 0 && info.is_key_cache) {
             block->gpu_cc.tc.set_has_data();
           }
@@ -1718,19 +2636,21 @@ void CacheEntryManager::cpu_background_flush() {
         if (dirty_cpus.size() > 0)
           SPDLOG_DEBUG("{} dirty CPU pages flushed.", dirty_cpus.size());
       });
-      {
-        std::lock_guard<std::mutex> ul(lock);
-        for (auto& e : usage_list) {
-          auto ul = e->try_lock();
-          if (ul.owns_lock()) {
-            if (e->cpu_cc.dirty.load()) {
-              entry_uls.push_back(std::move(ul));
-              e->flush_back_async(io_helper, dirty_cpus);
+      for (auto& shard : shards) {
+        std::lock_guard<std::mutex> ul(shard.lock);
+        for (auto queue : {&shard.small, &shard.main}) {
+          for (auto& e : *queue) {
+            auto ul = e->try_lock();
+            if (ul.owns_lock()) {
+              if (e->cpu_cc.dirty.load()) {
+                entry_uls.push_back(std::move(ul));
+                e->flush_back_async(io_helper, dirty_cpus);
+              }
             }
+            // if (dirty_cpus.size() == 100) {
+            //   break;
+            // }
           }
-          // if (dirty_cpus.size() == 100) {
-          //   break;
-          // }
         }
       }
 
@@ -0,0 +1,380 @@
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "periodic_task.hpp"
+#include "spdlog/spdlog.h"
+#include "xxhash.h"
+
+namespace journal {
+
+// Little binary encoding of the metadata, plain old data is copied as is.
+class BinaryWriter {
+ public:
+  template <typename T>
+  void put(const T& x) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    buf_.append(reinterpret_cast<const char*>(&x), sizeof(T));
+  }
+
+  void put_string(const std::string& s) {
+    put<uint64_t>(s.size());
+    buf_.append(s);
+  }
+
+  template <typename T>
+  void put_vector(const std::vector<T>& v) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    put<uint64_t>(v.size());
+    buf_.append(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+  }
+
+  std::string& data() { return buf_; }
+
+ private:
+  std::string buf_;
+};
+
+class BinaryReader {
+ public:
+  BinaryReader(const char* data, size_t size) : cur_(data), end_(data + size) {}
+
+  template <typename T>
+  T get() {
+    static_assert(std::is_trivially_copyable_v<T>);
+    T x;
+    std::memcpy(&x, take(sizeof(T)), sizeof(T));
+    return x;
+  }
+
+  std::string get_string() {
+    auto size = get<uint64_t>();
+    return std::string(take(size), size);
+  }
+
+  template <typename T>
+  std::vector<T> get_vector() {
+    auto size = get<uint64_t>();
+    if (size > remaining() / sizeof(T)) {
+      throw std::runtime_error("journal: truncated vector");
+    }
+    std::vector<T> v(size);
+    auto data = take(size * sizeof(T));
+    if (size > 0) {
+      // an empty vector has no buffer to copy to
+      std::memcpy(v.data(), data, size * sizeof(T));
+    }
+    return v;
+  }
+
+  size_t remaining() const { return end_ - cur_; }
+
+ private:
+  const char* take(size_t n) {
+    if (n > remaining()) {
+      throw std::runtime_error("journal: read past the end");
+    }
+    auto re = cur_;
+    cur_ += n;
+    return re;
+  }
+
+  const char* cur_;
+  const char* end_;
+};
+
+// Read only mapping of a whole file, the snapshot is parsed in place.
+class MappedFile {
+ public:
+  explicit MappedFile(const std::filesystem::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("journal: cannot open " + path.string());
+    }
+    struct stat st;
+    fstat(fd, &st);
+    size_ = st.st_size;
+    if (size_ > 0) {
+      addr_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    }
+    ::close(fd);
+    if (addr_ == MAP_FAILED) {
+      throw std::runtime_error("journal: cannot mmap " + path.string());
+    }
+  }
+  ~MappedFile() {
+    if (addr_ != nullptr && addr_ != MAP_FAILED) {
+      munmap(addr_, size_);
+    }
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return static_cast<const char*>(addr_); }
+  size_t size() const { return size_; }
+
+ private:
+  void* addr_ = nullptr;
+  size_t size_ = 0;
+};
+
+// fsyncs a file or, with O_DIRECTORY, the entries of a directory.
+inline void fsync_path(const std::filesystem::path& path, int flags = O_RDONLY) {
+  int fd = ::open(path.c_str(), flags);
+  if (fd < 0) {
+    throw std::runtime_error("journal: cannot open " + path.string());
+  }
+  int re = fsync(fd);
+  ::close(fd);
+  if (re != 0) {
+    throw std::runtime_error("journal: cannot fsync " + path.string());
+  }
+}
+
+// Writes `data` to `path` so that a crash leaves either the old or the new file.
+inline void write_file_atomic(const std::filesystem::path& path, const std::string& data) {
+  auto tmp = path;
+  tmp += ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("journal: cannot create " + tmp.string());
+  }
+  for (size_t done = 0; done < data.size();) {
+    auto n = ::write(fd, data.data() + done, data.size() - done);
+    if (n < 0) {
+      ::close(fd);
+      throw std::runtime_error("journal: cannot write " + tmp.string());
+    }
+    done += n;
+  }
+  if (fdatasync(fd) != 0) {
+    ::close(fd);
+    throw std::runtime_error("journal: cannot fdatasync " + tmp.string());
+  }
+  ::close(fd);
+  std::filesystem::rename(tmp, path);
+  fsync_path(path.parent_path(), O_RDONLY | O_DIRECTORY);
+}
+
+/*
+Append only write-ahead log. A record is [payload size u32][type u32][xxh64 of payload u64][payload].
+
+Records are buffered in memory and group committed, with one write and one fdatasync, by a background task every
+`commit_interval` or when sync() is called. A torn or corrupt tail, left by a crash in the middle of a commit, ends
+the replay and is cut off before new records are appended.
+
+Records are numbered as they are appended, a commit publishes the number of the last record it made durable. A failed
+write or fdatasync stops the commits for good: what follows a torn record is never replayed anyway.
+*/
+class Journal {
+ public:
+  struct RecordHeader {
+    uint32_t size;
+    uint32_t type;
+    uint64_t checksum;
+  };
+
+  Journal(std::filesystem::path path, bool truncate,
+          std::chrono::milliseconds commit_interval = std::chrono::milliseconds(10))
+      : path_(std::move(path)) {
+    fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0), 0644);
+    if (fd_ < 0) {
+      throw std::runtime_error("journal: cannot open " + path_.string());
+    }
+    committer_ = std::make_unique<periodic::PeriodicTask>([this]() { commit(); }, commit_interval);
+  }
+
+  ~Journal() {
+    committer_.reset();
+    commit();
+    if (failed()) {
+      SPDLOG_ERROR("journal: records of {} were lost", path_.string());
+    }
+    ::close(fd_);
+  }
+
+  Journal(const Journal&) = delete;
+  Journal& operator=(const Journal&) = delete;
+
+  void append(uint32_t type, const std::string& payload) {
+    RecordHeader header{static_cast<uint32_t>(payload.size()), type, XXH64(payload.data(), payload.size(), 0)};
+    std::lock_guard<std::mutex> lg(buffer_lock_);
+    buffer_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    buffer_.append(payload);
+    appended_seq_++;
+  }
+
+  // Blocks until every record appended before the call is on disk, throws if a commit failed before that.
+  void sync() {
+    uint64_t target;
+    {
+      std::lock_guard<std::mutex> lg(buffer_lock_);
+      target = appended_seq_;
+    }
+    std::unique_lock<std::mutex> ul(commit_lock_);
+    if (committed_seq_ >= target) {
+      return;
+    }
+    committer_->wakeUp();
+    commit_cv_.wait(ul, [&] { return committed_seq_ >= target || commit_error_ != nullptr; });
+    if (committed_seq_ < target) {
+      std::rethrow_exception(commit_error_);
+    }
+  }
+
+  // Moves the committed records to `to`, appending them if `to` already exists, and starts an empty journal. Used
+  // when a snapshot is taken: `to` holds what the snapshot covers until it is durable.
+  void rotate(const std::filesystem::path& to) {
+    std::lock_guard<std::mutex> io_lg(io_lock_);
+    std::lock_guard<std::mutex> lg(buffer_lock_);
+    if (auto error = failed()) {
+      std::rethrow_exception(error);
+    }
+    write_all(buffer_);
+    buffer_.clear();
+    if (fdatasync(fd_) != 0) {
+      throw std::runtime_error("journal: cannot fdatasync " + path_.string());
+    }
+    publish(appended_seq_, nullptr);
+    ::close(fd_);
+    if (std::filesystem::exists(to)) {
+      // the previous snapshot never completed, keep its records too
+      {
+        std::ifstream src(path_, std::ios::binary);
+        std::ofstream dst(to, std::ios::binary | std::ios::app);
+        dst << src.rdbuf();
+        if (!dst.flush()) {
+          throw std::runtime_error("journal: cannot append to " + to.string());
+        }
+      }
+      // the records must be durable in `to` before they leave the journal
+      fsync_path(to);
+      std::filesystem::remove(path_);
+    } else {
+      std::filesystem::rename(path_, to);
+    }
+    fsync_path(to.parent_path(), O_RDONLY | O_DIRECTORY);
+    fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      throw std::runtime_error("journal: cannot open " + path_.string());
+    }
+  }
+
+  // Calls `apply` on every intact record of the file at `path` in order, then cuts off a torn tail. Returns the
+  // number of records replayed.
+  static size_t replay(const std::filesystem::path& path, const std::function<void(uint32_t, BinaryReader&)>& apply) {
+    if (std::filesystem::exists(path) == false || std::filesystem::file_size(path) == 0) {
+      return 0;
+    }
+    size_t count = 0, good = 0;
+    size_t size = 0;
+    {
+      MappedFile file(path);
+      size = file.size();
+      while (good + sizeof(RecordHeader) <= size) {
+        RecordHeader header;
+        std::memcpy(&header, file.data() + good, sizeof(header));
+        const char* payload = file.data() + good + sizeof(header);
+        if (header.size > size - good - sizeof(header) || XXH64(payload, header.size, 0) != header.checksum) {
+          break;
+        }
+        BinaryReader reader(payload, header.size);
+        apply(header.type, reader);
+        good += sizeof(header) + header.size;
+        count++;
+      }
+    }
+    if (good < size) {
+      std::filesystem::resize_file(path, good);
+    }
+    return count;
+  }
+
+ private:
+  // Runs on the committer, the error of a failed commit is handed to sync() instead of being thrown.
+  void commit() {
+    std::lock_guard<std::mutex> io_lg(io_lock_);
+    std::string batch;
+    uint64_t seq;
+    {
+      std::lock_guard<std::mutex> lg(buffer_lock_);
+      batch.swap(buffer_);
+      seq = appended_seq_;
+    }
+    if (failed() || batch.empty()) {
+      // an empty batch still publishes, the records before it were committed under io_lock_
+      publish(seq, nullptr);
+      return;
+    }
+    try {
+      write_all(batch);
+      if (fdatasync(fd_) != 0) {
+        throw std::runtime_error("journal: cannot fdatasync " + path_.string());
+      }
+      publish(seq, nullptr);
+    } catch (...) {
+      publish(0, std::current_exception());
+    }
+  }
+
+  std::exception_ptr failed() {
+    std::lock_guard<std::mutex> lg(commit_lock_);
+    return commit_error_;
+  }
+
+  void publish(uint64_t seq, std::exception_ptr error) {
+    {
+      std::lock_guard<std::mutex> lg(commit_lock_);
+      if (error) {
+        commit_error_ = error;
+      } else if (commit_error_ == nullptr) {
+        committed_seq_ = std::max(committed_seq_, seq);
+      }
+    }
+    commit_cv_.notify_all();
+  }
+
+  void write_all(const std::string& data) {
+    for (size_t done = 0; done < data.size();) {
+      auto n = ::write(fd_, data.data() + done, data.size() - done);
+      if (n < 0) {
+        throw std::runtime_error("journal: cannot write " + path_.string());
+      }
+      done += n;
+    }
+  }
+
+  std::filesystem::path path_;
+  int fd_;
+  std::mutex io_lock_;      // orders commits and rotations
+  std::mutex buffer_lock_;  // guards buffer_ and appended_seq_
+  std::string buffer_;
+  uint64_t appended_seq_ = 0;
+  std::mutex commit_lock_;  // guards committed_seq_ and commit_error_
+  std::condition_variable commit_cv_;
+  uint64_t committed_seq_ = 0;
+  std::exception_ptr commit_error_;
+  std::unique_ptr<periodic::PeriodicTask> committer_;
+};
+
+}  // namespace journal
+
+#endif  // JOURNAL_HPP
@@ -45,6 +45,9 @@ class MPSCQueue {
     prev_head->next.store(node, std::memory_order_release);
   }
 
+  // 消费者调用
+  bool empty() const { return tail->next.load(std::memory_order_acquire) == nullptr; }
+
   // 消费者调用
   std::shared_ptr<T> dequeue() {
     Node* next = tail->next.load(std::memory_order_acquire);
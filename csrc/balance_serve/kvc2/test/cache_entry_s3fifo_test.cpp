@@ -0,0 +1,123 @@
+#include <cassert>
+#include <iostream>
+#include <vector>
+#include "cache_entry.hh"
+
+using namespace kvc2;
+
+// 1600 pages, room for 400 blocks of 4 pages
+constexpr size_t PoolSize = 1600 * 4096;
+constexpr size_t BlockSize = 4 * 4096;
+
+struct TestCache {
+  // outlives the manager, whose entries give their pages back when it is destroyed
+  std::shared_ptr<PageAlignedMemoryPool> pool = std::make_shared<PageAlignedMemoryPool>(PoolSize);
+  CacheEntryManager m{CacheEntryManagerConfig{.evict_count = 1, .kvc2_top = nullptr}};
+  std::vector<CacheEntryManager::BlockPtr> pinned;
+
+  TestCache() { m.pool = pool; }
+
+  // Reads the block of key into memory, like a lookup does, and keeps it in use if pin
+  bool use(uint64_t key, bool pin = false) {
+    bool is_new;
+    auto e = m.get(is_new, BlockSize, key);
+    if (e->inc_ref_or_alloc_on_cpu() == false) {
+      return false;
+    }
+    if (pin) {
+      pinned.push_back(e);
+    } else {
+      e->cpu_cc.ref_count.fetch_sub(1);
+    }
+    return true;
+  }
+
+  bool in_memory(uint64_t key) {
+    bool is_new;
+    auto e = m.get(is_new, BlockSize, key);
+    return is_new == false && e->data != nullptr;
+  }
+};
+
+// 1. blocks read more than once stay while a long one-off scan goes through
+void testScanResistance() {
+  TestCache c;
+  for (int round = 0; round < 2; round++) {
+    for (uint64_t k = 1; k <= 200; k++) {
+      assert(c.use(k));
+    }
+  }
+  for (uint64_t k = 0; k < 2000; k++) {
+    assert(c.use(100000 + k));
+  }
+  size_t kept = 0;
+  for (uint64_t k = 1; k <= 200; k++) {
+    kept += c.in_memory(k);
+  }
+  // an LRU would have none of them left
+  assert(kept >= 180);
+  std::cout << "Test 1 passed: " << kept << " of 200 hot blocks survived the scan." << std::endl;
+}
+
+// 2. a key evicted from small lately comes back to main
+void testGhost() {
+  TestCache c;
+  for (uint64_t k = 1; k <= 400; k++) {
+    assert(c.use(k));
+  }
+  // evicts the first keys from small, they are remembered as ghosts
+  for (uint64_t k = 0; k < 100; k++) {
+    assert(c.use(100000 + k));
+  }
+  assert(c.in_memory(1) == false);
+  assert(c.use(1));
+  // a new scan evicts the blocks of small, not key 1, which went to main
+  for (uint64_t k = 0; k < 300; k++) {
+    assert(c.use(200000 + k));
+  }
+  assert(c.in_memory(1));
+  std::cout << "Test 2 passed: ghost keys come back to main." << std::endl;
+}
+
+// 3. when every block of small is in use, eviction falls back to main
+void testPinnedSmall() {
+  TestCache c;
+  for (int round = 0; round < 2; round++) {
+    for (uint64_t k = 1; k <= 340; k++) {
+      assert(c.use(k));
+    }
+  }
+  for (uint64_t k = 0; k < 60; k++) {
+    assert(c.use(10000 + k, true));
+  }
+  for (uint64_t k = 0; k < 100; k++) {
+    assert(c.use(20000 + k));
+  }
+  for (auto& e : c.pinned) {
+    assert(e->data != nullptr);
+  }
+  std::cout << "Test 3 passed: blocks in use are never evicted, main gives way instead." << std::endl;
+}
+
+// 4. drop() removes unused entries only
+void testDrop() {
+  TestCache c;
+  assert(c.use(1, true));
+  assert(c.use(2));
+  assert(c.m.drop(1) == false);
+  assert(c.m.drop(2));
+  assert(c.in_memory(1));
+  bool is_new;
+  c.m.get(is_new, BlockSize, 2);
+  assert(is_new);
+  std::cout << "Test 4 passed: drop() keeps the entries in use." << std::endl;
+}
+
+int main() {
+  testScanResistance();
+  testGhost();
+  testPinnedSmall();
+  testDrop();
+  std::cout << "All tests passed." << std::endl;
+  return 0;
+}
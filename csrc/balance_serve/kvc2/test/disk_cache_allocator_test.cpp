@@ -0,0 +1,160 @@
+#include <cassert>
+#include <iostream>
+#include <vector>
+#include "prefix.cpp"
+
+using namespace kvc2;
+
+namespace fs = std::filesystem;
+
+static fs::path test_dir;
+
+CacheInfo test_info{
+    .model_name = "disk-cache-allocator-test",
+    .is_key_cache = true,
+    .quant_type = "FP32",
+};
+
+std::shared_ptr<DiskCacheAllocator> make_allocator(const std::string& name) {
+  return std::make_shared<DiskCacheAllocator>(test_dir / name, test_info, 16);
+}
+
+Location at(size_t start_idx, size_t length) {
+  Location re;
+  re.start_idx = start_idx;
+  re.length = length;
+  return re;
+}
+
+// 1. freed space is reused first, by the smallest extent that fits
+void testReuse() {
+  auto a = make_allocator("reuse");
+  std::vector<Location> locs;
+  for (size_t length : {5, 1, 3, 1, 8, 1}) {
+    locs.push_back(a->alloc(length));
+  }
+  assert(a->allocated() == 19 && a->used() == 19);
+  a->free(locs[0]);
+  a->free(locs[2]);
+  a->free(locs[4]);
+  assert(a->allocated() == 19 && a->used() == 3);
+
+  // best fit: 3 goes to the extent of 3, 4 to the one of 5, 8 to the one of 8
+  assert(a->alloc(3).start_idx == locs[2].start_idx);
+  assert(a->alloc(4).start_idx == locs[0].start_idx);
+  assert(a->alloc(8).start_idx == locs[4].start_idx);
+  // the block left of the 5, then the end
+  assert(a->alloc(1).start_idx == locs[0].start_idx + 4);
+  assert(a->alloc(1).start_idx == 19);
+  assert(a->used() == a->allocated());
+  std::cout << "Test 1 passed: freed extents are reused by best fit." << std::endl;
+}
+
+// 2. neighbouring free extents merge, and a free extent at the end gives the tail back
+void testCoalesce() {
+  auto a = make_allocator("coalesce");
+  auto x = a->alloc(4);
+  auto y = a->alloc(4);
+  auto z = a->alloc(4);
+  auto tail = a->alloc(4);
+  a->free(x);
+  a->free(z);
+  a->free(y);
+  assert(a->used() == 4);
+  // only a merged extent holds 12 blocks
+  assert(a->alloc(12).start_idx == x.start_idx);
+  assert(a->allocated() == 16);
+
+  a->free(tail);
+  assert(a->allocated() == 12);
+  // the extents before the end merge with it
+  a->free(at(8, 4));
+  a->free(at(0, 8));
+  assert(a->allocated() == 0 && a->used() == 0);
+  assert(a->alloc(2).start_idx == 0);
+  std::cout << "Test 2 passed: free extents are coalesced." << std::endl;
+}
+
+// 3. the free extents are what lies between the locations of the prefixes on load
+void testRebuild() {
+  auto a = make_allocator("rebuild");
+  a->restore(100);
+  a->rebuild_free_extents({at(50, 10), at(10, 5), at(70, 5)});
+  assert(a->allocated() == 75);
+  assert(a->used() == 20);
+  assert(a->alloc(10).start_idx == 0);
+  assert(a->alloc(35).start_idx == 15);
+  assert(a->alloc(10).start_idx == 60);
+  assert(a->alloc(1).start_idx == 75);
+
+  // nothing used, everything is given back
+  a->rebuild_free_extents({});
+  assert(a->allocated() == 0 && a->used() == 0);
+  std::cout << "Test 3 passed: free extents are rebuilt from the used locations." << std::endl;
+}
+
+// 4. compact() shrinks the files once the blocks at their end are freed
+void testCompact() {
+  auto a = make_allocator("compact");
+  auto big = a->alloc(1500);
+  auto small = a->alloc(10);
+  auto capacity = async_store::capacity(a->get_store(0));
+  assert(capacity > 1510);
+  auto file = test_dir / "compact" / test_info.path(0);
+  assert(fs::file_size(file) == capacity * async_store::element_bytes(a->get_store(0)));
+
+  // still in use at the end, nothing to shrink
+  a->free(big);
+  a->compact();
+  assert(async_store::capacity(a->get_store(0)) == capacity);
+
+  a->free(small);
+  assert(a->allocated() == 0);
+  a->compact();
+  assert(async_store::capacity(a->get_store(0)) == DiskCacheAllocator::InitialCapacity);
+  assert(fs::file_size(file) == DiskCacheAllocator::InitialCapacity * async_store::element_bytes(a->get_store(0)));
+
+  // and grow again on demand
+  auto again = a->alloc(1500);
+  assert(again.start_idx == 0);
+  assert(async_store::capacity(a->get_store(0)) > 1500);
+  std::cout << "Test 4 passed: compact() shrinks the store files." << std::endl;
+}
+
+// 5. one allocation past twice the capacity still gets blocks backed by the files
+void testGrowPastDouble() {
+  auto a = make_allocator("grow");
+  auto big = a->alloc(5000);
+  assert(big.start_idx == 0);
+  auto capacity = async_store::capacity(a->get_store(0));
+  assert(capacity > 5000);
+  auto file = test_dir / "grow" / test_info.path(0);
+  assert(fs::file_size(file) == capacity * async_store::element_bytes(a->get_store(0)));
+  std::cout << "Test 5 passed: a large allocation grows the stores past its end." << std::endl;
+}
+
+int main() {
+  NumTokenPerBlock = 256;
+  model_configs[test_info.model_name] = ModelConfig{
+      .hidden_size = 0,
+      .max_position_embeddings = 0,
+      .num_attention_heads = 0,
+      .num_hidden_layers = 2,
+      .num_key_value_heads = 0,
+      .vocab_size = 0,
+  };
+
+  // O_DIRECT is not supported on tmpfs, the stores go to the working directory
+  test_dir = fs::current_path() / "disk_cache_allocator_test_data";
+  fs::remove_all(test_dir);
+
+  testReuse();
+  testCoalesce();
+  testRebuild();
+  testCompact();
+  testGrowPastDouble();
+
+  fs::remove_all(test_dir);
+  std::cout << "All tests passed." << std::endl;
+  return 0;
+}
@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include "async_store.cpp"
+
+using namespace async_store;
+
+namespace fs = std::filesystem;
+
+static fs::path test_dir;
+
+// Elements of a packed store, O_DIRECT needs the buffers aligned too
+constexpr size_t ElementSize = 4096;
+
+struct Buffers {
+  std::vector<char*> data;
+  Buffers(size_t count, int fill) {
+    for (size_t i = 0; i < count; i++) {
+      data.push_back(static_cast<char*>(std::aligned_alloc(ElementSize, ElementSize)));
+      std::memset(data.back(), fill, ElementSize);
+    }
+  }
+  ~Buffers() {
+    for (auto p : data) {
+      std::free(p);
+    }
+  }
+};
+
+std::shared_ptr<IORequest> make_request(ArrayStore* store, bool write, void* data, size_t index,
+                                        IOPriority priority = IO_Foreground, BatchPromise* promise = nullptr) {
+  auto req = std::make_shared<IORequest>();
+  req->store = store;
+  req->write = write;
+  req->data = data;
+  req->index = index;
+  req->priority = priority;
+  req->need_promise = promise != nullptr;
+  req->promise = promise;
+  return req;
+}
+
+// 1. requests on adjacent indices of a packed store become one run, in index order
+void testMergeRuns() {
+  auto store = create_or_open_store(ElementSize, 64, test_dir / "merge.bin");
+  auto unpacked = create_or_open_store(ElementSize - 100, 64, test_dir / "unpacked.bin");
+  Buffers buffers(12, 0);
+  IODealerImpl impl(false, 128);
+
+  // 0..7 shuffled, then 10, and reads of 8 and 9 which must not join the writes
+  std::vector<size_t> indices = {3, 0, 7, 1, 5, 2, 6, 4};
+  for (size_t i = 0; i < indices.size(); i++) {
+    impl.queues[IO_Foreground].enqueue(make_request(store, true, buffers.data[i], indices[i]));
+  }
+  impl.queues[IO_Foreground].enqueue(make_request(store, true, buffers.data[8], 10));
+  impl.queues[IO_Foreground].enqueue(make_request(store, false, buffers.data[9], 8));
+  impl.queues[IO_Foreground].enqueue(make_request(store, false, buffers.data[10], 9));
+  // a store whose elements are padded on disk is never merged
+  impl.queues[IO_Foreground].enqueue(make_request(unpacked, false, buffers.data[11], 0));
+  impl.queues[IO_Foreground].enqueue(make_request(unpacked, false, buffers.data[11], 1));
+
+  assert(impl.take(IO_Foreground));
+  assert(impl.take(IO_Background) == false);
+  auto& runs = impl.pending[IO_Foreground];
+  size_t writes = 0, reads = 0;
+  std::shared_ptr<IODealerImpl::WriteBatch> batch = nullptr;
+  for (auto& run : runs) {
+    for (size_t i = 0; i < run.requests.size(); i++) {
+      assert(run.requests[i]->index == run.index + i);
+    }
+    if (run.write) {
+      writes++;
+      // the write runs of a take are synced together
+      assert(run.writes != nullptr && (batch == nullptr || batch == run.writes));
+      batch = run.writes;
+      if (run.index == 0) {
+        assert(run.requests.size() == 8);
+      } else {
+        assert(run.index == 10 && run.requests.size() == 1);
+      }
+    } else {
+      reads++;
+      if (run.store == store) {
+        assert(run.index == 8 && run.requests.size() == 2);
+      } else {
+        assert(run.requests.size() == 1);
+      }
+    }
+  }
+  assert(writes == 2 && reads == 3);
+  assert(batch->pending == 2);
+
+  runs.clear();
+  close_store(store);
+  close_store(unpacked);
+  std::cout << "Test 1 passed: adjacent requests are merged into runs." << std::endl;
+}
+
+// 2. merged writes land at their own index, and read back whole
+void testReadBack() {
+  auto store = create_or_open_store(ElementSize, 64, test_dir / "read_back.bin");
+  IODealer dealer(false, 16);
+  auto io = dealer.start_io_thread();
+
+  Buffers written(32, 0), read(32, 0);
+  for (size_t i = 0; i < 32; i++) {
+    std::memset(written.data[i], 'a' + i % 26, ElementSize);
+  }
+  {
+    BatchPromise promise(32);
+    for (size_t i = 0; i < 32; i++) {
+      dealer.enqueue(make_request(store, true, written.data[i], i, IO_Foreground, &promise));
+    }
+    promise.get_shared_fut().wait();
+  }
+  {
+    BatchPromise promise(32);
+    // every other one first, so that the reads come in more than one batch
+    for (size_t i = 0; i < 32; i += 2) {
+      dealer.enqueue(make_request(store, false, read.data[i], i, IO_Foreground, &promise));
+    }
+    for (size_t i = 1; i < 32; i += 2) {
+      dealer.enqueue(make_request(store, false, read.data[i], i, IO_Foreground, &promise));
+    }
+    promise.get_shared_fut().wait();
+  }
+  for (size_t i = 0; i < 32; i++) {
+    assert(std::memcmp(written.data[i], read.data[i], ElementSize) == 0);
+  }
+
+  dealer.stop();
+  io.join();
+  close_store(store);
+  std::cout << "Test 2 passed: merged runs read back what was written." << std::endl;
+}
+
+// 3. background write-back does not hold up foreground reads
+void testPriorities() {
+  auto store = create_or_open_store(ElementSize, 256, test_dir / "priorities.bin");
+  // a quarter of the depth for the background, one run at a time
+  IODealer dealer(false, 4);
+  std::mutex order_lock;
+  std::vector<IOPriority> order;
+  dealer.observe_latency([&](IOPriority priority, double) {
+    std::lock_guard<std::mutex> lg(order_lock);
+    order.push_back(priority);
+  });
+
+  Buffers background(64, 1), foreground(16, 0);
+  BatchPromise promise(64 + 16);
+  // all queued before the dealer starts, not adjacent so that every request is a run of its own
+  for (size_t i = 0; i < 64; i++) {
+    dealer.enqueue(make_request(store, true, background.data[i], 2 * i, IO_Background, &promise));
+  }
+  for (size_t i = 0; i < 16; i++) {
+    dealer.enqueue(make_request(store, false, foreground.data[i], 2 * i + 129, IO_Foreground, &promise));
+  }
+  auto io = dealer.start_io_thread();
+  promise.get_shared_fut().wait();
+
+  assert(order.size() == 64 + 16);
+  // the writes of a batch complete together, once all of them are synced
+  assert(std::count(order.begin(), order.begin() + 16, IO_Foreground) == 16);
+
+  dealer.stop();
+  io.join();
+  close_store(store);
+  std::cout << "Test 3 passed: foreground reads finish before the background writes." << std::endl;
+}
+
+// 4. a cancelled read sets its promise and leaves the buffer alone, writes are never dropped
+void testCancel() {
+  auto store = create_or_open_store(ElementSize, 64, test_dir / "cancel.bin");
+  IODealer dealer(false, 16);
+  auto io = dealer.start_io_thread();
+
+  Buffers data(8, 'x'), read(8, 0);
+  {
+    BatchPromise promise(8);
+    for (size_t i = 0; i < 8; i++) {
+      dealer.enqueue(make_request(store, true, data.data[i], i, IO_Foreground, &promise));
+    }
+    promise.get_shared_fut().wait();
+  }
+
+  std::atomic_bool cancelled = true;
+  std::atomic_bool kept = false;
+  {
+    BatchPromise promise(8);
+    for (size_t i = 0; i < 8; i++) {
+      auto req = make_request(store, false, read.data[i], i, IO_Foreground, &promise);
+      req->cancelled = i < 4 ? &cancelled : &kept;
+      dealer.enqueue(req);
+    }
+    promise.get_shared_fut().wait();
+  }
+  for (size_t i = 0; i < 4; i++) {
+    assert(read.data[i][0] == 0 && read.data[i][ElementSize - 1] == 0);
+  }
+  for (size_t i = 4; i < 8; i++) {
+    assert(read.data[i][0] == 'x' && read.data[i][ElementSize - 1] == 'x');
+  }
+
+  // a cancel flag on a write is ignored
+  Buffers again(1, 'y'), check(1, 0);
+  {
+    BatchPromise promise(1);
+    auto req = make_request(store, true, again.data[0], 0, IO_Foreground, &promise);
+    req->cancelled = &cancelled;
+    dealer.enqueue(req);
+    promise.get_shared_fut().wait();
+  }
+  {
+    BatchPromise promise(1);
+    dealer.enqueue(make_request(store, false, check.data[0], 0, IO_Foreground, &promise));
+    promise.get_shared_fut().wait();
+  }
+  assert(check.data[0][0] == 'y');
+
+  dealer.stop();
+  io.join();
+  close_store(store);
+  std::cout << "Test 4 passed: cancelled reads are dropped." << std::endl;
+}
+
+int main() {
+  // O_DIRECT is not supported on tmpfs, the test files go to the working directory
+  test_dir = fs::current_path() / "io_dealer_test_data";
+  fs::remove_all(test_dir);
+  fs::create_directories(test_dir);
+
+  testMergeRuns();
+  testReadBack();
+  testPriorities();
+  testCancel();
+
+  fs::remove_all(test_dir);
+  std::cout << "All tests passed." << std::endl;
+  return 0;
+}
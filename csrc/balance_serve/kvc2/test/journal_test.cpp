@@ -0,0 +1,190 @@
+#include <cassert>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "utils/journal.hpp"
+
+namespace fs = std::filesystem;
+
+static fs::path test_dir;
+
+static void append_record(journal::Journal& j, uint64_t i) {
+  journal::BinaryWriter w;
+  w.put<uint64_t>(i);
+  w.put_string("record " + std::to_string(i));
+  w.put_vector(std::vector<uint32_t>(i % 7, static_cast<uint32_t>(i)));
+  j.append(1, w.data());
+}
+
+// Replays `path` and checks that it holds the records [begin, end) in order
+static void check_records(const fs::path& path, uint64_t begin, uint64_t end) {
+  uint64_t next = begin;
+  auto count = journal::Journal::replay(path, [&](uint32_t type, journal::BinaryReader& r) {
+    assert(type == 1);
+    auto i = r.get<uint64_t>();
+    assert(i == next);
+    assert(r.get_string() == "record " + std::to_string(i));
+    auto v = r.get_vector<uint32_t>();
+    assert(v.size() == i % 7);
+    for (auto x : v) {
+      assert(x == i);
+    }
+    assert(r.remaining() == 0);
+    next++;
+  });
+  assert(count == end - begin);
+  assert(next == end);
+}
+
+// 1. sync() returns with every record appended before it in the file
+void testSyncAndReplay() {
+  auto path = test_dir / "sync.bin";
+  {
+    journal::Journal j(path, true, std::chrono::milliseconds(1000));
+    for (uint64_t i = 0; i < 100; i++) {
+      append_record(j, i);
+      if (i % 10 == 9) {
+        // the committer runs once a second, sync() must not wait for it
+        j.sync();
+        check_records(path, 0, i + 1);
+      }
+    }
+  }
+  check_records(path, 0, 100);
+  std::cout << "Test 1 passed: sync() makes the appended records durable." << std::endl;
+}
+
+// 2. a torn or corrupt tail ends the replay and is cut off
+void testTornTail() {
+  auto path = test_dir / "torn.bin";
+  {
+    journal::Journal j(path, true);
+    for (uint64_t i = 0; i < 20; i++) {
+      append_record(j, i);
+    }
+  }
+  auto good = fs::file_size(path);
+
+  // half a record header
+  {
+    FILE* f = fopen(path.c_str(), "ab");
+    fwrite("garbage!", 1, 8, f);
+    fclose(f);
+  }
+  check_records(path, 0, 20);
+  assert(fs::file_size(path) == good);
+
+  // a whole header whose payload is cut short
+  {
+    journal::Journal j(path, false);
+    append_record(j, 20);
+  }
+  auto full = fs::file_size(path);
+  fs::resize_file(path, full - 3);
+  check_records(path, 0, 20);
+  assert(fs::file_size(path) == good);
+
+  // a payload that does not match its checksum, the records after it are lost too
+  {
+    journal::Journal j(path, false);
+    append_record(j, 20);
+    append_record(j, 21);
+  }
+  {
+    FILE* f = fopen(path.c_str(), "r+b");
+    fseek(f, good + sizeof(journal::Journal::RecordHeader), SEEK_SET);
+    fputc(0x5a, f);
+    fclose(f);
+  }
+  check_records(path, 0, 20);
+  assert(fs::file_size(path) == good);
+
+  // appending goes on after the cut
+  {
+    journal::Journal j(path, false);
+    append_record(j, 20);
+  }
+  check_records(path, 0, 21);
+  std::cout << "Test 2 passed: torn tails are cut off." << std::endl;
+}
+
+// 3. rotate() moves the records out, appending to a target left by an unfinished snapshot
+void testRotate() {
+  auto path = test_dir / "rotate.bin";
+  auto old = test_dir / "rotate.old";
+  fs::remove(old);
+  {
+    journal::Journal j(path, true);
+    for (uint64_t i = 0; i < 10; i++) {
+      append_record(j, i);
+    }
+    j.rotate(old);
+    check_records(old, 0, 10);
+    check_records(path, 0, 0);
+
+    for (uint64_t i = 10; i < 15; i++) {
+      append_record(j, i);
+    }
+    // the snapshot of the first rotation never completed
+    j.rotate(old);
+    check_records(old, 0, 15);
+
+    append_record(j, 15);
+    j.sync();
+  }
+  check_records(path, 15, 16);
+  std::cout << "Test 3 passed: rotate() keeps every record." << std::endl;
+}
+
+// 4. a failed write is reported by sync(), and by every sync() after it
+void testSyncError() {
+  // writes to /dev/full fail with ENOSPC
+  journal::Journal j("/dev/full", false);
+  append_record(j, 0);
+  bool thrown = false;
+  try {
+    j.sync();
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+
+  append_record(j, 1);
+  thrown = false;
+  try {
+    j.sync();
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+  std::cout << "Test 4 passed: sync() reports failed commits." << std::endl;
+}
+
+// 5. write_file_atomic replaces the file as a whole
+void testWriteFileAtomic() {
+  auto path = test_dir / "meta.bin";
+  journal::write_file_atomic(path, "first");
+  journal::write_file_atomic(path, "second snapshot");
+  journal::MappedFile file(path);
+  assert(std::string(file.data(), file.size()) == "second snapshot");
+  assert(fs::exists(test_dir / "meta.bin.tmp") == false);
+  std::cout << "Test 5 passed: write_file_atomic() replaces the file." << std::endl;
+}
+
+int main() {
+  test_dir = fs::temp_directory_path() / "kvc2_journal_test";
+  fs::remove_all(test_dir);
+  fs::create_directories(test_dir);
+
+  testSyncAndReplay();
+  testTornTail();
+  testRotate();
+  testSyncError();
+  testWriteFileAtomic();
+
+  fs::remove_all(test_dir);
+  std::cout << "All tests passed." << std::endl;
+  return 0;
+}
@@ -0,0 +1,64 @@
+#include "common.hpp"
+
+int main(int argc, char* argv[]) {
+  init(argc, argv);
+  spdlog::set_level(spdlog::level::debug);
+
+  // key and value blocks of every layer
+  size_t element_size = test_cache_info.element_size(config.num_token_per_page, config.gpu_cache_config->k_head_dim);
+  size_t block_bytes = (element_size + 511) / 512 * 512 * test_cache_info.hidden_layer_count() * 2;
+  config.load_from_disk = false;
+  config.disk_quota = 20 * block_bytes;
+  config.disk_eviction_policy = "lru";
+  auto kvc2 = kvc2::create_kvc2(config);
+
+  std::mt19937 gen(123);
+  std::vector<std::vector<Token>> ids;
+  std::vector<std::vector<layer_data>> ks, vs;
+  auto insert = [&]() {
+    ids.push_back(random_ids(5 * config.num_token_per_page, gen));
+    ks.push_back(random_kvcache(5, gen));
+    vs.push_back(random_kvcache(5, gen));
+    kvc2->raw_insert(test_model_name, test_quant_type, ids.back().data(), ids.back().size(), ks.back(), vs.back());
+  };
+
+  // the first prefix is the least recently used from now on, but a handle holds it
+  insert();
+  auto pinned = kvc2->lookup(test_model_name, test_quant_type, ids[0].data(), ids[0].size(), ids[0].size());
+  assert(pinned != nullptr && pinned->matched_length() == ids[0].size());
+
+  // 50 blocks over a quota of 20
+  for (size_t i = 1; i < 10; i++) {
+    insert();
+  }
+  // the reclaimer runs every second
+  std::this_thread::sleep_for(std::chrono::seconds(3));
+
+  auto read = [&](size_t i) {
+    auto k = empty_kvcache(5);
+    auto v = empty_kvcache(5);
+    auto length = kvc2->raw_read(test_model_name, test_quant_type, ids[i].data(), ids[i].size(), k, v);
+    if (length == ids[i].size()) {
+      cmp_handle_data(ks[i], k);
+      cmp_handle_data(vs[i], v);
+    }
+    return length;
+  };
+
+  // the oldest prefixes are gone, except the one in use
+  assert(read(0) == ids[0].size());
+  assert(read(1) == 0);
+  assert(read(2) == 0);
+  // the newest are kept
+  assert(read(9) == ids[9].size());
+  size_t kept = 0;
+  for (size_t i = 1; i < 10; i++) {
+    kept += read(i) == ids[i].size();
+  }
+  // 18 blocks are left after a reclaim, 5 of them pinned
+  assert(kept <= 3);
+
+  pinned = nullptr;
+  SPDLOG_CRITICAL("All Test Passed: {}", argv[0]);
+  return 0;
+}
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+#include "page_aligned_memory_pool.cpp"
+
+// The pool is cut into 16 blocks, with 64 pages each here
+constexpr size_t BlockCount = 16;
+constexpr size_t PagesPerBlock = 64;
+constexpr size_t PoolPages = BlockCount * PagesPerBlock;
+
+// Takes every page of the pool one by one, in address order
+std::vector<void*> alloc_all_pages(PageAlignedMemoryPool& pool) {
+  std::vector<void*> pages;
+  while (auto p = pool.alloc(PageSize)) {
+    pages.push_back(p);
+  }
+  std::sort(pages.begin(), pages.end());
+  return pages;
+}
+
+// Checks that every block is a single free run again, which needs every freed run merged with its neighbours
+void check_all_merged(PageAlignedMemoryPool& pool) {
+  std::vector<void*> runs;
+  for (size_t i = 0; i < BlockCount; i++) {
+    auto p = pool.alloc(PagesPerBlock * PageSize);
+    assert(p != nullptr);
+    runs.push_back(p);
+  }
+  assert(pool.alloc(PageSize) == nullptr);
+  for (auto p : runs) {
+    pool.free(p, PagesPerBlock * PageSize);
+  }
+}
+
+// 1. all pages can be taken, and freeing them in any order merges them back
+void testAllocFreeMerge() {
+  PageAlignedMemoryPool pool(PoolPages * PageSize);
+  auto pages = alloc_all_pages(pool);
+  assert(pages.size() == PoolPages);
+  for (size_t i = 1; i < pages.size(); i++) {
+    assert(reinterpret_cast<char*>(pages[i]) - reinterpret_cast<char*>(pages[i - 1]) == (ptrdiff_t)PageSize);
+  }
+  std::mt19937 gen(123);
+  std::shuffle(pages.begin(), pages.end(), gen);
+  for (auto p : pages) {
+    pool.free(p, PageSize);
+  }
+  check_all_merged(pool);
+  std::cout << "Test 1 passed: freed pages merge back into whole blocks." << std::endl;
+}
+
+// 2. a size that is not a power of two finds its runs behind shorter runs of the same list
+void testFloorListScan() {
+  PageAlignedMemoryPool pool(PoolPages * PageSize);
+  auto pages = alloc_all_pages(pool);
+  // every block: 9 times [free free used free free free used], and its last page used. The runs of 2 and 3 pages
+  // share the list of [2, 4) pages, and no larger list has a run.
+  size_t runs_of_2 = 0, runs_of_3 = 0;
+  for (size_t b = 0; b < BlockCount; b++) {
+    for (size_t unit = 0; unit < 9; unit++) {
+      size_t first = b * PagesPerBlock + unit * 7;
+      for (size_t i : {0, 1, 3, 4, 5}) {
+        pool.free(pages[first + i], PageSize);
+      }
+      runs_of_2++;
+      runs_of_3++;
+    }
+  }
+  std::vector<void*> taken;
+  for (size_t i = 0; i < runs_of_3; i++) {
+    auto p = pool.alloc(3 * PageSize);
+    assert(p != nullptr);
+    taken.push_back(p);
+  }
+  // only the runs of 2 pages are left
+  assert(pool.alloc(3 * PageSize) == nullptr);
+  for (size_t i = 0; i < runs_of_2; i++) {
+    auto p = pool.alloc(2 * PageSize);
+    assert(p != nullptr);
+    taken.push_back(p);
+  }
+  assert(pool.alloc(PageSize) == nullptr);
+  std::cout << "Test 2 passed: runs of the floor list are scanned." << std::endl;
+}
+
+// 3. alloc_multiple gives all it was asked for or nothing
+void testAllocMultiple() {
+  PageAlignedMemoryPool pool(PoolPages * PageSize);
+  auto some = pool.alloc_multiple(2 * PageSize, 100);
+  assert(some.size() == 100);
+  std::sort(some.begin(), some.end());
+  assert(std::adjacent_find(some.begin(), some.end()) == some.end());
+
+  // 1024 - 200 pages are left, 500 runs of 2 do not fit
+  assert(pool.alloc_multiple(2 * PageSize, 500).empty());
+  auto rest = pool.alloc_multiple(2 * PageSize, (PoolPages - 200) / 2);
+  assert(rest.size() == (PoolPages - 200) / 2);
+  assert(pool.alloc(PageSize) == nullptr);
+
+  for (auto p : some) {
+    pool.free(p, 2 * PageSize);
+  }
+  for (auto p : rest) {
+    pool.free(p, 2 * PageSize);
+  }
+  check_all_merged(pool);
+  std::cout << "Test 3 passed: alloc_multiple() is all or nothing." << std::endl;
+}
+
+// 4. threads that start at different blocks share the pool without losing pages
+void testThreads() {
+  PageAlignedMemoryPool pool(PoolPages * PageSize);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; t++) {
+    threads.emplace_back([&pool, t]() {
+      std::mt19937 gen(t);
+      std::vector<std::pair<void*, size_t>> held;
+      for (int i = 0; i < 20000; i++) {
+        if (held.empty() == false && (gen() % 2 == 0 || held.size() > 16)) {
+          auto k = gen() % held.size();
+          pool.free(held[k].first, held[k].second);
+          held[k] = held.back();
+          held.pop_back();
+        } else {
+          size_t size = (gen() % 7 + 1) * PageSize;
+          if (auto p = pool.alloc(size)) {
+            held.push_back({p, size});
+          }
+        }
+      }
+      for (auto& [p, size] : held) {
+        pool.free(p, size);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  check_all_merged(pool);
+  std::cout << "Test 4 passed: no page is lost across threads." << std::endl;
+}
+
+// 5. a node past the first word of the mask does not break the pool
+void testHighNumaNode() {
+  PageAlignedMemoryPool pool(PoolPages * PageSize, 100);
+  auto p = pool.alloc(PageSize);
+  assert(p != nullptr);
+  pool.free(p, PageSize);
+  std::cout << "Test 5 passed: NUMA node 100 is accepted." << std::endl;
+}
+
+int main() {
+  spdlog::set_level(spdlog::level::warn);
+  testAllocFreeMerge();
+  testFloorListScan();
+  testAllocMultiple();
+  testThreads();
+  testHighNumaNode();
+  std::cout << "All tests passed." << std::endl;
+  return 0;
+}
@@ -95,7 +95,14 @@ PYBIND11_MODULE(sched_ext, m) {
       .def_readwrite("kvc2_root_path", &scheduler::Settings::kvc2_root_path)
       .def_readwrite("memory_pool_size_GB",
                      &scheduler::Settings::memory_pool_size_GB)
+      .def_readwrite("memory_pool_numa_node",
+                     &scheduler::Settings::memory_pool_numa_node)
+      .def_readwrite("memory_pool_huge_pages",
+                     &scheduler::Settings::memory_pool_huge_pages)
       .def_readwrite("evict_count", &scheduler::Settings::evict_count)
+      .def_readwrite("disk_quota_GB", &scheduler::Settings::disk_quota_GB)
+      .def_readwrite("disk_eviction_policy",
+                     &scheduler::Settings::disk_eviction_policy)
       .def_readwrite("strategy_name", &scheduler::Settings::strategy_name)
       .def_readwrite("kvc2_metrics_port",
                      &scheduler::Settings::kvc2_metrics_port)
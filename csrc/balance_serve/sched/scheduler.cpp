@@ -136,6 +136,9 @@ struct Query {
   TokenLength plan_position;   // the position where no kvcache now, in plan
   size_t prepare_try_count = 0;
   std::shared_ptr<kvc2::DoubleCacheHandleInterface> kvc2_handle = nullptr;
+  // set by cancel_query, drops the disk reads of a load in flight
+  std::shared_ptr<std::atomic_bool> cancelled =
+      std::make_shared<std::atomic_bool>(false);
 
   // derived from kvc2_handle
   torch::Tensor block_index; // block indexes
@@ -307,9 +310,13 @@ struct KVC2_Maintainer {
         .config_path = settings.kvc2_config_path,
         .num_token_per_page = settings.page_size,
         .memory_pool_size = size_t(settings.memory_pool_size_GB * 1e9),
+        .memory_pool_numa_node = settings.memory_pool_numa_node,
+        .memory_pool_huge_pages = settings.memory_pool_huge_pages,
         .evict_count = settings.evict_count,
         .gpu_cache_config = gpu_cache_config,
         .metrics_port = settings.kvc2_metrics_port,
+        .disk_quota = size_t(settings.disk_quota_GB * 1e9),
+        .disk_eviction_policy = settings.disk_eviction_policy,
     };
     kvc2_interface = kvc2::create_kvc2(kvc2_config);
     if (settings.load_from_disk)
@@ -541,6 +548,7 @@ struct QueryMaintainer : public Scheduler {
       SPDLOG_ERROR("Query {} is not found", id);
       return;
     }
+    it->second->cancelled->store(true);
     query_map.erase(it);
   }
 
@@ -727,7 +735,18 @@ void Query::to_status(Status to) {
         ctx.model_name, ctx.quant_type,
         static_cast<kvc2::Token *>(query_token.data_ptr()), prompt_length,
         estimated_length,
-        [this](std::shared_ptr<kvc2::DoubleCacheHandleInterface> handle) {
+        [this, id = id, cancelled = cancelled,
+         maintainer = ctx.query_maintainer](
+            std::shared_ptr<kvc2::DoubleCacheHandleInterface> handle) {
+          if (cancelled->load()) {
+            // the query may be gone, only let the strategy move on
+            SPDLOG_INFO("Query {} is cancelled while loading", id);
+            maintainer->event_loop_queue.enqueue(EventPrepared{
+                .query_id = id,
+                .ok = false,
+            });
+            return;
+          }
           if (handle == nullptr) {
             SPDLOG_INFO("Get handle from kvc2 Failed.");
             this->after_load(false);
@@ -737,7 +756,8 @@ void Query::to_status(Status to) {
             this->to_status(Ready);
             this->after_load(true);
           }
-        });
+        },
+        cancelled);
     break;
   case Ready:
     SPDLOG_INFO("Ready Query {}", id);
@@ -837,6 +857,14 @@ struct FCFS_single_prefill : public QueryMaintainer {
   }
 
   void strategy_prepare(const EventPrepare &prepare) override {
+    if (query_map.count(prepare.query_id) == 0) {
+      // cancelled while waiting for another try
+      event_loop_queue.enqueue(EventPrepared{
+          .query_id = prepare.query_id,
+          .ok = false,
+      });
+      return;
+    }
     if (prepare.first_try) {
       auto &q = query_map[prepare.query_id];
       q->to_status(Query::Preparing);
@@ -848,8 +876,9 @@ struct FCFS_single_prefill : public QueryMaintainer {
   }
 
   void strategy_prepared(const EventPrepared &prepared) override {
-    assert(prepared.ok);
-    ready_queue.push(query_map[prepared.query_id]);
+    if (prepared.ok) {
+      ready_queue.push(query_map[prepared.query_id]);
+    }
     if (queue.empty() == false) {
       auto next_q_prepare = queue.front();
       queue.pop();
@@ -67,7 +67,11 @@ struct Settings {
   std::string kvc2_config_path;
   std::string kvc2_root_path;
   double memory_pool_size_GB = 100;
+  int memory_pool_numa_node = -1; // -1 for no binding
+  bool memory_pool_huge_pages = false;
   size_t evict_count = 20;
+  double disk_quota_GB = 0;  // 0 for no limit
+  std::string disk_eviction_policy = "lru";
   size_t kvc2_metrics_port;
   bool load_from_disk = false;
   bool save_to_disk = false;
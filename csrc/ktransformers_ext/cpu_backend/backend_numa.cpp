@@ -11,17 +11,13 @@
 #include "backend_numa.h"
 #include <fstream>
 #include <unordered_set>
+#include <cstring>
 #include <vector>
 #include <map>
 #include <string>
 #include <fstream>
 #include <set>
 #include <algorithm> 
-// #define __AMX_INT8__ 1
-// #define __AVX512VNNI__ 1
-#if defined(__AMX_INT8__) && defined(__AVX512VNNI__)
-    #include "../operators/llamafile/amx_gemm.hpp"
-#endif
 
 
 thread_local int Backend_NUMA::numa_node_ = -1;
@@ -358,10 +354,8 @@ void Backend_NUMA::worker_thread(int thread_id) {
     
     bind_to_cpu(cpu_id); 
     set_numa_mempolicy(numa_node_);
-
-    #if defined(__AMX_INT8__) && defined(__AVX512VNNI__)
-        ggml_tile_config_init();
-    #endif
+    // AMX tile configs are loaded lazily by amx_gemm_compute, only on hosts
+    // where get_cpu_features() allows AMX
     
     while (true) {
         ThreadStatus status =
@@ -0,0 +1,144 @@
+/**
+ * @Description  : Runtime x86 ISA detection used to pick kernel variants.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+#include "cpu_features.h"
+
+#include <cstdint>
+#include <cstdio>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <cpuid.h>
+#endif
+
+#if defined(__gnu_linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+#define ARCH_GET_XCOMP_PERM 0x1022
+#define ARCH_REQ_XCOMP_PERM 0x1023
+#define XFEATURE_XTILEDATA 18
+
+#define XCR0_AVX_STATE 0x6        // xmm | ymm
+#define XCR0_AVX512_STATE 0xe0    // opmask | zmm_hi256 | hi16_zmm
+#define XCR0_AMX_STATE 0x60000    // xtilecfg | xtiledata
+
+static uint64_t read_xcr0() {
+    uint32_t eax, edx;
+    // xgetbv, without requiring -mxsave for the intrinsic
+    __asm__ volatile(".byte 0x0f, 0x01, 0xd0" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+}
+
+// Linux keeps the 8KB tile data state disabled until a process asks for it,
+// the first tile instruction faults otherwise.
+static bool request_amx_permission() {
+#if defined(__gnu_linux__)
+    if (syscall(SYS_arch_prctl, ARCH_REQ_XCOMP_PERM, XFEATURE_XTILEDATA) != 0) {
+        return false;
+    }
+    uint64_t bitmask = 0;
+    if (syscall(SYS_arch_prctl, ARCH_GET_XCOMP_PERM, &bitmask) != 0) {
+        return false;
+    }
+    return (bitmask & (1ull << XFEATURE_XTILEDATA)) != 0;
+#else
+    return false;
+#endif
+}
+
+static CPUFeatures detect_cpu_features() {
+    CPUFeatures f;
+    uint32_t eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return f;
+    }
+    const bool osxsave = (ecx >> 27) & 1;
+    const bool has_fma = (ecx >> 12) & 1;
+    const bool has_f16c = (ecx >> 29) & 1;
+    if (!osxsave) {
+        return f;
+    }
+
+    const uint64_t xcr0 = read_xcr0();
+    const bool os_avx = (xcr0 & XCR0_AVX_STATE) == XCR0_AVX_STATE;
+    const bool os_avx512 = os_avx && (xcr0 & XCR0_AVX512_STATE) == XCR0_AVX512_STATE;
+    const bool os_amx = (xcr0 & XCR0_AMX_STATE) == XCR0_AMX_STATE;
+    if (!os_avx) {
+        return f;
+    }
+    f.fma = has_fma;
+    f.f16c = has_f16c;
+
+    uint32_t max_leaf = __get_cpuid_max(0, nullptr);
+    if (max_leaf < 7) {
+        return f;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    f.avx2 = (ebx >> 5) & 1;
+    if (os_avx512) {
+        f.avx512f = (ebx >> 16) & 1;
+        f.avx512dq = (ebx >> 17) & 1;
+        f.avx512bw = (ebx >> 30) & 1;
+        f.avx512vl = (ebx >> 31) & 1;
+        f.avx512vnni = (ecx >> 11) & 1;
+    }
+    const bool amx_bf16 = (edx >> 22) & 1;
+    const bool amx_tile = (edx >> 24) & 1;
+    const bool amx_int8 = (edx >> 25) & 1;
+    const uint32_t max_subleaf = eax;
+
+    if (max_subleaf >= 1) {
+        __cpuid_count(7, 1, eax, ebx, ecx, edx);
+        f.avxvnni = (eax >> 4) & 1;
+        f.avx512bf16 = os_avx512 && ((eax >> 5) & 1);
+    }
+
+    // the amx kernels also use avx512 for packing and the M=1 path
+    const bool amx_avx512 = f.avx512bw && f.avx512vl && f.avx512dq && f.avx512vnni && f.avx512bf16;
+    if (amx_tile && amx_int8 && amx_bf16 && os_amx && amx_avx512) {
+        f.amx = request_amx_permission();
+        if (!f.amx) {
+            fprintf(stderr, "AMX present but tile data permission was denied, using AVX512 kernels\n");
+        }
+    }
+    return f;
+}
+
+#else
+
+static CPUFeatures detect_cpu_features() {
+    return CPUFeatures();
+}
+
+#endif
+
+const CPUFeatures& get_cpu_features() {
+    static const CPUFeatures features = detect_cpu_features();
+    return features;
+}
+
+const char* get_cpu_isa_name() {
+    const CPUFeatures& f = get_cpu_features();
+    if (f.amx) {
+        return "amx";
+    }
+    if (f.avx512f && f.avx512vl && f.avx512bw && f.avx512dq && f.avx512vnni && f.avx512bf16) {
+        return "avx512_bf16";
+    }
+    if (f.avx512f) {
+        return "avx512f";
+    }
+    if (f.avx2 && f.avxvnni) {
+        return "avxvnni";
+    }
+    if (f.avx2 && f.fma) {
+        return "avx2";
+    }
+    return "generic";
+}
@@ -0,0 +1,39 @@
+/**
+ * @Description  : Runtime x86 ISA detection used to pick kernel variants.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+#ifndef CPUINFER_CPU_FEATURES_H
+#define CPUINFER_CPU_FEATURES_H
+
+// AMX kernels are compiled in either by a native build on an AMX host, or by
+// the per-file ISA flags of a KTRANSFORMERS_CPU_DISPATCH build. Whether they
+// may run is decided at runtime with `get_cpu_features().amx`.
+#if defined(KTRANSFORMERS_CPU_DISPATCH) || (defined(__AMX_INT8__) && defined(__AVX512VNNI__))
+#define KTRANSFORMERS_HAS_AMX_KERNELS 1
+#endif
+
+struct CPUFeatures {
+    bool avx2 = false;
+    bool fma = false;
+    bool f16c = false;
+    bool avxvnni = false;
+    bool avx512f = false;
+    bool avx512bw = false;
+    bool avx512dq = false;
+    bool avx512vl = false;
+    bool avx512vnni = false;
+    bool avx512bf16 = false;
+    // amx-tile, amx-int8 and amx-bf16 are present, enabled in XCR0, and the
+    // kernel granted this process the tile data state
+    bool amx = false;
+};
+
+// Detected once with cpuid/xgetbv; the first call also requests AMX tile data
+// permission from the kernel, so it should happen before workers start.
+const CPUFeatures& get_cpu_features();
+
+// short name of the widest kernel family usable on this cpu, for logging
+const char* get_cpu_isa_name();
+
+#endif
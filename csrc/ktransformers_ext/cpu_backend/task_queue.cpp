@@ -40,6 +40,15 @@ void TaskQueue::enqueue(std::function<void()> task) {
 void TaskQueue::sync() {
     while (!sync_flag.load(std::memory_order_seq_cst))
         ;
+    std::exception_ptr e;
+    {
+        mutex.lock();
+        std::swap(e, error);
+        mutex.unlock();
+    }
+    if (e) {
+        std::rethrow_exception(e);
+    }
 }
 
 void TaskQueue::processTasks() {
@@ -55,9 +64,17 @@ void TaskQueue::processTasks() {
             tasks.pop();
             mutex.unlock();
         }
-        task();
+        std::exception_ptr e;
+        try {
+            task();
+        } catch (...) {
+            e = std::current_exception();
+        }
         {
             mutex.lock();
+            if (e && !error) {
+                error = e;
+            }
             if (tasks.empty()) {
                 sync_flag.store(true, std::memory_order_seq_cst);
             }
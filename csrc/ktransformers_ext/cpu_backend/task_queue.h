@@ -12,6 +12,7 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <exception>
 #include <functional>
 #include <mutex>
 #include <queue>
@@ -123,6 +124,8 @@ class TaskQueue {
 
     void enqueue(std::function<void()>);
 
+    // Waits for the queued tasks, then rethrows the first exception one of
+    // them threw since the last sync
     void sync();
 
    private:
@@ -134,5 +137,6 @@ class TaskQueue {
     std::thread worker;
     std::atomic<bool> sync_flag;
     std::atomic<bool> exit_flag;
+    std::exception_ptr error;
 };
 #endif
\ No newline at end of file
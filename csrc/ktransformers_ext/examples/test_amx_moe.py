@@ -0,0 +1,87 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  : AMXBF16_MOE and AMXInt8_MOE against a torch reference, at
+               token counts that run the per-token path, the AVX512-VNNI
+               kernels (expert batches of 2-16 rows) and the AMX tiles.
+Version      : 1.0.0
+Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+import time
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+expert_num = 8
+hidden_size = 1024
+intermediate_size = 512
+n_routed_experts = 2
+max_len = 512
+# below group_min_len (10) tokens go one by one, 16 tokens give the 8 experts
+# about 4 rows each (VNNI), 256 tokens about 64 rows (AMX) and 512 tokens
+# more than one MOE_M_BLOCK of rows
+qlens = [1, 4, 16, 64, 256, 512]
+CPUInfer = cpuinfer_ext.CPUInfer(48)
+
+def act_fn(x):
+    return x / (1.0 + torch.exp(-x))
+
+def mlp_torch(input, gate_proj, up_proj, down_proj):
+    gate_buf = torch.mm(input, gate_proj.t())
+    up_buf = torch.mm(input, up_proj.t())
+    intermediate = act_fn(gate_buf) * up_buf
+    ret = torch.mm(intermediate, down_proj.t())
+    return ret
+
+def moe_torch(input, expert_ids, weights, gate_proj, up_proj, down_proj):
+    output = torch.zeros((input.shape[0], hidden_size), dtype=torch.float32)
+    for i in range(input.shape[0]):
+        for j in range(expert_ids.shape[1]):
+            e = expert_ids[i, j]
+            output[i] += weights[i, j] * mlp_torch(input[i:i + 1], gate_proj[e], up_proj[e], down_proj[e])[0]
+    return output
+
+with torch.inference_mode(mode=True):
+    gate_proj = torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.bfloat16).contiguous()
+    up_proj = torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.bfloat16).contiguous()
+    down_proj = torch.randn((expert_num, hidden_size, intermediate_size), dtype=torch.bfloat16).contiguous()
+    config = cpuinfer_ext.moe.AMX_MOEConfig(expert_num, n_routed_experts, hidden_size, intermediate_size, max_len, gate_proj.data_ptr(), up_proj.data_ptr(), down_proj.data_ptr())
+
+    # int8 requantizes the weights to q8_0
+    for moe_class, threshold in [(cpuinfer_ext.moe.AMXBF16_MOE, 0.01), (cpuinfer_ext.moe.AMXInt8_MOE, 0.05)]:
+        try:
+            moe = moe_class(config)
+        except RuntimeError as e:
+            # built without the AMX kernels
+            print(e)
+            sys.exit(0)
+        CPUInfer.submit(moe.load_weights())
+        CPUInfer.sync()
+        CPUInfer.submit(moe.warm_up())
+        CPUInfer.sync()
+
+        for qlen in qlens:
+            expert_ids = torch.stack([torch.randperm(expert_num)[:n_routed_experts] for _ in range(qlen)]).contiguous()
+            weights = torch.rand((qlen, n_routed_experts), dtype=torch.float32).contiguous()
+            input = (torch.randn((qlen, hidden_size), dtype=torch.bfloat16) / 100).contiguous()
+            output = torch.empty((qlen, hidden_size), dtype=torch.bfloat16).contiguous()
+            batch_size_tensor = torch.tensor([qlen], dtype=torch.int32)
+
+            CPUInfer.submit(
+                moe.forward(
+                    qlen,
+                    n_routed_experts,
+                    expert_ids.data_ptr(),
+                    weights.data_ptr(),
+                    input.data_ptr(),
+                    output.data_ptr(),
+                    batch_size_tensor.data_ptr()
+                )
+            )
+            CPUInfer.sync()
+
+            t_output = moe_torch(input.float(), expert_ids, weights, gate_proj.float(), up_proj.float(), down_proj.float())
+            diff = torch.mean(torch.abs(output.float() - t_output)) / torch.mean(torch.abs(t_output))
+            print(moe_class.__name__, 'qlen', qlen, 'diff = ', diff)
+            assert(diff < threshold)
@@ -0,0 +1,71 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  : MLA attention of absorbed queries over the latent KVCache
+               against a torch reference, a prompt and then decode steps.
+Version      : 1.0.0
+Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+import time
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 2
+q_head_num = 16
+kv_lora_rank = 512
+rope_dim = 64
+head_dim = kv_lora_rank + rope_dim
+block_len = 64
+anchor_num = 1
+anchor_type = cpuinfer_ext.kvcache.AnchorType.DYNAMIC
+kv_type = cpuinfer_ext.kvcache.ggml_type.FP16
+retrieval_type = cpuinfer_ext.kvcache.RetrievalType.LAYER
+layer_step = 1
+token_step = 1
+layer_offset = 0
+max_thread_num = 64
+max_batch_size = 1
+max_block_num = 16
+softmax_scale = (128 + rope_dim) ** -0.5
+prompt_len = 300
+decode_steps = 4
+CPUInfer = cpuinfer_ext.CPUInfer(max_thread_num)
+
+def mla_torch(q, kv, visible):
+    # q [q_len, q_head_num, head_dim], kv [seqlen, head_dim], token t attends
+    # to the first visible[t] rows, the value is the compressed kv part
+    scores = torch.einsum('qhd,kd->hqk', q.float(), kv.float()) * softmax_scale
+    mask = torch.arange(kv.shape[0])[None, :] >= visible[:, None]
+    scores.masked_fill_(mask[None], float('-inf'))
+    return torch.einsum('hqk,kd->qhd', scores.softmax(dim=-1), kv[:, :kv_lora_rank].float())
+
+with torch.inference_mode(mode=True):
+    config = cpuinfer_ext.kvcache.KVCacheConfig(layer_num, 1, q_head_num, head_dim, block_len, anchor_num, anchor_type, kv_type, retrieval_type, layer_step, token_step, layer_offset, max_block_num, max_batch_size, max_thread_num, kv_lora_rank)
+    kvcache = cpuinfer_ext.kvcache.KVCache(config)
+    block_table = torch.randperm(max_block_num).to(torch.int32).view(1, -1).contiguous()
+
+    total = prompt_len + decode_steps
+    for layer_idx in range(layer_num):
+        q = (torch.randn((1, total, q_head_num, head_dim), dtype=torch.float16) / 4).contiguous()
+        kv = torch.randn((1, total, head_dim), dtype=torch.float16).contiguous()
+        output = torch.empty((1, total, q_head_num, kv_lora_rank), dtype=torch.float16).contiguous()
+
+        # the prompt at once, then one token per step
+        cache_seqlens = torch.zeros((1,), dtype=torch.int32)
+        chunks = [(0, prompt_len)] + [(t, t + 1) for t in range(prompt_len, total)]
+        for begin, end in chunks:
+            q_chunk = q[:, begin:end].contiguous()
+            kv_chunk = kv[:, begin:end].contiguous()
+            output_chunk = torch.empty((1, end - begin, q_head_num, kv_lora_rank), dtype=torch.float16).contiguous()
+            attn_lse = torch.empty((1, end - begin, q_head_num), dtype=torch.float32).contiguous()
+            CPUInfer.submit(kvcache.attn_mla(q_chunk.data_ptr(), kv_chunk.data_ptr(), output_chunk.data_ptr(), attn_lse.data_ptr(), softmax_scale, layer_idx, end - begin, 1, max_block_num, block_table.data_ptr(), cache_seqlens.data_ptr()))
+            CPUInfer.sync()
+            output[:, begin:end] = output_chunk
+            cache_seqlens += end - begin
+
+        t_output = mla_torch(q[0], kv[0], torch.arange(1, total + 1))
+        diff = torch.mean(torch.abs(output[0].float() - t_output)) / torch.mean(torch.abs(t_output))
+        print('layer', layer_idx, 'diff = ', diff)
+        assert(diff < 0.005)
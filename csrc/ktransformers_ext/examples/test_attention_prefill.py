@@ -0,0 +1,73 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  : Chunked prefill attention of KVCache against a torch
+               reference.
+Version      : 1.0.0
+Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+import time
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 1
+q_head_num = 8
+head_dim = 128
+block_len = 128
+anchor_num = 1
+anchor_type = cpuinfer_ext.kvcache.AnchorType.DYNAMIC
+kv_type = cpuinfer_ext.kvcache.ggml_type.FP16
+retrieval_type = cpuinfer_ext.kvcache.RetrievalType.LAYER
+layer_step = 1
+token_step = 1
+layer_offset = 0
+max_thread_num = 64
+max_batch_size = 1
+max_block_num = 16 # per sequence
+CPUInfer = cpuinfer_ext.CPUInfer(max_thread_num)
+
+def attention_torch(q, k, v, visible):
+    # q [q_len, q_head_num, head_dim], k/v [seqlen, kv_head_num, head_dim],
+    # token t attends to the first visible[t] positions
+    n_gqa = q.shape[1] // k.shape[1]
+    k = k.float().repeat_interleave(n_gqa, dim=1)
+    v = v.float().repeat_interleave(n_gqa, dim=1)
+    scores = torch.einsum('qhd,khd->hqk', q.float(), k) / head_dim ** 0.5
+    mask = torch.arange(k.shape[0])[None, :] >= visible[:, None]
+    scores.masked_fill_(mask[None], float('-inf'))
+    return torch.einsum('hqk,khd->qhd', scores.softmax(dim=-1), v)
+
+def make_kvcache(kv_head_num, batch_size):
+    config = cpuinfer_ext.kvcache.KVCacheConfig(layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num, anchor_type, kv_type, retrieval_type, layer_step, token_step, layer_offset, max_block_num * batch_size, batch_size, max_thread_num)
+    return cpuinfer_ext.kvcache.KVCache(config)
+
+with torch.inference_mode(mode=True):
+    # prefill: a prompt written chunk by chunk sees the same prefix as at once
+    for kv_head_num in [1, 2]:
+        kvcache = make_kvcache(kv_head_num, 1)
+        block_table = torch.arange(max_block_num, dtype=torch.int32).view(1, -1).contiguous()
+        prompt_len = 700
+        q = (torch.randn((1, prompt_len, q_head_num, head_dim), dtype=torch.float16) / 4).contiguous()
+        k = torch.randn((1, prompt_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+        v = torch.randn((1, prompt_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+        output = torch.empty((1, prompt_len, q_head_num, head_dim), dtype=torch.float16).contiguous()
+        attn_lse = torch.empty((1, prompt_len, q_head_num), dtype=torch.float32).contiguous()
+
+        cache_seqlens = torch.zeros((1,), dtype=torch.int32)
+        for begin, end in [(0, 1), (1, 200), (200, 456), (456, 700)]:
+            q_chunk = q[:, begin:end].contiguous()
+            k_chunk = k[:, begin:end].contiguous()
+            v_chunk = v[:, begin:end].contiguous()
+            output_chunk = torch.empty((1, end - begin, q_head_num, head_dim), dtype=torch.float16).contiguous()
+            lse_chunk = torch.empty((1, end - begin, q_head_num), dtype=torch.float32).contiguous()
+            CPUInfer.submit(kvcache.attn_prefill(q_chunk.data_ptr(), k_chunk.data_ptr(), v_chunk.data_ptr(), output_chunk.data_ptr(), lse_chunk.data_ptr(), 0, end - begin, 1, max_block_num, block_table.data_ptr(), cache_seqlens.data_ptr()))
+            CPUInfer.sync()
+            output[:, begin:end] = output_chunk
+            cache_seqlens += end - begin
+
+        t_output = attention_torch(q[0], k[0], v[0], torch.arange(1, prompt_len + 1))
+        diff = torch.mean(torch.abs(output[0].float() - t_output)) / torch.mean(torch.abs(t_output))
+        print('prefill kv_head_num', kv_head_num, 'diff = ', diff)
+        assert(diff < 0.005)
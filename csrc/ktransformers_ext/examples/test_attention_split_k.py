@@ -0,0 +1,72 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  : Split-K decode attention of KVCache against a torch
+               reference.
+Version      : 1.0.0
+Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+import time
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 1
+q_head_num = 8
+head_dim = 128
+block_len = 128
+anchor_num = 1
+anchor_type = cpuinfer_ext.kvcache.AnchorType.DYNAMIC
+kv_type = cpuinfer_ext.kvcache.ggml_type.FP16
+retrieval_type = cpuinfer_ext.kvcache.RetrievalType.LAYER
+layer_step = 1
+token_step = 1
+layer_offset = 0
+max_thread_num = 64
+max_batch_size = 2
+max_block_num = 16 # per sequence
+CPUInfer = cpuinfer_ext.CPUInfer(max_thread_num)
+
+def attention_torch(q, k, v, visible):
+    # q [q_len, q_head_num, head_dim], k/v [seqlen, kv_head_num, head_dim],
+    # token t attends to the first visible[t] positions
+    n_gqa = q.shape[1] // k.shape[1]
+    k = k.float().repeat_interleave(n_gqa, dim=1)
+    v = v.float().repeat_interleave(n_gqa, dim=1)
+    scores = torch.einsum('qhd,khd->hqk', q.float(), k) / head_dim ** 0.5
+    mask = torch.arange(k.shape[0])[None, :] >= visible[:, None]
+    scores.masked_fill_(mask[None], float('-inf'))
+    return torch.einsum('hqk,khd->qhd', scores.softmax(dim=-1), v)
+
+def make_kvcache(kv_head_num, batch_size):
+    config = cpuinfer_ext.kvcache.KVCacheConfig(layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num, anchor_type, kv_type, retrieval_type, layer_step, token_step, layer_offset, max_block_num * batch_size, batch_size, max_thread_num)
+    return cpuinfer_ext.kvcache.KVCache(config)
+
+with torch.inference_mode(mode=True):
+    # decode: the blocks are cut into split_num = ceil(4 * threads / heads)
+    # chunks, at most one per block, fewer kv heads give more chunks
+    seqlen_pairs = [(1, 127), (129, 1000), (1500, 2047), (128, 256)]
+    for kv_head_num in [1, 2, 8]:
+        kvcache = make_kvcache(kv_head_num, 2)
+        block_table = torch.arange(2 * max_block_num, dtype=torch.int32).view(2, max_block_num).contiguous()
+        total = max_block_num * block_len
+        k = (torch.randn((2, total, kv_head_num, head_dim), dtype=torch.float16)).contiguous()
+        v = (torch.randn((2, total, kv_head_num, head_dim), dtype=torch.float16)).contiguous()
+        seqlens_zero = torch.zeros((2,), dtype=torch.int32)
+        CPUInfer.submit(kvcache.update_kvcache_fp16(k.data_ptr(), v.data_ptr(), 0, block_table.data_ptr(), 2, max_block_num, seqlens_zero.data_ptr(), total))
+        CPUInfer.sync()
+
+        for seqlens in seqlen_pairs:
+            cache_seqlens = torch.tensor(seqlens, dtype=torch.int32)
+            q = (torch.randn((2, 1, q_head_num, head_dim), dtype=torch.float16) / 4).contiguous()
+            output = torch.empty((2, 1, q_head_num, head_dim), dtype=torch.float16).contiguous()
+            attn_lse = torch.empty((2, 1, q_head_num), dtype=torch.float32).contiguous()
+            CPUInfer.submit(kvcache.attn(q.data_ptr(), output.data_ptr(), attn_lse.data_ptr(), 0, 0, 1, 2, max_block_num, block_table.data_ptr(), cache_seqlens.data_ptr(), -1, -1, -1))
+            CPUInfer.sync()
+
+            for b in range(2):
+                t_output = attention_torch(q[b], k[b, :seqlens[b]], v[b, :seqlens[b]], torch.tensor([seqlens[b]]))
+                diff = torch.mean(torch.abs(output[b].float() - t_output)) / torch.mean(torch.abs(t_output))
+                print('decode kv_head_num', kv_head_num, 'seqlen', seqlens[b], 'diff = ', diff)
+                assert(diff < 0.005)
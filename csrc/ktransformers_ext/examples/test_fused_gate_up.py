@@ -0,0 +1,108 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  : MLP and MOE with the fused gate/up projection against the
+               separate gate and up projections and a torch reference.
+Version      : 1.0.0
+Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+import time
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+expert_num = 8
+hidden_size = 2048
+intermediate_size = 1024
+stride = 32
+group_min_len = 10
+group_max_len = 1024
+n_routed_experts = 2
+proj_type = 1 # ggml_type::GGML_TYPE_F16
+hidden_type = 1 # ggml_type::GGML_TYPE_F16
+qlens = [1, 30, 200]
+CPUInfer = cpuinfer_ext.CPUInfer(48)
+
+def act_fn(x):
+    return x / (1.0 + torch.exp(-x))
+
+def mlp_torch(input, gate_proj, up_proj, down_proj):
+    gate_buf = torch.mm(input, gate_proj.t())
+    up_buf = torch.mm(input, up_proj.t())
+    intermediate = act_fn(gate_buf) * up_buf
+    ret = torch.mm(intermediate, down_proj.t())
+    return ret
+
+def moe_torch(input, expert_ids, weights, gate_proj, up_proj, down_proj):
+    output = torch.zeros((input.shape[0], hidden_size), dtype=torch.float32)
+    for i in range(input.shape[0]):
+        for j in range(expert_ids.shape[1]):
+            e = expert_ids[i, j]
+            output[i] += weights[i, j] * mlp_torch(input[i:i + 1], gate_proj[e], up_proj[e], down_proj[e])[0]
+    return output
+
+def check(outputs, t_output, name):
+    fused, unfused = outputs
+    diff = torch.mean(torch.abs(fused.float() - unfused.float())) / torch.mean(torch.abs(unfused.float()))
+    print(name, 'fused vs unfused diff = ', diff)
+    assert(diff < 0.001)
+    for output in outputs:
+        diff = torch.mean(torch.abs(output.float() - t_output)) / torch.mean(torch.abs(t_output))
+        print(name, 'diff = ', diff)
+        assert(diff < 0.001)
+
+with torch.inference_mode(mode=True):
+    gate_proj = torch.randn((intermediate_size, hidden_size), dtype=torch.float16).contiguous()
+    up_proj = torch.randn((intermediate_size, hidden_size), dtype=torch.float16).contiguous()
+    down_proj = torch.randn((hidden_size, intermediate_size), dtype=torch.float16).contiguous()
+    mlps = []
+    for fuse_gate_up in [True, False]:
+        config = cpuinfer_ext.mlp.MLPConfig(hidden_size, intermediate_size, stride, group_max_len, gate_proj.data_ptr(), up_proj.data_ptr(), down_proj.data_ptr(), proj_type, proj_type, proj_type, hidden_type)
+        config.fuse_gate_up = fuse_gate_up
+        mlps.append(cpuinfer_ext.mlp.MLP(config))
+
+    for qlen in qlens:
+        input = (torch.randn((qlen, hidden_size), dtype=torch.float16) / 100).contiguous()
+        outputs = []
+        for mlp in mlps:
+            output = torch.empty((qlen, hidden_size), dtype=torch.float16).contiguous()
+            CPUInfer.submit(mlp.forward(qlen, input.data_ptr(), output.data_ptr()))
+            CPUInfer.sync()
+            outputs.append(output)
+        t_output = mlp_torch(input.float(), gate_proj.float(), up_proj.float(), down_proj.float())
+        check(outputs, t_output, 'mlp qlen ' + str(qlen))
+
+    gate_proj = torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float16).contiguous()
+    up_proj = torch.randn((expert_num, intermediate_size, hidden_size), dtype=torch.float16).contiguous()
+    down_proj = torch.randn((expert_num, hidden_size, intermediate_size), dtype=torch.float16).contiguous()
+    moes = []
+    for fuse_gate_up in [True, False]:
+        config = cpuinfer_ext.moe.MOEConfig(expert_num, n_routed_experts, hidden_size, intermediate_size, stride, group_min_len, group_max_len, gate_proj.data_ptr(), up_proj.data_ptr(), down_proj.data_ptr(), proj_type, proj_type, proj_type, hidden_type)
+        config.fuse_gate_up = fuse_gate_up
+        moes.append(cpuinfer_ext.moe.MOE(config))
+
+    # below group_min_len the experts run token by token, above it in groups
+    for qlen in qlens:
+        expert_ids = torch.stack([torch.randperm(expert_num)[:n_routed_experts] for _ in range(qlen)]).contiguous()
+        weights = torch.rand((qlen, n_routed_experts), dtype=torch.float32).contiguous()
+        input = (torch.randn((qlen, hidden_size), dtype=torch.float16) / 100).contiguous()
+        batch_size_tensor = torch.tensor([qlen], dtype=torch.int32)
+        outputs = []
+        for moe in moes:
+            output = torch.empty((qlen, hidden_size), dtype=torch.float16).contiguous()
+            CPUInfer.submit(
+                moe.forward(
+                    qlen,
+                    n_routed_experts,
+                    expert_ids.data_ptr(),
+                    weights.data_ptr(),
+                    input.data_ptr(),
+                    output.data_ptr(),
+                    batch_size_tensor.data_ptr()
+                )
+            )
+            CPUInfer.sync()
+            outputs.append(output)
+        t_output = moe_torch(input.float(), expert_ids, weights, gate_proj.float(), up_proj.float(), down_proj.float())
+        check(outputs, t_output, 'moe qlen ' + str(qlen))
@@ -0,0 +1,192 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  : Shared KVCache blocks (fork, copy-on-write, free) and the
+               sliding window with attention sinks (evict_window).
+Version      : 1.0.0
+Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+import time
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 2
+kv_head_num = 2
+q_head_num = 8
+head_dim = 128
+block_len = 128
+anchor_num = 1
+anchor_type = cpuinfer_ext.kvcache.AnchorType.DYNAMIC
+kv_type = cpuinfer_ext.kvcache.ggml_type.FP16
+retrieval_type = cpuinfer_ext.kvcache.RetrievalType.LAYER
+layer_step = 1
+token_step = 1
+layer_offset = 0
+max_thread_num = 64
+max_batch_size = 1
+max_block_num = 32 # blocks of the pool
+table_len = 16 # blocks per sequence
+CPUInfer = cpuinfer_ext.CPUInfer(max_thread_num)
+
+def make_kvcache():
+    config = cpuinfer_ext.kvcache.KVCacheConfig(layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num, anchor_type, kv_type, retrieval_type, layer_step, token_step, layer_offset, max_block_num, max_batch_size, max_thread_num)
+    return cpuinfer_ext.kvcache.KVCache(config)
+
+def new_table(kvcache, block_num):
+    table = torch.full((1, table_len), -1, dtype=torch.int32).contiguous()
+    for i in range(block_num):
+        table[0, i] = kvcache.alloc_block()
+    return table
+
+def write(kvcache, table, k, v, begin):
+    # k/v [layer_num, q_len, kv_head_num, head_dim] after the first begin tokens
+    cache_seqlens = torch.tensor([begin], dtype=torch.int32)
+    for layer_idx in range(layer_num):
+        k_layer = k[layer_idx].unsqueeze(0).contiguous()
+        v_layer = v[layer_idx].unsqueeze(0).contiguous()
+        CPUInfer.submit(kvcache.update_kvcache_fp16(k_layer.data_ptr(), v_layer.data_ptr(), layer_idx, table.data_ptr(), 1, table_len, cache_seqlens.data_ptr(), k.shape[1]))
+        CPUInfer.sync()
+
+def read(kvcache, table, seqlen):
+    k = torch.zeros((layer_num, table_len * block_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+    v = torch.zeros((layer_num, table_len * block_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+    cache_seqlens = torch.tensor([seqlen], dtype=torch.int32)
+    for layer_idx in range(layer_num):
+        CPUInfer.submit(kvcache.get_kvcache_fp16(k[layer_idx].data_ptr(), v[layer_idx].data_ptr(), layer_idx, table.data_ptr(), 1, table_len, cache_seqlens.data_ptr()))
+        CPUInfer.sync()
+    return k[:, :seqlen], v[:, :seqlen]
+
+def random_kv(q_len):
+    return (torch.randn((layer_num, q_len, kv_head_num, head_dim), dtype=torch.float16),
+            torch.randn((layer_num, q_len, kv_head_num, head_dim), dtype=torch.float16))
+
+def rotate_back(k, cos, sin):
+    # RoPE by -shift of k [..., head_dim], cos/sin [head_dim] at shift
+    half = head_dim // 2
+    x = k[..., :half].float()
+    y = k[..., half:].float()
+    c = cos[:half].float()
+    s = sin[:half].float()
+    return torch.cat([x * c + y * s, y * c - x * s], dim=-1)
+
+with torch.inference_mode(mode=True):
+    # fork, copy-on-write and free
+    kvcache = make_kvcache()
+    a = new_table(kvcache, 3)
+    k_a, v_a = random_kv(300)
+    write(kvcache, a, k_a, v_a, 0)
+
+    b = torch.full((1, table_len), -1, dtype=torch.int32).contiguous()
+    kvcache.fork_block_table(a.data_ptr(), b.data_ptr(), 3)
+    assert(torch.equal(a[0, :3], b[0, :3]))
+    for i in range(3):
+        assert(kvcache.get_block_ref(int(a[0, i])) == 2)
+
+    # the partial last block is copied by the first write of b, the full
+    # blocks stay shared
+    k_b_tail, v_b_tail = random_kv(20)
+    write(kvcache, b, k_b_tail, v_b_tail, 300)
+    assert(b[0, 2] != a[0, 2] and torch.equal(a[0, :2], b[0, :2]))
+    assert(kvcache.get_block_ref(int(a[0, 0])) == 2)
+    assert(kvcache.get_block_ref(int(a[0, 2])) == 1)
+    assert(kvcache.get_block_ref(int(b[0, 2])) == 1)
+    a_last = int(a[0, 2])
+    k_a_tail, v_a_tail = random_kv(10)
+    write(kvcache, a, k_a_tail, v_a_tail, 300)
+    assert(a[0, 2] == a_last)
+
+    k, v = read(kvcache, a, 310)
+    assert(torch.equal(k, torch.cat([k_a, k_a_tail], dim=1)) and torch.equal(v, torch.cat([v_a, v_a_tail], dim=1)))
+    k, v = read(kvcache, b, 320)
+    assert(torch.equal(k, torch.cat([k_a, k_b_tail], dim=1)) and torch.equal(v, torch.cat([v_a, v_b_tail], dim=1)))
+
+    kvcache.free_block_table(b.data_ptr(), 3)
+    assert(kvcache.get_block_ref(int(a[0, 0])) == 1)
+    assert(kvcache.get_block_ref(int(b[0, 2])) == 0)
+    # freeing b again would take a's blocks below zero, nothing changes
+    try:
+        kvcache.free_block_table(b.data_ptr(), 3)
+        assert(False)
+    except IndexError as e:
+        print('double free:', e)
+    assert(kvcache.get_block_ref(int(a[0, 0])) == 1)
+    assert(kvcache.alloc_block() == b[0, 2])
+    for block_idx in [-1, max_block_num]:
+        try:
+            kvcache.get_block_ref(block_idx)
+            assert(False)
+        except IndexError as e:
+            print('bad block:', e)
+    print('fork, copy-on-write and free passed')
+
+    # sliding window: 1 sink block and a window of 3 blocks out of 10, the
+    # window moves back by 6 blocks and its keys are rotated back by as much
+    kvcache = make_kvcache()
+    rope_len = max_block_num * block_len
+    inv_freq = 1.0 / (10000 ** (torch.arange(0, head_dim, 2).float() / head_dim))
+    freqs = torch.outer(torch.arange(rope_len).float(), inv_freq)
+    emb = torch.cat([freqs, freqs], dim=-1)
+    cos = emb.cos().to(torch.float16).contiguous()
+    sin = emb.sin().to(torch.float16).contiguous()
+    kvcache.get_sincos(sin.data_ptr(), cos.data_ptr(), rope_len)
+
+    seqlen = 9 * block_len + 50
+    sink_block_num = 1
+    window_block_num = 3
+    spill_block_num = 2
+    evict_num = 10 - sink_block_num - window_block_num
+    shift = evict_num * block_len
+    a = new_table(kvcache, 10)
+    k_a, v_a = random_kv(seqlen)
+    write(kvcache, a, k_a, v_a, 0)
+    # blocks 3 and 5 matter most and are spilled, in that order
+    importance = torch.zeros((1, table_len * block_len, q_head_num), dtype=torch.float16)
+    importance[0, 3 * block_len:4 * block_len] = 1.0
+    importance[0, 5 * block_len:6 * block_len] = 0.5
+    importance = importance.contiguous()
+    offset = torch.zeros((1,), dtype=torch.int32)
+    CPUInfer.submit(kvcache.update_importance(importance.data_ptr(), 0, a.data_ptr(), 1, table_len, offset.data_ptr(), seqlen))
+    CPUInfer.sync()
+
+    # another sequence shares all of the blocks, its copy must not change
+    c = torch.full((1, table_len), -1, dtype=torch.int32).contiguous()
+    kvcache.fork_block_table(a.data_ptr(), c.data_ptr(), 10)
+    old = a.clone()
+
+    cache_seqlens = torch.tensor([seqlen], dtype=torch.int32)
+    spill_table = torch.zeros((1, spill_block_num), dtype=torch.int32).contiguous()
+    CPUInfer.submit(kvcache.evict_window(a.data_ptr(), cache_seqlens.data_ptr(), 1, table_len, sink_block_num, window_block_num, spill_table.data_ptr(), spill_block_num))
+    CPUInfer.sync()
+
+    assert(cache_seqlens[0] == seqlen - shift)
+    assert(spill_table[0, 0] == old[0, 3] and spill_table[0, 1] == old[0, 5])
+    assert(a[0, 0] == old[0, 0] and kvcache.get_block_ref(int(a[0, 0])) == 2)
+    # the window blocks were shared, they are copied before the rotation
+    for i in range(sink_block_num, sink_block_num + window_block_num):
+        assert(a[0, i] not in old[0, :10])
+        assert(kvcache.get_block_ref(int(a[0, i])) == 1)
+    for i in range(sink_block_num + evict_num, 10):
+        assert(kvcache.get_block_ref(int(old[0, i])) == 1)
+    # the spilled blocks are held by c and the spill table
+    for i in [3, 5]:
+        assert(kvcache.get_block_ref(int(old[0, i])) == 2)
+
+    k, v = read(kvcache, a, seqlen - shift)
+    sink_len = sink_block_num * block_len
+    assert(torch.equal(k[:, :sink_len], k_a[:, :sink_len]) and torch.equal(v[:, :sink_len], v_a[:, :sink_len]))
+    assert(torch.equal(v[:, sink_len:], v_a[:, sink_len + shift:]))
+    t_k = rotate_back(k_a[:, sink_len + shift:], cos[shift], sin[shift])
+    diff = torch.mean(torch.abs(k[:, sink_len:].float() - t_k)) / torch.mean(torch.abs(t_k))
+    print('rotated window diff = ', diff)
+    assert(diff < 0.002)
+
+    k, v = read(kvcache, c, seqlen)
+    assert(torch.equal(k, k_a) and torch.equal(v, v_a))
+    spilled = torch.full((1, table_len), -1, dtype=torch.int32)
+    spilled[0, :spill_block_num] = spill_table[0]
+    k, v = read(kvcache, spilled.contiguous(), spill_block_num * block_len)
+    for j, i in enumerate([3, 5]):
+        assert(torch.equal(k[:, j * block_len:(j + 1) * block_len], k_a[:, i * block_len:(i + 1) * block_len]))
+    print('evict_window passed')
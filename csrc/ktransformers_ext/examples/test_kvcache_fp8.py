@@ -0,0 +1,79 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  : FP8 E4M3 KVCache, written in chunks and read back, and decode
+               attention over it against a torch reference.
+Version      : 1.0.0
+Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+import time
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 2
+kv_head_num = 2
+q_head_num = 8
+head_dim = 128
+block_len = 128
+anchor_num = 1
+anchor_type = cpuinfer_ext.kvcache.AnchorType.DYNAMIC
+kv_type = cpuinfer_ext.kvcache.ggml_type.FP8_E4M3
+retrieval_type = cpuinfer_ext.kvcache.RetrievalType.LAYER
+layer_step = 1
+token_step = 1
+layer_offset = 0
+max_thread_num = 64
+max_batch_size = 1
+max_block_num = 8
+CPUInfer = cpuinfer_ext.CPUInfer(max_thread_num)
+
+def attention_torch(q, k, v):
+    # q [q_head_num, head_dim], k/v [seqlen, kv_head_num, head_dim]
+    n_gqa = q.shape[0] // k.shape[1]
+    k = k.float().repeat_interleave(n_gqa, dim=1)
+    v = v.float().repeat_interleave(n_gqa, dim=1)
+    scores = torch.einsum('hd,khd->hk', q.float(), k) / head_dim ** 0.5
+    return torch.einsum('hk,khd->hd', scores.softmax(dim=-1), v)
+
+with torch.inference_mode(mode=True):
+    config = cpuinfer_ext.kvcache.KVCacheConfig(layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num, anchor_type, kv_type, retrieval_type, layer_step, token_step, layer_offset, max_block_num, max_batch_size, max_thread_num)
+    kvcache = cpuinfer_ext.kvcache.KVCache(config)
+    block_table = torch.tensor([[3, 0, 5, 1, 7, 2, 4, 6]], dtype=torch.int32).contiguous()
+
+    seqlen = 450
+    for layer_idx in range(layer_num):
+        k = torch.randn((1, seqlen, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+        v = torch.randn((1, seqlen, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+        # a chunk, a single token and a chunk that ends inside a block, tokens
+        # of one V group written by different calls
+        for begin, end in [(0, 300), (300, 301), (301, seqlen)]:
+            k_chunk = k[:, begin:end].contiguous()
+            v_chunk = v[:, begin:end].contiguous()
+            cache_seqlens = torch.tensor([begin], dtype=torch.int32)
+            CPUInfer.submit(kvcache.update_kvcache_fp16(k_chunk.data_ptr(), v_chunk.data_ptr(), layer_idx, block_table.data_ptr(), 1, max_block_num, cache_seqlens.data_ptr(), end - begin))
+            CPUInfer.sync()
+
+        k_out = torch.zeros((1, max_block_num * block_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+        v_out = torch.zeros((1, max_block_num * block_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+        cache_seqlens = torch.tensor([seqlen], dtype=torch.int32)
+        CPUInfer.submit(kvcache.get_kvcache_fp16(k_out.data_ptr(), v_out.data_ptr(), layer_idx, block_table.data_ptr(), 1, max_block_num, cache_seqlens.data_ptr()))
+        CPUInfer.sync()
+
+        # e4m3 keeps 3 mantissa bits
+        for name, ref, out in [('k', k, k_out), ('v', v, v_out)]:
+            diff = torch.mean(torch.abs(out[:, :seqlen].float() - ref.float())) / torch.mean(torch.abs(ref.float()))
+            print('layer', layer_idx, name, 'round trip diff = ', diff)
+            assert(diff < 0.05)
+
+        q = (torch.randn((1, 1, q_head_num, head_dim), dtype=torch.float16) / 4).contiguous()
+        output = torch.empty((1, 1, q_head_num, head_dim), dtype=torch.float16).contiguous()
+        attn_lse = torch.empty((1, 1, q_head_num), dtype=torch.float32).contiguous()
+        CPUInfer.submit(kvcache.attn(q.data_ptr(), output.data_ptr(), attn_lse.data_ptr(), layer_idx, 0, 1, 1, max_block_num, block_table.data_ptr(), cache_seqlens.data_ptr(), -1, -1, -1))
+        CPUInfer.sync()
+
+        t_output = attention_torch(q[0, 0], k[0], v[0])
+        diff = torch.mean(torch.abs(output[0, 0].float() - t_output)) / torch.mean(torch.abs(t_output))
+        print('layer', layer_idx, 'attn diff = ', diff)
+        assert(diff < 0.05)
@@ -0,0 +1,103 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  : KVCache dump and load of the versioned file format, and the
+               files load_kvcache must reject.
+Version      : 1.0.0
+Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+import tempfile
+import time
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+layer_num = 2
+kv_head_num = 2
+q_head_num = 8
+head_dim = 128
+block_len = 128
+anchor_num = 1
+anchor_type = cpuinfer_ext.kvcache.AnchorType.DYNAMIC
+kv_type = cpuinfer_ext.kvcache.ggml_type.FP16
+retrieval_type = cpuinfer_ext.kvcache.RetrievalType.LAYER
+layer_step = 1
+token_step = 1
+layer_offset = 0
+max_thread_num = 64
+max_batch_size = 1
+max_block_num = 8
+CPUInfer = cpuinfer_ext.CPUInfer(max_thread_num)
+
+def make_kvcache(kv_head_num=kv_head_num, max_block_num=max_block_num):
+    config = cpuinfer_ext.kvcache.KVCacheConfig(layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num, anchor_type, kv_type, retrieval_type, layer_step, token_step, layer_offset, max_block_num, max_batch_size, max_thread_num)
+    return cpuinfer_ext.kvcache.KVCache(config)
+
+def read(kvcache, table, seqlen, layer_idx):
+    k = torch.zeros((1, max_block_num * block_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+    v = torch.zeros((1, max_block_num * block_len, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+    cache_seqlens = torch.tensor([seqlen], dtype=torch.int32)
+    CPUInfer.submit(kvcache.get_kvcache_fp16(k.data_ptr(), v.data_ptr(), layer_idx, table.data_ptr(), 1, max_block_num, cache_seqlens.data_ptr()))
+    CPUInfer.sync()
+    return k[0, :seqlen], v[0, :seqlen]
+
+def expect_rejected(kvcache, path):
+    try:
+        CPUInfer.submit(kvcache.load_kvcache(path))
+        CPUInfer.sync()
+        assert(False)
+    except RuntimeError as e:
+        print('rejected:', e)
+
+with torch.inference_mode(mode=True):
+    seqlen = 300
+    kvcache = make_kvcache()
+    # the blocks of a sequence anywhere in the cache, the dump holds them in
+    # table order
+    block_table = torch.tensor([[5, 2, 7, 0, 1, 3, 4, 6]], dtype=torch.int32).contiguous()
+    ks, vs = [], []
+    for layer_idx in range(layer_num):
+        k = torch.randn((1, seqlen, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+        v = torch.randn((1, seqlen, kv_head_num, head_dim), dtype=torch.float16).contiguous()
+        cache_seqlens = torch.zeros((1,), dtype=torch.int32)
+        CPUInfer.submit(kvcache.update_kvcache_fp16(k.data_ptr(), v.data_ptr(), layer_idx, block_table.data_ptr(), 1, max_block_num, cache_seqlens.data_ptr(), seqlen))
+        CPUInfer.sync()
+        ks.append(k[0])
+        vs.append(v[0])
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        path = os.path.join(tmp_dir, 'kvcache.bin')
+        CPUInfer.submit(kvcache.dump_kvcache(block_table.data_ptr(), seqlen, path))
+        CPUInfer.sync()
+        assert(os.path.exists(path) and not os.path.exists(path + '.tmp'))
+
+        loaded = make_kvcache()
+        CPUInfer.submit(loaded.load_kvcache(path))
+        CPUInfer.sync()
+        assert(loaded.get_cache_total_len() == seqlen)
+        arange_table = torch.arange(max_block_num, dtype=torch.int32).view(1, -1).contiguous()
+        for layer_idx in range(layer_num):
+            k, v = read(loaded, arange_table, seqlen, layer_idx)
+            assert(torch.equal(k, ks[layer_idx]) and torch.equal(v, vs[layer_idx]))
+        print('dump and load passed')
+
+        # another config, fewer blocks than the dump, a flipped byte in the
+        # last record, and a file cut inside it
+        expect_rejected(make_kvcache(kv_head_num=1), path)
+        expect_rejected(make_kvcache(max_block_num=2), path)
+        with open(path, 'rb') as f:
+            data = bytearray(f.read())
+        record_bytes = 2 * kv_head_num * block_len * head_dim * 2 + block_len * q_head_num * 2
+        record_bytes = (record_bytes + 4095) // 4096 * 4096
+        corrupted = bytearray(data)
+        corrupted[len(data) - record_bytes + 100] ^= 0xff
+        corrupted_path = os.path.join(tmp_dir, 'corrupted.bin')
+        with open(corrupted_path, 'wb') as f:
+            f.write(corrupted)
+        expect_rejected(make_kvcache(), corrupted_path)
+        truncated_path = os.path.join(tmp_dir, 'truncated.bin')
+        with open(truncated_path, 'wb') as f:
+            f.write(data[:len(data) - record_bytes // 2])
+        expect_rejected(make_kvcache(), truncated_path)
+        print('rejected files passed')
@@ -0,0 +1,51 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  : Linear over the 2-D {m_block, stride} tiles, at token counts
+               around the minimum row block and across group_max_len.
+Version      : 1.0.0
+Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+import time
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+input_size = 4096
+output_size = 2048
+stride = 32
+group_max_len = 256
+hidden_type = 1 # ggml_type::GGML_TYPE_F16
+# below 16 rows the input is converted serially and there is one row block,
+# a tail block shorter than the others, and more rows than group_max_len
+# split into several forward_many calls
+qlens = [1, 15, 16, 17, 100, 255, 256, group_max_len + 37, 3 * group_max_len]
+CPUInfer = cpuinfer_ext.CPUInfer(48)
+
+with torch.inference_mode(mode=True):
+    proj = torch.randn((output_size, input_size), dtype=torch.float16).contiguous()
+    # f16 weights take the f16 input as is, q8_0 weights requantize it
+    for proj_type, threshold in [(1, 0.001), (8, 0.01)]: # ggml_type::GGML_TYPE_F16, GGML_TYPE_Q8_0
+        config = cpuinfer_ext.linear.LinearConfig(input_size, output_size, stride, group_max_len, proj.data_ptr(), proj_type, hidden_type)
+        linear = cpuinfer_ext.linear.Linear(config)
+
+        for qlen in qlens:
+            input = (torch.randn((qlen, input_size), dtype=torch.float16) / 100).contiguous()
+            output = torch.empty((qlen, output_size), dtype=torch.float16).contiguous()
+            CPUInfer.submit(
+                linear.forward(
+                    qlen,
+                    input.data_ptr(),
+                    output.data_ptr()
+                )
+            )
+            CPUInfer.sync()
+
+            t_output = torch.mm(input.float(), proj.float().t())
+            diff = torch.mean(torch.abs(output.float() - t_output)) / torch.mean(torch.abs(t_output))
+            print('proj_type', proj_type, 'qlen', qlen, 'diff = ', diff)
+            assert(diff < threshold)
+            # every row is written, one tile left out would leave garbage
+            row_diff = torch.mean(torch.abs(output.float() - t_output), dim=1) / torch.mean(torch.abs(t_output))
+            assert(torch.all(row_diff < 10 * threshold))
@@ -0,0 +1,97 @@
+#!/usr/bin/env python
+# coding=utf-8
+'''
+Description  : Linear with FP8 E4M3 block-scaled weights and GPTQ/AWQ INT4
+               group-quantized weights against the dequantized weights.
+Version      : 1.0.0
+Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+'''
+import os, sys
+import time
+sys.path.append(os.path.dirname(__file__) + '/../build')
+import cpuinfer_ext
+import torch
+
+input_size = 2048
+output_size = 1024
+stride = 64
+group_max_len = 1024
+# the second 100 runs on the bf16 blocks the first one packed on AMX cpus
+qlens = [1, 30, 100, 100]
+CPUInfer = cpuinfer_ext.CPUInfer(48)
+
+def fp8_weight(n, k):
+    # e4m3 [n, k] with a weight_scale_inv per 128x128 block
+    w = torch.randn((n, k), dtype=torch.float32)
+    blocks = w.view(n // 128, 128, k // 128, 128)
+    scale_inv = blocks.abs().amax(dim=(1, 3)) / 448
+    scale = scale_inv.repeat_interleave(128, dim=0).repeat_interleave(128, dim=1)
+    q = (w / scale).to(torch.float8_e4m3fn)
+    return q.view(torch.uint8).contiguous(), scale_inv.contiguous(), q.float() * scale
+
+def to_int32(words):
+    words = words & 0xffffffff
+    return torch.where(words >= 2 ** 31, words - 2 ** 32, words).to(torch.int32).contiguous()
+
+def pack_int4(x, shifts):
+    # x [..., 8] nibbles, shifts of each in the word
+    words = torch.zeros(x.shape[:-1], dtype=torch.int64)
+    for j in range(8):
+        words |= x[..., j].to(torch.int64) << shifts[j]
+    return to_int32(words)
+
+gptq_shifts = [0, 4, 8, 12, 16, 20, 24, 28]
+awq_shifts = [0, 16, 4, 20, 8, 24, 12, 28] # of column n % 8
+
+def int4_weight(n, k, group_size, proj_type):
+    q = torch.randint(0, 16, (n, k))
+    zero = torch.randint(1, 16, (n, k // group_size))
+    scales = (torch.rand((k // group_size, n)) * 0.01 + 0.005).to(torch.float16).contiguous()
+    if proj_type == cpuinfer_ext.GGML_TYPE_GPTQ_INT4:
+        # qweight [k / 8, n], 8 consecutive k per word, zeros stored as zero - 1
+        qweight = pack_int4(q.t().reshape(k // 8, 8, n).permute(0, 2, 1), gptq_shifts)
+        qzeros = pack_int4((zero - 1).t().reshape(k // group_size, n // 8, 8), gptq_shifts)
+    else:
+        # qweight [k, n / 8]
+        qweight = pack_int4(q.t().reshape(k, n // 8, 8), awq_shifts)
+        qzeros = pack_int4(zero.t().reshape(k // group_size, n // 8, 8), awq_shifts)
+    w = scales.t().float().repeat_interleave(group_size, dim=1) * (q - zero.repeat_interleave(group_size, dim=1)).float()
+    return qweight, qzeros, scales, w
+
+def check(linear, w, hidden_dtype, threshold, name):
+    for qlen in qlens:
+        input = (torch.randn((qlen, input_size), dtype=torch.float32) / 10).to(hidden_dtype).contiguous()
+        output = torch.empty((qlen, output_size), dtype=hidden_dtype).contiguous()
+        CPUInfer.submit(
+            linear.forward(
+                qlen,
+                input.data_ptr(),
+                output.data_ptr()
+            )
+        )
+        CPUInfer.sync()
+
+        t_output = torch.mm(input.float(), w.t())
+        diff = torch.mean(torch.abs(output.float() - t_output)) / torch.mean(torch.abs(t_output))
+        print(name, 'qlen', qlen, 'diff = ', diff)
+        assert(diff < threshold)
+
+with torch.inference_mode(mode=True):
+    # fp8 takes bf16 activations
+    proj, scale_inv, w = fp8_weight(output_size, input_size)
+    config = cpuinfer_ext.linear.LinearConfig(input_size, output_size, stride, group_max_len, proj.data_ptr(), cpuinfer_ext.GGML_TYPE_FP8_E4M3, 30, scale_inv.data_ptr())
+    try:
+        linear = cpuinfer_ext.linear.Linear(config)
+    except ValueError as e:
+        # the packed weight types are only kept in the per-node copies
+        print(e)
+        sys.exit(0)
+    check(linear, w, torch.bfloat16, 0.01, 'fp8')
+
+    # the activations are quantized to q8_1 for the int4 weights
+    for proj_type, name in [(cpuinfer_ext.GGML_TYPE_GPTQ_INT4, 'gptq'), (cpuinfer_ext.GGML_TYPE_AWQ_INT4, 'awq')]:
+        for group_size in [128, 256, input_size]:
+            qweight, qzeros, scales, w = int4_weight(output_size, input_size, group_size, proj_type)
+            config = cpuinfer_ext.linear.LinearConfig(input_size, output_size, stride, group_max_len, qweight.data_ptr(), proj_type, 1, scales.data_ptr(), qzeros.data_ptr(), group_size)
+            linear = cpuinfer_ext.linear.Linear(config)
+            check(linear, w, torch.float16, 0.02, name + ' group_size ' + str(group_size))
@@ -17,6 +17,7 @@
 #include "operators/llamafile/linear.h"
 #include "operators/llamafile/mlp.h"
 #include "operators/llamafile/moe.h"
+#include "operators/llamafile/amx_moe.h"
 
 #include "pybind11/functional.h"
 #include "pybind11/operators.h"
@@ -321,6 +322,145 @@ class KVCacheBindings {
         }
     };
 
+    class AttnPrefillBindings {
+      public:
+        struct Args {
+            CPUInfer *cpuinfer;
+            KVCache *kv_cache;
+            const ggml_fp16_t *q_in;
+            const ggml_fp16_t *k_in;
+            const ggml_fp16_t *v_in;
+            ggml_fp16_t *output;
+            float *attn_lse;
+            int layer_idx;
+            int q_len;
+            int batch_size;
+            int max_block_num;
+            int *block_table;
+            int *cache_seqlens;
+        };
+        static void inner(void *args) {
+            Args *args_ = (Args *)args;
+            args_->cpuinfer->enqueue(
+                &KVCache::attn_prefill, args_->kv_cache, args_->q_in,
+                args_->k_in, args_->v_in, args_->output, args_->attn_lse,
+                args_->layer_idx, args_->q_len, args_->batch_size,
+                args_->max_block_num, args_->block_table, args_->cache_seqlens);
+        }
+        static std::pair<intptr_t, intptr_t>
+        cpuinfer_interface(KVCache &kv_cache, intptr_t q_in, intptr_t k_in,
+                           intptr_t v_in, intptr_t output, intptr_t attn_lse,
+                           int layer_idx, int q_len, int batch_size,
+                           int max_block_num, intptr_t block_table,
+                           intptr_t cache_seqlens) {
+            Args *args = new Args{nullptr,
+                                  &kv_cache,
+                                  (const ggml_fp16_t *)q_in,
+                                  (const ggml_fp16_t *)k_in,
+                                  (const ggml_fp16_t *)v_in,
+                                  (ggml_fp16_t *)output,
+                                  (float *)attn_lse,
+                                  layer_idx,
+                                  q_len,
+                                  batch_size,
+                                  max_block_num,
+                                  (int *)block_table,
+                                  (int *)cache_seqlens};
+            return std::make_pair((intptr_t)&inner, (intptr_t)args);
+        }
+    };
+
+    class AttnMLABindings {
+      public:
+        struct Args {
+            CPUInfer *cpuinfer;
+            KVCache *kv_cache;
+            const ggml_fp16_t *q_in;
+            const ggml_fp16_t *kv_in;
+            ggml_fp16_t *output;
+            float *attn_lse;
+            float softmax_scale;
+            int layer_idx;
+            int q_len;
+            int batch_size;
+            int max_block_num;
+            int *block_table;
+            int *cache_seqlens;
+        };
+        static void inner(void *args) {
+            Args *args_ = (Args *)args;
+            args_->cpuinfer->enqueue(
+                &KVCache::attn_mla, args_->kv_cache, args_->q_in,
+                args_->kv_in, args_->output, args_->attn_lse,
+                args_->softmax_scale, args_->layer_idx, args_->q_len,
+                args_->batch_size, args_->max_block_num, args_->block_table,
+                args_->cache_seqlens);
+        }
+        static std::pair<intptr_t, intptr_t>
+        cpuinfer_interface(KVCache &kv_cache, intptr_t q_in, intptr_t kv_in,
+                           intptr_t output, intptr_t attn_lse,
+                           float softmax_scale, int layer_idx, int q_len,
+                           int batch_size, int max_block_num,
+                           intptr_t block_table, intptr_t cache_seqlens) {
+            Args *args = new Args{nullptr,
+                                  &kv_cache,
+                                  (const ggml_fp16_t *)q_in,
+                                  (const ggml_fp16_t *)kv_in,
+                                  (ggml_fp16_t *)output,
+                                  (float *)attn_lse,
+                                  softmax_scale,
+                                  layer_idx,
+                                  q_len,
+                                  batch_size,
+                                  max_block_num,
+                                  (int *)block_table,
+                                  (int *)cache_seqlens};
+            return std::make_pair((intptr_t)&inner, (intptr_t)args);
+        }
+    };
+
+    class EvictWindowBindings {
+      public:
+        struct Args {
+            CPUInfer *cpuinfer;
+            KVCache *kv_cache;
+            int *block_table;
+            int *cache_seqlens;
+            int batch_size;
+            int max_block_num;
+            int sink_block_num;
+            int window_block_num;
+            int *spill_table;
+            int spill_block_num;
+        };
+        static void inner(void *args) {
+            Args *args_ = (Args *)args;
+            args_->cpuinfer->enqueue(
+                &KVCache::evict_window, args_->kv_cache, args_->block_table,
+                args_->cache_seqlens, args_->batch_size, args_->max_block_num,
+                args_->sink_block_num, args_->window_block_num,
+                args_->spill_table, args_->spill_block_num);
+        }
+        static std::pair<intptr_t, intptr_t>
+        cpuinfer_interface(KVCache &kv_cache, intptr_t block_table,
+                           intptr_t cache_seqlens, int batch_size,
+                           int max_block_num, int sink_block_num,
+                           int window_block_num, intptr_t spill_table,
+                           int spill_block_num) {
+            Args *args = new Args{nullptr,
+                                  &kv_cache,
+                                  (int *)block_table,
+                                  (int *)cache_seqlens,
+                                  batch_size,
+                                  max_block_num,
+                                  sink_block_num,
+                                  window_block_num,
+                                  (int *)spill_table,
+                                  spill_block_num};
+            return std::make_pair((intptr_t)&inner, (intptr_t)args);
+        }
+    };
+
     class ClearImportanceAllLayersBindings {
       public:
         struct Args {
@@ -564,6 +704,75 @@ class MOEBindings {
     };
 };
 
+template <class T>
+class AMX_MOEBindings {
+  public:
+    class WarmUpBindings {
+      public:
+        struct Args {
+            CPUInfer *cpuinfer;
+            T *moe;
+        };
+        static void inner(void *args) {
+            Args *args_ = (Args *)args;
+            args_->cpuinfer->enqueue(&T::warm_up, args_->moe);
+        }
+        static std::pair<intptr_t, intptr_t> cpuinfer_interface(T &moe) {
+            Args *args = new Args{nullptr, &moe};
+            return std::make_pair((intptr_t)&inner, (intptr_t)args);
+        }
+    };
+    class LoadWeightsBindings {
+      public:
+        struct Args {
+            CPUInfer *cpuinfer;
+            T *moe;
+        };
+        static void inner(void *args) {
+            Args *args_ = (Args *)args;
+            args_->cpuinfer->enqueue(&T::load_weights, args_->moe);
+        }
+        static std::pair<intptr_t, intptr_t> cpuinfer_interface(T &moe) {
+            Args *args = new Args{nullptr, &moe};
+            return std::make_pair((intptr_t)&inner, (intptr_t)args);
+        }
+    };
+    class ForwardBindings {
+      public:
+        struct Args {
+            CPUInfer *cpuinfer;
+            T *moe;
+            int qlen;
+            int k;
+            const uint64_t *expert_ids;
+            const float *weights;
+            const void *input;
+            void *output;
+            int *batch_size_tensor;
+        };
+        static void inner(void *args) {
+            Args *args_ = (Args *)args;
+            args_->cpuinfer->enqueue(
+                &T::forward, args_->moe, args_->qlen, args_->k,
+                args_->expert_ids, args_->weights, args_->input, args_->output, args_->batch_size_tensor);
+        }
+        static std::pair<intptr_t, intptr_t>
+        cpuinfer_interface(T &moe, int qlen, int k, intptr_t expert_ids,
+                           intptr_t weights, intptr_t input, intptr_t output, intptr_t batch_size_tensor) {
+            Args *args = new Args{nullptr,
+                                  &moe,
+                                  qlen,
+                                  k,
+                                  (const uint64_t *)expert_ids,
+                                  (const float *)weights,
+                                  (const void *)input,
+                                  (void *)output,
+                                  (int *)batch_size_tensor};
+            return std::make_pair((intptr_t)&inner, (intptr_t)args);
+        }
+    };
+};
+
  
 
 PYBIND11_MODULE(cpuinfer_ext, m) {
@@ -574,6 +783,13 @@ PYBIND11_MODULE(cpuinfer_ext, m) {
         .def("sync", &CPUInfer::sync)
         .def("sync_with_cuda_stream", &CPUInfer::sync_with_cuda_stream);
 
+    // weight type id of fp8 e4m3 projections with 128x128 block scales, see fp8_gemm.h
+    m.attr("GGML_TYPE_FP8_E4M3") = (int)GGML_TYPE_FP8_E4M3;
+    // weight type ids of gptq/awq int4 projections with group-wise scales and
+    // zero points, see int4_gemm.h
+    m.attr("GGML_TYPE_GPTQ_INT4") = (int)GGML_TYPE_GPTQ_INT4;
+    m.attr("GGML_TYPE_AWQ_INT4") = (int)GGML_TYPE_AWQ_INT4;
+
     auto linear_module = m.def_submodule("linear");
     py::class_<LinearConfig>(linear_module, "LinearConfig")
         .def(py::init([](int hidden_size, int intermediate_size, int stride,
@@ -582,6 +798,27 @@ PYBIND11_MODULE(cpuinfer_ext, m) {
             return LinearConfig(hidden_size, intermediate_size, stride,
                                 group_max_len, (void *)proj,
                                 (ggml_type)proj_type, (ggml_type)hidden_type);
+        }))
+        .def(py::init([](int hidden_size, int intermediate_size, int stride,
+                         int group_max_len, intptr_t proj, int proj_type,
+                         int hidden_type, intptr_t proj_scale) {
+            LinearConfig config(hidden_size, intermediate_size, stride,
+                                group_max_len, (void *)proj,
+                                (ggml_type)proj_type, (ggml_type)hidden_type);
+            config.proj_scale = (void *)proj_scale;
+            return config;
+        }))
+        .def(py::init([](int hidden_size, int intermediate_size, int stride,
+                         int group_max_len, intptr_t proj, int proj_type,
+                         int hidden_type, intptr_t proj_scale,
+                         intptr_t proj_zeros, int group_size) {
+            LinearConfig config(hidden_size, intermediate_size, stride,
+                                group_max_len, (void *)proj,
+                                (ggml_type)proj_type, (ggml_type)hidden_type);
+            config.proj_scale = (void *)proj_scale;
+            config.proj_zeros = (void *)proj_zeros;
+            config.group_size = group_size;
+            return config;
         }));
     py::class_<Linear>(linear_module, "Linear")
         .def(py::init<LinearConfig>())
@@ -599,7 +836,46 @@ PYBIND11_MODULE(cpuinfer_ext, m) {
                              (void *)down_proj, (ggml_type)gate_type,
                              (ggml_type)up_type, (ggml_type)down_type,
                              (ggml_type)hidden_type);
-        }));
+        }))
+        .def(py::init([](int hidden_size, int intermediate_size, int stride,
+                         int group_max_len, intptr_t gate_proj,
+                         intptr_t up_proj, intptr_t down_proj, int gate_type,
+                         int up_type, int down_type, int hidden_type,
+                         intptr_t gate_scale, intptr_t up_scale,
+                         intptr_t down_scale) {
+            MLPConfig config(hidden_size, intermediate_size, stride,
+                             group_max_len, (void *)gate_proj, (void *)up_proj,
+                             (void *)down_proj, (ggml_type)gate_type,
+                             (ggml_type)up_type, (ggml_type)down_type,
+                             (ggml_type)hidden_type);
+            config.gate_scale = (void *)gate_scale;
+            config.up_scale = (void *)up_scale;
+            config.down_scale = (void *)down_scale;
+            return config;
+        }))
+        .def(py::init([](int hidden_size, int intermediate_size, int stride,
+                         int group_max_len, intptr_t gate_proj,
+                         intptr_t up_proj, intptr_t down_proj, int gate_type,
+                         int up_type, int down_type, int hidden_type,
+                         intptr_t gate_scale, intptr_t up_scale,
+                         intptr_t down_scale, intptr_t gate_zeros,
+                         intptr_t up_zeros, intptr_t down_zeros,
+                         int group_size) {
+            MLPConfig config(hidden_size, intermediate_size, stride,
+                             group_max_len, (void *)gate_proj, (void *)up_proj,
+                             (void *)down_proj, (ggml_type)gate_type,
+                             (ggml_type)up_type, (ggml_type)down_type,
+                             (ggml_type)hidden_type);
+            config.gate_scale = (void *)gate_scale;
+            config.up_scale = (void *)up_scale;
+            config.down_scale = (void *)down_scale;
+            config.gate_zeros = (void *)gate_zeros;
+            config.up_zeros = (void *)up_zeros;
+            config.down_zeros = (void *)down_zeros;
+            config.group_size = group_size;
+            return config;
+        }))
+        .def_readwrite("fuse_gate_up", &MLPConfig::fuse_gate_up);
     py::class_<MLP>(mlp_module, "MLP")
         .def(py::init<MLPConfig>())
         .def("warm_up", &MLPBindings::WarmUpBindinds::cpuinfer_interface)
@@ -618,12 +894,49 @@ PYBIND11_MODULE(cpuinfer_ext, m) {
                              (void *)down_proj, (ggml_type)gate_type,
                              (ggml_type)up_type, (ggml_type)down_type,
                              (ggml_type)hidden_type);
-        }));
+        }))
+        .def(py::init([](int expert_num, int routed_expert_num, int hidden_size,
+                         int intermediate_size, int stride, int group_min_len,
+                         int group_max_len, intptr_t gate_proj,
+                         intptr_t up_proj, intptr_t down_proj, int gate_type,
+                         int up_type, int down_type, int hidden_type,
+                         intptr_t gate_scale, intptr_t up_scale,
+                         intptr_t down_scale) {
+            MOEConfig config(expert_num, routed_expert_num, hidden_size,
+                             intermediate_size, stride, group_min_len,
+                             group_max_len, (void *)gate_proj, (void *)up_proj,
+                             (void *)down_proj, (ggml_type)gate_type,
+                             (ggml_type)up_type, (ggml_type)down_type,
+                             (ggml_type)hidden_type);
+            config.gate_scale = (void *)gate_scale;
+            config.up_scale = (void *)up_scale;
+            config.down_scale = (void *)down_scale;
+            return config;
+        }))
+        .def_readwrite("fuse_gate_up", &MOEConfig::fuse_gate_up);
     py::class_<MOE>(moe_module, "MOE")
         .def(py::init<MOEConfig>())
         .def("warm_up", &MOEBindings::WarmUpBindinds::cpuinfer_interface)
         .def("forward", &MOEBindings::ForwardBindings::cpuinfer_interface);
 
+    py::class_<AMX_MOEConfig>(moe_module, "AMX_MOEConfig")
+        .def(py::init([](int expert_num, int routed_expert_num, int hidden_size,
+                         int intermediate_size, int max_len, intptr_t gate_proj,
+                         intptr_t up_proj, intptr_t down_proj) {
+            return AMX_MOEConfig(expert_num, routed_expert_num, hidden_size,
+                                 intermediate_size, max_len, (void *)gate_proj,
+                                 (void *)up_proj, (void *)down_proj);
+        }));
+    py::class_<AMXBF16_MOE>(moe_module, "AMXBF16_MOE")
+        .def(py::init<AMX_MOEConfig>())
+        .def("warm_up", &AMX_MOEBindings<AMXBF16_MOE>::WarmUpBindings::cpuinfer_interface)
+        .def("load_weights", &AMX_MOEBindings<AMXBF16_MOE>::LoadWeightsBindings::cpuinfer_interface)
+        .def("forward", &AMX_MOEBindings<AMXBF16_MOE>::ForwardBindings::cpuinfer_interface);
+    py::class_<AMXInt8_MOE>(moe_module, "AMXInt8_MOE")
+        .def(py::init<AMX_MOEConfig>())
+        .def("warm_up", &AMX_MOEBindings<AMXInt8_MOE>::WarmUpBindings::cpuinfer_interface)
+        .def("load_weights", &AMX_MOEBindings<AMXInt8_MOE>::LoadWeightsBindings::cpuinfer_interface)
+        .def("forward", &AMX_MOEBindings<AMXInt8_MOE>::ForwardBindings::cpuinfer_interface);
  
 
     auto kvcache_module = m.def_submodule("kvcache");
@@ -638,7 +951,8 @@ PYBIND11_MODULE(cpuinfer_ext, m) {
         .value("FP16", ggml_type::GGML_TYPE_F16)
         .value("FP32", ggml_type::GGML_TYPE_F32)
         .value("Q4_0", ggml_type::GGML_TYPE_Q4_0)
-        .value("Q8_0", ggml_type::GGML_TYPE_Q8_0);
+        .value("Q8_0", ggml_type::GGML_TYPE_Q8_0)
+        .value("FP8_E4M3", GGML_TYPE_FP8_E4M3);
     py::enum_<RetrievalType>(kvcache_module, "RetrievalType")
         .value("LAYER", RetrievalType::LAYER)
         .value("KVHEAD", RetrievalType::KVHEAD)
@@ -647,6 +961,8 @@ PYBIND11_MODULE(cpuinfer_ext, m) {
     py::class_<KVCacheConfig>(kvcache_module, "KVCacheConfig")
         .def(py::init<int, int, int, int, int, int, AnchorType, ggml_type,
                       RetrievalType, int, int, int, int, int, int>())
+        .def(py::init<int, int, int, int, int, int, AnchorType, ggml_type,
+                      RetrievalType, int, int, int, int, int, int, int>())
         .def_readwrite("layer_num", &KVCacheConfig::layer_num)
         .def_readwrite("kv_head_num", &KVCacheConfig::kv_head_num)
         .def_readwrite("q_head_num", &KVCacheConfig::q_head_num)
@@ -661,7 +977,8 @@ PYBIND11_MODULE(cpuinfer_ext, m) {
         .def_readwrite("layer_offset", &KVCacheConfig::layer_offset)
         .def_readwrite("max_block_num", &KVCacheConfig::max_block_num)
         .def_readwrite("max_batch_size", &KVCacheConfig::max_batch_size)
-        .def_readwrite("max_thread_num", &KVCacheConfig::max_thread_num);
+        .def_readwrite("max_thread_num", &KVCacheConfig::max_thread_num)
+        .def_readwrite("kv_lora_rank", &KVCacheConfig::kv_lora_rank);
     py::class_<KVCache>(kvcache_module, "KVCache")
         .def(py::init<KVCacheConfig>())
         .def("get_cache_total_len", &KVCache::get_cache_total_len)
@@ -669,6 +986,21 @@ PYBIND11_MODULE(cpuinfer_ext, m) {
              [](KVCache &kvcache, int cache_total_len) {
                  kvcache.update_cache_total_len(cache_total_len);
              })
+        .def("alloc_block", &KVCache::alloc_block)
+        .def("fork_block_table",
+             [](KVCache &kvcache, intptr_t src_table, intptr_t dst_table,
+                int block_num) {
+                 kvcache.fork_block_table((const int *)src_table,
+                                          (int *)dst_table, block_num);
+             })
+        .def("free_block_table",
+             [](KVCache &kvcache, intptr_t block_table, int block_num) {
+                 kvcache.free_block_table((const int *)block_table,
+                                          block_num);
+             })
+        .def("get_block_ref", &KVCache::get_block_ref)
+        .def("evict_window",
+             &KVCacheBindings::EvictWindowBindings::cpuinfer_interface)
         .def("attn", &KVCacheBindings::AttnBindings::cpuinfer_interface)
         .def(
             "get_all_kvcache_one_layer",
@@ -684,9 +1016,20 @@ PYBIND11_MODULE(cpuinfer_ext, m) {
              &KVCacheBindings::UpdateImportanceBindings::cpuinfer_interface)
         .def("attn_with_kvcache",
              &KVCacheBindings::AttnWithKVCacheBindings::cpuinfer_interface)
+        .def("attn_prefill",
+             &KVCacheBindings::AttnPrefillBindings::cpuinfer_interface)
+        .def("attn_mla", &KVCacheBindings::AttnMLABindings::cpuinfer_interface)
         .def("clear_importance_all_layers",
              &KVCacheBindings::ClearImportanceAllLayersBindings::
                  cpuinfer_interface)
         .def("calc_anchor_all_layers",
-             &KVCacheBindings::CalcAnchorAllLayersBindinds::cpuinfer_interface);
+             &KVCacheBindings::CalcAnchorAllLayersBindinds::cpuinfer_interface)
+        .def("load_kvcache",
+             &KVCacheBindings::LoadKVCacheBindings::cpuinfer_interface)
+        .def("dump_kvcache",
+             &KVCacheBindings::DumpKVCacheBindings::cpuinfer_interface)
+        .def("get_sincos", [](KVCache &kvcache, intptr_t sin, intptr_t cos,
+                              int seqlen) {
+            kvcache.get_sincos((ggml_fp16_t *)sin, (ggml_fp16_t *)cos, seqlen);
+        });
 }
\ No newline at end of file
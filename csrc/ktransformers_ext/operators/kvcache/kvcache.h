@@ -32,6 +32,8 @@
 
 #include "../../cpu_backend/backend.h"
 #include "../../cpu_backend/backend_numa.h"
+#include "../llamafile/fp8_gemm.h"
+#include "kvcache_arena.h"
 #include "llama.cpp/ggml-common.h"
 #include "llama.cpp/ggml-impl.h"
 #include "llama.cpp/ggml-quants.h"
@@ -128,7 +130,8 @@ struct KVCacheConfig {
     int block_len;   /**< Length of each block in the cache. */
     int anchor_num;  /**< Number of anchors used in attention. */
 
-    ggml_type kv_type; /**< Data type of the KV Cache (e.g., fp16, q8_0). */
+    ggml_type kv_type; /**< Data type of the KV Cache: fp16, q4_0, q8_0 or
+                          fp8_e4m3 (GGML_TYPE_FP8_E4M3). */
 
     // Controls the pre-allocated memory size
     int max_block_num;  /**< Maximum number of blocks that can be allocated. */
@@ -144,6 +147,11 @@ struct KVCacheConfig {
     int token_step;   /**< Step size between tokens. */
     int layer_offset; /**< Offset value for layers. */
 
+    int kv_lora_rank; /**< MLA when > 0: the cache holds one latent row of
+                         head_dim = kv_lora_rank + rope dim per token
+                         (kv_head_num is 1), whose first kv_lora_rank dims are
+                         also the value. */
+
     /**
      * @brief Default constructor for KVCacheConfig.
      *
@@ -173,12 +181,15 @@ struct KVCacheConfig {
      * @param max_block_num The maximum number of blocks that can be allocated.
      * @param max_batch_size The maximum batch size that can be processed.
      * @param max_thread_num The maximum number of threads that can be used.
+     * @param kv_lora_rank The latent rank of an MLA cache, 0 for classic
+     * per-head K/V.
      */
     KVCacheConfig(int layer_num, int kv_head_num, int q_head_num, int head_dim,
                   int block_len, int anchor_num, AnchorType anchor_type,
                   ggml_type kv_type, RetrievalType retrieval_type,
                   int layer_step, int token_step, int layer_offset,
-                  int max_block_num, int max_batch_size, int max_thread_num);
+                  int max_block_num, int max_batch_size, int max_thread_num,
+                  int kv_lora_rank = 0);
 };
 
 /**
@@ -319,6 +330,62 @@ class KVCache {
     void update_cache_total_len(int cache_total_len) {
         cache_total_len_ = cache_total_len;
     }
+
+    /**
+     * @brief Takes a free block out of the pool with one reference.
+     *
+     * Blocks shared through fork_block_table must all come from here. Block
+     * tables that index the cache directly (reference count 0) keep working,
+     * but must not mix with the pool.
+     */
+    int alloc_block();
+
+    /**
+     * @brief Makes `dst_table` share the first `block_num` blocks of
+     * `src_table`, e.g. for parallel samples or a common system prompt.
+     *
+     * Every write of K/V through a block table (update_kvcache_fp16,
+     * attn_with_kvcache, attn_prefill, attn_mla) first copies a shared block
+     * it is about to append to and points the table at the copy, so the
+     * fully shared prefix blocks are stored once.
+     */
+    void fork_block_table(const int *src_table, int *dst_table,
+                          int block_num);
+
+    /**
+     * @brief Drops one reference of the first `block_num` blocks of a table,
+     * blocks no longer referenced go back to the pool.
+     */
+    void free_block_table(const int *block_table, int block_num);
+
+    int get_block_ref(int block_idx);
+
+    /**
+     * @brief Sliding window with attention sinks: keeps the first
+     * `sink_block_num` blocks and the last `window_block_num` blocks (the
+     * partial tail included) of every sequence and evicts the blocks between
+     * them, so memory and per-token attention cost stay constant.
+     *
+     * The kept window moves down to follow the sinks in the block table and
+     * cache_seqlens shrinks by the evicted tokens. K is cached after RoPE, so
+     * the window keys are rotated back by the evicted length with the tables
+     * of get_sincos, which must cover it; new tokens then take their rotary
+     * position from cache_seqlens. Evicted blocks are recycled in place as the
+     * next tail blocks, except shared ones and the `spill_block_num` of
+     * highest importance, which are written to `spill_table` and replaced by
+     * pool blocks from alloc_block. A spilled block keeps its K/V, importance
+     * and anchors, e.g. for a retrieval table or dump_kvcache. The anchors of
+     * the rotated window blocks are recomputed with calc_anchor_all_layers.
+     *
+     * @param block_table [batch_size, max_block_num], updated in place
+     * @param cache_seqlens [batch_size], updated in place
+     * @param spill_table [batch_size, spill_block_num], -1 past the spilled
+     * blocks, may be nullptr if `spill_block_num` is 0
+     */
+    void evict_window(int *block_table, int *cache_seqlens, int batch_size,
+                      int max_block_num, int sink_block_num,
+                      int window_block_num, int *spill_table,
+                      int spill_block_num, Backend *backend);
     void attn(const ggml_fp16_t *q_in, ggml_fp16_t *output, float *attn_lse,
               int layer_idx, int generate_token_idx, int q_len, int batch_size,
               int max_block_num, int *block_table, int *cache_seqlens,
@@ -380,6 +447,49 @@ class KVCache {
                            int *cache_seqlens, int topk, int local,
                            Backend *backend);
 
+    /**
+     * @brief Causal attention of a prompt chunk against the cached prefix and
+     * itself.
+     *
+     * The K/V of the chunk are first written into the blocks of block_table
+     * after the cache_seqlens tokens already cached, then every token attends
+     * to all positions up to its own. Queries are tiled so that each block of
+     * K/V is multiplied with the q heads of many tokens at once.
+     *
+     * @param q_in [batch_size, q_len, q_head_num, head_dim]
+     * @param k_in,v_in [batch_size, q_len, kv_head_num, head_dim]
+     * @param output [batch_size, q_len, q_head_num, head_dim]
+     * @param attn_lse [batch_size, q_len, q_head_num]
+     * @param cache_seqlens Tokens cached before the chunk, [batch_size]; the
+     * caller advances them by q_len afterwards.
+     */
+    void attn_prefill(const ggml_fp16_t *q_in, const ggml_fp16_t *k_in,
+                      const ggml_fp16_t *v_in, ggml_fp16_t *output,
+                      float *attn_lse, int layer_idx, int q_len,
+                      int batch_size, int max_block_num, int *block_table,
+                      int *cache_seqlens, Backend *backend);
+
+    /**
+     * @brief Decode attention of MLA over the compressed latent cache.
+     *
+     * The caller absorbs W_UK into the query (q_nope * W_UK, then q_pe) and
+     * W_UV into the output projection, so every q head attends directly to
+     * the cached latent rows and no per-head K/V is ever expanded. The new
+     * latent rows are first written after the cache_seqlens cached tokens;
+     * token t of the chunk sees positions up to cache_seqlens + t. Blocks are
+     * split over the threads like the decode of attn_with_kvcache.
+     *
+     * @param q_in [batch_size, q_len, q_head_num, head_dim]
+     * @param kv_in [batch_size, q_len, head_dim], the compressed kv followed
+     * by k_pe, nullptr if already cached
+     * @param output [batch_size, q_len, q_head_num, kv_lora_rank]
+     * @param attn_lse [batch_size, q_len, q_head_num]
+     */
+    void attn_mla(const ggml_fp16_t *q_in, const ggml_fp16_t *kv_in,
+                  ggml_fp16_t *output, float *attn_lse, float softmax_scale,
+                  int layer_idx, int q_len, int batch_size, int max_block_num,
+                  int *block_table, int *cache_seqlens, Backend *backend);
+
     void clear_importance_all_layers(int *block_table, int *cache_seqlens,
                                      int batch_size, int max_block_num,
                                      Backend *backend);
@@ -406,34 +516,31 @@ class KVCache {
     int n_gqa_;                            // q_head_num / kv_head_num
     int cache_total_len_;                  // Number of tokens in cache
     std::vector<uint64_t> past_block_num_; // [layer_num]
-    std::vector<std::vector<std::vector<std::vector<block_q4_0>>>>
-        k_cache_q4; // [layer_num, kv_head_num, past_block_num, block_len *
-                    // (head_dim / QK_4)]
-    std::vector<std::vector<std::vector<std::vector<block_q4_0>>>>
-        v_cache_q4; // [layer_num, kv_head_num, past_block_num, head_dim *
-                    // (block_len / QK_4)]
-    std::vector<std::vector<std::vector<std::vector<block_q8_0>>>>
-        k_cache_q8; // [layer_num, kv_head_num, past_block_num, block_len *
-                    // (head_dim / QK_8)]
-    std::vector<std::vector<std::vector<std::vector<block_q8_0>>>>
-        v_cache_q8; // [layer_num, kv_head_num, past_block_num, head_dim *
-                    // (block_len / QK_8)]
-
-    std::vector<std::vector<std::vector<std::vector<ggml_fp16_t>>>>
-        k_cache_fp16_; // [layer_num, kv_head_num, past_block_num, block_len *
-                       // head_dim]
-    std::vector<std::vector<std::vector<std::vector<ggml_fp16_t>>>>
-        v_cache_fp16_; // [layer_num, kv_head_num, past_block_num, head_dim *
-                       // block_len]
-
-    std::vector<std::vector<std::vector<std::vector<ggml_fp16_t>>>>
-        importance_; // [layer_num, past_block_num, block_len,
-                     // attention_head_num]
+    std::vector<int> block_ref_;   // [max_block_num], block tables using it
+    std::vector<int> free_blocks_; // unreferenced blocks, lowest index last
+    // Guards block_ref_ and free_blocks_, the bindings of alloc_block and
+    // friends run on the python thread while CPUInfer writes
+    std::mutex block_ref_mutex_;
+    // Blocks of kv_type, per layer on the NUMA node that runs the head in
+    // attention_kvhead_/attention_layer_, see head_node_
+    KVCacheArena k_cache_; // [layer_num, kv_head_num, past_block_num,
+                           // block_len * head_dim (/ QK4_0 or QK8_0 blocks if
+                           // quantized)]
+    KVCacheArena v_cache_; // [layer_num, kv_head_num, past_block_num,
+                           // head_dim * block_len (/ QK4_0 or QK8_0 blocks if
+                           // quantized)]
+
+    KVCacheArena importance_; // [layer_num, 1, past_block_num, block_len *
+                              // attention_head_num] fp16
 
     std::vector<ggml_fp16_t>
         anchor_; // [layer_num * past_block_num * anchor_num *
                  // attention_head_num * head_dim]
 
+    // NUMA node of each kv head, the node whose threads handle the head in
+    // attention, -1 (interleaved) when there are fewer heads than nodes
+    std::vector<int> head_node_; // [kv_head_num]
+
     // Runtime data
     int64_t layer_id_;
     int64_t block_idx_;
@@ -444,6 +551,7 @@ class KVCache {
     // Rotary positional embeddings
     std::vector<std::vector<ggml_fp16_t>> sin_; // [seq_len, head_dim]
     std::vector<std::vector<ggml_fp16_t>> cos_; // [seq_len, head_dim]
+    int sincos_len_ = 0; // rows filled by get_sincos
 
     // update/get
     int seq_len_;
@@ -466,14 +574,14 @@ class KVCache {
         avg_q; // [batch_size, q_head_num * head_dim]
 
     std::vector<std::vector<ggml_fp16_t>>
-        avg_q_fp16; // [batch_size, q_head_num * head_dim]
-    std::vector<
-        std::priority_queue<std::pair<float, int>,
-                            std::vector<std::pair<float, int>>, std::greater<>>>
-        top_similar_block_;
+        avg_q_fp16; // [batch_size, anchor_num * q_head_num * head_dim], the
+                    // positive then negative part of avg_q for QUEST
+    std::vector<std::vector<int>>
+        top_block_id_; // [batch_size, max_block_num]
 
     std::vector<std::vector<float>> block_similar_;
-    std::vector<std::vector<std::vector<float>>> block_similar_kv_head_;
+    std::vector<std::vector<float>>
+        block_similar_kv_head_; // [batch_size, kv_head_num * max_block_num]
     std::vector<std::vector<std::vector<float>>> block_similar_q_head_;
 
     std::vector<int> cache_seqlens_;               // [batch_size]
@@ -512,12 +620,52 @@ class KVCache {
         q_q8_0_; // [batch_size, kv_head_num, n_gqa * head_dim / QK8_0]
     std::vector<std::vector<std::vector<float>>>
         q_fp32_; // [batch_size, kv_head_num, n_gqa * head_dim]
+    std::vector<std::vector<std::vector<ggml_bf16_t>>>
+        q_bf16_; // [batch_size, kv_head_num, n_gqa * head_dim], fp8 caches
 
     std::vector<std::vector<std::vector<float>>>
         output_fp32_; // [batch_size, kv_head_num, n_gqa * head_dim]
     std::vector<std::vector<std::vector<float>>>
         attn_lse_; // [batch_size, kv_head_num, n_gqa]
 
+    // partial results of attention_split_k_ and attn_mla
+    std::vector<float> split_output_fp32_; // [batch_size, kv_head_num,
+                                           // split_num, n_gqa * head_dim]
+    std::vector<float>
+        split_attn_lse_; // [batch_size, kv_head_num, split_num, n_gqa]
+    std::vector<float>
+        mla_q_fp32_; // [batch_size, q_len, q_head_num, head_dim]
+
+    // Chunks of the sequence handed out per thread by the split-K decode,
+    // more than one so that work stealing can even out the tail.
+    static constexpr int kSplitsPerThread = 4;
+
+    // Query tokens per attn_prefill task. All n_gqa q heads of a token share
+    // the K/V of their kv head, so a tile is one [kPrefillTile * n_gqa,
+    // head_dim] GEMM per block.
+    static constexpr int kPrefillTile = 32;
+
+    // Scratch of the attn_prefill and attn_mla tasks, one per thread so that
+    // no task allocates
+    struct TileScratch {
+        // attn_prefill, rows = kPrefillTile * n_gqa, sized by ThreadResize
+        std::vector<float> acc;                    // [rows, head_dim]
+        std::vector<float> acc_lse;                // [rows]
+        std::vector<float> attn_score;             // [rows, block_len]
+        std::vector<float> block_output;           // [rows, head_dim]
+        std::vector<block_q8_0> block_output_q8_0; // [rows * head_dim / QK8_0]
+        std::vector<float> block_lse;              // [rows]
+        std::vector<char> q_tile;                  // [rows, head_dim] fp16
+        std::vector<float> q_fp32;                 // [head_dim]
+        std::vector<char> draft;                   // see attn_prefill
+        // attn_mla, rows = q_len * q_head_num, grown by attn_mla
+        std::vector<float> latent;                 // [block_len, head_dim]
+        std::vector<float> row_max;                // [rows]
+        std::vector<float> row_sum;                // [rows]
+        std::vector<float> score;                  // [rows, block_len]
+    };
+    std::vector<TileScratch> thread_local_tile_; // [thread_num]
+
     std::vector<std::pair<int, int>> thread_cur_head_idx_; // [thread_num]
 
     std::vector<std::vector<block_q8_0>>
@@ -542,6 +690,15 @@ class KVCache {
     std::vector<float> q_fp32; // [n_gqa * head_dim]
 
     void quantize_q_(const uint16_t *q_in_data, int batch_size);
+
+    // Elements of a K row / V channel that are quantized together, 1 for
+    // fp16, QK4_0 / QK8_0 for q4_0 / q8_0 and QK_FP8 for fp8
+    int kv_group_size_() const;
+    // Converts `n` elements of a K row or V channel of a cache block from /
+    // to fp32, starting at element `offset`. `offset` and `n` are multiples
+    // of kv_group_size_().
+    void store_kv_(void *block, int offset, const float *x, int n) const;
+    void load_kv_(const void *block, int offset, float *y, int n) const;
     void attn_initialize_layer_(int batch_size, int layer_idx, int *block_table,
                                 int &max_block_num, int *cache_seqlens);
     void attn_initialize_kvhead_(int batch_size, int layer_idx,
@@ -569,6 +726,22 @@ class KVCache {
         int max_block_num, int *cache_seqlens, int init_block_num,
         int local_block_num, int pick_block_num, Backend *backend);
 
+    // Averages q over the tokens into avg_q (and avg_q_fp16)
+    void average_retrieval_q_(const uint16_t *q_in_data, int batch_size,
+                              int q_len);
+    // Whether the block similarity is a dot product of avg_q_fp16 and the
+    // anchors, true for a single anchor and for QUEST
+    bool similarity_is_gemm_() const;
+    // Similarity of the `n` blocks `block_idx` to the q heads [head_begin,
+    // head_begin + head_num) of a batch, sum over the dims of the max over
+    // the anchors of anchor * q
+    void block_similarity_(int layer_idx, int batch_id, int head_begin,
+                           int head_num, const int *block_idx, int n,
+                           float *similarity) const;
+    // Writes the `pick_block_num` most similar block ids of [begin, end) to
+    // `block_id` in ascending order
+    void pick_top_blocks_(const float *similarity, int begin, int end,
+                          int pick_block_num, int *block_id) const;
     void select_block_layer_(int batch_size, int layer_idx, int max_block_num,
                              int init_block_num, int local_block_num,
                              int pick_block_num);
@@ -589,6 +762,68 @@ class KVCache {
                            float *attn_lse, int batch_size, Backend *backend);
     void attention_layer_(const uint16_t *q_in_data, ggml_fp16_t *output,
                           float *attn_lse, int batch_size, Backend *backend);
+    // Reads the dumps that predate the versioned format of dump_kvcache
+    void load_kvcache_unversioned_(std::ifstream &ifs_tensor);
+
+    // Decode attention of one layer split over the sequence (split-K),
+    // get_block_idx(batch_id, block_id, head_id) picks the cache block
+    void attention_split_k_(const uint16_t *q_in_data, ggml_fp16_t *output,
+                            float *attn_lse, int batch_size,
+                            std::function<int(int, int, int)> get_block_idx);
+    // Attention of the n_gqa q heads against one block into
+    // thread_local_output_fp32_/thread_local_attn_lse_, false if the block is
+    // past the end of the sequence
+    bool attn_block_(const uint16_t *q_in_data, int batch_id, int head_id,
+                     int block_id, int block_idx, int thread_id);
+    // attn_with_kvcache_one_block_ for `bsz` q rows of the kv_type kernel (q
+    // in fp16, q8_0 or bf16), the output is always dequantized to fp32
+    void attn_rows_one_block_(int bsz, const void *q, bool is_full_attn,
+                              const uint8_t *attn_mask, int head_id,
+                              int block_idx, float *attn_score,
+                              block_q8_0 *output_q8_0, float *output,
+                              float *lse, void *draft);
+    // Bit mask of the first seq_len positions of a block
+    void fill_attn_mask_(uint8_t *attn_mask, int seq_len) const;
+    // Folds a block result into a running [row_num, head_dim] output and lse,
+    // an lse of -inf means empty
+    void merge_attn_output_(int row_num, float *output, float *lse,
+                            const float *block_output, const float *block_lse);
+    // Merges the split_num partial results of split_output_fp32_ /
+    // split_attn_lse_, laid out [group_num, split_num, group_rows, row_dim],
+    // into the fp16 output and lse of the group_num * group_rows rows
+    void merge_split_attn_(int group_num, int group_rows, int split_num,
+                           int row_dim, ggml_fp16_t *output, float *attn_lse);
+    // alloc_block with block_ref_mutex_ held
+    int alloc_block_();
+    // Throws std::out_of_range for an index past block_ref_, e.g. -1
+    void check_block_idx_(int block_idx, const char *caller) const;
+    // Copies the shared blocks that the tokens [cache_seqlens, cache_seqlens
+    // + q_len) are written to, updating block_table in place
+    void make_blocks_writable_(int *block_table, int batch_size,
+                               int max_block_num, const int *cache_seqlens,
+                               int q_len);
+    // Copies K/V, importance and anchors of a block in every layer
+    void copy_block_(int src_idx, int dst_idx);
+    // Rotates the K rows of every layer and head of the blocks back by
+    // shift[i] positions of RoPE
+    void rotate_back_blocks_(const std::vector<int> &block_idx,
+                             const std::vector<int> &shift);
+    // Sum of the importance of a block over all layers
+    float block_importance_(int block_idx);
+    // Stores the latent rows of attn_mla, one task per token
+    void write_mla_kv_(const ggml_fp16_t *kv_in, int q_len, int batch_size,
+                       int max_block_num, int *block_table,
+                       int *cache_seqlens);
+    // Stores the K/V of a prefill chunk, one task per head and block
+    void write_prefill_kv_(const uint16_t *k_in, const uint16_t *v_in,
+                           int q_len, int batch_size, int max_block_num,
+                           int *block_table, int *cache_seqlens);
+
+    // Runs kv_head_num * head_task_num tasks, task_id is head-major, on the
+    // node of each head if they are placed
+    void do_head_work_(int head_task_num, std::function<void(int)> init,
+                       std::function<void(int)> compute,
+                       std::function<void(int)> finalize);
 
     /**
      * @brief Computes attention with KV cache for one block.
@@ -725,4 +960,14 @@ class KVCache {
  * @param v The scalar value by which to scale the vector.
  */
 void ggml_vec_scale_f32(const int n, float *y, const float v);
+
+/**
+ * @brief Adds a float32 vector scaled by a scalar to another, y += x * v.
+ *
+ * @param n The number of elements in the vectors.
+ * @param y The vector accumulated into.
+ * @param x The vector to scale and add.
+ * @param v The scalar value by which `x` is scaled.
+ */
+void ggml_vec_mad_f32(const int n, float *y, const float *x, const float v);
 #endif
\ No newline at end of file
@@ -0,0 +1,160 @@
+/**
+ * @Description  : Contiguous NUMA-placed storage of the per-block tensors of
+ *                 the KV cache.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+
+#include "kvcache_arena.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <numa.h>
+#include <numaif.h>
+
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+// transparent huge pages back a mapping in 2M pages
+static constexpr size_t kHugePageSize = 2ul << 20;
+
+static uint8_t *map_on_node(size_t bytes, int node) {
+    void *ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) {
+        throw std::runtime_error("KVCacheArena: failed to map " +
+                                 std::to_string(bytes) + " bytes: " +
+                                 strerror(errno));
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(ptr, bytes, MADV_HUGEPAGE);
+#endif
+    // Bind before the first touch, the pages are placed when they fault in.
+    // Not fatal, the memory is still usable without the policy.
+    struct bitmask *mask = numa_allocate_nodemask();
+    if (node >= 0) {
+        numa_bitmask_setbit(mask, node);
+    } else {
+        for (int nid = 0; nid < numa_num_configured_nodes(); nid++) {
+            numa_bitmask_setbit(mask, nid);
+        }
+    }
+    mbind(ptr, bytes, node >= 0 ? MPOL_BIND : MPOL_INTERLEAVE, mask->maskp,
+          mask->size + 1, 0);
+    numa_free_nodemask(mask);
+    return static_cast<uint8_t *>(ptr);
+}
+
+KVCacheArena::~KVCacheArena() { unmap_(); }
+
+void KVCacheArena::init(int layer_num, int head_num, size_t block_bytes,
+                        std::vector<int> head_node) {
+    unmap_();
+    layer_num_ = layer_num;
+    head_num_ = head_num;
+    block_bytes_ = block_bytes;
+    block_num_ = 0;
+    capacity_ = 0;
+    head_node_ = std::move(head_node);
+    head_node_.resize(head_num, -1);
+
+    node_keys_.clear();
+    node_head_num_.clear();
+    head_key_.assign(head_num, 0);
+    head_slot_.assign(head_num, 0);
+    for (int head_id = 0; head_id < head_num; head_id++) {
+        auto it = std::find(node_keys_.begin(), node_keys_.end(),
+                            head_node_[head_id]);
+        if (it == node_keys_.end()) {
+            node_keys_.push_back(head_node_[head_id]);
+            node_head_num_.push_back(0);
+            it = node_keys_.end() - 1;
+        }
+        head_key_[head_id] = it - node_keys_.begin();
+        head_slot_[head_id] = node_head_num_[head_key_[head_id]]++;
+    }
+    head_base_.assign((size_t)layer_num * head_num, nullptr);
+}
+
+void KVCacheArena::resize(int block_num) {
+    if (block_num > capacity_) {
+        // the cache grows a block at a time while decoding, double the
+        // capacity so that it is remapped and copied O(log n) times. Pages
+        // past block_num are never touched, they cost no memory.
+        map_(std::max(block_num, 2 * capacity_));
+    } else if (block_num < block_num_) {
+        // give the pages of the dropped blocks back, zeroing the partial pages
+        // at both ends by hand
+        const uintptr_t page = sysconf(_SC_PAGESIZE);
+        for (int layer_id = 0; layer_id < layer_num_; layer_id++) {
+            for (int head_id = 0; head_id < head_num_; head_id++) {
+                uint8_t *lo = block<uint8_t>(layer_id, head_id, block_num);
+                uint8_t *hi = block<uint8_t>(layer_id, head_id, block_num_);
+                uint8_t *a =
+                    (uint8_t *)(((uintptr_t)lo + page - 1) & ~(page - 1));
+                uint8_t *b = (uint8_t *)((uintptr_t)hi & ~(page - 1));
+                if (a < b) {
+                    madvise(a, b - a, MADV_DONTNEED);
+                    memset(lo, 0, a - lo);
+                    memset(b, 0, hi - b);
+                } else {
+                    memset(lo, 0, hi - lo);
+                }
+            }
+        }
+    }
+    block_num_ = block_num;
+}
+
+void KVCacheArena::map_(int capacity) {
+    const int node_num = node_keys_.size();
+    std::vector<Region> regions(layer_num_ * node_num);
+    std::vector<uint8_t *> head_base(head_base_.size());
+    for (int layer_id = 0; layer_id < layer_num_; layer_id++) {
+        for (int key = 0; key < node_num; key++) {
+            size_t bytes =
+                (size_t)node_head_num_[key] * capacity * block_bytes_;
+            bytes = (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+            try {
+                regions[layer_id * node_num + key] = {
+                    map_on_node(bytes, node_keys_[key]), bytes};
+            } catch (...) {
+                // the old mapping stays in use, drop the new one
+                for (auto &region : regions) {
+                    if (region.data != nullptr) {
+                        munmap(region.data, region.bytes);
+                    }
+                }
+                throw;
+            }
+        }
+        for (int head_id = 0; head_id < head_num_; head_id++) {
+            head_base[layer_id * head_num_ + head_id] =
+                regions[layer_id * node_num + head_key_[head_id]].data +
+                (size_t)head_slot_[head_id] * capacity * block_bytes_;
+            if (block_num_ > 0) {
+                memcpy(head_base[layer_id * head_num_ + head_id],
+                       head_base_[layer_id * head_num_ + head_id],
+                       block_num_ * block_bytes_);
+            }
+        }
+    }
+    unmap_();
+    regions_ = std::move(regions);
+    head_base_ = std::move(head_base);
+    capacity_ = capacity;
+}
+
+void KVCacheArena::unmap_() {
+    for (auto &region : regions_) {
+        munmap(region.data, region.bytes);
+    }
+    regions_.clear();
+}
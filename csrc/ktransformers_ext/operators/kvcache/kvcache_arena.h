@@ -0,0 +1,83 @@
+/**
+ * @Description  : Contiguous NUMA-placed storage of the per-block tensors of
+ *                 the KV cache.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+
+#ifndef CPUINFER_OPERATOR_KVCACHE_ARENA_H
+#define CPUINFER_OPERATOR_KVCACHE_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @class KVCacheArena
+ * @brief Fixed-size blocks of [layer_num, head_num, block_num] in one mapping
+ * per layer and NUMA node.
+ *
+ * The heads of a layer that live on the same node share one anonymous mapping
+ * laid out [head, block, block_bytes], bound to that node and advised for
+ * transparent huge pages. Pages are only committed when a block is first
+ * written, so the capacity can be reserved up front and `resize` is metadata
+ * work: growing within the capacity touches nothing, shrinking returns the
+ * pages of the dropped blocks to the kernel (they read back as zero, like the
+ * value-initialized blocks they replace). Only growing past the capacity
+ * remaps and copies, and it at least doubles the capacity.
+ */
+class KVCacheArena {
+  public:
+    KVCacheArena() = default;
+    ~KVCacheArena();
+    KVCacheArena(const KVCacheArena &) = delete;
+    KVCacheArena &operator=(const KVCacheArena &) = delete;
+
+    /**
+     * @brief Sets the shape of the arena, no memory is mapped until `resize`.
+     *
+     * @param head_node NUMA node of each head, -1 interleaves the head over
+     * all nodes.
+     */
+    void init(int layer_num, int head_num, size_t block_bytes,
+              std::vector<int> head_node);
+
+    /**
+     * @brief Makes blocks [0, block_num) of every layer and head addressable.
+     */
+    void resize(int block_num);
+
+    int get_block_num() const { return block_num_; }
+    size_t get_block_bytes() const { return block_bytes_; }
+
+    template <typename T>
+    T *block(int layer_id, int head_id, int block_idx) const {
+        return reinterpret_cast<T *>(
+            head_base_[layer_id * head_num_ + head_id] +
+            block_idx * block_bytes_);
+    }
+
+  private:
+    struct Region {
+        uint8_t *data;
+        size_t bytes;
+    };
+
+    void map_(int capacity);
+    void unmap_();
+
+    int layer_num_ = 0;
+    int head_num_ = 0;
+    size_t block_bytes_ = 0;
+    int block_num_ = 0;
+    int capacity_ = 0;
+    std::vector<int> head_node_;       // [head_num]
+    std::vector<int> head_key_;        // [head_num], index into node_keys_
+    std::vector<int> head_slot_;       // [head_num], slot in its node region
+    std::vector<int> node_keys_;       // nodes (or -1) that own heads
+    std::vector<int> node_head_num_;   // [node_keys_.size()]
+    std::vector<Region> regions_;      // [layer_num, node_keys_.size()]
+    std::vector<uint8_t *> head_base_; // [layer_num * head_num]
+};
+
+#endif
@@ -11,679 +11,290 @@
 #include "kvcache.h"
 
 #include <chrono>
+#include <cmath>
+#include <numeric>
 
-void KVCache::attention_kvhead_(const uint16_t *q_in_data, ggml_fp16_t *output,
-                                float *attn_lse, int batch_size,
-                                Backend *backend) {
-    // Timer start
-    auto start = std::chrono::high_resolution_clock::now();
-    seq_len_ = config_.block_len;
-
-    Backend_NUMA::getInstance().do_work(
-        batch_size * config_.kv_head_num * max_block_num_after_retrieval_,
-        [&](int thread_id) {
-            thread_cur_head_idx_[thread_id].first = -1;
-            thread_cur_head_idx_[thread_id].second = -1;
-        },
-        [&](int task_id) {
-            int batch_id = task_id / (config_.kv_head_num *
-                                      max_block_num_after_retrieval_);
-            int head_id = (task_id % (config_.kv_head_num *
-                                      max_block_num_after_retrieval_)) /
-                          max_block_num_after_retrieval_;
-            int block_id = task_id % max_block_num_after_retrieval_;
-            int thread_id = Backend::thread_local_id;
+// Blocks scored per retrieval task
+static constexpr int kSimilarityTile = 256;
 
-            // If the block is out of the sequence length, skip it.
-            if (cache_seqlens_[batch_id] / config_.block_len < block_id) {
-                return;
-            }
-            int block_idx =
-                block_table_after_retrieval_kvhead_[batch_id][block_id]
-                                                   [head_id];
-            if (cache_seqlens_[batch_id] / config_.block_len == block_id) {
-                int seq_len = cache_seqlens_[batch_id] % config_.block_len;
-                if (seq_len == 0)
-                    return;
-
-                // Prepare the attention mask for the last block.
-                int full_blocks = seq_len / 8;
-                int remaining_bits = seq_len % 8;
-                // Fill full blocks with 1s
-                for (int i = 0; i < full_blocks; ++i) {
-                    thread_local_attn_mask_[thread_id][i] = 0xFF;
-                }
-                // Fill the remaining bits in the next block
-                if (remaining_bits > 0 && full_blocks < seq_len_ / 8) {
-                    thread_local_attn_mask_[thread_id][full_blocks] =
-                        (1 << remaining_bits) - 1;
-                } else {
-                    thread_local_attn_mask_[thread_id][full_blocks] = 0;
-                }
+void KVCache::do_head_work_(int head_task_num, std::function<void(int)> init,
+                            std::function<void(int)> compute,
+                            std::function<void(int)> finalize) {
+    if (head_node_[0] == -1) {
+        Backend_NUMA::getInstance().do_work(
+            config_.kv_head_num * head_task_num, init, compute, finalize);
+    } else {
+        // Same split of the heads over the nodes as head_node_
+        Backend_NUMA::getInstance().do_k_work_stealing_job(
+            head_task_num, config_.kv_head_num, init, compute, finalize);
+    }
+}
 
-                for (int i = full_blocks + 1; i < seq_len_ / 8; ++i) {
-                    thread_local_attn_mask_[thread_id][i] = 0;
-                }
-                if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num, GGML_TYPE_F16,
-                        (void *)&q_in_data[batch_id * config_.kv_head_num *
-                                               n_gqa_ * config_.head_dim +
-                                           head_id * n_gqa_ * config_.head_dim],
-                        seq_len_, 0, false,
-                        thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_F16, 0,
-                        k_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_F16, 1,
-                        v_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, false,
-                        thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q4_0, 0,
-                        k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
-                        v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, false,
-                        thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q8_0, 0,
-                        k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
-                        v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                }
-            } else {
-                if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num, GGML_TYPE_F16,
-                        (void *)&q_in_data[batch_id * config_.kv_head_num *
-                                               n_gqa_ * config_.head_dim +
-                                           head_id * n_gqa_ * config_.head_dim],
-                        seq_len_, 0, true, nullptr, GGML_TYPE_F16, 0,
-                        k_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_F16, 1,
-                        v_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q4_0, 0,
-                        k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
-                        v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q8_0, 0,
-                        k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
-                        v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                }
-            }
-            int cur_batch_idx = thread_cur_head_idx_[thread_id].first;
-            int cur_head_id = thread_cur_head_idx_[thread_id].second;
-            if (batch_id == cur_batch_idx && head_id == cur_head_id) {
-                for (int i = 0; i < n_gqa_; i++) {
-                    float new_attn_lse =
-                        thread_local_cur_attn_lse_[thread_id][i] +
-                        std::log(
-                            1.0 +
-                            std::exp(thread_local_attn_lse_[thread_id][i] -
-                                     thread_local_cur_attn_lse_[thread_id][i]));
-                    ggml_vec_scale_f32(
-                        config_.head_dim,
-                        thread_local_cur_output_fp32_[thread_id].data() +
-                            i * config_.head_dim,
-                        std::exp(thread_local_cur_attn_lse_[thread_id][i] -
-                                 new_attn_lse));
-                    ggml_vec_scale_f32(
-                        config_.head_dim,
-                        thread_local_output_fp32_[thread_id].data() +
-                            i * config_.head_dim,
-                        std::exp(thread_local_attn_lse_[thread_id][i] -
-                                 new_attn_lse));
-                    for (int j = 0; j < config_.head_dim; j++) {
-                        thread_local_cur_output_fp32_[thread_id]
-                                                     [i * config_.head_dim +
-                                                      j] +=
-                            thread_local_output_fp32_[thread_id]
-                                                     [i * config_.head_dim + j];
-                    }
-                    thread_local_cur_attn_lse_[thread_id][i] = new_attn_lse;
-                }
-            } else {
-                if (cur_batch_idx != -1) {
-                    mutex_[cur_batch_idx][cur_head_id]->lock();
-                    for (int i = 0; i < n_gqa_; i++) {
-                        if (std::abs(attn_lse_[cur_batch_idx][cur_head_id][i]) <
-                            1e-6) {
-                            attn_lse_[cur_batch_idx][cur_head_id][i] =
-                                thread_local_cur_attn_lse_[thread_id][i];
-                            for (int j = 0; j < config_.head_dim; j++) {
-                                output_fp32_[cur_batch_idx][cur_head_id]
-                                            [i * config_.head_dim + j] =
-                                                thread_local_cur_output_fp32_
-                                                    [thread_id]
-                                                    [i * config_.head_dim + j];
-                            }
-                            continue;
-                        }
-                        float new_attn_lse =
-                            attn_lse_[cur_batch_idx][cur_head_id][i] +
-                            std::log(
-                                1.0 +
-                                std::exp(
-                                    thread_local_cur_attn_lse_[thread_id][i] -
-                                    attn_lse_[cur_batch_idx][cur_head_id][i]));
-                        ggml_vec_scale_f32(
-                            config_.head_dim,
-                            output_fp32_[cur_batch_idx][cur_head_id].data() +
-                                i * config_.head_dim,
-                            std::exp(attn_lse_[cur_batch_idx][cur_head_id][i] -
-                                     new_attn_lse));
-                        ggml_vec_scale_f32(
-                            config_.head_dim,
-                            thread_local_cur_output_fp32_[thread_id].data() +
-                                i * config_.head_dim,
-                            std::exp(thread_local_cur_attn_lse_[thread_id][i] -
-                                     new_attn_lse));
-                        for (int j = 0; j < config_.head_dim; j++) {
-                            output_fp32_[cur_batch_idx][cur_head_id]
-                                        [i * config_.head_dim + j] +=
-                                thread_local_cur_output_fp32_
-                                    [thread_id][i * config_.head_dim + j];
-                        }
-                        attn_lse_[cur_batch_idx][cur_head_id][i] = new_attn_lse;
-                    }
-                    mutex_[cur_batch_idx][cur_head_id]->unlock();
-                }
-                thread_cur_head_idx_[thread_id].first = batch_id;
-                thread_cur_head_idx_[thread_id].second = head_id;
-                for (int i = 0; i < n_gqa_; i++) {
-                    thread_local_cur_attn_lse_[thread_id][i] =
-                        thread_local_attn_lse_[thread_id][i];
-                    for (int j = 0; j < config_.head_dim; j++) {
-                        thread_local_cur_output_fp32_
-                            [thread_id][i * config_.head_dim + j] =
-                                thread_local_output_fp32_[thread_id]
-                                                         [i * config_.head_dim +
-                                                          j];
-                    }
-                }
-            }
-        },
-        // Merge the results of the remaining blocks.
-        [&](int thread_id) {
-            int cur_batch_idx = thread_cur_head_idx_[thread_id].first;
-            int cur_head_id = thread_cur_head_idx_[thread_id].second;
-            if (cur_head_id != -1) {
-                mutex_[cur_batch_idx][cur_head_id]->lock();
-                for (int i = 0; i < n_gqa_; i++) {
-                    float new_attn_lse;
-                    if (std::abs(attn_lse_[cur_batch_idx][cur_head_id][i]) <
-                        1e-6) {
-                        attn_lse_[cur_batch_idx][cur_head_id][i] =
-                            thread_local_cur_attn_lse_[thread_id][i];
-                        for (int j = 0; j < config_.head_dim; j++) {
-                            output_fp32_[cur_batch_idx][cur_head_id]
-                                        [i * config_.head_dim + j] =
-                                            thread_local_cur_output_fp32_
-                                                [thread_id]
-                                                [i * config_.head_dim + j];
-                        }
-                        continue;
-                    }
-                    new_attn_lse =
-                        attn_lse_[cur_batch_idx][cur_head_id][i] +
-                        std::log(
-                            1.0 +
-                            std::exp(thread_local_cur_attn_lse_[thread_id][i] -
-                                     attn_lse_[cur_batch_idx][cur_head_id][i]));
-                    ggml_vec_scale_f32(
-                        config_.head_dim,
-                        output_fp32_[cur_batch_idx][cur_head_id].data() +
-                            i * config_.head_dim,
-                        std::exp(attn_lse_[cur_batch_idx][cur_head_id][i] -
-                                 new_attn_lse));
-                    ggml_vec_scale_f32(
-                        config_.head_dim,
-                        thread_local_cur_output_fp32_[thread_id].data() +
-                            i * config_.head_dim,
-                        std::exp(thread_local_cur_attn_lse_[thread_id][i] -
-                                 new_attn_lse));
-                    for (int j = 0; j < config_.head_dim; j++) {
-                        output_fp32_[cur_batch_idx][cur_head_id]
-                                    [i * config_.head_dim + j] +=
-                            thread_local_cur_output_fp32_[thread_id]
-                                                         [i * config_.head_dim +
-                                                          j];
-                    }
-                    attn_lse_[cur_batch_idx][cur_head_id][i] = new_attn_lse;
-                }
-                mutex_[cur_batch_idx][cur_head_id]->unlock();
-            }
-        });
-    // move the results to output and attn_lse
-    uint16_t *output_data = reinterpret_cast<uint16_t *>(output);
-    float *attn_lse_data = attn_lse;
-    for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
-        for (int i = 0; i < config_.kv_head_num; i++) {
-            for (int j = 0; j < n_gqa_ * config_.head_dim; j++) {
-                output_data[batch_idx * config_.kv_head_num * n_gqa_ *
-                                config_.head_dim +
-                            i * n_gqa_ * config_.head_dim + j] =
-                    GGML_FP32_TO_FP16(output_fp32_[batch_idx][i][j]);
-            }
-            for (int j = 0; j < n_gqa_; j++) {
-                attn_lse_data[batch_idx * config_.kv_head_num * n_gqa_ +
-                              i * n_gqa_ + j] = attn_lse_[batch_idx][i][j];
-            }
-        }
+void KVCache::fill_attn_mask_(uint8_t *attn_mask, int seq_len) const {
+    int full_blocks = seq_len / 8;
+    int remaining_bits = seq_len % 8;
+    // Fill full blocks with 1s
+    for (int i = 0; i < full_blocks; ++i) {
+        attn_mask[i] = 0xFF;
+    }
+    // Fill the remaining bits in the next block
+    if (remaining_bits > 0 && full_blocks < config_.block_len / 8) {
+        attn_mask[full_blocks] = (1 << remaining_bits) - 1;
+    } else if (full_blocks < config_.block_len / 8) {
+        attn_mask[full_blocks] = 0;
     }
 
-    // Timer end
-    auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> diff = end - start;
-    // printf("layer %d time of computing attention: %f s\n", layer_idx,
-    //        diff.count());
+    for (int i = full_blocks + 1; i < config_.block_len / 8; ++i) {
+        attn_mask[i] = 0;
+    }
 }
 
-void KVCache::attention_layer_(const uint16_t *q_in_data, ggml_fp16_t *output,
-                               float *attn_lse, int batch_size,
-                               Backend *backend) {
-    // Timer start
-    auto start = std::chrono::high_resolution_clock::now();
-    seq_len_ = config_.block_len;
-    Backend_NUMA::getInstance().do_work(
-        batch_size * config_.kv_head_num * max_block_num_after_retrieval_,
-        [&](int thread_id) {
-            thread_cur_head_idx_[thread_id].first = -1;
-            thread_cur_head_idx_[thread_id].second = -1;
-        },
-        [&](int task_id) {
-            int batch_id = task_id / (config_.kv_head_num *
-                                      max_block_num_after_retrieval_);
-            int head_id = (task_id % (config_.kv_head_num *
-                                      max_block_num_after_retrieval_)) /
-                          max_block_num_after_retrieval_;
-            int block_id = task_id % max_block_num_after_retrieval_;
-            int thread_id = Backend::thread_local_id;
-            // If the block is out of the sequence length, skip it.
-            if (cache_seqlens_[batch_id] / config_.block_len < block_id) {
-                return;
-            }
-            int block_idx = block_table_after_retrieval_[batch_id][block_id];
-            if (cache_seqlens_[batch_id] / config_.block_len == block_id) {
-                int seq_len = cache_seqlens_[batch_id] % config_.block_len;
-                if (seq_len == 0)
-                    return;
-
-                // Prepare the attention mask for the last block.
-                int full_blocks = seq_len / 8;
-                int remaining_bits = seq_len % 8;
-
-                // Fill full blocks with 1s
-                for (int i = 0; i < full_blocks; ++i) {
-                    thread_local_attn_mask_[thread_id][i] = 0xFF;
-                }
-                // Fill the remaining bits in the next block
-                if (remaining_bits > 0 && full_blocks < seq_len_ / 8) {
-                    thread_local_attn_mask_[thread_id][full_blocks] =
-                        (1 << remaining_bits) - 1;
-                } else {
-                    thread_local_attn_mask_[thread_id][full_blocks] = 0;
-                }
-
-                for (int i = full_blocks + 1; i < seq_len_ / 8; ++i) {
-                    thread_local_attn_mask_[thread_id][i] = 0;
-                }
-                if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num, GGML_TYPE_F16,
-                        (void *)&q_in_data[batch_id * config_.kv_head_num *
-                                               n_gqa_ * config_.head_dim +
-                                           head_id * n_gqa_ * config_.head_dim],
-                        seq_len_, 0, false,
-                        thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_F16, 0,
-                        k_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_F16, 1,
-                        v_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, false,
-                        thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q4_0, 0,
-                        k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
-                        v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, false,
-                        thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q8_0, 0,
-                        k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
-                        v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                }
-            } else {
-                if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num, GGML_TYPE_F16,
-                        (void *)&q_in_data[batch_id * config_.kv_head_num *
-                                               n_gqa_ * config_.head_dim +
-                                           head_id * n_gqa_ * config_.head_dim],
-                        seq_len_, 0, true, nullptr, GGML_TYPE_F16, 0,
-                        k_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_F16, 1,
-                        v_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q4_0, 0,
-                        k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
-                        v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q8_0, 0,
-                        k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
-                        v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                }
-            }
-            int cur_batch_idx = thread_cur_head_idx_[thread_id].first;
-            int cur_head_id = thread_cur_head_idx_[thread_id].second;
-            if (batch_id == cur_batch_idx && head_id == cur_head_id) {
-                for (int i = 0; i < n_gqa_; i++) {
-                    float new_attn_lse =
-                        thread_local_cur_attn_lse_[thread_id][i] +
-                        std::log(
-                            1.0 +
-                            std::exp(thread_local_attn_lse_[thread_id][i] -
-                                     thread_local_cur_attn_lse_[thread_id][i]));
-                    ggml_vec_scale_f32(
-                        config_.head_dim,
-                        thread_local_cur_output_fp32_[thread_id].data() +
-                            i * config_.head_dim,
-                        std::exp(thread_local_cur_attn_lse_[thread_id][i] -
-                                 new_attn_lse));
-                    ggml_vec_scale_f32(
-                        config_.head_dim,
-                        thread_local_output_fp32_[thread_id].data() +
-                            i * config_.head_dim,
-                        std::exp(thread_local_attn_lse_[thread_id][i] -
-                                 new_attn_lse));
-                    for (int j = 0; j < config_.head_dim; j++) {
-                        thread_local_cur_output_fp32_[thread_id]
-                                                     [i * config_.head_dim +
-                                                      j] +=
-                            thread_local_output_fp32_[thread_id]
-                                                     [i * config_.head_dim + j];
-                    }
-                    thread_local_cur_attn_lse_[thread_id][i] = new_attn_lse;
-                }
-            } else {
-                if (cur_batch_idx != -1) {
-                    mutex_[cur_batch_idx][cur_head_id]->lock();
-                    for (int i = 0; i < n_gqa_; i++) {
-                        if (std::abs(attn_lse_[cur_batch_idx][cur_head_id][i]) <
-                            1e-6) {
-                            attn_lse_[cur_batch_idx][cur_head_id][i] =
-                                thread_local_cur_attn_lse_[thread_id][i];
-                            for (int j = 0; j < config_.head_dim; j++) {
-                                output_fp32_[cur_batch_idx][cur_head_id]
-                                            [i * config_.head_dim + j] =
-                                                thread_local_cur_output_fp32_
-                                                    [thread_id]
-                                                    [i * config_.head_dim + j];
-                            }
-                            continue;
-                        }
-                        float new_attn_lse =
-                            attn_lse_[cur_batch_idx][cur_head_id][i] +
-                            std::log(
-                                1.0 +
-                                std::exp(
-                                    thread_local_cur_attn_lse_[thread_id][i] -
-                                    attn_lse_[cur_batch_idx][cur_head_id][i]));
-                        ggml_vec_scale_f32(
-                            config_.head_dim,
-                            output_fp32_[cur_batch_idx][cur_head_id].data() +
-                                i * config_.head_dim,
-                            std::exp(attn_lse_[cur_batch_idx][cur_head_id][i] -
-                                     new_attn_lse));
-                        ggml_vec_scale_f32(
-                            config_.head_dim,
-                            thread_local_cur_output_fp32_[thread_id].data() +
-                                i * config_.head_dim,
-                            std::exp(thread_local_cur_attn_lse_[thread_id][i] -
-                                     new_attn_lse));
-                        for (int j = 0; j < config_.head_dim; j++) {
-                            output_fp32_[cur_batch_idx][cur_head_id]
-                                        [i * config_.head_dim + j] +=
-                                thread_local_cur_output_fp32_
-                                    [thread_id][i * config_.head_dim + j];
-                        }
-                        attn_lse_[cur_batch_idx][cur_head_id][i] = new_attn_lse;
-                    }
-                    mutex_[cur_batch_idx][cur_head_id]->unlock();
-                }
-                thread_cur_head_idx_[thread_id].first = batch_id;
-                thread_cur_head_idx_[thread_id].second = head_id;
-                for (int i = 0; i < n_gqa_; i++) {
-                    thread_local_cur_attn_lse_[thread_id][i] =
-                        thread_local_attn_lse_[thread_id][i];
-                    for (int j = 0; j < config_.head_dim; j++) {
-                        thread_local_cur_output_fp32_
-                            [thread_id][i * config_.head_dim + j] =
-                                thread_local_output_fp32_[thread_id]
-                                                         [i * config_.head_dim +
-                                                          j];
-                    }
+void KVCache::attn_rows_one_block_(int bsz, const void *q, bool is_full_attn,
+                                   const uint8_t *attn_mask, int head_id,
+                                   int block_idx, float *attn_score,
+                                   block_q8_0 *output_q8_0, float *output,
+                                   float *lse, void *draft) {
+    if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+        attn_with_kvcache_one_block_(
+            config_.head_dim, bsz, GGML_TYPE_F16, q, config_.block_len, 0,
+            is_full_attn, attn_mask, GGML_TYPE_F16, 0,
+            k_cache_.block<ggml_fp16_t>(layer_id_, head_id, block_idx), 0,
+            nullptr, nullptr, GGML_TYPE_F16, 1,
+            v_cache_.block<ggml_fp16_t>(layer_id_, head_id, block_idx), 0,
+            nullptr, nullptr, attn_score, output, lse, draft, nullptr,
+            cos_.data(), sin_.data());
+    } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
+        attn_with_kvcache_one_block_(
+            config_.head_dim, bsz, GGML_TYPE_Q8_0, q, config_.block_len, 0,
+            is_full_attn, attn_mask, GGML_TYPE_Q4_0, 0,
+            k_cache_.block<block_q4_0>(layer_id_, head_id, block_idx), 0,
+            nullptr, nullptr, GGML_TYPE_Q4_0, 1,
+            v_cache_.block<block_q4_0>(layer_id_, head_id, block_idx), 0,
+            nullptr, nullptr, attn_score, output_q8_0, lse, draft, nullptr,
+            cos_.data(), sin_.data());
+        dequantize_row_q8_0(output_q8_0, output, bsz * config_.head_dim);
+    } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
+        attn_with_kvcache_one_block_(
+            config_.head_dim, bsz, GGML_TYPE_Q8_0, q, config_.block_len, 0,
+            is_full_attn, attn_mask, GGML_TYPE_Q8_0, 0,
+            k_cache_.block<block_q8_0>(layer_id_, head_id, block_idx), 0,
+            nullptr, nullptr, GGML_TYPE_Q8_0, 1,
+            v_cache_.block<block_q8_0>(layer_id_, head_id, block_idx), 0,
+            nullptr, nullptr, attn_score, output_q8_0, lse, draft, nullptr,
+            cos_.data(), sin_.data());
+        dequantize_row_q8_0(output_q8_0, output, bsz * config_.head_dim);
+    } else if (config_.kv_type == GGML_TYPE_FP8_E4M3) {
+        attn_with_kvcache_one_block_(
+            config_.head_dim, bsz, GGML_TYPE_BF16, q, config_.block_len, 0,
+            is_full_attn, attn_mask, GGML_TYPE_FP8_E4M3, 0,
+            k_cache_.block<block_fp8>(layer_id_, head_id, block_idx), 0,
+            nullptr, nullptr, GGML_TYPE_FP8_E4M3, 1,
+            v_cache_.block<block_fp8>(layer_id_, head_id, block_idx), 0,
+            nullptr, nullptr, attn_score, output, lse, draft, nullptr,
+            cos_.data(), sin_.data());
+    }
+}
+
+bool KVCache::attn_block_(const uint16_t *q_in_data, int batch_id,
+                          int head_id, int block_id, int block_idx,
+                          int thread_id) {
+    bool is_full_attn = true;
+    const uint8_t *attn_mask = nullptr;
+    if (cache_seqlens_[batch_id] / config_.block_len == block_id) {
+        int seq_len = cache_seqlens_[batch_id] % config_.block_len;
+        if (seq_len == 0)
+            return false;
+
+        // Prepare the attention mask for the last block.
+        fill_attn_mask_(thread_local_attn_mask_[thread_id].data(), seq_len);
+        is_full_attn = false;
+        attn_mask = thread_local_attn_mask_[thread_id].data();
+    }
+
+    const void *q;
+    if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+        q = &q_in_data[(batch_id * config_.kv_head_num + head_id) * n_gqa_ *
+                       config_.head_dim];
+    } else if (config_.kv_type == GGML_TYPE_FP8_E4M3) {
+        q = q_bf16_[batch_id][head_id].data();
+    } else {
+        q = q_q8_0_[batch_id][head_id].data();
+    }
+    attn_rows_one_block_(n_gqa_, q, is_full_attn, attn_mask, head_id,
+                         block_idx, thread_local_attn_score_[thread_id].data(),
+                         thread_local_output_q8_0_[thread_id].data(),
+                         thread_local_output_fp32_[thread_id].data(),
+                         thread_local_attn_lse_[thread_id].data(),
+                         thread_local_draft_[thread_id].data());
+    return true;
+}
+
+void KVCache::merge_attn_output_(int row_num, float *output, float *lse,
+                                 const float *block_output,
+                                 const float *block_lse) {
+    for (int i = 0; i < row_num; i++) {
+        if (block_lse[i] == -std::numeric_limits<float>::infinity()) {
+            continue;
+        }
+        float max_lse = std::max(lse[i], block_lse[i]);
+        float scale = std::exp(lse[i] - max_lse);
+        float block_scale = std::exp(block_lse[i] - max_lse);
+        float *y = output + i * config_.head_dim;
+        const float *x = block_output + i * config_.head_dim;
+        float sum = scale + block_scale;
+        scale /= sum;
+        block_scale /= sum;
+        for (int j = 0; j < config_.head_dim; j++) {
+            y[j] = y[j] * scale + x[j] * block_scale;
+        }
+        lse[i] = max_lse + std::log(sum);
+    }
+}
+
+void KVCache::attention_split_k_(
+    const uint16_t *q_in_data, ggml_fp16_t *output, float *attn_lse,
+    int batch_size, std::function<int(int, int, int)> get_block_idx) {
+    seq_len_ = config_.block_len;
+    int thread_num = Backend_NUMA::getInstance().get_num_threads();
+    if (thread_num > (int)thread_local_output_fp32_.size()) {
+        ThreadResize(thread_num);
+    }
+
+    // Flash-decoding: the blocks of every (batch, kv head) are cut into
+    // split_num contiguous chunks so that even a single head keeps all
+    // threads busy. Each chunk leaves a partial output and lse in its own
+    // slot, no locking, and the slots are merged in a second pass.
+    int block_num = max_block_num_after_retrieval_;
+    int head_num = batch_size * config_.kv_head_num;
+    int split_num = (kSplitsPerThread * thread_num + head_num - 1) / head_num;
+    split_num = std::max(1, std::min(split_num, block_num));
+    int row_size = n_gqa_ * config_.head_dim;
+    split_output_fp32_.resize((size_t)head_num * split_num * row_size);
+    split_attn_lse_.resize((size_t)head_num * split_num * n_gqa_);
+
+    do_head_work_(
+        batch_size * split_num, nullptr,
+        [&](int task_id) {
+            int head_id = task_id / (batch_size * split_num);
+            int batch_id = task_id / split_num % batch_size;
+            int split_id = task_id % split_num;
+            int thread_id = Backend_NUMA::thread_local_id_;
+            size_t slot =
+                ((size_t)batch_id * config_.kv_head_num + head_id) *
+                    split_num +
+                split_id;
+            float *split_output = split_output_fp32_.data() + slot * row_size;
+            float *split_lse = split_attn_lse_.data() + slot * n_gqa_;
+            std::fill(split_output, split_output + row_size, 0.0f);
+            std::fill(split_lse, split_lse + n_gqa_,
+                      -std::numeric_limits<float>::infinity());
+
+            // Blocks past the end of the sequence are skipped.
+            int block_begin = (int64_t)split_id * block_num / split_num;
+            int block_end = std::min(
+                (int)((int64_t)(split_id + 1) * block_num / split_num),
+                cache_seqlens_[batch_id] / config_.block_len + 1);
+            for (int block_id = block_begin; block_id < block_end;
+                 block_id++) {
+                if (!attn_block_(q_in_data, batch_id, head_id, block_id,
+                                 get_block_idx(batch_id, block_id, head_id),
+                                 thread_id)) {
+                    continue;
                 }
+                merge_attn_output_(n_gqa_, split_output, split_lse,
+                                   thread_local_output_fp32_[thread_id].data(),
+                                   thread_local_attn_lse_[thread_id].data());
             }
         },
-        // Merge the results of the remaining blocks.
-        [&](int thread_id) {
-            int cur_batch_idx = thread_cur_head_idx_[thread_id].first;
-            int cur_head_id = thread_cur_head_idx_[thread_id].second;
-            if (cur_head_id != -1) {
-                mutex_[cur_batch_idx][cur_head_id]->lock();
-                for (int i = 0; i < n_gqa_; i++) {
-                    float new_attn_lse;
-                    if (std::abs(attn_lse_[cur_batch_idx][cur_head_id][i]) <
-                        1e-6) {
-                        attn_lse_[cur_batch_idx][cur_head_id][i] =
-                            thread_local_cur_attn_lse_[thread_id][i];
-                        for (int j = 0; j < config_.head_dim; j++) {
-                            output_fp32_[cur_batch_idx][cur_head_id]
-                                        [i * config_.head_dim + j] =
-                                            thread_local_cur_output_fp32_
-                                                [thread_id]
-                                                [i * config_.head_dim + j];
-                        }
+        nullptr);
+
+    merge_split_attn_(head_num, n_gqa_, split_num, config_.head_dim, output,
+                      attn_lse);
+}
+
+void KVCache::merge_split_attn_(int group_num, int group_rows, int split_num,
+                                int row_dim, ggml_fp16_t *output,
+                                float *attn_lse) {
+    // Merge the chunks of every row: out = sum_s exp(lse_s - lse) * out_s
+    // with lse = log(sum_s exp(lse_s)), written straight to the fp16 output.
+    size_t slot_size = (size_t)group_rows * row_dim;
+    Backend_NUMA::getInstance().do_work(
+        group_num * group_rows, nullptr,
+        [&](int task_id) {
+            int group = task_id / group_rows;
+            int i = task_id % group_rows;
+            int thread_id = Backend_NUMA::thread_local_id_;
+            const float *split_lse = split_attn_lse_.data() +
+                                     (size_t)group * split_num * group_rows +
+                                     i;
+            const float *split_output = split_output_fp32_.data() +
+                                        (size_t)group * split_num * slot_size +
+                                        (size_t)i * row_dim;
+            float *sum = thread_local_cur_output_fp32_[thread_id].data();
+            std::fill(sum, sum + row_dim, 0.0f);
+
+            float max_lse = -std::numeric_limits<float>::infinity();
+            for (int s = 0; s < split_num; s++) {
+                max_lse = std::max(max_lse, split_lse[s * group_rows]);
+            }
+            float sum_exp = 0;
+            if (max_lse != -std::numeric_limits<float>::infinity()) {
+                for (int s = 0; s < split_num; s++) {
+                    float w = std::exp(split_lse[s * group_rows] - max_lse);
+                    if (w == 0) {
                         continue;
                     }
-                    new_attn_lse =
-                        attn_lse_[cur_batch_idx][cur_head_id][i] +
-                        std::log(
-                            1.0 +
-                            std::exp(thread_local_cur_attn_lse_[thread_id][i] -
-                                     attn_lse_[cur_batch_idx][cur_head_id][i]));
-                    ggml_vec_scale_f32(
-                        config_.head_dim,
-                        output_fp32_[cur_batch_idx][cur_head_id].data() +
-                            i * config_.head_dim,
-                        std::exp(attn_lse_[cur_batch_idx][cur_head_id][i] -
-                                 new_attn_lse));
-                    ggml_vec_scale_f32(
-                        config_.head_dim,
-                        thread_local_cur_output_fp32_[thread_id].data() +
-                            i * config_.head_dim,
-                        std::exp(thread_local_cur_attn_lse_[thread_id][i] -
-                                 new_attn_lse));
-                    for (int j = 0; j < config_.head_dim; j++) {
-                        output_fp32_[cur_batch_idx][cur_head_id]
-                                    [i * config_.head_dim + j] +=
-                            thread_local_cur_output_fp32_[thread_id]
-                                                         [i * config_.head_dim +
-                                                          j];
+                    const float *x = split_output + s * slot_size;
+                    for (int j = 0; j < row_dim; j++) {
+                        sum[j] += w * x[j];
                     }
-                    attn_lse_[cur_batch_idx][cur_head_id][i] = new_attn_lse;
+                    sum_exp += w;
                 }
-                mutex_[cur_batch_idx][cur_head_id]->unlock();
+                ggml_vec_scale_f32(row_dim, sum, 1.0f / sum_exp);
             }
-        });
 
-    // move the results to output and attn_lse
-    uint16_t *output_data = reinterpret_cast<uint16_t *>(output);
-    float *attn_lse_data = attn_lse;
-    for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
-        for (int i = 0; i < config_.kv_head_num; i++) {
-            for (int j = 0; j < n_gqa_ * config_.head_dim; j++) {
-                output_data[batch_idx * config_.kv_head_num * n_gqa_ *
-                                config_.head_dim +
-                            i * n_gqa_ * config_.head_dim + j] =
-                    GGML_FP32_TO_FP16(output_fp32_[batch_idx][i][j]);
-            }
-            for (int j = 0; j < n_gqa_; j++) {
-                attn_lse_data[batch_idx * config_.kv_head_num * n_gqa_ +
-                              i * n_gqa_ + j] = attn_lse_[batch_idx][i][j];
+            // An empty sequence keeps the zero output and lse
+            ggml_fp16_t *out = output + (size_t)task_id * row_dim;
+            for (int j = 0; j < row_dim; j++) {
+                out[j] = GGML_FP32_TO_FP16(sum[j]);
             }
-        }
-    }
+            attn_lse[task_id] =
+                sum_exp > 0 ? max_lse + std::log(sum_exp) : 0.0f;
+        },
+        nullptr);
+}
+
+void KVCache::attention_kvhead_(const uint16_t *q_in_data, ggml_fp16_t *output,
+                                float *attn_lse, int batch_size,
+                                Backend *backend) {
+    // Timer start
+    auto start = std::chrono::high_resolution_clock::now();
+
+    attention_split_k_(q_in_data, output, attn_lse, batch_size,
+                       [&](int batch_id, int block_id, int head_id) {
+                           return block_table_after_retrieval_kvhead_
+                               [batch_id][block_id][head_id];
+                       });
+
+    // Timer end
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> diff = end - start;
+    // printf("layer %d time of computing attention: %f s\n", layer_idx,
+    //        diff.count());
+}
+
+void KVCache::attention_layer_(const uint16_t *q_in_data, ggml_fp16_t *output,
+                               float *attn_lse, int batch_size,
+                               Backend *backend) {
+    // Timer start
+    auto start = std::chrono::high_resolution_clock::now();
+
+    attention_split_k_(q_in_data, output, attn_lse, batch_size,
+                       [&](int batch_id, int block_id, int head_id) {
+                           return block_table_after_retrieval_[batch_id]
+                                                              [block_id];
+                       });
+
     // Timer end
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> diff = end - start;
@@ -780,6 +391,17 @@ void KVCache::quantize_q_(const uint16_t *q_in_data, int batch_size) {
                                   i * n_gqa_ * config_.head_dim + j]);
                 }
             }
+        } else if (config_.kv_type == GGML_TYPE_FP8_E4M3) {
+            // fp8_gemm takes the activations in bf16
+            for (int i = 0; i < config_.kv_head_num; i++) {
+                for (int j = 0; j < n_gqa_ * config_.head_dim; j++) {
+                    q_bf16_[batch_idx][i][j] = ggml_fp32_to_bf16(
+                        GGML_FP16_TO_FP32(
+                            q_in_data[batch_idx * config_.kv_head_num *
+                                          n_gqa_ * config_.head_dim +
+                                      i * n_gqa_ * config_.head_dim + j]));
+                }
+            }
         } else {
             // quantize q
             for (int i = 0; i < config_.kv_head_num; i++) {
@@ -814,10 +436,6 @@ void KVCache::attn_initialize_layer_(int batch_size, int layer_idx,
                 attn_lse_[batch_idx][i][j] = 0;
             }
         }
-        // clear top_similar_block_
-
-        while (!top_similar_block_[batch_idx].empty())
-            top_similar_block_[batch_idx].pop();
     }
 
     // get block_table_before_retrieval_ and cache_seqlens_
@@ -849,6 +467,135 @@ void KVCache::attn_initialize_layer_(int batch_size, int layer_idx,
     //        std::chrono::duration<double>(end - start).count());
 }
 
+void KVCache::average_retrieval_q_(const uint16_t *q_in_data, int batch_size,
+                                   int q_len) {
+    const int q_dim = config_.q_head_num * config_.head_dim;
+    for (int batch_id = 0; batch_id < batch_size; batch_id++) {
+        float *q = avg_q[batch_id].data();
+        const uint16_t *q_in = q_in_data + (size_t)batch_id * q_len * q_dim;
+        for (int j = 0; j < q_dim; j++) {
+            q[j] = GGML_FP16_TO_FP32(q_in[j]);
+        }
+        for (int i = 1; i < q_len; i++) {
+            for (int j = 0; j < q_dim; j++) {
+                q[j] += GGML_FP16_TO_FP32(q_in[i * q_dim + j]);
+            }
+        }
+        if (q_len > 1) {
+            for (int j = 0; j < q_dim; j++) {
+                q[j] /= q_len;
+            }
+        }
+        if (!similarity_is_gemm_()) {
+            continue;
+        }
+        // max(a0 * q, a1 * q) is a0 * q for q >= 0 and a1 * q otherwise when
+        // a0 >= a1, which holds for the max/min anchors of QUEST. Splitting q
+        // by sign turns the score into a plain dot product with the anchors.
+        ggml_fp16_t *q_fp16 = avg_q_fp16[batch_id].data();
+        for (int j = 0; j < q_dim; j++) {
+            if (config_.anchor_num == 1) {
+                q_fp16[j] = GGML_FP32_TO_FP16(q[j]);
+            } else {
+                q_fp16[j] = GGML_FP32_TO_FP16(std::max(q[j], 0.0f));
+                q_fp16[q_dim + j] = GGML_FP32_TO_FP16(std::min(q[j], 0.0f));
+            }
+        }
+    }
+}
+
+bool KVCache::similarity_is_gemm_() const {
+    return config_.anchor_num == 1 ||
+           (config_.anchor_num == 2 && config_.anchor_type == QUEST);
+}
+
+void KVCache::block_similarity_(int layer_idx, int batch_id, int head_begin,
+                                int head_num, const int *block_idx, int n,
+                                float *similarity) const {
+    const int q_dim = config_.q_head_num * config_.head_dim;
+    const size_t block_stride = (size_t)config_.anchor_num * q_dim;
+    const ggml_fp16_t *anchor =
+        anchor_.data() + (size_t)layer_idx * config_.max_block_num *
+                             block_stride +
+        head_begin * config_.head_dim;
+    const int k = head_num * config_.head_dim;
+
+    for (int begin = 0, end; begin < n; begin = end) {
+        // one GEMM per run of consecutive blocks, the anchors of a run are a
+        // [run, anchor_num * q_dim] row-major matrix
+        end = begin + 1;
+        while (end < n && block_idx[end] == block_idx[end - 1] + 1) {
+            end++;
+        }
+        const ggml_fp16_t *a = anchor + block_idx[begin] * block_stride;
+        bool ok = similarity_is_gemm_();
+        for (int anchor_id = 0; ok && anchor_id < config_.anchor_num;
+             anchor_id++) {
+            float partial[kSimilarityTile];
+            ok = llamafile_sgemm(
+                end - begin, 1, k, a + anchor_id * q_dim, block_stride,
+                avg_q_fp16[batch_id].data() + anchor_id * q_dim +
+                    head_begin * config_.head_dim,
+                k, anchor_id == 0 ? similarity + begin : partial, end - begin,
+                0, 1, GGML_TASK_TYPE_COMPUTE, GGML_TYPE_F16, GGML_TYPE_F16,
+                GGML_TYPE_F32, GGML_PREC_DEFAULT);
+            for (int i = 0; ok && anchor_id > 0 && i < end - begin; i++) {
+                similarity[begin + i] += partial[i];
+            }
+        }
+        // The sign split needs finite anchors with a0 >= a1, which anchors
+        // loaded from older dumps may not have. Recompute such runs below.
+        for (int i = begin; ok && i < end; i++) {
+            ok = std::isfinite(similarity[i]);
+        }
+        if (ok) {
+            continue;
+        }
+
+        const float *q = avg_q[batch_id].data() + head_begin * config_.head_dim;
+        for (int i = begin; i < end; i++) {
+            const ggml_fp16_t *block_anchor =
+                anchor + block_idx[i] * block_stride;
+            float sim = 0;
+            for (int l = 0; l < k; l++) {
+                float qa = std::numeric_limits<float>::lowest();
+                for (int anchor_id = 0; anchor_id < config_.anchor_num;
+                     anchor_id++) {
+                    float a = GGML_FP16_TO_FP32(
+                        block_anchor[anchor_id * q_dim + l]);
+                    // a non-finite anchor is a head without keys
+                    qa = std::max(qa, std::isfinite(a) ? a * q[l] : 0.0f);
+                }
+                sim += qa;
+            }
+            // only a non-finite q is left to make it NaN
+            similarity[i] = std::isnan(sim)
+                                ? -std::numeric_limits<float>::infinity()
+                                : sim;
+        }
+    }
+}
+
+void KVCache::pick_top_blocks_(const float *similarity, int begin, int end,
+                               int pick_block_num, int *block_id) const {
+    std::iota(block_id, block_id + end - begin, begin);
+    // NaN ranks last, nth_element needs a strict weak ordering
+    auto key = [similarity](int i) {
+        return std::isnan(similarity[i])
+                   ? -std::numeric_limits<float>::infinity()
+                   : similarity[i];
+    };
+    auto more_similar = [&key](int a, int b) {
+        return key(a) > key(b) || (key(a) == key(b) && a < b);
+    };
+    if (pick_block_num < end - begin) {
+        std::nth_element(block_id, block_id + pick_block_num,
+                         block_id + end - begin, more_similar);
+    }
+    // back in sequence order, the picked blocks are read one after another
+    std::sort(block_id, block_id + std::min(pick_block_num, end - begin));
+}
+
 void KVCache::calculate_block_similarity_layer_(
     const uint16_t *q_in_data, int batch_size, int layer_idx, int q_len,
     int max_block_num, int *cache_seqlens, int init_block_num,
@@ -856,169 +603,28 @@ void KVCache::calculate_block_similarity_layer_(
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
 
-    if (batch_size == 1 &&
-        config_.anchor_num == 1) { // TODO: improve batch_size > 1
-        for (int batch_id = 0; batch_id < batch_size; batch_id++) {
-            if (q_len == 1) {
-                for (int j = 0; j < config_.head_dim * config_.q_head_num;
-                     j++) {
-                    avg_q[batch_id][j] = GGML_FP16_TO_FP32(
-                        q_in_data[batch_id * q_len * config_.q_head_num *
-                                      config_.head_dim +
-                                  j]);
-                    avg_q_fp16[batch_id][j] =
-                        q_in_data[batch_id * q_len * config_.q_head_num *
-                                      config_.head_dim +
-                                  j];
-                }
-            } else {
-                for (int j = 0; j < config_.head_dim * config_.q_head_num;
-                     j++) {
-                    avg_q[batch_id][j] = 0;
-                }
-                for (int i = 0; i < q_len; i++) {
-                    for (int j = 0; j < config_.head_dim; j++) {
-                        avg_q[batch_id][j] += GGML_FP16_TO_FP32(
-                            q_in_data[batch_id * q_len * config_.q_head_num *
-                                          config_.head_dim +
-                                      i * config_.q_head_num *
-                                          config_.head_dim +
-                                      j]);
-                    }
-                }
-                for (int j = 0; j < config_.head_dim * config_.q_head_num;
-                     j++) {
-                    avg_q[batch_id][j] /= q_len;
-                    avg_q_fp16[batch_id][j] =
-                        GGML_FP32_TO_FP16(avg_q[batch_id][j]);
-                }
-            }
-            int seq_len = cache_seqlens_[batch_id];
-            int block_num = (seq_len / config_.block_len) - local_block_num -
-                            init_block_num;
-            if (block_num <= 0) {
-                continue;
-            }
-            bool is_seq = true;
-            for (int i = init_block_num + 1;
-                 i < (seq_len / config_.block_len) - local_block_num; i++) {
-                if (block_table_before_retrieval_[batch_id][i] !=
-                    block_table_before_retrieval_[batch_id][i - 1] + 1) {
-                    is_seq = false;
-                    break;
-                }
-            }
-            if (is_seq) {
-                int nth = backend->get_thread_num();
-                Backend_NUMA::getInstance().do_work(
-                    nth, nullptr,
-                    [&](int task_id) {
-                        int ith = task_id;
-                        bool ok = llamafile_sgemm(
-                            block_num, 1, config_.q_head_num * config_.head_dim,
-                            anchor_.data() +
-                                (layer_idx * config_.max_block_num +
-                                 block_table_before_retrieval_
-                                     [batch_id][init_block_num]) *
-                                    config_.anchor_num * config_.q_head_num *
-                                    config_.head_dim,
-                            config_.q_head_num * config_.head_dim,
-                            avg_q_fp16[batch_id].data(),
-                            config_.q_head_num * config_.head_dim,
-                            block_similar_[batch_id].data() + init_block_num,
-                            block_num, ith, nth, GGML_TASK_TYPE_COMPUTE,
-                            GGML_TYPE_F16, GGML_TYPE_F16, GGML_TYPE_F32,
-                            GGML_PREC_DEFAULT);
-                        if (!ok) {
-                            printf("llamafile_sgemm failed\n");
-                        }
-                    },
-                    nullptr);
-            } else {
-                Backend_NUMA::getInstance().do_work(
-                    block_num, nullptr,
-                    [&](int task_id) {
-                        int block_id = task_id + init_block_num;
-                        int block_idx =
-                            block_table_before_retrieval_[batch_id][block_id];
-                        bool ok = llamafile_sgemm(
-                            1, 1, config_.q_head_num * config_.head_dim,
-                            anchor_.data() +
-                                (layer_idx * config_.max_block_num +
-                                 block_table_before_retrieval_[batch_id]
-                                                              [block_idx]) *
-                                    config_.anchor_num * config_.q_head_num *
-                                    config_.head_dim,
-                            config_.q_head_num * config_.head_dim,
-                            avg_q_fp16[batch_id].data(),
-                            config_.q_head_num * config_.head_dim,
-                            block_similar_[batch_id].data() + block_id, 1, 0, 1,
-                            GGML_TASK_TYPE_COMPUTE, GGML_TYPE_F16,
-                            GGML_TYPE_F16, GGML_TYPE_F32, GGML_PREC_DEFAULT);
-                        if (!ok) {
-                            printf("llamafile_sgemm failed\n");
-                        }
-                    },
-                    nullptr);
+    average_retrieval_q_(q_in_data, batch_size, q_len);
+    const int tile_num =
+        (max_block_num + kSimilarityTile - 1) / kSimilarityTile;
+    Backend_NUMA::getInstance().do_work(
+        batch_size * tile_num, nullptr,
+        [&](int task_id) {
+            int batch_id = task_id / tile_num;
+            int tile_id = task_id % tile_num;
+            int begin = std::max(init_block_num, tile_id * kSimilarityTile);
+            int end = std::min(
+                cache_seqlens_[batch_id] / config_.block_len - local_block_num,
+                (tile_id + 1) * kSimilarityTile);
+            if (begin >= end) {
+                return;
             }
-        }
-    } else {
-        Backend_NUMA::getInstance().do_work(
-            batch_size * max_block_num, nullptr,
-            [&](int task_id) {
-                int batch_id = task_id / max_block_num;
-                int block_id = task_id % max_block_num;
-                int seq_len = cache_seqlens_[batch_id];
-
-                if (block_id < init_block_num ||
-                    block_id >=
-                        (seq_len / config_.block_len) - local_block_num) {
-                    return;
-                }
+            block_similarity_(
+                layer_idx, batch_id, 0, config_.q_head_num,
+                block_table_before_retrieval_[batch_id].data() + begin,
+                end - begin, block_similar_[batch_id].data() + begin);
+        },
+        nullptr);
 
-                int block_idx =
-                    block_table_before_retrieval_[batch_id][block_id];
-                float sim = 0;
-
-                for (int head_id = 0; head_id < config_.q_head_num; head_id++) {
-                    for (int i = 0; i < config_.head_dim; i++) {
-                        float q_i = 0,
-                              qa_i = std::numeric_limits<float>::lowest();
-                        for (int q_id = 0; q_id < q_len; q_id++) {
-                            q_i += GGML_FP16_TO_FP32(
-                                q_in_data[batch_id * q_len *
-                                              config_.q_head_num *
-                                              config_.head_dim +
-                                          q_id * config_.q_head_num *
-                                              config_.head_dim +
-                                          head_id * config_.head_dim + i]);
-                        }
-                        q_i /= q_len;
-                        for (int anchor_id = 0; anchor_id < config_.anchor_num;
-                             anchor_id++) {
-                            qa_i = std::max(
-                                qa_i,
-                                GGML_FP16_TO_FP32(
-                                    anchor_[(long long)layer_idx *
-                                                config_.max_block_num *
-                                                config_.anchor_num *
-                                                config_.q_head_num *
-                                                config_.head_dim +
-                                            block_idx * config_.anchor_num *
-                                                config_.q_head_num *
-                                                config_.head_dim +
-                                            anchor_id * config_.q_head_num *
-                                                config_.head_dim +
-                                            head_id * config_.head_dim + i]) *
-                                    q_i);
-                        }
-                        sim += qa_i;
-                    }
-                }
-                block_similar_[batch_id][block_id] = sim;
-            },
-            nullptr);
-    }
     // Timer end
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> diff = end - start;
@@ -1043,28 +649,20 @@ void KVCache::select_block_layer_(int batch_size, int layer_idx,
             continue;
         }
 
-        for (int block_id = init_block_num;
-             block_id <
-             (cache_seqlens_[batch_idx] / config_.block_len) - local_block_num;
-             block_id++) {
-            top_similar_block_[batch_idx].push(std::make_pair(
-                block_similar_[batch_idx][block_id],
-                block_table_before_retrieval_[batch_idx][block_id]));
-            if (top_similar_block_[batch_idx].size() > pick_block_num) {
-                top_similar_block_[batch_idx].pop();
-            }
-        }
+        int *block_id = top_block_id_[batch_idx].data();
+        pick_top_blocks_(block_similar_[batch_idx].data(), init_block_num,
+                         (cache_seqlens_[batch_idx] / config_.block_len) -
+                             local_block_num,
+                         pick_block_num, block_id);
 
         int i = 0;
         for (; i < init_block_num; i++) {
             block_table_after_retrieval_[batch_idx][i] =
                 block_table_before_retrieval_[batch_idx][i];
         }
-        while (!top_similar_block_[batch_idx].empty()) {
+        for (int j = 0; j < pick_block_num; j++, i++) {
             block_table_after_retrieval_[batch_idx][i] =
-                top_similar_block_[batch_idx].top().second;
-            top_similar_block_[batch_idx].pop();
-            i++;
+                block_table_before_retrieval_[batch_idx][block_id[j]];
         }
         for (; i < init_block_num + pick_block_num + local_block_num; i++) {
             block_table_after_retrieval_[batch_idx][i] =
@@ -1207,155 +805,15 @@ void KVCache::calculate_sparsity_layer_(const uint16_t *q_in_data,
             int head_id = (task_id % (config_.kv_head_num * max_block_num)) /
                           max_block_num;
             int block_id = task_id % max_block_num;
-            int thread_id = Backend::thread_local_id;
+            int thread_id = Backend_NUMA::thread_local_id_;
             // If the block is out of the sequence length, skip it.
             if (cache_seqlens[batch_id] / config_.block_len < block_id) {
                 return;
             }
             int block_idx = block_table[batch_id * max_block_num + block_id];
-            if (cache_seqlens_[batch_id] / config_.block_len == block_id) {
-                int seq_len = cache_seqlens_[batch_id] % config_.block_len;
-                if (seq_len == 0)
-                    return;
-
-                // Prepare the attention mask for the last block.
-                int full_blocks = seq_len / 8;
-                int remaining_bits = seq_len % 8;
-                // Fill full blocks with 1s
-                for (int i = 0; i < full_blocks; ++i) {
-                    thread_local_attn_mask_[thread_id][i] = 0xFF;
-                }
-                // Fill the remaining bits in the next block
-                if (remaining_bits > 0 && full_blocks < seq_len_ / 8) {
-                    thread_local_attn_mask_[thread_id][full_blocks] =
-                        (1 << remaining_bits) - 1;
-                } else {
-                    thread_local_attn_mask_[thread_id][full_blocks] = 0;
-                }
-
-                for (int i = full_blocks + 1; i < seq_len_ / 8; ++i) {
-                    thread_local_attn_mask_[thread_id][i] = 0;
-                }
-                if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num, GGML_TYPE_F16,
-                        (void *)&q_in_data[batch_id * config_.kv_head_num *
-                                               n_gqa_ * config_.head_dim +
-                                           head_id * n_gqa_ * config_.head_dim],
-                        seq_len_, 0, false,
-                        thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_F16, 0,
-                        k_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_F16, 1,
-                        v_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, false,
-                        thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q4_0, 0,
-                        k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
-                        v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, false,
-                        thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q8_0, 0,
-                        k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
-                        v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                }
-            } else {
-                if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num, GGML_TYPE_F16,
-                        (void *)&q_in_data[batch_id * config_.kv_head_num *
-                                               n_gqa_ * config_.head_dim +
-                                           head_id * n_gqa_ * config_.head_dim],
-                        seq_len_, 0, true, nullptr, GGML_TYPE_F16, 0,
-                        k_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_F16, 1,
-                        v_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q4_0, 0,
-                        k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
-                        v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q8_0, 0,
-                        k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
-                        v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                }
+            if (!attn_block_(q_in_data, batch_id, head_id, block_id, block_idx,
+                             thread_id)) {
+                return;
             }
             for (int i = 0; i < n_gqa_; i++) {
                 block_lse_[batch_id][block_idx][head_id * n_gqa_ + i] =
@@ -1538,10 +996,6 @@ void KVCache::attn_initialize_kvhead_(int batch_size, int layer_idx,
                 attn_lse_[batch_idx][i][j] = 0;
             }
         }
-
-        // clear top_similar_block_
-        while (!top_similar_block_[batch_idx].empty())
-            top_similar_block_[batch_idx].pop();
     }
 
     for (int batch_idx = 0; batch_idx < batch_size; batch_idx++) {
@@ -1550,7 +1004,6 @@ void KVCache::attn_initialize_kvhead_(int batch_size, int layer_idx,
             for (int j = 0; j < config_.kv_head_num; j++) {
                 block_table_before_retrieval_kvhead_[batch_idx][i][j] =
                     block_table[batch_idx * max_block_num + i];
-                block_similar_kv_head_[batch_idx][i][j] = 0;
             }
         }
     }
@@ -1676,156 +1129,15 @@ void KVCache::calculate_sparsity_kvhead_(const uint16_t *q_in_data,
             int head_id = (task_id % (config_.kv_head_num * max_block_num)) /
                           max_block_num;
             int block_id = task_id % max_block_num;
-            int thread_id = Backend::thread_local_id;
+            int thread_id = Backend_NUMA::thread_local_id_;
             // If the block is out of the sequence length, skip it.
             if (cache_seqlens[batch_id] / config_.block_len < block_id) {
                 return;
             }
             int block_idx = block_table[batch_id * max_block_num + block_id];
-            if (cache_seqlens_[batch_id] / config_.block_len == block_id) {
-                int seq_len = cache_seqlens_[batch_id] % config_.block_len;
-                if (seq_len == 0)
-                    return;
-
-                // Prepare the attention mask for the last block.
-                int full_blocks = seq_len / 8;
-                int remaining_bits = seq_len % 8;
-
-                // Fill full blocks with 1s
-                for (int i = 0; i < full_blocks; ++i) {
-                    thread_local_attn_mask_[thread_id][i] = 0xFF;
-                }
-                // Fill the remaining bits in the next block
-                if (remaining_bits > 0 && full_blocks < seq_len_ / 8) {
-                    thread_local_attn_mask_[thread_id][full_blocks] =
-                        (1 << remaining_bits) - 1;
-                } else {
-                    thread_local_attn_mask_[thread_id][full_blocks] = 0;
-                }
-
-                for (int i = full_blocks + 1; i < seq_len_ / 8; ++i) {
-                    thread_local_attn_mask_[thread_id][i] = 0;
-                }
-                if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num, GGML_TYPE_F16,
-                        (void *)&q_in_data[batch_id * config_.kv_head_num *
-                                               n_gqa_ * config_.head_dim +
-                                           head_id * n_gqa_ * config_.head_dim],
-                        seq_len_, 0, false,
-                        thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_F16, 0,
-                        k_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_F16, 1,
-                        v_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, false,
-                        thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q4_0, 0,
-                        k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
-                        v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, false,
-                        thread_local_attn_mask_[thread_id].data(),
-                        GGML_TYPE_Q8_0, 0,
-                        k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
-                        v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                }
-            } else {
-                if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num, GGML_TYPE_F16,
-                        (void *)&q_in_data[batch_id * config_.kv_head_num *
-                                               n_gqa_ * config_.head_dim +
-                                           head_id * n_gqa_ * config_.head_dim],
-                        seq_len_, 0, true, nullptr, GGML_TYPE_F16, 0,
-                        k_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_F16, 1,
-                        v_cache_fp16_[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q4_0, 0,
-                        k_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q4_0, 1,
-                        v_cache_q4[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                    attn_with_kvcache_one_block_(
-                        config_.head_dim,
-                        config_.q_head_num / config_.kv_head_num,
-                        GGML_TYPE_Q8_0, q_q8_0_[batch_id][head_id].data(),
-                        seq_len_, 0, true, nullptr, GGML_TYPE_Q8_0, 0,
-                        k_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr, GGML_TYPE_Q8_0, 1,
-                        v_cache_q8[layer_id_][head_id][block_idx].data(), 0,
-                        nullptr, nullptr,
-                        thread_local_attn_score_[thread_id].data(),
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_attn_lse_[thread_id].data(),
-                        thread_local_draft_[thread_id].data(), nullptr,
-                        cos_.data(), sin_.data());
-                    dequantize_row_q8_0(
-                        thread_local_output_q8_0_[thread_id].data(),
-                        thread_local_output_fp32_[thread_id].data(),
-                        n_gqa_ * config_.head_dim);
-                }
+            if (!attn_block_(q_in_data, batch_id, head_id, block_id, block_idx,
+                             thread_id)) {
+                return;
             }
             for (int i = 0; i < n_gqa_; i++) {
                 block_lse_[batch_id][block_idx][head_id * n_gqa_ + i] =
@@ -1999,53 +1311,33 @@ void KVCache::calculate_block_similarity_kvhead_(
     int local_block_num, int pick_block_num, Backend *backend) {
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
+
+    average_retrieval_q_(q_in_data, batch_size, q_len);
+    const int tile_num =
+        (max_block_num + kSimilarityTile - 1) / kSimilarityTile;
     Backend_NUMA::getInstance().do_work(
-        batch_size * max_block_num, nullptr,
+        batch_size * config_.kv_head_num * tile_num, nullptr,
         [&](int task_id) {
-            int batch_id = task_id / max_block_num;
-            int block_id = task_id % max_block_num;
-            int seq_len = cache_seqlens_[batch_id];
-
-            if (block_id < init_block_num ||
-                block_id >= (seq_len / config_.block_len) - local_block_num) {
+            int batch_id = task_id / (config_.kv_head_num * tile_num);
+            int head_id = task_id / tile_num % config_.kv_head_num;
+            int tile_id = task_id % tile_num;
+            int begin = std::max(init_block_num, tile_id * kSimilarityTile);
+            int end = std::min(
+                cache_seqlens_[batch_id] / config_.block_len - local_block_num,
+                (tile_id + 1) * kSimilarityTile);
+            if (begin >= end) {
                 return;
             }
-            int block_idx =
-                block_table_before_retrieval_kvhead_[batch_id][block_id][0];
-
-            for (int head_id = 0; head_id < config_.q_head_num; head_id++) {
-                for (int i = 0; i < config_.head_dim; i++) {
-                    float q_i = 0, qa_i = std::numeric_limits<float>::lowest();
-                    for (int q_id = 0; q_id < q_len; q_id++) {
-                        q_i += GGML_FP16_TO_FP32(
-                            q_in_data[batch_id * q_len * config_.q_head_num *
-                                          config_.head_dim +
-                                      q_id * config_.q_head_num *
-                                          config_.head_dim +
-                                      head_id * config_.head_dim + i]);
-                    }
-                    q_i /= q_len;
-                    for (int anchor_id = 0; anchor_id < config_.anchor_num;
-                         anchor_id++) {
-                        qa_i = std::max(
-                            qa_i,
-                            GGML_FP16_TO_FP32(
-                                anchor_[layer_idx * config_.max_block_num *
-                                            config_.anchor_num *
-                                            config_.q_head_num *
-                                            config_.head_dim +
-                                        block_idx * config_.anchor_num *
-                                            config_.q_head_num *
-                                            config_.head_dim +
-                                        anchor_id * config_.q_head_num *
-                                            config_.head_dim +
-                                        head_id * config_.head_dim + i]) *
-                                q_i);
-                    }
-                    block_similar_kv_head_[batch_id][block_id]
-                                          [head_id / n_gqa_] += qa_i;
-                }
+            // the anchors are kept per block of the first kv head
+            int block_idx[kSimilarityTile];
+            for (int i = begin; i < end; i++) {
+                block_idx[i - begin] =
+                    block_table_before_retrieval_kvhead_[batch_id][i][0];
             }
+            block_similarity_(layer_idx, batch_id, head_id * n_gqa_, n_gqa_,
+                              block_idx, end - begin,
+                              block_similar_kv_head_[batch_id].data() +
+                                  head_id * config_.max_block_num + begin);
         },
         nullptr);
 
@@ -2076,31 +1368,23 @@ void KVCache::select_block_kvhead_(int batch_size, int layer_idx,
             continue;
         }
         for (int head_id = 0; head_id < config_.kv_head_num; head_id++) {
-
-            for (int block_id = init_block_num;
-                 block_id < (cache_seqlens_[batch_idx] / config_.block_len) -
-                                local_block_num;
-                 block_id++) {
-
-                top_similar_block_[batch_idx].push(std::make_pair(
-                    block_similar_kv_head_[batch_idx][block_id][head_id],
-                    block_table_before_retrieval_kvhead_[batch_idx][block_id]
-                                                        [head_id]));
-                if (top_similar_block_[batch_idx].size() > pick_block_num) {
-                    top_similar_block_[batch_idx].pop();
-                }
-            }
+            int *block_id = top_block_id_[batch_idx].data();
+            pick_top_blocks_(block_similar_kv_head_[batch_idx].data() +
+                                 head_id * config_.max_block_num,
+                             init_block_num,
+                             (cache_seqlens_[batch_idx] / config_.block_len) -
+                                 local_block_num,
+                             pick_block_num, block_id);
 
             int i = 0;
             for (; i < init_block_num; i++) {
                 block_table_after_retrieval_kvhead_[batch_idx][i][head_id] =
                     block_table_before_retrieval_kvhead_[batch_idx][i][head_id];
             }
-            while (!top_similar_block_[batch_idx].empty()) {
+            for (int j = 0; j < pick_block_num; j++, i++) {
                 block_table_after_retrieval_kvhead_[batch_idx][i][head_id] =
-                    top_similar_block_[batch_idx].top().second;
-                top_similar_block_[batch_idx].pop();
-                i++;
+                    block_table_before_retrieval_kvhead_[batch_idx][block_id[j]]
+                                                        [head_id];
             }
             for (; i < init_block_num + pick_block_num + local_block_num; i++) {
                 block_table_after_retrieval_kvhead_[batch_idx][i][head_id] =
@@ -2186,7 +1470,8 @@ void KVCache::get_attn_sparsity(const ggml_fp16_t *q_in, float *attn_sparsity,
 
 void KVCache::attn_with_kvcache_one_block_(
     int head_dim, int bsz,
-    ggml_type q_type, // GGML data type of `Q`, only supports fp16 and q8_0
+    ggml_type q_type, // GGML data type of `Q`, only supports fp16, q8_0 and
+                      // bf16 (for fp8_e4m3 caches)
     // [bsz, head_dim]
     // Quantization is always on the head_dim dimension (per_token). If
     // head_dim % 32 != 0, an error will be raised. The size must be bsz *
@@ -2200,7 +1485,7 @@ void KVCache::attn_with_kvcache_one_block_(
     const uint8_t *attn_mask,
 
     ggml_type k_type, // GGML data type of `K Cache`, only supports fp16,
-                      // q4_0, q8_0
+                      // q4_0, q8_0, fp8_e4m3
     int k_quant_type, // 0 for per_token, 1 for per_channel, others raise an
                       // error
     // [seq_len, head_dim]
@@ -2251,8 +1536,63 @@ void KVCache::attn_with_kvcache_one_block_(
     assert(head_dim % 32 == 0);
     assert(k_quant_type == 0);
     assert(v_quant_type == 1);
-    assert(q_type == GGML_TYPE_F16 || q_type == GGML_TYPE_Q8_0);
-    if (q_type == GGML_TYPE_F16) {
+    assert(q_type == GGML_TYPE_F16 || q_type == GGML_TYPE_Q8_0 ||
+           q_type == GGML_TYPE_BF16);
+    if (q_type == GGML_TYPE_BF16) {
+        // fp8 caches: fp8_gemm dequantizes the blocks of K and V inside its
+        // dot products, q and the probabilities are fed in bf16. Both the
+        // head_dim of K and the seq_len of V are multiples of QK_FP8.
+        assert(k_type == GGML_TYPE_FP8_E4M3);
+        assert(v_type == GGML_TYPE_FP8_E4M3);
+        assert(head_dim % QK_FP8 == 0 && past_kv_len % QK_FP8 == 0);
+        // TODO: anchor, rope
+        assert(num_k_anchor == 0);
+        assert(rotary_angle == nullptr);
+
+        fp8_gemm(bsz, past_kv_len, head_dim, k_cache, (const ggml_bf16_t *)q,
+                 head_dim, attn_score, past_kv_len);
+
+        // attn = attn * scale
+        float scale_factor = 1.0 / std::sqrt(float(head_dim));
+        ggml_vec_scale_f32(bsz * past_kv_len, attn_score, scale_factor);
+
+        // attn = attn & mask
+        if (!is_full_attn) {
+            for (int i = 0; i < bsz; i++) {
+                for (int j = 0; j < past_kv_len; j++) {
+                    int index = i * past_kv_len + j;
+                    if (!(attn_mask[j / 8] & (1 << (j % 8)))) {
+                        attn_score[index] =
+                            std::numeric_limits<float>::lowest();
+                    }
+                }
+            }
+        }
+
+        // attn = softmax(attn)
+        for (int i = 0; i < bsz; i++) {
+            float sum_exp = 0;
+            for (int j = 0; j < past_kv_len; j++) {
+                attn_score[i * past_kv_len + j] =
+                    std::exp(attn_score[i * past_kv_len + j]);
+                sum_exp += attn_score[i * past_kv_len + j];
+            }
+            for (int j = 0; j < past_kv_len; j++) {
+                attn_score[i * past_kv_len + j] /= sum_exp;
+            }
+            if (lse != nullptr) {
+                lse[i] = std::log(sum_exp);
+            }
+        }
+
+        // output = attn * v
+        ggml_bf16_t *attn_score_bf16 = reinterpret_cast<ggml_bf16_t *>(draft);
+        ggml_fp32_to_bf16_row(attn_score, attn_score_bf16, bsz * past_kv_len);
+        // TODO: anchor
+        assert(num_v_anchor == 0);
+        fp8_gemm(bsz, head_dim, past_kv_len, v_cache, attn_score_bf16,
+                 past_kv_len, (float *)output, head_dim);
+    } else if (q_type == GGML_TYPE_F16) {
         assert(k_type == GGML_TYPE_F16);
         assert(v_type == GGML_TYPE_F16);
 
@@ -0,0 +1,133 @@
+/**
+ * @Description  : Reference-counted cache blocks shared between sequences,
+ *                 copied on the first write of a sequence that diverges.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+
+#include "kvcache.h"
+
+int KVCache::alloc_block() {
+    std::lock_guard<std::mutex> lock(block_ref_mutex_);
+    return alloc_block_();
+}
+
+int KVCache::alloc_block_() {
+    if (free_blocks_.empty()) {
+        throw std::runtime_error("KVCache: no free block left out of " +
+                                 std::to_string(block_ref_.size()));
+    }
+    int block_idx = free_blocks_.back();
+    free_blocks_.pop_back();
+    block_ref_[block_idx] = 1;
+    return block_idx;
+}
+
+void KVCache::check_block_idx_(int block_idx, const char *caller) const {
+    // -1 and the other unset entries of a table are not blocks
+    if (block_idx < 0 || block_idx >= (int)block_ref_.size()) {
+        throw std::out_of_range(std::string(caller) + ": block " +
+                                std::to_string(block_idx) + " out of range");
+    }
+}
+
+void KVCache::fork_block_table(const int *src_table, int *dst_table,
+                               int block_num) {
+    std::lock_guard<std::mutex> lock(block_ref_mutex_);
+    // checked first, a bad table leaves the counts untouched
+    for (int i = 0; i < block_num; i++) {
+        check_block_idx_(src_table[i], "fork_block_table");
+    }
+    for (int i = 0; i < block_num; i++) {
+        dst_table[i] = src_table[i];
+        block_ref_[src_table[i]]++;
+    }
+}
+
+void KVCache::free_block_table(const int *block_table, int block_num) {
+    std::lock_guard<std::mutex> lock(block_ref_mutex_);
+    for (int i = 0; i < block_num; i++) {
+        check_block_idx_(block_table[i], "free_block_table");
+    }
+    std::vector<int> ref(block_num);
+    for (int i = 0; i < block_num; i++) {
+        // a table holding a block twice must hold two references
+        ref[i] = --block_ref_[block_table[i]];
+        if (ref[i] < 0) {
+            for (int j = 0; j <= i; j++) {
+                block_ref_[block_table[j]]++;
+            }
+            throw std::out_of_range(
+                "free_block_table: block " + std::to_string(block_table[i]) +
+                " freed more often than it is referenced");
+        }
+    }
+    for (int i = 0; i < block_num; i++) {
+        if (ref[i] == 0) {
+            free_blocks_.push_back(block_table[i]);
+        }
+    }
+}
+
+int KVCache::get_block_ref(int block_idx) {
+    std::lock_guard<std::mutex> lock(block_ref_mutex_);
+    check_block_idx_(block_idx, "get_block_ref");
+    return block_ref_[block_idx];
+}
+
+void KVCache::make_blocks_writable_(int *block_table, int batch_size,
+                                    int max_block_num, const int *cache_seqlens,
+                                    int q_len) {
+    std::lock_guard<std::mutex> lock(block_ref_mutex_);
+    for (int batch_id = 0; batch_id < batch_size; batch_id++) {
+        // only the blocks that receive the new tokens, the full blocks of a
+        // shared prefix stay shared
+        int block_begin = cache_seqlens[batch_id] / config_.block_len;
+        int block_end =
+            (cache_seqlens[batch_id] + q_len - 1) / config_.block_len;
+        for (int block_id = block_begin; block_id <= block_end; block_id++) {
+            int &block_idx = block_table[batch_id * max_block_num + block_id];
+            check_block_idx_(block_idx, "make_blocks_writable_");
+            if (block_ref_[block_idx] <= 1) {
+                continue;
+            }
+            int copy_idx = alloc_block_();
+            copy_block_(block_idx, copy_idx);
+            block_ref_[block_idx]--;
+            block_idx = copy_idx;
+        }
+    }
+}
+
+void KVCache::copy_block_(int src_idx, int dst_idx) {
+    // The block of every layer is copied at once: the layers after the one
+    // being written still hold the shared prefix and read the new index from
+    // the same block table.
+    size_t anchor_block_size =
+        (size_t)config_.anchor_num * config_.q_head_num * config_.head_dim;
+    Backend_NUMA::getInstance().do_work(
+        config_.layer_num, nullptr,
+        [&](int layer_id) {
+            for (int head_id = 0; head_id < config_.kv_head_num; head_id++) {
+                memcpy(k_cache_.block<void>(layer_id, head_id, dst_idx),
+                       k_cache_.block<void>(layer_id, head_id, src_idx),
+                       k_cache_.get_block_bytes());
+                // an MLA cache never writes V, its pages stay uncommitted
+                if (config_.kv_lora_rank == 0) {
+                    memcpy(v_cache_.block<void>(layer_id, head_id, dst_idx),
+                           v_cache_.block<void>(layer_id, head_id, src_idx),
+                           v_cache_.get_block_bytes());
+                }
+            }
+            memcpy(importance_.block<void>(layer_id, 0, dst_idx),
+                   importance_.block<void>(layer_id, 0, src_idx),
+                   importance_.get_block_bytes());
+            ggml_fp16_t *anchor =
+                anchor_.data() +
+                (size_t)layer_id * config_.max_block_num * anchor_block_size;
+            memcpy(anchor + dst_idx * anchor_block_size,
+                   anchor + src_idx * anchor_block_size,
+                   anchor_block_size * sizeof(ggml_fp16_t));
+        },
+        nullptr);
+}
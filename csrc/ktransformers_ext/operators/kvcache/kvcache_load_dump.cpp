@@ -10,12 +10,198 @@
 
 #include "kvcache.h"
 
+#include <cerrno>
 #include <chrono>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// File layout (version 1), offsets in bytes from the start of the file:
+//   KVCacheFileHeader
+//   KVCacheFileBlock index [layer_num, block_num]
+//   anchor_                                at header.anchor_offset
+//   one record per (layer, block)          at index[i].offset
+// A record holds the K blocks of all kv heads, the V blocks of all kv heads
+// and the importance block. The anchor and the records start on a page
+// boundary so they are mapped and copied in parallel.
+// Files without the magic are the unversioned dumps: cache_total_len,
+// anchor_, then per layer the K/V blocks of each head and the importance.
+
+static constexpr char kKVCacheFileMagic[8] = {'K', 'T', 'K', 'V',
+                                              'C', 'A', 'C', 'H'};
+static constexpr uint32_t kKVCacheFileVersion = 1;
+static constexpr size_t kKVCacheFileAlign = 4096;
+static constexpr uint64_t kChecksumSeed = 0xcbf29ce484222325ull;
+
+struct KVCacheFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t kv_type;
+    uint32_t layer_num;
+    uint32_t kv_head_num;
+    uint32_t q_head_num;
+    uint32_t head_dim;
+    uint32_t block_len;
+    uint32_t anchor_num;
+    int32_t cache_total_len;
+    uint32_t block_num;
+    uint64_t kv_block_bytes;
+    uint64_t importance_block_bytes;
+    uint64_t anchor_offset;
+    uint64_t anchor_bytes;
+    uint64_t anchor_checksum;
+};
+
+struct KVCacheFileBlock {
+    uint64_t offset;
+    uint64_t checksum;
+};
+
+static size_t align_up(size_t x) {
+    return (x + kKVCacheFileAlign - 1) / kKVCacheFileAlign * kKVCacheFileAlign;
+}
+
+// FNV-1a over 8-byte words. A record is hashed block by block, each call
+// continuing from the hash of the previous block.
+static uint64_t checksum(const void *data, size_t bytes,
+                         uint64_t seed = kChecksumSeed) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    uint64_t h = seed;
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0x100000001b3ull;
+    }
+    for (; i < bytes; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
 
 void KVCache::load_kvcache(std::string tensor_file_path, Backend *backend) {
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
-    std::ifstream ifs_tensor(tensor_file_path, std::ios::binary);
+    int fd = open(tensor_file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open tensor file");
+    }
+    struct stat st;
+    KVCacheFileHeader header;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header) ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, kKVCacheFileMagic, sizeof(header.magic)) != 0) {
+        close(fd);
+        std::ifstream ifs_tensor(tensor_file_path, std::ios::binary);
+        load_kvcache_unversioned_(ifs_tensor);
+        return;
+    }
+    auto check = [&](bool ok, const std::string &what) {
+        if (!ok) {
+            close(fd);
+            throw std::runtime_error("load_kvcache: " + tensor_file_path +
+                                     ": " + what);
+        }
+    };
+    check(header.version == kKVCacheFileVersion,
+          "unsupported version " + std::to_string(header.version));
+    check(header.kv_type == config_.kv_type &&
+              header.layer_num == config_.layer_num &&
+              header.kv_head_num == config_.kv_head_num &&
+              header.q_head_num == config_.q_head_num &&
+              header.head_dim == config_.head_dim &&
+              header.block_len == config_.block_len &&
+              header.anchor_num == config_.anchor_num &&
+              header.anchor_bytes == anchor_.size() * sizeof(ggml_fp16_t),
+          "the cache was dumped with a different config");
+    check(header.block_num <= (uint32_t)config_.max_block_num,
+          std::to_string(header.block_num) +
+              " blocks, more than max_block_num");
+    const size_t index_bytes = (size_t)header.layer_num * header.block_num *
+                               sizeof(KVCacheFileBlock);
+    check((size_t)st.st_size >= sizeof(header) + index_bytes &&
+              (size_t)st.st_size >=
+                  header.anchor_offset + header.anchor_bytes,
+          "truncated file");
+
+    uint8_t *file = static_cast<uint8_t *>(
+        mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+    close(fd);
+    if (file == MAP_FAILED) {
+        throw std::runtime_error("load_kvcache: failed to map " +
+                                 tensor_file_path + ": " + strerror(errno));
+    }
+    madvise(file, st.st_size, MADV_WILLNEED);
+
+    cache_total_len_ = header.cache_total_len;
+    int past_block_num = header.block_num;
+    printf("cache_total_len: %d, past_block_num: %d\n", cache_total_len_,
+           past_block_num);
+    for (int i = 0; i < config_.layer_num; ++i) {
+        past_block_num_[i] = past_block_num;
+    }
+    if (past_block_num > k_cache_.get_block_num()) {
+        k_cache_.resize(past_block_num);
+        v_cache_.resize(past_block_num);
+        importance_.resize(past_block_num);
+    }
+    const size_t kv_bytes = k_cache_.get_block_bytes();
+    const size_t importance_bytes = importance_.get_block_bytes();
+    const size_t record_bytes =
+        2 * config_.kv_head_num * kv_bytes + importance_bytes;
+    const KVCacheFileBlock *index =
+        reinterpret_cast<const KVCacheFileBlock *>(file + sizeof(header));
+
+    memcpy(anchor_.data(), file + header.anchor_offset, header.anchor_bytes);
+    std::atomic<int> bad_records(
+        checksum(anchor_.data(), header.anchor_bytes) !=
+        header.anchor_checksum);
+    // The threads copy whole records from the page cache into the arena, so
+    // the reads of the file and the faults of the arena are spread over them
+    Backend_NUMA::getInstance().do_work(
+        config_.layer_num * past_block_num, nullptr,
+        [&](int task_id) {
+            int layer_id = task_id / past_block_num;
+            int block_idx = task_id % past_block_num;
+            if (index[task_id].offset + record_bytes > (size_t)st.st_size) {
+                bad_records++;
+                return;
+            }
+            const uint8_t *src = file + index[task_id].offset;
+            uint64_t h = kChecksumSeed;
+            for (KVCacheArena *cache : {&k_cache_, &v_cache_}) {
+                for (int head_id = 0; head_id < config_.kv_head_num;
+                     head_id++) {
+                    h = checksum(src, kv_bytes, h);
+                    memcpy(cache->block<uint8_t>(layer_id, head_id, block_idx),
+                           src, kv_bytes);
+                    src += kv_bytes;
+                }
+            }
+            h = checksum(src, importance_bytes, h);
+            memcpy(importance_.block<uint8_t>(layer_id, 0, block_idx), src,
+                   importance_bytes);
+            if (h != index[task_id].checksum) {
+                bad_records++;
+            }
+        },
+        nullptr);
+    munmap(file, st.st_size);
+    if (bad_records > 0) {
+        throw std::runtime_error("load_kvcache: " + tensor_file_path + ": " +
+                                 std::to_string(bad_records.load()) +
+                                 " corrupted records");
+    }
+    // Timer end
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> diff = end - start;
+    printf("time of load: %f s\n", diff.count());
+}
+
+void KVCache::load_kvcache_unversioned_(std::ifstream &ifs_tensor) {
+    // Timer start
+    auto start = std::chrono::high_resolution_clock::now();
     if (!ifs_tensor) {
         throw std::runtime_error("Failed to open tensor file");
     }
@@ -30,32 +216,24 @@ void KVCache::load_kvcache(std::string tensor_file_path, Backend *backend) {
     }
     ifs_tensor.read(reinterpret_cast<char *>(anchor_.data()),
                     anchor_.size() * sizeof(ggml_fp16_t));
+    if (past_block_num > k_cache_.get_block_num()) {
+        k_cache_.resize(past_block_num);
+        v_cache_.resize(past_block_num);
+        importance_.resize(past_block_num);
+    }
+    // The importance rows of a block are contiguous, [block_len, q_head_num]
     for (int i = 0; i < config_.layer_num; ++i) {
         for (int j = 0; j < config_.kv_head_num; ++j) {
             for (int k = 0; k < past_block_num_[i]; ++k) {
-                if (config_.kv_type == GGML_TYPE_F16) {
-                    ifs_tensor.read(
-                        reinterpret_cast<char *>(k_cache_fp16_[i][j][k].data()),
-                        k_cache_fp16_[i][j][k].size() * sizeof(ggml_fp16_t));
-                    ifs_tensor.read(
-                        reinterpret_cast<char *>(v_cache_fp16_[i][j][k].data()),
-                        v_cache_fp16_[i][j][k].size() * sizeof(ggml_fp16_t));
-                } else if (config_.kv_type == GGML_TYPE_Q4_0) {
-                    ifs_tensor.read(
-                        reinterpret_cast<char *>(k_cache_q4[i][j][k].data()),
-                        k_cache_q4[i][j][k].size() * sizeof(block_q4_0));
-                    ifs_tensor.read(
-                        reinterpret_cast<char *>(v_cache_q4[i][j][k].data()),
-                        v_cache_q4[i][j][k].size() * sizeof(block_q4_0));
-                }
+                ifs_tensor.read(k_cache_.block<char>(i, j, k),
+                                k_cache_.get_block_bytes());
+                ifs_tensor.read(v_cache_.block<char>(i, j, k),
+                                v_cache_.get_block_bytes());
             }
         }
         for (int k = 0; k < past_block_num_[i]; ++k) {
-            for (int l = 0; l < config_.block_len; l++) {
-                ifs_tensor.read(
-                    reinterpret_cast<char *>(importance_[i][k][l].data()),
-                    importance_[i][k][l].size() * sizeof(ggml_fp16_t));
-            }
+            ifs_tensor.read(importance_.block<char>(i, 0, k),
+                            importance_.get_block_bytes());
         }
     }
     ifs_tensor.close();
@@ -64,63 +242,122 @@ void KVCache::load_kvcache(std::string tensor_file_path, Backend *backend) {
     std::chrono::duration<double> diff = end - start;
     printf("time of load: %f s\n", diff.count());
 }
+
 void KVCache::dump_kvcache(int *block_table, int cache_total_len,
                            std::string tensor_file_path, Backend *backend) {
     // Timer start
     auto start = std::chrono::high_resolution_clock::now();
-    std::ofstream ofs(tensor_file_path, std::ios::binary);
+    // Written next to the target and renamed over it once complete, so a
+    // dump that dies midway never leaves a file without its header
+    const std::string tmp_path = tensor_file_path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
     printf("dump_kvcache: %s\n", tensor_file_path.c_str());
-    if (!ofs.is_open()) {
-        std::cerr << "Cannot open file " << tensor_file_path << std::endl;
+    if (fd < 0) {
+        std::cerr << "Cannot open file " << tmp_path << std::endl;
         return;
     }
-    ofs.write(reinterpret_cast<const char *>(&cache_total_len),
-              sizeof(cache_total_len));
     int past_block_num =
         (cache_total_len + config_.block_len - 1) / config_.block_len;
     printf("cache_total_len: %d, past_block_num: %d\n", cache_total_len,
            past_block_num);
-    ofs.write(reinterpret_cast<const char *>(anchor_.data()),
-              anchor_.size() * sizeof(ggml_fp16_t));
-    for (int i = 0; i < config_.layer_num; ++i) {
-        for (int j = 0; j < config_.kv_head_num; ++j) {
-            for (int k = 0; k < past_block_num; ++k) {
-                int block_idx = block_table[k];
-                if (config_.kv_type == GGML_TYPE_F16) {
-                    ofs.write(reinterpret_cast<const char *>(
-                                  k_cache_fp16_[i][j][block_idx].data()),
-                              k_cache_fp16_[i][j][block_idx].size() *
-                                  sizeof(ggml_fp16_t));
-                    ofs.write(reinterpret_cast<const char *>(
-                                  v_cache_fp16_[i][j][block_idx].data()),
-                              v_cache_fp16_[i][j][block_idx].size() *
-                                  sizeof(ggml_fp16_t));
-
-                } else if (config_.kv_type == GGML_TYPE_Q4_0) {
-                    ofs.write(reinterpret_cast<const char *>(
-                                  k_cache_q4[i][j][block_idx].data()),
-                              k_cache_q4[i][j][block_idx].size() *
-                                  sizeof(block_q4_0));
-                    ofs.write(reinterpret_cast<const char *>(
-                                  v_cache_q4[i][j][block_idx].data()),
-                              v_cache_q4[i][j][block_idx].size() *
-                                  sizeof(block_q4_0));
-                }
+
+    const size_t kv_bytes = k_cache_.get_block_bytes();
+    const size_t importance_bytes = importance_.get_block_bytes();
+    const size_t record_bytes =
+        2 * config_.kv_head_num * kv_bytes + importance_bytes;
+
+    KVCacheFileHeader header = {};
+    memcpy(header.magic, kKVCacheFileMagic, sizeof(header.magic));
+    header.version = kKVCacheFileVersion;
+    header.kv_type = config_.kv_type;
+    header.layer_num = config_.layer_num;
+    header.kv_head_num = config_.kv_head_num;
+    header.q_head_num = config_.q_head_num;
+    header.head_dim = config_.head_dim;
+    header.block_len = config_.block_len;
+    header.anchor_num = config_.anchor_num;
+    header.cache_total_len = cache_total_len;
+    header.block_num = past_block_num;
+    header.kv_block_bytes = kv_bytes;
+    header.importance_block_bytes = importance_bytes;
+    header.anchor_bytes = anchor_.size() * sizeof(ggml_fp16_t);
+    header.anchor_checksum = checksum(anchor_.data(), header.anchor_bytes);
+
+    std::vector<KVCacheFileBlock> index(config_.layer_num * past_block_num);
+    header.anchor_offset =
+        align_up(sizeof(header) + index.size() * sizeof(KVCacheFileBlock));
+    size_t file_bytes = align_up(header.anchor_offset + header.anchor_bytes);
+    for (auto &record : index) {
+        record.offset = file_bytes;
+        file_bytes += align_up(record_bytes);
+    }
+
+    std::atomic<bool> failed(false);
+    auto write_at = [&](const void *data, size_t bytes, size_t offset) {
+        const char *p = static_cast<const char *>(data);
+        while (bytes > 0) {
+            ssize_t n = pwrite(fd, p, bytes, offset);
+            if (n <= 0) {
+                failed = true;
+                return;
             }
+            p += n;
+            bytes -= n;
+            offset += n;
         }
-        for (int k = 0; k < past_block_num; ++k) {
-            int block_idx = block_table[k];
-            for (int l = 0; l < config_.block_len; l++) {
-                ofs.write(reinterpret_cast<const char *>(
-                              importance_[i][block_idx][l].data()),
-                          importance_[i][block_idx][l].size() *
-                              sizeof(ggml_fp16_t));
+    };
+    // Every record has its own place in the file, the threads pwrite them
+    // straight from the arena
+    Backend_NUMA::getInstance().do_work(
+        config_.layer_num * past_block_num, nullptr,
+        [&](int task_id) {
+            int layer_id = task_id / past_block_num;
+            int block_idx = block_table[task_id % past_block_num];
+            size_t offset = index[task_id].offset;
+            uint64_t h = kChecksumSeed;
+            for (KVCacheArena *cache : {&k_cache_, &v_cache_}) {
+                for (int head_id = 0; head_id < config_.kv_head_num;
+                     head_id++) {
+                    const uint8_t *src =
+                        cache->block<uint8_t>(layer_id, head_id, block_idx);
+                    h = checksum(src, kv_bytes, h);
+                    write_at(src, kv_bytes, offset);
+                    offset += kv_bytes;
+                }
             }
-        }
+            const uint8_t *src =
+                importance_.block<uint8_t>(layer_id, 0, block_idx);
+            index[task_id].checksum = checksum(src, importance_bytes, h);
+            write_at(src, importance_bytes, offset);
+        },
+        nullptr);
+    write_at(&header, sizeof(header), 0);
+    write_at(index.data(), index.size() * sizeof(KVCacheFileBlock),
+             sizeof(header));
+    write_at(anchor_.data(), header.anchor_bytes, header.anchor_offset);
+    if (ftruncate(fd, file_bytes) != 0 || fdatasync(fd) != 0) {
+        failed = true;
+    }
+    if (close(fd) != 0 || failed ||
+        rename(tmp_path.c_str(), tensor_file_path.c_str()) != 0) {
+        std::cerr << "Failed to write " << tensor_file_path << ": "
+                  << strerror(errno) << std::endl;
+        unlink(tmp_path.c_str());
+        return;
+    }
+    // the rename is durable once the directory is
+    size_t slash = tensor_file_path.find_last_of('/');
+    std::string dir =
+        slash == std::string::npos
+            ? "."
+            : tensor_file_path.substr(0, std::max<size_t>(slash, 1));
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
     }
-    ofs.close();
     // Timer end
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> diff = end - start;
     printf("time of dump: %f s\n", diff.count());
-}
\ No newline at end of file
+}
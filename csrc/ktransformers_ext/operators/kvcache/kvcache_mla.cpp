@@ -0,0 +1,215 @@
+/**
+ * @Description  : MLA decode attention of absorbed queries over the
+ *                 compressed latent cache.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+
+#include "kvcache.h"
+
+#include <chrono>
+
+void KVCache::write_mla_kv_(const ggml_fp16_t *kv_in, int q_len,
+                            int batch_size, int max_block_num,
+                            int *block_table, int *cache_seqlens) {
+    // A latent row is one K row of the single kv head, V is never written
+    Backend_NUMA::getInstance().do_work(
+        batch_size * q_len, nullptr,
+        [&](int task_id) {
+            int batch_id = task_id / q_len;
+            int pos = cache_seqlens[batch_id] + task_id % q_len;
+            int block_idx = block_table[batch_id * max_block_num +
+                                        pos / config_.block_len];
+            int offset = pos % config_.block_len * config_.head_dim;
+            const ggml_fp16_t *src =
+                kv_in + (size_t)task_id * config_.head_dim;
+
+            if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+                memcpy(k_cache_.block<ggml_fp16_t>(layer_id_, 0, block_idx) +
+                           offset,
+                       src, config_.head_dim * sizeof(ggml_fp16_t));
+                return;
+            }
+            std::vector<float> row(config_.head_dim);
+            for (int l = 0; l < config_.head_dim; l++) {
+                row[l] = GGML_FP16_TO_FP32(src[l]);
+            }
+            store_kv_(k_cache_.block<void>(layer_id_, 0, block_idx), offset,
+                      row.data(), config_.head_dim);
+        },
+        nullptr);
+}
+
+void KVCache::attn_mla(const ggml_fp16_t *q_in, const ggml_fp16_t *kv_in,
+                       ggml_fp16_t *output, float *attn_lse,
+                       float softmax_scale, int layer_idx, int q_len,
+                       int batch_size, int max_block_num, int *block_table,
+                       int *cache_seqlens, Backend *backend) {
+    // Timer start
+    auto start = std::chrono::high_resolution_clock::now();
+
+    if (config_.kv_lora_rank <= 0) {
+        throw std::runtime_error("attn_mla needs a KV cache with kv_lora_rank");
+    }
+    layer_id_ = layer_idx;
+    if (kv_in != nullptr) {
+        make_blocks_writable_(block_table, batch_size, max_block_num,
+                              cache_seqlens, q_len);
+        write_mla_kv_(kv_in, q_len, batch_size, max_block_num, block_table,
+                      cache_seqlens);
+    }
+
+    const int head_dim = config_.head_dim;
+    const int rank = config_.kv_lora_rank;
+    const int block_len = config_.block_len;
+    // the q heads of all tokens of a batch share the latent rows
+    const int rows = q_len * config_.q_head_num;
+
+    int block_num = 1;
+    for (int batch_id = 0; batch_id < batch_size; batch_id++) {
+        block_num = std::max(block_num, (cache_seqlens[batch_id] + q_len +
+                                         block_len - 1) /
+                                            block_len);
+    }
+    int thread_num = Backend_NUMA::getInstance().get_num_threads();
+    if (thread_num > (int)thread_local_tile_.size()) {
+        ThreadResize(thread_num);
+    }
+    for (TileScratch &tile : thread_local_tile_) {
+        if ((int)tile.row_max.size() < rows) {
+            tile.row_max.resize(rows);
+            tile.row_sum.resize(rows);
+            tile.score.resize((size_t)rows * block_len);
+        }
+    }
+    // Same split-K as attention_split_k_, with one kv head the batches are
+    // the only other source of parallelism
+    int split_num = (kSplitsPerThread * thread_num + batch_size - 1) /
+                    batch_size;
+    split_num = std::max(1, std::min(split_num, block_num));
+    split_output_fp32_.resize((size_t)batch_size * split_num * rows * rank);
+    split_attn_lse_.resize((size_t)batch_size * split_num * rows);
+    mla_q_fp32_.resize((size_t)batch_size * rows * head_dim);
+    for (size_t i = 0; i < mla_q_fp32_.size(); i++) {
+        mla_q_fp32_[i] = GGML_FP16_TO_FP32(q_in[i]);
+    }
+
+    do_head_work_(
+        batch_size * split_num, nullptr,
+        [&](int task_id) {
+            int batch_id = task_id / split_num;
+            int split_id = task_id % split_num;
+            int seq_len = cache_seqlens[batch_id] + q_len;
+            size_t slot = (size_t)batch_id * split_num + split_id;
+            float *acc = split_output_fp32_.data() + slot * rows * rank;
+            float *acc_lse = split_attn_lse_.data() + slot * rows;
+            std::fill(acc, acc + (size_t)rows * rank, 0.0f);
+            TileScratch &tile =
+                thread_local_tile_[Backend_NUMA::thread_local_id_];
+            std::vector<float> &row_max = tile.row_max;
+            std::vector<float> &row_sum = tile.row_sum;
+            std::vector<float> &latent = tile.latent;
+            std::vector<float> &score = tile.score;
+            std::fill(row_max.begin(), row_max.begin() + rows,
+                      -std::numeric_limits<float>::infinity());
+            std::fill(row_sum.begin(), row_sum.begin() + rows, 0.0f);
+            const float *q =
+                mla_q_fp32_.data() + (size_t)batch_id * rows * head_dim;
+
+            int block_begin = (int64_t)split_id * block_num / split_num;
+            int block_end =
+                std::min((int)((int64_t)(split_id + 1) * block_num / split_num),
+                         (seq_len + block_len - 1) / block_len);
+            for (int block_id = block_begin; block_id < block_end;
+                 block_id++) {
+                int block_idx =
+                    block_table[batch_id * max_block_num + block_id];
+                int pos_begin = block_id * block_len;
+                int n = std::min(block_len, seq_len - pos_begin);
+                load_kv_(k_cache_.block<void>(layer_id_, 0, block_idx), 0,
+                         latent.data(), n * head_dim);
+
+                // score[row, token] = q_row . latent_token
+                bool ok = llamafile_sgemm(
+                    n, rows, head_dim, latent.data(), head_dim, q, head_dim,
+                    score.data(), block_len, 0, 1, GGML_TASK_TYPE_COMPUTE,
+                    GGML_TYPE_F32, GGML_TYPE_F32, GGML_TYPE_F32,
+                    GGML_PREC_DEFAULT);
+                if (!ok) {
+                    for (int r = 0; r < rows; r++) {
+                        for (int i = 0; i < n; i++) {
+                            float dot = 0;
+                            for (int l = 0; l < head_dim; l++) {
+                                dot += q[(size_t)r * head_dim + l] *
+                                       latent[(size_t)i * head_dim + l];
+                            }
+                            score[(size_t)r * block_len + i] = dot;
+                        }
+                    }
+                }
+
+                // online softmax, the probabilities replace the scores
+                for (int r = 0; r < rows; r++) {
+                    float *s = score.data() + (size_t)r * block_len;
+                    int visible = std::min(n, cache_seqlens[batch_id] +
+                                                  r / config_.q_head_num + 1 -
+                                                  pos_begin);
+                    if (visible <= 0) {
+                        std::fill(s, s + n, 0.0f);
+                        continue;
+                    }
+                    float max_score = row_max[r];
+                    for (int i = 0; i < visible; i++) {
+                        s[i] *= softmax_scale;
+                        max_score = std::max(max_score, s[i]);
+                    }
+                    float rescale = std::exp(row_max[r] - max_score);
+                    if (rescale != 1.0f) {
+                        ggml_vec_scale_f32(rank, acc + (size_t)r * rank,
+                                           rescale);
+                    }
+                    float sum = 0;
+                    for (int i = 0; i < visible; i++) {
+                        s[i] = std::exp(s[i] - max_score);
+                        sum += s[i];
+                    }
+                    std::fill(s + visible, s + n, 0.0f);
+                    row_sum[r] = row_sum[r] * rescale + sum;
+                    row_max[r] = max_score;
+                }
+
+                // acc[row] += p[row, token] * value_token, the value is the
+                // first kv_lora_rank dims of the latent row, read once for
+                // all the q heads
+                for (int i = 0; i < n; i++) {
+                    const float *value = latent.data() + (size_t)i * head_dim;
+                    for (int r = 0; r < rows; r++) {
+                        float p = score[(size_t)r * block_len + i];
+                        if (p != 0) {
+                            ggml_vec_mad_f32(rank, acc + (size_t)r * rank,
+                                             value, p);
+                        }
+                    }
+                }
+            }
+
+            for (int r = 0; r < rows; r++) {
+                if (row_sum[r] == 0) {
+                    acc_lse[r] = -std::numeric_limits<float>::infinity();
+                    continue;
+                }
+                ggml_vec_scale_f32(rank, acc + (size_t)r * rank,
+                                   1.0f / row_sum[r]);
+                acc_lse[r] = row_max[r] + std::log(row_sum[r]);
+            }
+        },
+        nullptr);
+
+    merge_split_attn_(batch_size, rows, split_num, rank, output, attn_lse);
+
+    // Timer end
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> diff = end - start;
+    // printf("layer %d time of mla attention: %f s\n", layer_idx,
+    //        diff.count());
+}
@@ -0,0 +1,248 @@
+/**
+ * @Description  : Causal prefill attention of a chunk of tokens against the
+ *                 cached prefix and itself.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+
+#include "kvcache.h"
+
+#include <chrono>
+
+void KVCache::write_prefill_kv_(const uint16_t *k_in, const uint16_t *v_in,
+                                int q_len, int batch_size, int max_block_num,
+                                int *block_table, int *cache_seqlens) {
+    // Every task owns one block of one head, so a V group shared by several
+    // new tokens is requantized once and never by two threads.
+    int block_num = (q_len + config_.block_len - 1) / config_.block_len + 1;
+    do_head_work_(
+        batch_size * block_num, nullptr,
+        [&](int task_id) {
+            int head_id = task_id / (batch_size * block_num);
+            int batch_id = task_id / block_num % batch_size;
+            int block_id =
+                cache_seqlens[batch_id] / config_.block_len +
+                task_id % block_num;
+            int begin =
+                std::max(cache_seqlens[batch_id], block_id * config_.block_len);
+            int end = std::min(cache_seqlens[batch_id] + q_len,
+                               (block_id + 1) * config_.block_len);
+            if (begin >= end) {
+                return;
+            }
+            int block_idx = block_table[batch_id * max_block_num + block_id];
+            size_t token_stride = config_.kv_head_num * config_.head_dim;
+            auto token_offset = [&](int pos) {
+                return ((size_t)batch_id * q_len + pos -
+                        cache_seqlens[batch_id]) *
+                           token_stride +
+                       head_id * config_.head_dim;
+            };
+
+            if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+                ggml_fp16_t *k_block =
+                    k_cache_.block<ggml_fp16_t>(layer_id_, head_id, block_idx);
+                ggml_fp16_t *v_block =
+                    v_cache_.block<ggml_fp16_t>(layer_id_, head_id, block_idx);
+                for (int pos = begin; pos < end; pos++) {
+                    int pos_in_block = pos % config_.block_len;
+                    memcpy(k_block + pos_in_block * config_.head_dim,
+                           k_in + token_offset(pos),
+                           config_.head_dim * sizeof(ggml_fp16_t));
+                    for (int l = 0; l < config_.head_dim; l++) {
+                        v_block[l * config_.block_len + pos_in_block] =
+                            v_in[token_offset(pos) + l];
+                    }
+                }
+                return;
+            }
+
+            std::vector<float> row_fp32(
+                std::max(config_.head_dim, config_.block_len));
+            void *k_block = k_cache_.block<void>(layer_id_, head_id, block_idx);
+            for (int pos = begin; pos < end; pos++) {
+                for (int l = 0; l < config_.head_dim; l++) {
+                    row_fp32[l] =
+                        GGML_FP16_TO_FP32(k_in[token_offset(pos) + l]);
+                }
+                store_kv_(k_block, pos % config_.block_len * config_.head_dim,
+                          row_fp32.data(), config_.head_dim);
+            }
+            // V is quantized along the tokens: keep the tokens already in the
+            // block, zero the ones not written yet so they do not widen the
+            // scale of their group
+            void *v_block = v_cache_.block<void>(layer_id_, head_id, block_idx);
+            int cached = begin - block_id * config_.block_len;
+            int filled = end - block_id * config_.block_len;
+            for (int l = 0; l < config_.head_dim; l++) {
+                float *row = row_fp32.data();
+                if (cached > 0) {
+                    load_kv_(v_block, l * config_.block_len, row,
+                             config_.block_len);
+                }
+                for (int pos = begin; pos < end; pos++) {
+                    row[pos % config_.block_len] =
+                        GGML_FP16_TO_FP32(v_in[token_offset(pos) + l]);
+                }
+                std::fill(row + filled, row + config_.block_len, 0.0f);
+                store_kv_(v_block, l * config_.block_len, row,
+                          config_.block_len);
+            }
+        },
+        nullptr);
+}
+
+void KVCache::attn_prefill(const ggml_fp16_t *q_in, const ggml_fp16_t *k_in,
+                           const ggml_fp16_t *v_in, ggml_fp16_t *output,
+                           float *attn_lse, int layer_idx, int q_len,
+                           int batch_size, int max_block_num, int *block_table,
+                           int *cache_seqlens, Backend *backend) {
+    // Timer start
+    auto start = std::chrono::high_resolution_clock::now();
+
+    layer_id_ = layer_idx;
+    seq_len_ = config_.block_len;
+    make_blocks_writable_(block_table, batch_size, max_block_num,
+                          cache_seqlens, q_len);
+    write_prefill_kv_(k_in, v_in, q_len, batch_size, max_block_num,
+                      block_table, cache_seqlens);
+
+    const int head_dim = config_.head_dim;
+    const int block_len = config_.block_len;
+    const int tile_num = (q_len + kPrefillTile - 1) / kPrefillTile;
+    int thread_num = Backend_NUMA::getInstance().get_num_threads();
+    if (thread_num > (int)thread_local_tile_.size()) {
+        ThreadResize(thread_num);
+    }
+
+    do_head_work_(
+        batch_size * tile_num, nullptr,
+        [&](int task_id) {
+            int head_id = task_id / (batch_size * tile_num);
+            int batch_id = task_id / tile_num % batch_size;
+            // last tiles first, they see the longest prefix
+            int tile_id = tile_num - 1 - task_id % tile_num;
+            int t_begin = tile_id * kPrefillTile;
+            int t_end = std::min(q_len, t_begin + kPrefillTile);
+            int rows = (t_end - t_begin) * n_gqa_;
+            int pos_begin = cache_seqlens[batch_id] + t_begin;
+            int thread_id = Backend_NUMA::thread_local_id_;
+            TileScratch &tile = thread_local_tile_[thread_id];
+            std::vector<float> &acc = tile.acc;
+            std::vector<float> &acc_lse = tile.acc_lse;
+            std::vector<float> &attn_score = tile.attn_score;
+            std::vector<float> &block_output = tile.block_output;
+            std::vector<block_q8_0> &block_output_q8_0 = tile.block_output_q8_0;
+            std::vector<float> &block_lse = tile.block_lse;
+            std::vector<uint8_t> &attn_mask =
+                thread_local_attn_mask_[thread_id];
+            std::vector<char> &draft = tile.draft;
+            std::fill(acc.begin(), acc.begin() + (size_t)rows * head_dim, 0.0f);
+            std::fill(acc_lse.begin(), acc_lse.begin() + rows,
+                      -std::numeric_limits<float>::infinity());
+
+            // The q rows of the tile, [token, gqa, head_dim], in the type the
+            // kernel of kv_type takes
+            std::vector<char> &q_tile = tile.q_tile;
+            size_t q_row_bytes = head_dim * sizeof(ggml_fp16_t);
+            std::vector<float> &q_fp32 = tile.q_fp32;
+            for (int t = t_begin; t < t_end; t++) {
+                for (int g = 0; g < n_gqa_; g++) {
+                    int row = (t - t_begin) * n_gqa_ + g;
+                    const ggml_fp16_t *src =
+                        q_in +
+                        (((size_t)batch_id * q_len + t) * config_.q_head_num +
+                         head_id * n_gqa_ + g) *
+                            head_dim;
+                    if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+                        memcpy(q_tile.data() + row * q_row_bytes, src,
+                               q_row_bytes);
+                        continue;
+                    }
+                    for (int l = 0; l < head_dim; l++) {
+                        q_fp32[l] = GGML_FP16_TO_FP32(src[l]);
+                    }
+                    if (config_.kv_type == GGML_TYPE_FP8_E4M3) {
+                        ggml_fp32_to_bf16_row(
+                            q_fp32.data(),
+                            (ggml_bf16_t *)q_tile.data() + row * head_dim,
+                            head_dim);
+                    } else {
+                        quantize_row_q8_0(
+                            q_fp32.data(),
+                            (block_q8_0 *)q_tile.data() +
+                                row * head_dim / QK8_0,
+                            head_dim);
+                    }
+                }
+            }
+            size_t q_token_bytes = n_gqa_ * q_row_bytes;
+            if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0 ||
+                config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
+                q_token_bytes = n_gqa_ * head_dim / QK8_0 * sizeof(block_q8_0);
+            }
+
+            int last_pos = cache_seqlens[batch_id] + t_end - 1;
+            for (int block_id = 0; block_id <= last_pos / block_len;
+                 block_id++) {
+                int block_idx =
+                    block_table[batch_id * max_block_num + block_id];
+                int block_begin = block_id * block_len;
+                if (block_begin + block_len - 1 <= pos_begin) {
+                    // every token of the tile sees the whole block
+                    attn_rows_one_block_(rows, q_tile.data(), true, nullptr,
+                                         head_id, block_idx, attn_score.data(),
+                                         block_output_q8_0.data(),
+                                         block_output.data(), block_lse.data(),
+                                         draft.data());
+                    merge_attn_output_(rows, acc.data(), acc_lse.data(),
+                                       block_output.data(), block_lse.data());
+                    continue;
+                }
+                // the block crosses the diagonal, each token has its own
+                // causal mask
+                for (int t = t_begin; t < t_end; t++) {
+                    int visible =
+                        cache_seqlens[batch_id] + t - block_begin + 1;
+                    if (visible <= 0) {
+                        continue;
+                    }
+                    int row = (t - t_begin) * n_gqa_;
+                    bool is_full_attn = visible >= block_len;
+                    if (!is_full_attn) {
+                        fill_attn_mask_(attn_mask.data(), visible);
+                    }
+                    attn_rows_one_block_(
+                        n_gqa_, q_tile.data() + (t - t_begin) * q_token_bytes,
+                        is_full_attn, attn_mask.data(), head_id, block_idx,
+                        attn_score.data(), block_output_q8_0.data(),
+                        block_output.data(), block_lse.data(), draft.data());
+                    merge_attn_output_(n_gqa_,
+                                       acc.data() + (size_t)row * head_dim,
+                                       acc_lse.data() + row,
+                                       block_output.data(), block_lse.data());
+                }
+            }
+
+            for (int t = t_begin; t < t_end; t++) {
+                for (int g = 0; g < n_gqa_; g++) {
+                    int row = (t - t_begin) * n_gqa_ + g;
+                    size_t q_head =
+                        ((size_t)batch_id * q_len + t) * config_.q_head_num +
+                        head_id * n_gqa_ + g;
+                    for (int l = 0; l < head_dim; l++) {
+                        output[q_head * head_dim + l] = GGML_FP32_TO_FP16(
+                            acc[(size_t)row * head_dim + l]);
+                    }
+                    attn_lse[q_head] = acc_lse[row];
+                }
+            }
+        },
+        nullptr);
+
+    // Timer end
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> diff = end - start;
+    // printf("layer %d time of prefill attention: %f s\n", layer_idx,
+    //        diff.count());
+}
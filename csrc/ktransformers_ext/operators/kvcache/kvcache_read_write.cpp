@@ -72,7 +72,7 @@ void KVCache::update_importance_one_block(const ggml_fp16_t *importance,
         config_.block_len, nullptr,
         [&](int task_id) {
             int k = task_id;
-            memcpy(importance_[layer_id_][block_idx].data() + k,
+            memcpy(importance_.block<ggml_fp16_t>(layer_id_, 0, block_idx) + k,
                    importance_data_ + k, sizeof(uint16_t));
         },
         nullptr);
@@ -100,7 +100,7 @@ void KVCache::get_importance_one_block(ggml_fp16_t *importance, int layer_id,
         [&](int task_id) {
             int k = task_id;
             memcpy(importance_data_ + k,
-                   importance_[layer_id_][block_idx].data() + k,
+                   importance_.block<ggml_fp16_t>(layer_id_, 0, block_idx) + k,
                    sizeof(uint16_t));
         },
         nullptr);
@@ -127,65 +127,46 @@ void KVCache::update_kvcache_one_block_fp16(const ggml_fp16_t *k_in,
 
     int new_block_num = std::max((int)past_block_num_[layer_id], block_idx + 1);
 
-    importance_[layer_id_].resize(new_block_num);
-
-    for (int i = 0; i < config_.kv_head_num; i++) {
-        k_cache_q4[layer_id][i].resize(new_block_num);
-        v_cache_q4[layer_id][i].resize(new_block_num);
-        // anchor_[layer_id][i].resize(new_block_num);
-    }
-
-    for (int i = 0; i < new_block_num; i++) {
-        importance_[layer_id][i].resize(config_.block_len);
+    if (new_block_num > k_cache_.get_block_num()) {
+        k_cache_.resize(new_block_num);
+        v_cache_.resize(new_block_num);
+        importance_.resize(new_block_num);
     }
 
     // Each task updates the k cache or v cache of a certain header
     Backend_NUMA::getInstance().do_work(
         config_.kv_head_num * 2, nullptr,
         [&](int task_id) {
-            std::vector<float> block_fp32(32);
+            std::vector<float> row_fp32(
+                std::max(config_.head_dim, config_.block_len));
             int head_id = task_id / 2;
             if (task_id & 1) {
                 // fill k_cache_
-                k_cache_q4[layer_id_][head_id][block_idx].resize(
-                    config_.block_len * config_.head_dim / 32);
+                void *block =
+                    k_cache_.block<void>(layer_id_, head_id, block_idx);
                 for (int k = 0; k < config_.block_len; k++) {
-                    for (int l = 0; l < config_.head_dim / 32; l++) {
-                        block_q4_0 block;
-                        for (int m = 0; m < 32; m++) {
-
-                            block_fp32[m] = GGML_FP16_TO_FP32(
-                                k_data_[((0 * config_.kv_head_num + head_id) *
-                                             seq_len_ +
-                                         0 * config_.block_len + k) *
-                                            config_.head_dim +
-                                        l * 32 + m]);
-                        }
-                        quantize_row_q4_0(block_fp32.data(), &block, 32);
-                        k_cache_q4[layer_id_][head_id][block_idx]
-                                  [k * config_.head_dim / 32 + l] = block;
+                    for (int l = 0; l < config_.head_dim; l++) {
+                        row_fp32[l] = GGML_FP16_TO_FP32(
+                            k_data_[(head_id * seq_len_ + k) *
+                                        config_.head_dim +
+                                    l]);
                     }
+                    store_kv_(block, k * config_.head_dim, row_fp32.data(),
+                              config_.head_dim);
                 }
             } else {
                 // fill v_cache_
-                v_cache_q4[layer_id_][head_id][block_idx].resize(
-                    config_.head_dim * config_.block_len / 32);
-                for (int k = 0; k < config_.block_len / 32; k++) {
-                    for (int l = 0; l < config_.head_dim; l++) {
-                        block_q4_0 block;
-                        for (int m = 0; m < 32; m++) {
-
-                            block_fp32[m] = GGML_FP16_TO_FP32(
-                                v_data_[((0 * config_.kv_head_num + head_id) *
-                                             seq_len_ +
-                                         0 * config_.block_len + k * 32 + m) *
-                                            config_.head_dim +
-                                        l]);
-                        }
-                        quantize_row_q4_0(block_fp32.data(), &block, 32);
-                        v_cache_q4[layer_id_][head_id][block_idx]
-                                  [l * config_.block_len / 32 + k] = block;
+                void *block =
+                    v_cache_.block<void>(layer_id_, head_id, block_idx);
+                for (int l = 0; l < config_.head_dim; l++) {
+                    for (int k = 0; k < config_.block_len; k++) {
+                        row_fp32[k] = GGML_FP16_TO_FP32(
+                            v_data_[(head_id * seq_len_ + k) *
+                                        config_.head_dim +
+                                    l]);
                     }
+                    store_kv_(block, l * config_.block_len, row_fp32.data(),
+                              config_.block_len);
                 }
             }
         },
@@ -216,43 +197,31 @@ void KVCache::get_kvcache_one_block_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
     Backend_NUMA::getInstance().do_work(
         config_.kv_head_num * 2, nullptr,
         [&](int task_id) {
-            std::vector<float> block_fp32(32);
+            std::vector<float> row_fp32(
+                std::max(config_.head_dim, config_.block_len));
             int head_id = task_id / 2;
             if (task_id & 1) {
                 // get k_cache_
+                void *block =
+                    k_cache_.block<void>(layer_id_, head_id, block_idx);
                 for (int k = 0; k < config_.block_len; k++) {
-                    for (int l = 0; l < config_.head_dim / 32; l++) {
-                        block_q4_0 block =
-                            k_cache_q4[layer_id_][head_id][block_idx]
-                                      [k * config_.head_dim / 32 + l];
-                        dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                        for (int m = 0; m < 32; m++) {
-
-                            k_data_[((0 * config_.kv_head_num + head_id) *
-                                         seq_len_ +
-                                     0 * config_.block_len + k) *
-                                        config_.head_dim +
-                                    l * 32 + m] =
-                                GGML_FP32_TO_FP16(block_fp32[m]);
-                        }
+                    load_kv_(block, k * config_.head_dim, row_fp32.data(),
+                             config_.head_dim);
+                    for (int l = 0; l < config_.head_dim; l++) {
+                        k_data_[(head_id * seq_len_ + k) * config_.head_dim +
+                                l] = GGML_FP32_TO_FP16(row_fp32[l]);
                     }
                 }
             } else {
                 // get v_cache_
-                for (int k = 0; k < config_.block_len / 32; k++) {
-                    for (int l = 0; l < config_.head_dim; l++) {
-                        block_q4_0 block =
-                            v_cache_q4[layer_id_][head_id][block_idx]
-                                      [l * config_.block_len / 32 + k];
-                        dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                        for (int m = 0; m < 32; m++) {
-
-                            v_data_[((0 * config_.kv_head_num + head_id) *
-                                         seq_len_ +
-                                     0 * config_.block_len + k * 32 + m) *
-                                        config_.head_dim +
-                                    l] = GGML_FP32_TO_FP16(block_fp32[m]);
-                        }
+                void *block =
+                    v_cache_.block<void>(layer_id_, head_id, block_idx);
+                for (int l = 0; l < config_.head_dim; l++) {
+                    load_kv_(block, l * config_.block_len, row_fp32.data(),
+                             config_.block_len);
+                    for (int k = 0; k < config_.block_len; k++) {
+                        v_data_[(head_id * seq_len_ + k) * config_.head_dim +
+                                l] = GGML_FP32_TO_FP16(row_fp32[k]);
                     }
                 }
             }
@@ -280,13 +249,16 @@ void KVCache::get_and_update_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
     layer_id_ = layer_id;
     k_data_ = const_cast<uint16_t *>(k_in);
     v_data_ = const_cast<uint16_t *>(v_in);
+    make_blocks_writable_(block_table, batch_size, max_block_num,
+                          cache_seqlens, q_len);
 
     // Each task updates the k cache and v cache of a certain header
     Backend_NUMA::getInstance().do_work(
         config_.kv_head_num * max_block_num * batch_size, nullptr,
         [&](int task_id) {
             // printf("block_idx: %d, task_id: %d\n", block_idx, task_id);
-            std::vector<float> block_fp32(32);
+            std::vector<float> row_fp32(
+                std::max(config_.head_dim, config_.block_len));
             int batch_id = task_id / (config_.kv_head_num * max_block_num);
             int block_id = (task_id / config_.kv_head_num) % max_block_num;
             int head_id = task_id % config_.kv_head_num;
@@ -294,7 +266,13 @@ void KVCache::get_and_update_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
             int seq_len = cache_seqlens[batch_id];
             int block_l = block_id * config_.block_len;
             int block_r = block_id * config_.block_len + config_.block_len;
-
+            // offset of token k of the block in k_data_ / v_data_
+            auto token_offset = [&](int k) {
+                return ((size_t)batch_id * max_block_num * config_.block_len +
+                        block_l + k) *
+                           config_.kv_head_num * config_.head_dim +
+                       head_id * config_.head_dim;
+            };
             if (block_l < seq_len) {
                 if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
                     for (int k = 0; k < config_.block_len; k++) {
@@ -310,7 +288,8 @@ void KVCache::get_and_update_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
                                       config_.head_dim) +
                                  k * (config_.kv_head_num * config_.head_dim) +
                                  head_id * config_.head_dim + l] =
-                                    k_cache_fp16_[layer_id_][head_id][block_idx]
+                                    k_cache_.block<ggml_fp16_t>(
+                                        layer_id_, head_id, block_idx)
                                                  [k * config_.head_dim + l];
                             v_data_
                                 [batch_id *
@@ -321,112 +300,36 @@ void KVCache::get_and_update_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
                                       config_.head_dim) +
                                  k * (config_.kv_head_num * config_.head_dim) +
                                  head_id * config_.head_dim + l] =
-                                    v_cache_fp16_[layer_id_][head_id][block_idx]
+                                    v_cache_.block<ggml_fp16_t>(
+                                        layer_id_, head_id, block_idx)
                                                  [l * config_.block_len + k];
                         }
                     }
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
+                } else {
                     // get k_cache_
+                    void *k_block =
+                        k_cache_.block<void>(layer_id_, head_id, block_idx);
                     for (int k = 0; k < config_.block_len; k++) {
-                        if (block_id * config_.block_len + k >= seq_len)
+                        if (block_l + k >= seq_len)
                             break;
-                        for (int l = 0; l < config_.head_dim / 32; l++) {
-                            block_q4_0 block =
-                                k_cache_q4[layer_id_][head_id][block_idx]
-                                          [k * config_.head_dim / 32 + l];
-                            dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                k_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        k * (config_.kv_head_num *
-                                             config_.head_dim) +
-                                        head_id * config_.head_dim + l * 32 +
-                                        m] = GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
-                        }
-                    }
-                    // get v_cache_
-                    for (int k = 0; k < config_.block_len / 32; k++) {
+                        load_kv_(k_block, k * config_.head_dim,
+                                 row_fp32.data(), config_.head_dim);
                         for (int l = 0; l < config_.head_dim; l++) {
-                            block_q4_0 block =
-                                v_cache_q4[layer_id_][head_id][block_idx]
-                                          [l * config_.block_len / 32 + k];
-                            dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                if (block_id * config_.block_len + k * 32 + m >=
-                                    seq_len)
-                                    break;
-                                v_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        (k * 32 + m) * config_.kv_head_num *
-                                            config_.head_dim +
-                                        head_id * config_.head_dim + l] =
-                                    GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
-                        }
-                    }
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                    // get k_cache_
-                    for (int k = 0; k < config_.block_len; k++) {
-                        if (block_id * config_.block_len + k >= seq_len)
-                            break;
-                        for (int l = 0; l < config_.head_dim / 32; l++) {
-                            block_q8_0 block =
-                                k_cache_q8[layer_id_][head_id][block_idx]
-                                          [k * config_.head_dim / 32 + l];
-                            dequantize_row_q8_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                k_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        k * (config_.kv_head_num *
-                                             config_.head_dim) +
-                                        head_id * config_.head_dim + l * 32 +
-                                        m] = GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
+                            k_data_[token_offset(k) + l] =
+                                GGML_FP32_TO_FP16(row_fp32[l]);
                         }
                     }
                     // get v_cache_
-                    for (int k = 0; k < config_.block_len / 32; k++) {
-                        for (int l = 0; l < config_.head_dim; l++) {
-                            block_q8_0 block =
-                                v_cache_q8[layer_id_][head_id][block_idx]
-                                          [l * config_.block_len / 32 + k];
-                            dequantize_row_q8_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                if (block_id * config_.block_len + k * 32 + m >=
-                                    seq_len)
-                                    break;
-                                v_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        (k * 32 + m) * config_.kv_head_num *
-                                            config_.head_dim +
-                                        head_id * config_.head_dim + l] =
-                                    GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
+                    void *v_block =
+                        v_cache_.block<void>(layer_id_, head_id, block_idx);
+                    for (int l = 0; l < config_.head_dim; l++) {
+                        load_kv_(v_block, l * config_.block_len,
+                                 row_fp32.data(), config_.block_len);
+                        for (int k = 0; k < config_.block_len; k++) {
+                            if (block_l + k >= seq_len)
+                                break;
+                            v_data_[token_offset(k) + l] =
+                                GGML_FP32_TO_FP16(row_fp32[k]);
                         }
                     }
                 }
@@ -439,7 +342,8 @@ void KVCache::get_and_update_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
                             block_id * config_.block_len + k < seq_len)
                             continue;
                         for (int l = 0; l < config_.head_dim; l++) {
-                            k_cache_fp16_[layer_id_][head_id][block_idx]
+                            k_cache_.block<ggml_fp16_t>(layer_id_, head_id,
+                                                        block_idx)
                                          [k * config_.head_dim + l] = k_data_
                                              [batch_id * (max_block_num *
                                                           config_.block_len *
@@ -451,7 +355,8 @@ void KVCache::get_and_update_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
                                               k * (config_.kv_head_num *
                                                    config_.head_dim) +
                                               head_id * config_.head_dim + l];
-                            v_cache_fp16_[layer_id_][head_id][block_idx]
+                            v_cache_.block<ggml_fp16_t>(layer_id_, head_id,
+                                                        block_idx)
                                          [l * config_.block_len + k] = v_data_
                                              [batch_id * (max_block_num *
                                                           config_.block_len *
@@ -465,121 +370,36 @@ void KVCache::get_and_update_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
                                               head_id * config_.head_dim + l];
                         }
                     }
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
+                } else {
                     // fill k_cache_
+                    void *k_block =
+                        k_cache_.block<void>(layer_id_, head_id, block_idx);
                     for (int k = 0; k < config_.block_len; k++) {
-                        if (block_id * config_.block_len + k >=
-                                seq_len + q_len ||
-                            block_id * config_.block_len + k < seq_len)
+                        if (block_l + k >= seq_len + q_len ||
+                            block_l + k < seq_len)
                             continue;
-                        for (int l = 0; l < config_.head_dim / 32; l++) {
-                            block_q4_0 block;
-                            for (int m = 0; m < 32; m++) {
-
-                                block_fp32[m] = GGML_FP16_TO_FP32(
-                                    k_data_[batch_id * (max_block_num *
-                                                        config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            block_id * (config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            k * (config_.kv_head_num *
-                                                 config_.head_dim) +
-                                            head_id * config_.head_dim +
-                                            l * 32 + m]);
-                            }
-                            quantize_row_q4_0(block_fp32.data(), &block, 32);
-                            k_cache_q4[layer_id_][head_id][block_idx]
-                                      [k * config_.head_dim / 32 + l] = block;
-                        }
-                    }
-
-                    // fill v_cache_
-                    for (int k = 0; k < config_.block_len / 32; k++) {
                         for (int l = 0; l < config_.head_dim; l++) {
-                            block_q4_0 block;
-                            for (int m = 0; m < 32; m++) {
-
-                                if (block_id * config_.block_len + k * 32 + m >=
-                                    seq_len + q_len) {
-                                    block_fp32[m] = 0;
-                                    continue;
-                                }
-                                block_fp32[m] = GGML_FP16_TO_FP32(
-                                    v_data_[batch_id * (max_block_num *
-                                                        config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            block_id * (config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            (k * 32 + m) * config_.kv_head_num *
-                                                config_.head_dim +
-                                            head_id * config_.head_dim + l]);
-                            }
-                            quantize_row_q4_0(block_fp32.data(), &block, 32);
-                            v_cache_q4[layer_id_][head_id][block_idx]
-                                      [l * config_.block_len / 32 + k] = block;
-                        }
-                    }
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                    // fill k_cache_
-                    for (int k = 0; k < config_.block_len; k++) {
-                        if (block_id * config_.block_len + k >=
-                                seq_len + q_len ||
-                            block_id * config_.block_len + k < seq_len)
-                            continue;
-                        for (int l = 0; l < config_.head_dim / 32; l++) {
-                            block_q8_0 block;
-                            for (int m = 0; m < 32; m++) {
-
-                                block_fp32[m] = GGML_FP16_TO_FP32(
-                                    k_data_[batch_id * (max_block_num *
-                                                        config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            block_id * (config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            k * (config_.kv_head_num *
-                                                 config_.head_dim) +
-                                            head_id * config_.head_dim +
-                                            l * 32 + m]);
-                            }
-                            quantize_row_q8_0(block_fp32.data(), &block, 32);
-                            k_cache_q8[layer_id_][head_id][block_idx]
-                                      [k * config_.head_dim / 32 + l] = block;
+                            row_fp32[l] =
+                                GGML_FP16_TO_FP32(k_data_[token_offset(k) + l]);
                         }
+                        store_kv_(k_block, k * config_.head_dim,
+                                  row_fp32.data(), config_.head_dim);
                     }
 
-                    // fill v_cache_
-                    for (int k = 0; k < config_.block_len / 32; k++) {
-                        for (int l = 0; l < config_.head_dim; l++) {
-                            block_q8_0 block;
-                            for (int m = 0; m < 32; m++) {
-
-                                if (block_id * config_.block_len + k * 32 + m >=
-                                    seq_len + q_len) {
-                                    block_fp32[m] = 0;
-                                    continue;
-                                }
-                                block_fp32[m] = GGML_FP16_TO_FP32(
-                                    v_data_[batch_id * (max_block_num *
-                                                        config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            block_id * (config_.block_len *
-                                                        config_.kv_head_num *
-                                                        config_.head_dim) +
-                                            (k * 32 + m) * config_.kv_head_num *
-                                                config_.head_dim +
-                                            head_id * config_.head_dim + l]);
-                            }
-                            quantize_row_q8_0(block_fp32.data(), &block, 32);
-                            v_cache_q8[layer_id_][head_id][block_idx]
-                                      [l * config_.block_len / 32 + k] = block;
+                    // fill v_cache_, the tokens before seq_len were read back
+                    // into v_data_ above and the ones past the end are zero
+                    void *v_block =
+                        v_cache_.block<void>(layer_id_, head_id, block_idx);
+                    for (int l = 0; l < config_.head_dim; l++) {
+                        for (int k = 0; k < config_.block_len; k++) {
+                            row_fp32[k] =
+                                block_l + k < seq_len + q_len
+                                    ? GGML_FP16_TO_FP32(
+                                          v_data_[token_offset(k) + l])
+                                    : 0;
                         }
+                        store_kv_(v_block, l * config_.block_len,
+                                  row_fp32.data(), config_.block_len);
                     }
                 }
             }
@@ -617,7 +437,9 @@ void KVCache::update_importance(const ggml_fp16_t *importance, int layer_id,
             }
             for (int k = 0; k < config_.block_len; k++) {
                 for (int head_id = 0; head_id < config_.q_head_num; head_id++) {
-                    importance_[layer_id_][block_idx][k][head_id] =
+                    importance_.block<ggml_fp16_t>(
+                        layer_id_, 0, block_idx)
+                        [k * config_.q_head_num + head_id] =
                         GGML_FP32_TO_FP16(
                             GGML_FP16_TO_FP32(
                                 importance_data_[batch_id * max_block_num *
@@ -628,7 +450,9 @@ void KVCache::update_importance(const ggml_fp16_t *importance, int layer_id,
                                                      config_.q_head_num +
                                                  head_id]) +
                             GGML_FP16_TO_FP32(
-                                importance_[layer_id_][block_idx][k][head_id]));
+                                importance_.block<ggml_fp16_t>(
+                                    layer_id_, 0, block_idx)
+                                    [k * config_.q_head_num + head_id]));
                 }
             }
         },
@@ -658,7 +482,8 @@ void KVCache::get_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
         config_.kv_head_num * max_block_num * batch_size, nullptr,
         [&](int task_id) {
             // printf("block_idx: %d, task_id: %d\n", block_idx, task_id);
-            std::vector<float> block_fp32(32);
+            std::vector<float> row_fp32(
+                std::max(config_.head_dim, config_.block_len));
             int batch_id = task_id / (config_.kv_head_num * max_block_num);
             int block_id = (task_id / config_.kv_head_num) % max_block_num;
             int head_id = task_id % config_.kv_head_num;
@@ -666,7 +491,13 @@ void KVCache::get_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
             int seq_len = cache_seqlens[batch_id];
             int block_l = block_id * config_.block_len;
             int block_r = block_id * config_.block_len + config_.block_len;
-
+            // offset of token k of the block in k_data_ / v_data_
+            auto token_offset = [&](int k) {
+                return ((size_t)batch_id * max_block_num * config_.block_len +
+                        block_l + k) *
+                           config_.kv_head_num * config_.head_dim +
+                       head_id * config_.head_dim;
+            };
             if (block_l < seq_len) {
                 if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
                     for (int k = 0; k < config_.block_len; k++) {
@@ -682,7 +513,8 @@ void KVCache::get_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
                                       config_.head_dim) +
                                  k * (config_.kv_head_num * config_.head_dim) +
                                  head_id * config_.head_dim + l] =
-                                    k_cache_fp16_[layer_id_][head_id][block_idx]
+                                    k_cache_.block<ggml_fp16_t>(
+                                        layer_id_, head_id, block_idx)
                                                  [k * config_.head_dim + l];
                             v_data_
                                 [batch_id *
@@ -693,112 +525,36 @@ void KVCache::get_kvcache_fp16(ggml_fp16_t *k_in, ggml_fp16_t *v_in,
                                       config_.head_dim) +
                                  k * (config_.kv_head_num * config_.head_dim) +
                                  head_id * config_.head_dim + l] =
-                                    v_cache_fp16_[layer_id_][head_id][block_idx]
+                                    v_cache_.block<ggml_fp16_t>(
+                                        layer_id_, head_id, block_idx)
                                                  [l * config_.block_len + k];
                         }
                     }
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
+                } else {
                     // get k_cache_
+                    void *k_block =
+                        k_cache_.block<void>(layer_id_, head_id, block_idx);
                     for (int k = 0; k < config_.block_len; k++) {
-                        if (block_id * config_.block_len + k >= seq_len)
+                        if (block_l + k >= seq_len)
                             break;
-                        for (int l = 0; l < config_.head_dim / 32; l++) {
-                            block_q4_0 block =
-                                k_cache_q4[layer_id_][head_id][block_idx]
-                                          [k * config_.head_dim / 32 + l];
-                            dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                k_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        k * (config_.kv_head_num *
-                                             config_.head_dim) +
-                                        head_id * config_.head_dim + l * 32 +
-                                        m] = GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
-                        }
-                    }
-                    // get v_cache_
-                    for (int k = 0; k < config_.block_len / 32; k++) {
+                        load_kv_(k_block, k * config_.head_dim,
+                                 row_fp32.data(), config_.head_dim);
                         for (int l = 0; l < config_.head_dim; l++) {
-                            block_q4_0 block =
-                                v_cache_q4[layer_id_][head_id][block_idx]
-                                          [l * config_.block_len / 32 + k];
-                            dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                if (block_id * config_.block_len + k * 32 + m >=
-                                    seq_len)
-                                    break;
-                                v_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        (k * 32 + m) * config_.kv_head_num *
-                                            config_.head_dim +
-                                        head_id * config_.head_dim + l] =
-                                    GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
-                        }
-                    }
-                } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                    // get k_cache_
-                    for (int k = 0; k < config_.block_len; k++) {
-                        if (block_id * config_.block_len + k >= seq_len)
-                            break;
-                        for (int l = 0; l < config_.head_dim / 32; l++) {
-                            block_q8_0 block =
-                                k_cache_q8[layer_id_][head_id][block_idx]
-                                          [k * config_.head_dim / 32 + l];
-                            dequantize_row_q8_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                k_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        k * (config_.kv_head_num *
-                                             config_.head_dim) +
-                                        head_id * config_.head_dim + l * 32 +
-                                        m] = GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
+                            k_data_[token_offset(k) + l] =
+                                GGML_FP32_TO_FP16(row_fp32[l]);
                         }
                     }
                     // get v_cache_
-                    for (int k = 0; k < config_.block_len / 32; k++) {
-                        for (int l = 0; l < config_.head_dim; l++) {
-                            block_q8_0 block =
-                                v_cache_q8[layer_id_][head_id][block_idx]
-                                          [l * config_.block_len / 32 + k];
-                            dequantize_row_q8_0(&block, block_fp32.data(), 32);
-                            for (int m = 0; m < 32; m++) {
-
-                                if (block_id * config_.block_len + k * 32 + m >=
-                                    seq_len)
-                                    break;
-                                v_data_[batch_id *
-                                            (max_block_num * config_.block_len *
-                                             config_.kv_head_num *
-                                             config_.head_dim) +
-                                        block_id * (config_.block_len *
-                                                    config_.kv_head_num *
-                                                    config_.head_dim) +
-                                        (k * 32 + m) * config_.kv_head_num *
-                                            config_.head_dim +
-                                        head_id * config_.head_dim + l] =
-                                    GGML_FP32_TO_FP16(block_fp32[m]);
-                            }
+                    void *v_block =
+                        v_cache_.block<void>(layer_id_, head_id, block_idx);
+                    for (int l = 0; l < config_.head_dim; l++) {
+                        load_kv_(v_block, l * config_.block_len,
+                                 row_fp32.data(), config_.block_len);
+                        for (int k = 0; k < config_.block_len; k++) {
+                            if (block_l + k >= seq_len)
+                                break;
+                            v_data_[token_offset(k) + l] =
+                                GGML_FP32_TO_FP16(row_fp32[k]);
                         }
                     }
                 }
@@ -822,6 +578,15 @@ void KVCache::update_kvcache_fp16(const ggml_fp16_t *k_in,
     layer_id_ = layer_id;
     k_data_ = const_cast<uint16_t *>(k_in);
     v_data_ = const_cast<uint16_t *>(v_in);
+    make_blocks_writable_(block_table, batch_size, max_block_num,
+                          cache_seqlens, q_len);
+    if (config_.kv_type != ggml_type::GGML_TYPE_F16) {
+        // V is quantized along the tokens, a group shared by several new
+        // tokens must be requantized by one task
+        write_prefill_kv_(k_in, v_in, q_len, batch_size, max_block_num,
+                          block_table, cache_seqlens);
+        return;
+    }
     // Each task updates the k cache and v cache of a certain header
     Backend_NUMA::getInstance().do_work(
         batch_size * config_.kv_head_num * q_len, nullptr,
@@ -837,7 +602,7 @@ void KVCache::update_kvcache_fp16(const ggml_fp16_t *k_in,
 
             if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
                 for (int l = 0; l < config_.head_dim; l++) {
-                    k_cache_fp16_[layer_id_][head_id][block_idx]
+                    k_cache_.block<ggml_fp16_t>(layer_id_, head_id, block_idx)
                                  [pos_in_block * config_.head_dim + l] =
                                      k_data_[batch_id *
                                                  (q_len * config_.kv_head_num *
@@ -845,7 +610,7 @@ void KVCache::update_kvcache_fp16(const ggml_fp16_t *k_in,
                                              q_offset * config_.kv_head_num *
                                                  config_.head_dim +
                                              head_id * config_.head_dim + l];
-                    v_cache_fp16_[layer_id_][head_id][block_idx]
+                    v_cache_.block<ggml_fp16_t>(layer_id_, head_id, block_idx)
                                  [l * config_.block_len + pos_in_block] =
                                      v_data_[batch_id *
                                                  (q_len * config_.kv_head_num *
@@ -854,74 +619,6 @@ void KVCache::update_kvcache_fp16(const ggml_fp16_t *k_in,
                                                  config_.head_dim +
                                              head_id * config_.head_dim + l];
                 }
-            } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-                std::vector<float> block_fp32(32);
-                // fill k_cache_
-                for (int l = 0; l < config_.head_dim / 32; l++) {
-                    block_q4_0 block;
-                    for (int m = 0; m < 32; m++) {
-
-                        block_fp32[m] = GGML_FP16_TO_FP32(
-                            k_data_[batch_id * (q_len * config_.kv_head_num *
-                                                config_.head_dim) +
-                                    head_id * config_.head_dim + l * 32 + m]);
-                    }
-                    quantize_row_q4_0(block_fp32.data(), &block, 32);
-
-                    k_cache_q4[layer_id_][head_id][block_idx]
-                              [pos_in_block * config_.head_dim / 32 + l] =
-                                  block;
-                }
-
-                // fill v_cache_
-                for (int l = 0; l < config_.head_dim; l++) {
-                    block_q4_0 block = v_cache_q4[layer_id_][head_id][block_idx]
-                                                 [l * config_.block_len / 32 +
-                                                  pos_in_block / 32];
-                    dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                    block_fp32[pos_in_block % 32] = GGML_FP16_TO_FP32(
-                        v_data_[batch_id * (q_len * config_.kv_head_num *
-                                            config_.head_dim) +
-                                head_id * config_.head_dim + l]);
-                    quantize_row_q4_0(block_fp32.data(), &block, 32);
-                    v_cache_q4[layer_id_][head_id][block_idx]
-                              [l * config_.block_len / 32 + pos_in_block / 32] =
-                                  block;
-                }
-            } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                std::vector<float> block_fp32(32);
-                // fill k_cache_
-                for (int l = 0; l < config_.head_dim / 32; l++) {
-                    block_q8_0 block;
-                    for (int m = 0; m < 32; m++) {
-
-                        block_fp32[m] = GGML_FP16_TO_FP32(
-                            k_data_[batch_id * (q_len * config_.kv_head_num *
-                                                config_.head_dim) +
-                                    head_id * config_.head_dim + l * 32 + m]);
-                    }
-                    quantize_row_q8_0(block_fp32.data(), &block, 32);
-
-                    k_cache_q8[layer_id_][head_id][block_idx]
-                              [pos_in_block * config_.head_dim / 32 + l] =
-                                  block;
-                }
-
-                // fill v_cache_
-                for (int l = 0; l < config_.head_dim; l++) {
-                    block_q8_0 block = v_cache_q8[layer_id_][head_id][block_idx]
-                                                 [l * config_.block_len / 32 +
-                                                  pos_in_block / 32];
-                    dequantize_row_q8_0(&block, block_fp32.data(), 32);
-                    block_fp32[pos_in_block % 32] = GGML_FP16_TO_FP32(
-                        v_data_[batch_id * (q_len * config_.kv_head_num *
-                                            config_.head_dim) +
-                                head_id * config_.head_dim + l]);
-                    quantize_row_q8_0(block_fp32.data(), &block, 32);
-                    v_cache_q8[layer_id_][head_id][block_idx]
-                              [l * config_.block_len / 32 + pos_in_block / 32] =
-                                  block;
-                }
             }
         },
         nullptr);
@@ -948,65 +645,42 @@ void KVCache::get_all_kvcache_one_layer(int layer_id, ggml_fp16_t *k_in,
     Backend_NUMA::getInstance().do_work(
         config_.kv_head_num * past_block_num_[layer_id] * 2, nullptr,
         [&](int task_id) {
-            std::vector<float> block_fp32(32);
+            std::vector<float> row_fp32(
+                std::max(config_.head_dim, config_.block_len));
             int head_id = task_id / 2 / past_block_num_[layer_id];
             int block_idx = task_id / 2 % past_block_num_[layer_id];
             if (block_idx >= block_num_)
                 return;
+            // tokens of the block inside cache_total_len_
+            int token_num = std::min(config_.block_len,
+                                     cache_total_len_ - block_idx * seq_len_);
+            size_t out_offset =
+                ((size_t)head_id * cache_total_len_ +
+                 block_idx * config_.block_len) *
+                config_.head_dim;
 
-            int max_offset = 0;
             if (task_id & 1) {
                 // get k_cache_
-                for (int k = 0; k < config_.block_len; k++) {
-                    if (block_idx * seq_len_ + k >= cache_total_len_)
-                        break;
-                    for (int l = 0; l < config_.head_dim / 32; l++) {
-                        block_q4_0 block =
-                            k_cache_q4[layer_id_][head_id][block_idx]
-                                      [k * config_.head_dim / 32 + l];
-                        dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                        for (int m = 0; m < 32; m++) {
-
-                            k_data_[(head_id * cache_total_len_ +
-                                     block_idx * config_.block_len + k) *
-                                        config_.head_dim +
-                                    l * 32 + m] =
-                                GGML_FP32_TO_FP16(block_fp32[m]);
-                            max_offset = std::max(
-                                max_offset,
-                                (int)(head_id * cache_total_len_ +
-                                      block_idx * config_.block_len + k) *
-                                        config_.head_dim +
-                                    l * 32 + m);
-                        }
+                void *block =
+                    k_cache_.block<void>(layer_id_, head_id, block_idx);
+                for (int k = 0; k < token_num; k++) {
+                    load_kv_(block, k * config_.head_dim, row_fp32.data(),
+                             config_.head_dim);
+                    for (int l = 0; l < config_.head_dim; l++) {
+                        k_data_[out_offset + k * config_.head_dim + l] =
+                            GGML_FP32_TO_FP16(row_fp32[l]);
                     }
                 }
             } else {
                 // get v_cache_
-                for (int k = 0; k < config_.block_len / 32; k++) {
-                    for (int l = 0; l < config_.head_dim; l++) {
-                        block_q4_0 block =
-                            v_cache_q4[layer_id_][head_id][block_idx]
-                                      [l * config_.block_len / 32 + k];
-                        dequantize_row_q4_0(&block, block_fp32.data(), 32);
-                        for (int m = 0; m < 32; m++) {
-
-                            if (block_idx * seq_len_ + k * 32 + m >=
-                                cache_total_len_)
-                                break;
-                            v_data_[(head_id * cache_total_len_ +
-                                     block_idx * config_.block_len + k * 32 +
-                                     m) *
-                                        config_.head_dim +
-                                    l] = GGML_FP32_TO_FP16(block_fp32[m]);
-                            max_offset =
-                                std::max(max_offset,
-                                         (int)((head_id * cache_total_len_ +
-                                                block_idx * config_.block_len +
-                                                k * 32 + m) *
-                                                   config_.head_dim +
-                                               l));
-                        }
+                void *block =
+                    v_cache_.block<void>(layer_id_, head_id, block_idx);
+                for (int l = 0; l < config_.head_dim; l++) {
+                    load_kv_(block, l * config_.block_len, row_fp32.data(),
+                             config_.block_len);
+                    for (int k = 0; k < token_num; k++) {
+                        v_data_[out_offset + k * config_.head_dim + l] =
+                            GGML_FP32_TO_FP16(row_fp32[k]);
                     }
                 }
             }
@@ -11,6 +11,7 @@
 #include "kvcache.h"
 
 #include <chrono>
+#include <cmath>
 
 std::string ggml_type_to_string(ggml_type type) {
     switch (type) {
@@ -22,6 +23,8 @@ std::string ggml_type_to_string(ggml_type type) {
         return "GGML_TYPE_Q4_0";
     case GGML_TYPE_Q8_0:
         return "GGML_TYPE_Q8_0";
+    case GGML_TYPE_FP8_E4M3:
+        return "GGML_TYPE_FP8_E4M3";
     }
     return "UNDIFINED";
 }
@@ -57,56 +60,97 @@ KVCacheConfig::KVCacheConfig(int layer_num, int kv_head_num, int q_head_num,
                              RetrievalType retrieval_type, int layer_step,
                              int token_step, int layer_offset,
                              int max_block_num, int max_batch_size,
-                             int max_thread_num)
+                             int max_thread_num, int kv_lora_rank)
     : layer_num(layer_num), kv_head_num(kv_head_num), q_head_num(q_head_num),
       head_dim(head_dim), block_len(block_len), anchor_num(anchor_num),
       anchor_type(anchor_type), kv_type(kv_type),
       retrieval_type(retrieval_type), layer_step(layer_step),
       token_step(token_step), layer_offset(layer_offset),
       max_block_num(max_block_num), max_batch_size(max_batch_size),
-      max_thread_num(max_thread_num) {
+      max_thread_num(max_thread_num), kv_lora_rank(kv_lora_rank) {
     printf(
         "layer_num: %d, kv_head_num: %d, q_head_num: %d, head_dim: %d, "
         "block_len: %d, anchor_num: %d, anchor_type: %s, kv_type: %s, "
         "retrieval_type: %s, layer_step: %d, token_step: %d, layer_offset: %d,"
-        "max_block_num: %d, max_batch_size: %d, max_thread_num: %d\n",
+        "max_block_num: %d, max_batch_size: %d, max_thread_num: %d, "
+        "kv_lora_rank: %d\n",
         layer_num, kv_head_num, q_head_num, head_dim, block_len, anchor_num,
         AnchorTypeToString(anchor_type).c_str(),
         ggml_type_to_string(kv_type).c_str(),
         RetrievalTypeToString(retrieval_type).c_str(), layer_step, token_step,
-        layer_offset, max_block_num, max_batch_size, max_thread_num);
+        layer_offset, max_block_num, max_batch_size, max_thread_num,
+        kv_lora_rank);
     assert(q_head_num % kv_head_num == 0);
 }
 KVCache::KVCache(KVCacheConfig config) {
     this->config_ = config;
 
     n_gqa_ = config_.q_head_num / config_.kv_head_num;
+    size_t kv_block_bytes = 0;
     if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
         // TODO: Elegant implement
-        k_cache_fp16_.resize(config_.layer_num);
-        v_cache_fp16_.resize(config_.layer_num);
-        selected_blocks_num_history_.resize(config_.layer_num /
-                                            config_.layer_step);
-        if (config_.retrieval_type == RetrievalType::LAYER) {
-            selected_blocks_history_.resize(config_.layer_num /
-                                            config_.layer_step);
-        } else if (config_.retrieval_type == RetrievalType::KVHEAD) {
-            selected_blocks_history_kvhead_.resize(config_.layer_num /
-                                                   config_.layer_step);
-        } else if (config_.retrieval_type == RetrievalType::QHEAD) {
-        }
+        kv_block_bytes =
+            config_.block_len * config_.head_dim * sizeof(ggml_fp16_t);
     } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-        k_cache_q4.resize(config.layer_num);
-        v_cache_q4.resize(config.layer_num);
+        kv_block_bytes = config_.block_len * config_.head_dim / QK4_0 *
+                         sizeof(block_q4_0);
     } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-        k_cache_q8.resize(config.layer_num);
-        v_cache_q8.resize(config.layer_num);
+        kv_block_bytes = config_.block_len * config_.head_dim / QK8_0 *
+                         sizeof(block_q8_0);
+    } else if (config_.kv_type == GGML_TYPE_FP8_E4M3) {
+        // K rows are split along head_dim, V channels along block_len
+        if (config_.head_dim % QK_FP8 != 0 || config_.block_len % QK_FP8 != 0) {
+            throw std::invalid_argument(
+                "fp8 KV cache needs head_dim and block_len to be "
+                "multiples of " +
+                std::to_string(QK_FP8));
+        }
+        kv_block_bytes = config_.block_len * config_.head_dim / QK_FP8 *
+                         sizeof(block_fp8);
     } else {
         assert(false);
     }
+    if (config_.kv_lora_rank > 0 &&
+        (config_.kv_head_num != 1 ||
+         config_.kv_lora_rank >= config_.head_dim)) {
+        throw std::invalid_argument(
+            "MLA KV cache needs kv_head_num 1 and head_dim larger than "
+            "kv_lora_rank");
+    }
+    selected_blocks_num_history_.resize(config_.layer_num /
+                                        config_.layer_step);
+    if (config_.retrieval_type == RetrievalType::LAYER) {
+        selected_blocks_history_.resize(config_.layer_num / config_.layer_step);
+    } else if (config_.retrieval_type == RetrievalType::KVHEAD) {
+        selected_blocks_history_kvhead_.resize(config_.layer_num /
+                                               config_.layer_step);
+    }
+
+    // attention_kvhead_/attention_layer_ hand the kv heads to the nodes in
+    // contiguous ranges (do_k_work_stealing_job over kv_head_num), keep each
+    // head's blocks on its node
+    head_node_.assign(config_.kv_head_num, -1);
+    if (config_.kv_head_num >= numa_nodes_) {
+        int base = config_.kv_head_num / numa_nodes_;
+        int remain = config_.kv_head_num % numa_nodes_;
+        int head_id = 0;
+        for (int nid = 0; nid < numa_nodes_; nid++) {
+            for (int i = 0; i < base + (nid < remain); i++) {
+                head_node_[head_id++] = nid;
+            }
+        }
+    }
+    k_cache_.init(config_.layer_num, config_.kv_head_num, kv_block_bytes,
+                  head_node_);
+    v_cache_.init(config_.layer_num, config_.kv_head_num, kv_block_bytes,
+                  head_node_);
+    importance_.init(config_.layer_num, 1,
+                     config_.block_len * config_.q_head_num *
+                         sizeof(ggml_fp16_t),
+                     {-1});
+
     anchor_.resize(config.layer_num * config.max_block_num * config.anchor_num *
                    config.q_head_num * config.head_dim);
-    importance_.resize(config.layer_num);
     past_block_num_.resize(config.layer_num);
     for (int i = 0; i < config.layer_num; i++) {
         past_block_num_[i] = 0;
@@ -115,6 +159,11 @@ KVCache::KVCache(KVCacheConfig config) {
     ThreadResize(config.max_thread_num);
     BatchResize(config.max_batch_size);
     BlockResize(config.max_block_num);
+    block_ref_.assign(config.max_block_num, 0);
+    free_blocks_.resize(config.max_block_num);
+    for (int i = 0; i < config.max_block_num; i++) {
+        free_blocks_[i] = config.max_block_num - 1 - i;
+    }
     q_fp32.resize(n_gqa_ * config.head_dim);
 }
 
@@ -128,6 +177,8 @@ void KVCache::ThreadResize(int thread_num) {
     thread_local_draft_.resize(thread_num);
     thread_cur_head_idx_.resize(thread_num);
     thread_local_attn_mask_.resize(thread_num);
+    thread_local_tile_.resize(thread_num);
+    const int rows = kPrefillTile * n_gqa_;
     for (int i = 0; i < thread_num; i++) {
         thread_local_output_q8_0_[i].resize(n_gqa_ * config_.head_dim / QK8_0);
         thread_local_attn_score_[i].resize(n_gqa_ * config_.block_len);
@@ -140,12 +191,33 @@ void KVCache::ThreadResize(int thread_num) {
             2 * config_.block_len * config_.head_dim +
             config_.block_len * config_.head_dim / QK4_0);
         thread_local_attn_mask_[i].resize(config_.block_len / 8);
+
+        TileScratch &tile = thread_local_tile_[i];
+        tile.latent.resize(config_.block_len * config_.head_dim);
+        if (config_.kv_lora_rank > 0) {
+            // attn_prefill does not run on an MLA cache
+            continue;
+        }
+        tile.acc.resize(rows * config_.head_dim);
+        tile.acc_lse.resize(rows);
+        tile.attn_score.resize(rows * config_.block_len);
+        tile.block_output.resize(rows * config_.head_dim);
+        tile.block_output_q8_0.resize(rows * config_.head_dim / QK8_0);
+        tile.block_lse.resize(rows);
+        tile.q_tile.resize(rows * config_.head_dim * sizeof(ggml_fp16_t));
+        tile.q_fp32.resize(config_.head_dim);
+        // See attn_with_kvcache_one_block_ for the draft it needs
+        tile.draft.resize(4 * rows * config_.block_len +
+                          8 * rows * config_.head_dim +
+                          2 * config_.block_len * config_.head_dim +
+                          config_.block_len * config_.head_dim / QK8_0);
     }
 }
 void KVCache::BatchResize(int batch_size) {
     mutex_.resize(batch_size);
     q_q8_0_.resize(batch_size);
     q_fp32_.resize(batch_size);
+    q_bf16_.resize(batch_size);
     output_fp32_.resize(batch_size);
     attn_lse_.resize(batch_size);
     block_lse_.resize(batch_size);
@@ -177,12 +249,12 @@ void KVCache::BatchResize(int batch_size) {
     } else if (config_.retrieval_type == RetrievalType::QHEAD) {
         block_similar_q_head_.resize(batch_size);
     }
+    top_block_id_.resize(batch_size);
     for (int i = 0; i < batch_size; i++) {
-        top_similar_block_.resize(batch_size);
-
         mutex_[i].resize(config_.kv_head_num);
         q_q8_0_[i].resize(config_.kv_head_num);
         q_fp32_[i].resize(config_.kv_head_num);
+        q_bf16_[i].resize(config_.kv_head_num);
         output_fp32_[i].resize(config_.kv_head_num);
         attn_lse_[i].resize(config_.kv_head_num);
 
@@ -192,6 +264,9 @@ void KVCache::BatchResize(int batch_size) {
             }
             q_q8_0_[i][j].resize(n_gqa_ * config_.head_dim / QK8_0);
             q_fp32_[i][j].resize(n_gqa_ * config_.head_dim);
+            if (config_.kv_type == GGML_TYPE_FP8_E4M3) {
+                q_bf16_[i][j].resize(n_gqa_ * config_.head_dim);
+            }
             output_fp32_[i][j].resize(n_gqa_ * config_.head_dim);
             attn_lse_[i][j].resize(n_gqa_);
         }
@@ -201,7 +276,8 @@ void KVCache::BatchResize(int batch_size) {
     for (int i = 0; i < batch_size; i++) {
         attn_sparsity_[i].resize(config_.q_head_num);
         avg_q[i].resize(config_.q_head_num * config_.head_dim);
-        avg_q_fp16[i].resize(config_.q_head_num * config_.head_dim);
+        avg_q_fp16[i].resize(config_.anchor_num * config_.q_head_num *
+                             config_.head_dim);
     }
 }
 
@@ -228,96 +304,44 @@ void KVCache::BlockResize(int max_block_num) {
         }
     }
 
-    for (int layer_id = 0; layer_id < config_.layer_num; layer_id++) {
-        importance_[layer_id].resize(max_block_num);
-
-        if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
-            // TODO: Elegant implement
-            k_cache_fp16_[layer_id].resize(config_.kv_head_num);
-            v_cache_fp16_[layer_id].resize(config_.kv_head_num);
+    // Only reserves address space for blocks that were never there, the pages
+    // are committed when the blocks are first written
+    k_cache_.resize(max_block_num);
+    v_cache_.resize(max_block_num);
+    importance_.resize(max_block_num);
 
-            for (int i = 0; i < config_.kv_head_num; i++) {
-                k_cache_fp16_[layer_id][i].resize(max_block_num);
-                v_cache_fp16_[layer_id][i].resize(max_block_num);
-
-                for (int j = 0; j < max_block_num; j++) {
-                    k_cache_fp16_[layer_id][i][j].resize(config_.block_len *
-                                                         config_.head_dim);
-                    v_cache_fp16_[layer_id][i][j].resize(config_.block_len *
-                                                         config_.head_dim);
-                }
-            }
-
-        } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-            k_cache_q4[layer_id].resize(config_.kv_head_num);
-            v_cache_q4[layer_id].resize(config_.kv_head_num);
-            for (int i = 0; i < config_.kv_head_num; i++) {
-                k_cache_q4[layer_id][i].resize(max_block_num);
-                v_cache_q4[layer_id][i].resize(max_block_num);
-
-                for (int j = 0; j < max_block_num; j++) {
-                    k_cache_q4[layer_id][i][j].resize(config_.block_len *
-                                                      config_.head_dim / 32);
-                    v_cache_q4[layer_id][i][j].resize(config_.block_len *
-                                                      config_.head_dim / 32);
-                }
-            }
-        } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-            k_cache_q8[layer_id].resize(config_.kv_head_num);
-            v_cache_q8[layer_id].resize(config_.kv_head_num);
-            for (int i = 0; i < config_.kv_head_num; i++) {
-                k_cache_q8[layer_id][i].resize(max_block_num);
-                v_cache_q8[layer_id][i].resize(max_block_num);
-
-                for (int j = 0; j < max_block_num; j++) {
-                    k_cache_q8[layer_id][i][j].resize(config_.block_len *
-                                                      config_.head_dim / 32);
-                    v_cache_q8[layer_id][i][j].resize(config_.block_len *
-                                                      config_.head_dim / 32);
-                }
-            }
-        } else {
-            assert(false);
-        }
-        for (int i = 0; i < config_.max_batch_size; i++) {
-            if (config_.retrieval_type == RetrievalType::LAYER) {
-                block_similar_[i].resize(max_block_num);
-                block_table_before_retrieval_[i].resize(max_block_num);
-                block_table_after_retrieval_[i].resize(max_block_num);
-            } else if (config_.retrieval_type == RetrievalType::KVHEAD) {
-                block_similar_kv_head_[i].resize(max_block_num);
-                block_table_before_retrieval_kvhead_[i].resize(max_block_num);
-                block_table_after_retrieval_kvhead_[i].resize(max_block_num);
-                for (int j = 0; j < max_block_num; j++) {
-                    block_similar_kv_head_[i][j].resize(config_.kv_head_num);
-                    block_table_before_retrieval_kvhead_[i][j].resize(
-                        config_.kv_head_num);
-                    block_table_after_retrieval_kvhead_[i][j].resize(
-                        config_.kv_head_num);
-                }
-            } else if (config_.retrieval_type == RetrievalType::QHEAD) {
-                block_similar_q_head_[i].resize(max_block_num);
-                block_table_before_retrieval_qhead_[i].resize(max_block_num);
-                block_table_after_retrieval_qhead_[i].resize(max_block_num);
-                for (int j = 0; j < max_block_num; j++) {
-                    block_similar_q_head_[i][j].resize(config_.q_head_num);
-                    block_table_before_retrieval_qhead_[i][j].resize(
-                        config_.q_head_num);
-                    block_table_after_retrieval_qhead_[i][j].resize(
-                        config_.q_head_num);
-                }
+    for (int i = 0; i < config_.max_batch_size; i++) {
+        top_block_id_[i].resize(max_block_num);
+        if (config_.retrieval_type == RetrievalType::LAYER) {
+            block_similar_[i].resize(max_block_num);
+            block_table_before_retrieval_[i].resize(max_block_num);
+            block_table_after_retrieval_[i].resize(max_block_num);
+        } else if (config_.retrieval_type == RetrievalType::KVHEAD) {
+            block_similar_kv_head_[i].resize(config_.kv_head_num *
+                                             max_block_num);
+            block_table_before_retrieval_kvhead_[i].resize(max_block_num);
+            block_table_after_retrieval_kvhead_[i].resize(max_block_num);
+            for (int j = 0; j < max_block_num; j++) {
+                block_table_before_retrieval_kvhead_[i][j].resize(
+                    config_.kv_head_num);
+                block_table_after_retrieval_kvhead_[i][j].resize(
+                    config_.kv_head_num);
             }
-            block_lse_[i].resize(max_block_num);
+        } else if (config_.retrieval_type == RetrievalType::QHEAD) {
+            block_similar_q_head_[i].resize(max_block_num);
+            block_table_before_retrieval_qhead_[i].resize(max_block_num);
+            block_table_after_retrieval_qhead_[i].resize(max_block_num);
             for (int j = 0; j < max_block_num; j++) {
-                block_lse_[i][j].resize(config_.q_head_num);
+                block_similar_q_head_[i][j].resize(config_.q_head_num);
+                block_table_before_retrieval_qhead_[i][j].resize(
+                    config_.q_head_num);
+                block_table_after_retrieval_qhead_[i][j].resize(
+                    config_.q_head_num);
             }
         }
-
-        for (int i = 0; i < max_block_num; i++) {
-            importance_[layer_id][i].resize(config_.block_len);
-            for (int j = 0; j < config_.block_len; j++) {
-                importance_[layer_id][i][j].resize(config_.q_head_num);
-            }
+        block_lse_[i].resize(max_block_num);
+        for (int j = 0; j < max_block_num; j++) {
+            block_lse_[i][j].resize(config_.q_head_num);
         }
     }
 }
@@ -378,7 +402,9 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                     for (int k = 0; k < seq_len_; k++) {
                         top_importances.push(std::make_pair(
                             GGML_FP16_TO_FP32(
-                                importance_[layer_id][block_idx][k][head_id]),
+                                importance_.block<ggml_fp16_t>(
+                                    layer_id, 0, block_idx)
+                                    [k * config_.q_head_num + head_id]),
                             std::make_pair(block_idx, k)));
                         // TODO: change to config_ item
                         if (top_importances.size() > config_.anchor_num) {
@@ -430,9 +456,9 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                                                     head_id * config_.head_dim +
                                                     l]) +
                                         GGML_FP16_TO_FP32(
-                                            k_cache_fp16_[layer_id]
-                                                         [head_id / n_gqa_]
-                                                         [top_block_idx]
+                                            k_cache_.block<ggml_fp16_t>(
+                                                layer_id, head_id / n_gqa_,
+                                                top_block_idx)
                                                          [top_indice *
                                                               config_.head_dim +
                                                           l]));
@@ -441,8 +467,8 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                         } else if (config_.kv_type ==
                                    ggml_type::GGML_TYPE_Q4_0) {
                             for (int l = 0; l < config_.head_dim / 32; l++) {
-                                block_q4_0 block = k_cache_q4
-                                    [layer_id][head_id / n_gqa_][top_block_idx]
+                                block_q4_0 block = k_cache_.block<block_q4_0>(
+                                    layer_id, head_id / n_gqa_, top_block_idx)
                                     [top_indice * config_.head_dim / 32 + l];
                                 dequantize_row_q4_0(&block, block_fp32.data(),
                                                     32);
@@ -481,8 +507,8 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                         } else if (config_.kv_type ==
                                    ggml_type::GGML_TYPE_Q8_0) {
                             for (int l = 0; l < config_.head_dim / 32; l++) {
-                                block_q8_0 block = k_cache_q8
-                                    [layer_id][head_id / n_gqa_][top_block_idx]
+                                block_q8_0 block = k_cache_.block<block_q8_0>(
+                                    layer_id, head_id / n_gqa_, top_block_idx)
                                     [top_indice * config_.head_dim / 32 + l];
                                 dequantize_row_q8_0(&block, block_fp32.data(),
                                                     32);
@@ -518,6 +544,26 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                                                         l * 32 + m]));
                                 }
                             }
+                        } else if (config_.kv_type == GGML_TYPE_FP8_E4M3) {
+                            std::vector<float> row_fp32(config_.head_dim);
+                            load_kv_(k_cache_.block<void>(layer_id,
+                                                          head_id / n_gqa_,
+                                                          top_block_idx),
+                                     top_indice * config_.head_dim,
+                                     row_fp32.data(), config_.head_dim);
+                            ggml_fp16_t *anchor =
+                                &anchor_[((size_t)layer_id *
+                                              config_.max_block_num +
+                                          top_block_idx) *
+                                             config_.anchor_num *
+                                             config_.q_head_num *
+                                             config_.head_dim +
+                                         head_id * config_.head_dim];
+                            for (int l = 0; l < config_.head_dim; l++) {
+                                anchor[l] = GGML_FP32_TO_FP16(
+                                    row_fp32[l] / 4 +
+                                    GGML_FP16_TO_FP32(anchor[l]));
+                            }
                         }
                         top_importances.pop();
                     }
@@ -574,9 +620,9 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                                                     head_id * config_.head_dim +
                                                     l]) +
                                         GGML_FP16_TO_FP32(
-                                            k_cache_fp16_[layer_id]
-                                                         [head_id / n_gqa_]
-                                                         [block_idx]
+                                            k_cache_.block<ggml_fp16_t>(
+                                                layer_id, head_id / n_gqa_,
+                                                block_idx)
                                                          [k * config_.head_dim +
                                                           l]) /
                                             config_.block_len);
@@ -636,9 +682,9 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                                                     head_id * config_.head_dim +
                                                     l]),
                                         GGML_FP16_TO_FP32(
-                                            k_cache_fp16_
-                                                [layer_id][head_id / n_gqa_]
-                                                [block_idx]
+                                            k_cache_.block<ggml_fp16_t>(
+                                                layer_id, head_id / n_gqa_,
+                                                block_idx)
                                                 [k * config_.head_dim + l])));
                             }
                         }
@@ -698,9 +744,9 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                                                     head_id * config_.head_dim +
                                                     l]) +
                                         GGML_FP16_TO_FP32(
-                                            k_cache_fp16_[layer_id]
-                                                         [head_id / n_gqa_]
-                                                         [block_idx]
+                                            k_cache_.block<ggml_fp16_t>(
+                                                layer_id, head_id / n_gqa_,
+                                                block_idx)
                                                          [k * config_.head_dim +
                                                           l]) /
                                             config_.anchor_num);
@@ -754,8 +800,8 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                                         head_id * config_.head_dim + l] =
                                     GGML_FP32_TO_FP16(std::max(
                                         GGML_FP16_TO_FP32(
-                                            k_cache_fp16_
-                                                [layer_id][head_id][block_idx]
+                                            k_cache_.block<ggml_fp16_t>(
+                                                layer_id, head_id, block_idx)
                                                 [indice * config_.head_dim +
                                                  l]),
                                         GGML_FP16_TO_FP32(
@@ -785,8 +831,8 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                                         head_id * config_.head_dim + l] =
                                     GGML_FP32_TO_FP16(std::min(
                                         GGML_FP16_TO_FP32(
-                                            k_cache_fp16_
-                                                [layer_id][head_id][block_idx]
+                                            k_cache_.block<ggml_fp16_t>(
+                                                layer_id, head_id, block_idx)
                                                 [indice * config_.head_dim +
                                                  l]),
                                         GGML_FP16_TO_FP32(
@@ -813,7 +859,8 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                              head_id++) {
                             for (int l = 0; l < config_.head_dim / 32; l++) {
                                 block_q4_0 block =
-                                    k_cache_q4[layer_id][head_id][block_idx]
+                                    k_cache_.block<block_q4_0>(
+                                        layer_id, head_id, block_idx)
                                               [indice * config_.head_dim / 32 +
                                                l];
                                 dequantize_row_q4_0(&block, block_fp32.data(),
@@ -909,7 +956,8 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                              head_id++) {
                             for (int l = 0; l < config_.head_dim / 32; l++) {
                                 block_q8_0 block =
-                                    k_cache_q8[layer_id][head_id][block_idx]
+                                    k_cache_.block<block_q8_0>(
+                                        layer_id, head_id, block_idx)
                                               [indice * config_.head_dim / 32 +
                                                l];
                                 dequantize_row_q8_0(&block, block_fp32.data(),
@@ -999,6 +1047,55 @@ void KVCache::calc_anchor_all_layers(int *block_table, int *cache_seqlens,
                             }
                         }
                     }
+                } else if (config_.kv_type == GGML_TYPE_FP8_E4M3) {
+                    std::vector<float> row_fp32(config_.head_dim);
+                    for (int indice = 0; indice < seq_len_; indice++) {
+                        for (int head_id = 0; head_id < config_.kv_head_num;
+                             head_id++) {
+                            load_kv_(k_cache_.block<void>(layer_id, head_id,
+                                                          block_idx),
+                                     indice * config_.head_dim,
+                                     row_fp32.data(), config_.head_dim);
+                            // anchor 0 keeps the max of each channel, anchor 1
+                            // the min
+                            ggml_fp16_t *anchor_max =
+                                &anchor_[((size_t)layer_id *
+                                              config_.max_block_num +
+                                          block_idx) *
+                                             config_.anchor_num *
+                                             config_.q_head_num *
+                                             config_.head_dim +
+                                         head_id * config_.head_dim];
+                            ggml_fp16_t *anchor_min =
+                                anchor_max +
+                                config_.q_head_num * config_.head_dim;
+                            for (int l = 0; l < config_.head_dim; l++) {
+                                anchor_max[l] = GGML_FP32_TO_FP16(
+                                    std::max(row_fp32[l],
+                                             GGML_FP16_TO_FP32(anchor_max[l])));
+                                anchor_min[l] = GGML_FP32_TO_FP16(
+                                    std::min(row_fp32[l],
+                                             GGML_FP16_TO_FP32(anchor_min[l])));
+                            }
+                        }
+                    }
+                }
+                // The heads no key was folded into, all of them past
+                // kv_head_num with GQA, keep the FLT_MIN/FLT_MAX init: 0 and
+                // inf in fp16. Zero them so that they add nothing to the
+                // similarity instead of inf * 0 = NaN.
+                ggml_fp16_t *anchor =
+                    &anchor_[((size_t)layer_id * config_.max_block_num +
+                              block_idx) *
+                             config_.anchor_num * config_.q_head_num *
+                             config_.head_dim];
+                for (int l = 0;
+                     l < config_.anchor_num * config_.q_head_num *
+                             config_.head_dim;
+                     l++) {
+                    if (!std::isfinite(GGML_FP16_TO_FP32(anchor[l]))) {
+                        anchor[l] = GGML_FP32_TO_FP16(0.0f);
+                    }
                 }
             } else {
                 assert(false);
@@ -1040,7 +1137,9 @@ void KVCache::clear_importance_all_layers(int *block_table, int *cache_seqlens,
                 // clear anchor_
                 for (int head_id = 0; head_id < config_.q_head_num; head_id++) {
                     for (int l = 0; l < config_.block_len; l++) {
-                        importance_[layer_id][block_idx][l][head_id] = 0;
+                        importance_.block<ggml_fp16_t>(
+                            layer_id, 0, block_idx)
+                            [l * config_.q_head_num + head_id] = 0;
                     }
                 }
             }
@@ -1080,24 +1179,10 @@ void KVCache::clear_kvcache_all_layers(int *block_table, int *cache_seqlens,
             }
             int block_idx = block_table[batch_id * max_block_num + block_id];
 
-            if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
-                for (int l = 0; l < config_.block_len * config_.head_dim; l++) {
-                    k_cache_fp16_[layer_id][head_id][block_idx][l] = 0;
-                    v_cache_fp16_[layer_id][head_id][block_idx][l] = 0;
-                }
-            } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
-                for (int l = 0; l < config_.block_len * config_.head_dim / 32;
-                     l++) {
-                    k_cache_q4[layer_id][head_id][block_idx][l].d = 0;
-                    v_cache_q4[layer_id][head_id][block_idx][l].d = 0;
-                }
-            } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
-                for (int l = 0; l < config_.block_len * config_.head_dim / 32;
-                     l++) {
-                    k_cache_q8[layer_id][head_id][block_idx][l].d = 0;
-                    v_cache_q8[layer_id][head_id][block_idx][l].d = 0;
-                }
-            }
+            memset(k_cache_.block<void>(layer_id, head_id, block_idx), 0,
+                   k_cache_.get_block_bytes());
+            memset(v_cache_.block<void>(layer_id, head_id, block_idx), 0,
+                   v_cache_.get_block_bytes());
         },
         nullptr);
 
@@ -1120,6 +1205,7 @@ void KVCache::get_sincos(ggml_fp16_t *sin, ggml_fp16_t *cos, int seqlen) {
             cos_[i][j] = cos_data[i * config_.head_dim + j];
         }
     }
+    sincos_len_ = seqlen;
 
     // Timer end
     auto end = std::chrono::high_resolution_clock::now();
@@ -1156,4 +1242,91 @@ void ggml_vec_scale_f32(const int n, float *y, const float v) {
         y[i] *= v;
     }
 #endif
-}
\ No newline at end of file
+}
+
+void ggml_vec_mad_f32(const int n, float *y, const float *x, const float v) {
+#if defined(GGML_SIMD)
+    const int np = (n & ~(GGML_F32_STEP - 1));
+
+    GGML_F32_VEC vx = GGML_F32_VEC_SET1(v);
+
+    GGML_F32_VEC ax[GGML_F32_ARR];
+    GGML_F32_VEC ay[GGML_F32_ARR];
+
+    for (int i = 0; i < np; i += GGML_F32_STEP) {
+        for (int j = 0; j < GGML_F32_ARR; j++) {
+            ax[j] = GGML_F32_VEC_LOAD(x + i + j * GGML_F32_EPR);
+            ay[j] = GGML_F32_VEC_LOAD(y + i + j * GGML_F32_EPR);
+            ay[j] = GGML_F32_VEC_FMA(ay[j], ax[j], vx);
+
+            GGML_F32_VEC_STORE(y + i + j * GGML_F32_EPR, ay[j]);
+        }
+    }
+
+    // leftovers
+    for (int i = np; i < n; ++i) {
+        y[i] += x[i] * v;
+    }
+#else
+    // scalar
+    for (int i = 0; i < n; ++i) {
+        y[i] += x[i] * v;
+    }
+#endif
+}
+
+int KVCache::kv_group_size_() const {
+    if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
+        return QK4_0;
+    } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
+        return QK8_0;
+    } else if (config_.kv_type == GGML_TYPE_FP8_E4M3) {
+        return QK_FP8;
+    }
+    return 1;
+}
+
+void KVCache::store_kv_(void *block, int offset, const float *x,
+                        int n) const {
+    if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+        ggml_fp16_t *dst = reinterpret_cast<ggml_fp16_t *>(block) + offset;
+        for (int i = 0; i < n; i++) {
+            dst[i] = GGML_FP32_TO_FP16(x[i]);
+        }
+    } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
+        quantize_row_q4_0(x, reinterpret_cast<block_q4_0 *>(block) +
+                                 offset / QK4_0,
+                          n);
+    } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
+        quantize_row_q8_0(x, reinterpret_cast<block_q8_0 *>(block) +
+                                 offset / QK8_0,
+                          n);
+    } else if (config_.kv_type == GGML_TYPE_FP8_E4M3) {
+        fp8_quantize_row(x, reinterpret_cast<block_fp8 *>(block) +
+                                offset / QK_FP8,
+                         n);
+    }
+}
+
+void KVCache::load_kv_(const void *block, int offset, float *y,
+                       int n) const {
+    if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+        const ggml_fp16_t *src =
+            reinterpret_cast<const ggml_fp16_t *>(block) + offset;
+        for (int i = 0; i < n; i++) {
+            y[i] = GGML_FP16_TO_FP32(src[i]);
+        }
+    } else if (config_.kv_type == ggml_type::GGML_TYPE_Q4_0) {
+        dequantize_row_q4_0(reinterpret_cast<const block_q4_0 *>(block) +
+                                offset / QK4_0,
+                            y, n);
+    } else if (config_.kv_type == ggml_type::GGML_TYPE_Q8_0) {
+        dequantize_row_q8_0(reinterpret_cast<const block_q8_0 *>(block) +
+                                offset / QK8_0,
+                            y, n);
+    } else if (config_.kv_type == GGML_TYPE_FP8_E4M3) {
+        fp8_dequantize_row(reinterpret_cast<const block_fp8 *>(block) +
+                               offset / QK_FP8,
+                           y, n);
+    }
+}
@@ -0,0 +1,197 @@
+/**
+ * @Description  : Sliding window with attention sinks, evicting the blocks
+ *                 between them and rotating the window keys back in place.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+
+#include "kvcache.h"
+
+#include <chrono>
+#include <numeric>
+
+void KVCache::evict_window(int *block_table, int *cache_seqlens,
+                           int batch_size, int max_block_num,
+                           int sink_block_num, int window_block_num,
+                           int *spill_table, int spill_block_num,
+                           Backend *backend) {
+    // Timer start
+    auto start = std::chrono::high_resolution_clock::now();
+
+    if (config_.kv_lora_rank > 0) {
+        // k_pe takes only the last dims of a latent row
+        throw std::runtime_error("evict_window does not support an MLA cache");
+    }
+    if (sink_block_num < 0 || window_block_num < 1 || spill_block_num < 0 ||
+        (spill_block_num > 0 && spill_table == nullptr)) {
+        throw std::invalid_argument(
+            "evict_window: bad sink, window or spill block number");
+    }
+
+    std::lock_guard<std::mutex> lock(block_ref_mutex_);
+    const int block_len = config_.block_len;
+    std::vector<int> rotate_idx;
+    std::vector<int> rotate_shift;
+    std::vector<int> cleared_idx;
+    for (int batch_id = 0; batch_id < batch_size; batch_id++) {
+        int *table = block_table + batch_id * max_block_num;
+        int *spill = spill_table + batch_id * spill_block_num;
+        std::fill(spill, spill + spill_block_num, -1);
+        int block_num = (cache_seqlens[batch_id] + block_len - 1) / block_len;
+        int evict_num = block_num - sink_block_num - window_block_num;
+        if (evict_num <= 0) {
+            continue;
+        }
+        int shift = evict_num * block_len;
+        if (shift >= sincos_len_) {
+            throw std::runtime_error(
+                "evict_window: get_sincos covers " +
+                std::to_string(sincos_len_) + " positions, the window moves "
+                "back by " + std::to_string(shift));
+        }
+
+        std::vector<int> evicted(table + sink_block_num,
+                                 table + sink_block_num + evict_num);
+        int spill_num = std::min(spill_block_num, evict_num);
+        if (spill_num > 0) {
+            std::vector<float> score(evict_num);
+            for (int i = 0; i < evict_num; i++) {
+                score[i] = block_importance_(evicted[i]);
+            }
+            std::vector<int> order(evict_num);
+            std::iota(order.begin(), order.end(), 0);
+            std::partial_sort(
+                order.begin(), order.begin() + spill_num, order.end(),
+                [&](int a, int b) { return score[a] > score[b]; });
+            for (int i = 0; i < spill_num; i++) {
+                spill[i] = evicted[order[i]];
+                evicted[order[i]] = -1;
+            }
+        }
+
+        // the window follows the sinks, the evicted blocks become the next
+        // tail blocks
+        std::copy(table + sink_block_num + evict_num, table + block_num,
+                  table + sink_block_num);
+        for (int i = 0; i < evict_num; i++) {
+            int block_idx = evicted[i];
+            if (block_idx >= 0) {
+                check_block_idx_(block_idx, "evict_window");
+            }
+            if (block_idx < 0 || block_ref_[block_idx] > 1) {
+                // spilled, or still read by another sequence
+                if (block_idx >= 0) {
+                    block_ref_[block_idx]--;
+                }
+                block_idx = alloc_block_();
+            }
+            table[block_num - evict_num + i] = block_idx;
+            cleared_idx.push_back(block_idx);
+        }
+        for (int block_id = sink_block_num; block_id < block_num - evict_num;
+             block_id++) {
+            int &block_idx = table[block_id];
+            check_block_idx_(block_idx, "evict_window");
+            if (block_ref_[block_idx] > 1) {
+                // the rotation is a write, same as make_blocks_writable_
+                int copy_idx = alloc_block_();
+                copy_block_(block_idx, copy_idx);
+                block_ref_[block_idx]--;
+                block_idx = copy_idx;
+            }
+            rotate_idx.push_back(block_idx);
+            rotate_shift.push_back(shift);
+        }
+        cache_seqlens[batch_id] -= shift;
+    }
+
+    // the recycled blocks start over, importance is accumulated per token
+    for (int block_idx : cleared_idx) {
+        for (int layer_id = 0; layer_id < config_.layer_num; layer_id++) {
+            memset(importance_.block<void>(layer_id, 0, block_idx), 0,
+                   importance_.get_block_bytes());
+        }
+    }
+    if (!rotate_idx.empty()) {
+        rotate_back_blocks_(rotate_idx, rotate_shift);
+        // the anchors are taken from the keys, the QUEST min/max bounds are
+        // not even linear in them, so they are built again from the rotated
+        // blocks as if these were one sequence
+        int rotate_num = rotate_idx.size();
+        int rotate_len = rotate_num * block_len;
+        calc_anchor_all_layers(rotate_idx.data(), &rotate_len, 1, rotate_num,
+                               backend);
+    }
+
+    // Timer end
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> diff = end - start;
+    // printf("time of evict_window: %f s\n", diff.count());
+}
+
+void KVCache::rotate_back_blocks_(const std::vector<int> &block_idx,
+                                  const std::vector<int> &shift) {
+    // RoPE rotates the pairs (l, l + head_dim / 2) by the angle of the
+    // position, rotating by -shift moves a key back by shift positions
+    const int head_dim = config_.head_dim;
+    const int half = head_dim / 2;
+    const int block_len = config_.block_len;
+    const int block_num = block_idx.size();
+    do_head_work_(
+        config_.layer_num * block_num, nullptr,
+        [&](int task_id) {
+            int head_id = task_id / (config_.layer_num * block_num);
+            int layer_id = task_id / block_num % config_.layer_num;
+            int i = task_id % block_num;
+            std::vector<float> cos_val(half);
+            std::vector<float> sin_val(half);
+            for (int l = 0; l < half; l++) {
+                cos_val[l] = GGML_FP16_TO_FP32(cos_[shift[i]][l]);
+                sin_val[l] = GGML_FP16_TO_FP32(sin_[shift[i]][l]);
+            }
+
+            if (config_.kv_type == ggml_type::GGML_TYPE_F16) {
+                ggml_fp16_t *k = k_cache_.block<ggml_fp16_t>(layer_id, head_id,
+                                                             block_idx[i]);
+                for (int t = 0; t < block_len; t++) {
+                    ggml_fp16_t *row = k + (size_t)t * head_dim;
+                    for (int l = 0; l < half; l++) {
+                        float x = GGML_FP16_TO_FP32(row[l]);
+                        float y = GGML_FP16_TO_FP32(row[l + half]);
+                        row[l] = GGML_FP32_TO_FP16(x * cos_val[l] +
+                                                   y * sin_val[l]);
+                        row[l + half] = GGML_FP32_TO_FP16(y * cos_val[l] -
+                                                          x * sin_val[l]);
+                    }
+                }
+                return;
+            }
+            void *k = k_cache_.block<void>(layer_id, head_id, block_idx[i]);
+            std::vector<float> k_fp32((size_t)block_len * head_dim);
+            load_kv_(k, 0, k_fp32.data(), block_len * head_dim);
+            for (int t = 0; t < block_len; t++) {
+                float *row = k_fp32.data() + (size_t)t * head_dim;
+                for (int l = 0; l < half; l++) {
+                    float x = row[l];
+                    float y = row[l + half];
+                    row[l] = x * cos_val[l] + y * sin_val[l];
+                    row[l + half] = y * cos_val[l] - x * sin_val[l];
+                }
+            }
+            store_kv_(k, 0, k_fp32.data(), block_len * head_dim);
+        },
+        nullptr);
+}
+
+float KVCache::block_importance_(int block_idx) {
+    int n = importance_.get_block_bytes() / sizeof(ggml_fp16_t);
+    float sum = 0;
+    for (int layer_id = 0; layer_id < config_.layer_num; layer_id++) {
+        const ggml_fp16_t *importance =
+            importance_.block<ggml_fp16_t>(layer_id, 0, block_idx);
+        for (int i = 0; i < n; i++) {
+            sum += GGML_FP16_TO_FP32(importance[i]);
+        }
+    }
+    return sum;
+}
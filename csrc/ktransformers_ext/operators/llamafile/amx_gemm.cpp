@@ -9,6 +9,10 @@
 #include <mutex>
 static std::mutex print_mutex;
 #include <iostream>
+#if defined(__gnu_linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #if (defined(_WIN32) || defined(_WIN64))
 #define RESTRICT __restrict
@@ -24,6 +28,20 @@ static std::mutex print_mutex;
 #define ALWAYS_INLINE inline
 #endif
 
+#if defined(KTRANSFORMERS_CPU_DISPATCH)
+// A dispatch build compiles the kernels below for AMX with a target pragma
+// instead of -m flags for the whole file. The headers above stay at the
+// baseline ISA, so no inline function or template they define is emitted here
+// with AVX512 code, where the linker could keep it for the callers in other
+// files. g++ does not define the ISA macros for a target pragma.
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512cd,avx512vl,avx512bw,avx512dq,avx512vnni,avx512bf16,amx-tile,amx-int8,amx-bf16")
+#define __AVX512F__ 1
+#define __AVX512VNNI__ 1
+#define __AVX512BF16__ 1
+#define __AMX_INT8__ 1
+#endif
+
 #if defined(__AMX_INT8__) && defined(__AVX512VNNI__)
 
 #if defined(__GNUC__)
@@ -46,34 +64,63 @@ static std::mutex print_mutex;
 #endif
 
 #define TC_CONFIG_TILE(i, r, cb) tc.rows[i] = r; tc.colsb[i] = cb
-void ggml_tile_config_init(void) {
-    static thread_local bool is_first_time = true;
 
-    if (!is_first_time) {
+// int8 and bf16 kernels use different tile shapes, remember which one is
+// loaded on this thread so that switching between them stays cheap.
+enum amx_tile_layout {
+    AMX_TILE_NONE = 0,
+    AMX_TILE_INT8 = 1,
+    AMX_TILE_BF16 = 2,
+};
+static thread_local int amx_tile_layout_ = AMX_TILE_NONE;
+
+void ggml_tile_config_init(void) {
+    if (amx_tile_layout_ == AMX_TILE_INT8) {
         return;
     }
 
     static thread_local tile_config_t tc;
-    tile_config_t current_tc;
-    _tile_storeconfig(&current_tc);
-
-    // load only when config changes
-    if (tc.palette_id == 0 || (memcmp(&current_tc.colsb, &tc.colsb, sizeof(uint16_t) * 8) != 0 &&
-                               memcmp(&current_tc.rows, &tc.rows, sizeof(uint8_t) * 8) != 0)) {
-        tc.palette_id = 1;
-        tc.start_row = 0;
-        TC_CONFIG_TILE(TMM0, 8, 64);
-        TC_CONFIG_TILE(TMM1, 8, 64);
-        TC_CONFIG_TILE(TMM2, 16, 32);
-        TC_CONFIG_TILE(TMM3, 16, 32);
-        TC_CONFIG_TILE(TMM4, 16, 64);
-        TC_CONFIG_TILE(TMM5, 16, 64);
-        TC_CONFIG_TILE(TMM6, 16, 64);
-        TC_CONFIG_TILE(TMM7, 16, 64);
-        _tile_loadconfig(&tc);
+    tc.palette_id = 1;
+    tc.start_row = 0;
+    TC_CONFIG_TILE(TMM0, 8, 64);
+    TC_CONFIG_TILE(TMM1, 8, 64);
+    TC_CONFIG_TILE(TMM2, 16, 32);
+    TC_CONFIG_TILE(TMM3, 16, 32);
+    TC_CONFIG_TILE(TMM4, 16, 64);
+    TC_CONFIG_TILE(TMM5, 16, 64);
+    TC_CONFIG_TILE(TMM6, 16, 64);
+    TC_CONFIG_TILE(TMM7, 16, 64);
+    _tile_loadconfig(&tc);
+
+    amx_tile_layout_ = AMX_TILE_INT8;
+}
+
+// bf16 config:
+//             A    B    C
+//    rows    16   16   16
+//    colsb   64   64   64
+//
+// A holds 16 x 32 bf16, B holds 32 x 16 bf16 packed in vnni-2 format,
+// so one TDPBF16PS also covers TILE_K = 32.
+void amx_tile_config_bf16_init(void) {
+    if (amx_tile_layout_ == AMX_TILE_BF16) {
+        return;
     }
 
-    is_first_time = false;
+    static thread_local tile_config_t tc;
+    tc.palette_id = 1;
+    tc.start_row = 0;
+    TC_CONFIG_TILE(TMM0, 16, 64);
+    TC_CONFIG_TILE(TMM1, 16, 64);
+    TC_CONFIG_TILE(TMM2, 16, 64);
+    TC_CONFIG_TILE(TMM3, 16, 64);
+    TC_CONFIG_TILE(TMM4, 16, 64);
+    TC_CONFIG_TILE(TMM5, 16, 64);
+    TC_CONFIG_TILE(TMM6, 16, 64);
+    TC_CONFIG_TILE(TMM7, 16, 64);
+    _tile_loadconfig(&tc);
+
+    amx_tile_layout_ = AMX_TILE_BF16;
 }
 
 
@@ -193,7 +240,12 @@ inline bool qtype_has_amx_kernels(const enum ggml_type type) {
         (type == GGML_TYPE_Q4_K) ||
         (type == GGML_TYPE_Q5_K) ||
         (type == GGML_TYPE_Q6_K) ||
-        (type == GGML_TYPE_IQ4_XS);
+        (type == GGML_TYPE_Q2_K) ||
+        (type == GGML_TYPE_Q3_K) ||
+        (type == GGML_TYPE_IQ4_XS) ||
+        (type == GGML_TYPE_IQ2_XXS) ||
+        (type == GGML_TYPE_IQ3_XXS) ||
+        (type == GGML_TYPE_IQ3_S);
 }
 
 
@@ -318,14 +370,6 @@ inline void from_float<block_q8_K>(const float * x, char * vy, int64_t k) {
 }
 
 
-
-#if defined(__gnu_linux__)
-#include <sys/syscall.h>
-#include <unistd.h>
-#endif
-
-
-
 namespace {
 
 // Forced unrolling
@@ -362,12 +406,30 @@ struct do_unpack : std::integral_constant<bool,
     std::is_same<T, block_q4_0>::value ||
     std::is_same<T, block_q4_1>::value> {};
 
+// iq types whose quants are decoded through a 16-entry int8 table,
+// they share the packed format of `block_iq4_xs`
+template <typename T>
+struct is_type_iq_lut : std::integral_constant<bool,
+    std::is_same<T, block_iq4_xs>::value ||
+    std::is_same<T, block_iq2_xxs>::value ||
+    std::is_same<T, block_iq3_xxs>::value ||
+    std::is_same<T, block_iq3_s>::value> {};
+
 template <typename T>
 struct is_type_qkk : std::integral_constant<bool,
+    std::is_same<T, block_q2_K>::value ||
+    std::is_same<T, block_q3_K>::value ||
     std::is_same<T, block_q4_K>::value ||
     std::is_same<T, block_q5_K>::value ||
     std::is_same<T, block_q6_K>::value ||
-    std::is_same<T, block_iq4_xs>::value> {};
+    is_type_iq_lut<T>::value> {};
+
+// QKK types with 16 quants per scale group, others have 32
+template <typename T>
+struct is_type_qkk_g16 : std::integral_constant<bool,
+    std::is_same<T, block_q2_K>::value ||
+    std::is_same<T, block_q3_K>::value ||
+    std::is_same<T, block_q6_K>::value> {};
 
 #define GGML_DISPATCH_FLOATING_TYPES(TYPE, ...)                                        \
     [&] {                                                                              \
@@ -387,56 +449,6 @@ struct is_type_qkk : std::integral_constant<bool,
         }                                                                              \
     }()
 
-#define GGML_DISPATCH_QTYPES(QT, ...)                                                  \
-    [&] {                                                                              \
-        switch (QT) {                                                                  \
-            case GGML_TYPE_Q4_0: {                                                     \
-                using type = block_q4_0;                                               \
-                using vec_dot_type = block_q8_0;                                       \
-                constexpr int blck_size = QK4_0;                                       \
-                return __VA_ARGS__();                                                  \
-            }                                                                          \
-            case GGML_TYPE_Q4_1: {                                                     \
-                using type = block_q4_1;                                               \
-                using vec_dot_type = block_q8_1;                                       \
-                constexpr int blck_size = QK4_1;                                       \
-                return __VA_ARGS__();                                                  \
-            }                                                                          \
-            case GGML_TYPE_Q8_0: {                                                     \
-                using type = block_q8_0;                                               \
-                using vec_dot_type = block_q8_0;                                       \
-                constexpr int blck_size = QK8_0;                                       \
-                return __VA_ARGS__();                                                  \
-            }                                                                          \
-            case GGML_TYPE_Q4_K: {                                                     \
-                using type = block_q4_K;                                               \
-                using vec_dot_type = block_q8_K;                                       \
-                constexpr int blck_size = QK_K;                                        \
-                return __VA_ARGS__();                                                  \
-            }                                                                          \
-            case GGML_TYPE_Q5_K: {                                                     \
-                using type = block_q5_K;                                               \
-                using vec_dot_type = block_q8_K;                                       \
-                constexpr int blck_size = QK_K;                                        \
-                return __VA_ARGS__();                                                  \
-            }                                                                          \
-            case GGML_TYPE_Q6_K: {                                                     \
-                using type = block_q6_K;                                               \
-                using vec_dot_type = block_q8_K;                                       \
-                constexpr int blck_size = QK_K;                                        \
-                return __VA_ARGS__();                                                  \
-            }                                                                          \
-            case GGML_TYPE_IQ4_XS: {                                                   \
-                using type = block_iq4_xs;                                             \
-                using vec_dot_type = block_q8_K;                                       \
-                constexpr int blck_size = QK_K;                                        \
-                return __VA_ARGS__();                                                  \
-            }                                                                          \
-            default:                                                                   \
-                fprintf(stderr, "Unsupported quantized data type: %d\n", int(TYPE));   \
-        }                                                                              \
-    }()
-
 #define GGML_DISPATCH_BOOL(BOOL_V, BOOL_NAME, ...)                                     \
     [&] {                                                                              \
         if (BOOL_V) {                                                                  \
@@ -490,6 +502,10 @@ struct is_type_qkk : std::integral_constant<bool,
 // See the notes `s8s8 igemm compensation in avx512-vnni` for detail.
 template <typename TB>
 int get_tile_size() {
+    // iq types are transcoded to {quants, scales, d}, see `pack_B` for iq types
+    if (is_type_iq_lut<TB>::value) {
+        return TILE_N * (QK_K / 2 + 8 + sizeof(ggml_half));
+    }
     int tile_size = TILE_N * sizeof(TB);
     if (do_compensate<TB>::value) {
         tile_size += TILE_N * sizeof(int32_t);
@@ -498,8 +514,11 @@ int get_tile_size() {
         std::is_same<TB, block_q5_K>::value) {
         tile_size += TILE_N * 4;
     }
-    if (std::is_same<TB, block_iq4_xs>::value) {
-        tile_size += TILE_N * 2;
+    if (std::is_same<TB, block_q2_K>::value) {
+        tile_size += TILE_N * 16;
+    }
+    if (std::is_same<TB, block_q3_K>::value) {
+        tile_size += TILE_N * 4;
     }
     return tile_size;
 }
@@ -507,6 +526,9 @@ int get_tile_size() {
 template <typename TB, int BLOCK_K>
 int get_row_size(int K) {
     int KB = K / BLOCK_K;
+    if (is_type_iq_lut<TB>::value) {
+        return KB * (QK_K / 2 + 8 + sizeof(ggml_half));
+    }
     int row_size = KB * sizeof(TB);
     if (do_compensate<TB>::value) {
         row_size += KB * sizeof(int32_t);
@@ -515,8 +537,11 @@ int get_row_size(int K) {
         std::is_same<TB, block_q5_K>::value) {
         row_size += KB * 4;
     }
-    if (std::is_same<TB, block_iq4_xs>::value) {
-        row_size += KB * 2;
+    if (std::is_same<TB, block_q2_K>::value) {
+        row_size += KB * 16;
+    }
+    if (std::is_same<TB, block_q3_K>::value) {
+        row_size += KB * 4;
     }
     return row_size;
 }
@@ -782,6 +807,16 @@ void unpack_A<block_q6_K>(int8_t * RESTRICT tile, const block_q8_K * RESTRICT A,
     }
 }
 
+template <>
+void unpack_A<block_q2_K>(int8_t * RESTRICT tile, const block_q8_K * RESTRICT A, int lda, int k, int nr) {
+    unpack_A<block_q6_K>(tile, A, lda, k, nr);
+}
+
+template <>
+void unpack_A<block_q3_K>(int8_t * RESTRICT tile, const block_q8_K * RESTRICT A, int lda, int k, int nr) {
+    unpack_A<block_q6_K>(tile, A, lda, k, nr);
+}
+
 #define MM256_SET_M128I(a, b) _mm256_insertf128_si256(_mm256_castsi128_si256(b), (a), 1)
 inline __m256i bytes_from_nibbles_32(const uint8_t * rsi) {
     const __m128i tmp = _mm_loadu_si128((const __m128i *)rsi);
@@ -993,14 +1028,14 @@ inline void pack_qs<block_q6_K>(void * RESTRICT packed_B, const block_q6_K * RES
     }
 }
 
-template <>
-inline void pack_qs<block_iq4_xs>(void * RESTRICT packed_B, const block_iq4_xs * RESTRICT B, int KB) {
+// pack TILE_N rows of nibbles in `block_iq4_xs::qs` layout, `stride` in bytes
+inline void pack_iq_lut_qs(void * RESTRICT packed_B, const uint8_t * RESTRICT qs, int stride) {
     __m512i v[16];
     char * pb = (char *)packed_B;
     for (int k = 0; k < QK_K / 64; ++k) {
         for (int n = 0; n < TILE_N; ++n) {
-            __m256i r0 = bytes_from_nibbles_32(B[n * KB].qs + k * 32 +  0);
-            __m256i r1 = bytes_from_nibbles_32(B[n * KB].qs + k * 32 + 16);
+            __m256i r0 = bytes_from_nibbles_32(qs + n * stride + k * 32 +  0);
+            __m256i r1 = bytes_from_nibbles_32(qs + n * stride + k * 32 + 16);
             v[n] = _mm512_inserti32x8(_mm512_castsi256_si512(r0), r1, 1);
         }
 
@@ -1014,6 +1049,40 @@ inline void pack_qs<block_iq4_xs>(void * RESTRICT packed_B, const block_iq4_xs *
     }
 }
 
+template <>
+inline void pack_qs<block_iq4_xs>(void * RESTRICT packed_B, const block_iq4_xs * RESTRICT B, int KB) {
+    pack_iq_lut_qs(packed_B, B[0].qs, KB * sizeof(block_iq4_xs));
+}
+
+// pack 2bit quants of 16 groups, each group {k/4, n, 4} is stored in 64 bytes,
+// the i-th 64 bytes row of the group at bit 2i. `q` is {TILE_N, QK_K}
+inline void pack_qs_2bit(void * RESTRICT packed_B, const uint8_t * RESTRICT q) {
+    uint8_t * pb = (uint8_t *)packed_B;
+    memset(pb, 0, (QK_K / 4) * TILE_N);
+    for (int g = 0; g < QK_K / 16; ++g) {
+        for (int n = 0; n < TILE_N; ++n) {
+            for (int k = 0; k < 16; ++k) {
+                pb[g * 64 + n * 4 + (k & 3)] |= (q[n * QK_K + g * 16 + k] & 0x3) << ((k >> 2) * 2);
+            }
+        }
+    }
+}
+
+// pack the 3rd bit of 16 groups, each group in 4 64-bit masks matching the
+// rows of `pack_qs_2bit`
+inline void pack_qh_1bit(void * RESTRICT packed_B, const uint8_t * RESTRICT q) {
+    uint8_t * ph = (uint8_t *)packed_B;
+    memset(ph, 0, (QK_K / 8) * TILE_N);
+    for (int g = 0; g < QK_K / 16; ++g) {
+        for (int n = 0; n < TILE_N; ++n) {
+            for (int k = 0; k < 16; ++k) {
+                const int idx = (k >> 2) * 64 + n * 4 + (k & 3);
+                ph[g * 32 + idx / 8] |= ((q[n * QK_K + g * 16 + k] >> 2) & 0x1) << (idx % 8);
+            }
+        }
+    }
+}
+
 // pack B to vnni formats in 4bits or 8 bits
 void pack_B(void * RESTRICT packed_B, const block_q4_0 * RESTRICT B, int KB) {
     pack_qs(packed_B, B, KB);
@@ -1175,6 +1244,177 @@ void pack_B(void * RESTRICT packed_B, const block_iq4_xs * RESTRICT B, int KB) {
     }
 }
 
+// packed_B layout:
+//   quants {16, TILE_N, 4}  2bits
+//   scales {16, TILE_N}     uint8
+//   mins   {8, TILE_N, 2}   uint8
+//   d      {TILE_N}     ggml_half
+//   dmin   {TILE_N}     ggml_half
+void pack_B(void * RESTRICT packed_B, const block_q2_K * RESTRICT B, int KB) {
+    uint8_t q[TILE_N * QK_K];
+    uint8_t * scales = reinterpret_cast<uint8_t *>((char *)packed_B + (QK_K / 4) * TILE_N);
+    uint8_t * mins = scales + 16 * TILE_N;
+    ggml_half * d = reinterpret_cast<ggml_half *>(mins + 16 * TILE_N);
+    ggml_half * dmin = d + TILE_N;
+
+    for (int n = 0; n < TILE_N; ++n) {
+        const block_q2_K & b = B[n * KB];
+        // qs holds 2 chunks of 128, each byte with 4 quants 32 apart
+        for (int k = 0; k < QK_K; ++k) {
+            const int c = k / 128, j = (k % 128) / 32, l = k % 32;
+            q[n * QK_K + k] = (b.qs[c * 32 + l] >> (2 * j)) & 0x3;
+        }
+        for (int g = 0; g < 16; ++g) {
+            scales[g * TILE_N + n] = b.scales[g] & 0xF;
+            mins[(g >> 1) * TILE_N * 2 + n * 2 + (g & 0x1)] = b.scales[g] >> 4;
+        }
+        d[n] = b.d;
+        dmin[n] = b.dmin;
+    }
+    pack_qs_2bit(packed_B, q);
+}
+
+// packed_B layout:
+//   quants {16, TILE_N, 4}  2bits, q + 4
+//   qh     {16, TILE_N, 4}  1bit
+//   scales {16, TILE_N}      int8
+//   d      {TILE_N}     ggml_half
+void pack_B(void * RESTRICT packed_B, const block_q3_K * RESTRICT B, int KB) {
+    const uint32_t kmask1 = 0x03030303;
+    const uint32_t kmask2 = 0x0f0f0f0f;
+
+    uint8_t q[TILE_N * QK_K];
+    int8_t * scales = reinterpret_cast<int8_t *>((char *)packed_B + (QK_K / 4) * TILE_N + (QK_K / 8) * TILE_N);
+    ggml_half * d = reinterpret_cast<ggml_half *>(scales + 16 * TILE_N);
+
+    for (int n = 0; n < TILE_N; ++n) {
+        const block_q3_K & b = B[n * KB];
+        for (int k = 0; k < QK_K; ++k) {
+            const int c = k / 128, j = (k % 128) / 32, l = k % 32;
+            const int ql = (b.qs[c * 32 + l] >> (2 * j)) & 0x3;
+            const int qh = (b.hmask[l] >> (c * 4 + j)) & 0x1;
+            q[n * QK_K + k] = ql | (qh << 2);
+        }
+
+        // convert 16 scales from int6 to int8
+        uint32_t aux[4];
+        memcpy(aux, b.scales, 12);
+        const uint32_t tmp = aux[2];
+        aux[2] = ((aux[0] >> 4) & kmask2) | (((tmp >> 4) & kmask1) << 4);
+        aux[3] = ((aux[1] >> 4) & kmask2) | (((tmp >> 6) & kmask1) << 4);
+        aux[0] = (aux[0] & kmask2) | (((tmp >> 0) & kmask1) << 4);
+        aux[1] = (aux[1] & kmask2) | (((tmp >> 2) & kmask1) << 4);
+        const int8_t * ps = reinterpret_cast<const int8_t *>(aux);
+        for (int g = 0; g < 16; ++g) {
+            scales[g * TILE_N + n] = ps[g] - 32;
+        }
+        d[n] = b.d;
+    }
+    pack_qs_2bit(packed_B, q);
+    pack_qh_1bit((char *)packed_B + (QK_K / 4) * TILE_N, q);
+}
+
+// Notes: iq types with 16-entry tables
+//
+// iq2_xxs, iq3_xxs and iq3_s decode each 32 quants to
+//    d * c * (2 * ls + 1) * grid[i] * sign[i]
+// where grid values have at most 8 magnitudes, so `grid * sign` fits in a 16-entry
+// int8 table like iq4_nl. They are transcoded once to the `block_iq4_xs` packed
+// format with (2 * ls + 1) as int8 scales and d * c as fp16, then share its kernels.
+//
+template <typename TB> struct iq_lut_traits {};
+
+template <> struct iq_lut_traits<block_iq4_xs> {
+    static constexpr int8_t values[16] = {
+        -127, -104, -83, -65, -49, -35, -22, -10, 1, 13, 25, 38, 53, 69, 89, 113};
+};
+
+template <> struct iq_lut_traits<block_iq2_xxs> {
+    static constexpr ggml_type type = GGML_TYPE_IQ2_XXS;
+    static constexpr float d_scale = 0.125f;
+    static constexpr int8_t values[16] = {
+        -43, -25, -8, 8, 25, 43, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    static int get_scale(const block_iq2_xxs & b, int ib32) {
+        uint32_t aux32;
+        memcpy(&aux32, b.qs + 4 * ib32 + 2, sizeof(uint32_t));
+        return 2 * (aux32 >> 28) + 1;
+    }
+};
+
+template <> struct iq_lut_traits<block_iq3_xxs> {
+    static constexpr ggml_type type = GGML_TYPE_IQ3_XXS;
+    static constexpr float d_scale = 0.25f;
+    static constexpr int8_t values[16] = {
+        -62, -52, -44, -36, -28, -20, -12, -4, 4, 12, 20, 28, 36, 44, 52, 62};
+    static int get_scale(const block_iq3_xxs & b, int ib32) {
+        uint32_t aux32;
+        memcpy(&aux32, b.qs + QK_K / 4 + 4 * ib32, sizeof(uint32_t));
+        return 2 * (aux32 >> 28) + 1;
+    }
+};
+
+template <> struct iq_lut_traits<block_iq3_s> {
+    static constexpr ggml_type type = GGML_TYPE_IQ3_S;
+    static constexpr float d_scale = 1.f;
+    static constexpr int8_t values[16] = {
+        -15, -13, -11, -9, -7, -5, -3, -1, 1, 3, 5, 7, 9, 11, 13, 15};
+    static int get_scale(const block_iq3_s & b, int ib32) {
+        return 2 * ((b.scales[ib32 / 2] >> (4 * (ib32 & 1))) & 0xF) + 1;
+    }
+};
+
+template <typename TB>
+inline __m512i load_iq_lut_values() {
+    return _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)iq_lut_traits<TB>::values));
+}
+
+template <typename TB>
+inline uint8_t nearest_iq_lut_index(int q) {
+    const int8_t * values = iq_lut_traits<TB>::values;
+    int best = 0;
+    for (int i = 1; i < 16; ++i) {
+        if (std::abs(values[i] - q) < std::abs(values[best] - q)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// packed_B layout: same as block_iq4_xs
+template <typename TB,
+          typename std::enable_if<is_type_iq_lut<TB>::value && !std::is_same<TB, block_iq4_xs>::value, int>::type = 0>
+void pack_B(void * RESTRICT packed_B, const TB * RESTRICT B, int KB) {
+    using traits = iq_lut_traits<TB>;
+    const auto to_float = ggml_internal_get_type_traits(traits::type).to_float;
+
+    uint8_t qs[TILE_N * QK_K / 2];
+    float y[QK_K];
+    int8_t * scales = reinterpret_cast<int8_t *>((char *)packed_B + (QK_K / 2) * TILE_N);
+    ggml_half * d = reinterpret_cast<ggml_half *>(scales + 8 * TILE_N);
+
+    for (int n = 0; n < TILE_N; ++n) {
+        const TB & b = B[n * KB];
+        to_float(&b, y, QK_K);
+
+        const float dd = GGML_CPU_FP16_TO_FP32(b.d) * traits::d_scale;
+        d[n] = GGML_CPU_FP32_TO_FP16(dd);
+        for (int ib = 0; ib < QK_K / 32; ++ib) {
+            const int ls = traits::get_scale(b, ib);
+            scales[ib * TILE_N + n] = ls;
+
+            const float id = dd != 0.f ? 1.f / (dd * ls) : 0.f;
+            uint8_t idx[32];
+            for (int j = 0; j < 32; ++j) {
+                idx[j] = nearest_iq_lut_index<TB>(nearest_int(y[ib * 32 + j] * id));
+            }
+            for (int j = 0; j < 16; ++j) {
+                qs[n * QK_K / 2 + ib * 16 + j] = idx[j] | (idx[j + 16] << 4);
+            }
+        }
+    }
+    pack_iq_lut_qs(packed_B, qs, QK_K / 2);
+}
+
 template<typename TB, typename packed_B_t = packed_B_type<TB>>
 void unpack_B(packed_B_t * RESTRICT tile, const void * RESTRICT packed_B) {
     GGML_UNUSED(tile);
@@ -1290,14 +1530,39 @@ void unpack_B<block_q6_K>(int8_t * RESTRICT tile, const void * RESTRICT packed_B
 }
 
 template <>
-void unpack_B<block_iq4_xs>(int8_t * RESTRICT tile, const void * RESTRICT packed_B, int k) {
-    static const __m512i values128 = _mm512_set_epi8(
-        113, 89, 69, 53, 38, 25, 13, 1, -10, -22, -35, -49, -65, -83, -104, -127,
-        113, 89, 69, 53, 38, 25, 13, 1, -10, -22, -35, -49, -65, -83, -104, -127,
-        113, 89, 69, 53, 38, 25, 13, 1, -10, -22, -35, -49, -65, -83, -104, -127,
-        113, 89, 69, 53, 38, 25, 13, 1, -10, -22, -35, -49, -65, -83, -104, -127
-    );
+void unpack_B<block_q2_K>(int8_t * RESTRICT tile, const void * RESTRICT packed_B, int k) {
+    // 2bits, stride 64 bytes
+    const __m512i bytes = _mm512_loadu_si512((const char *)packed_B + k * 64);
+    const __m512i lowMask = _mm512_set1_epi8(0x3);
+
+    // notes: skip zero padding from row4 to row7 as we have done so in `unpack_A`
+    for (int n = 0; n < 4; ++n) {
+        const __m512i r = _mm512_and_si512(_mm512_srli_epi16(bytes, n * 2), lowMask);
+        _mm512_storeu_si512((__m512i *)(tile + n * 64), r);
+    }
+}
+
+template <>
+void unpack_B<block_q3_K>(int8_t * RESTRICT tile, const void * RESTRICT packed_B, int k) {
+    // lower 2bits, stride 64 bytes
+    const __m512i bytes = _mm512_loadu_si512((const char *)packed_B + k * 64);
+
+    // higher 1bit, stride 32 bytes
+    uint64_t hbits[4];
+    memcpy(hbits, (const char *)packed_B + (QK_K / 4) * TILE_N + k * 32, sizeof(hbits));
+
+    const __m512i off = _mm512_set1_epi8(4);
+    const __m512i lowMask = _mm512_set1_epi8(0x3);
+
+    // notes: skip zero padding from row4 to row7 as we have done so in `unpack_A`
+    for (int n = 0; n < 4; ++n) {
+        __m512i r = _mm512_and_si512(_mm512_srli_epi16(bytes, n * 2), lowMask);
+        r = _mm512_mask_sub_epi8(r, _cvtu64_mask64(~hbits[n]), r, off);
+        _mm512_storeu_si512((__m512i *)(tile + n * 64), r);
+    }
+}
 
+inline void unpack_B_iq_lut(int8_t * RESTRICT tile, const void * RESTRICT packed_B, int k, const __m512i values128) {
     const int packed_B_group_size = QK_K / 2 * TILE_N / 8;
     const char * pb = (const char *)packed_B + k * packed_B_group_size;
     const __m512i lowMask = _mm512_set1_epi8(0xF);
@@ -1311,6 +1576,30 @@ void unpack_B<block_iq4_xs>(int8_t * RESTRICT tile, const void * RESTRICT packed
     }
 }
 
+template <>
+void unpack_B<block_iq4_xs>(int8_t * RESTRICT tile, const void * RESTRICT packed_B, int k) {
+    static const __m512i values128 = load_iq_lut_values<block_iq4_xs>();
+    unpack_B_iq_lut(tile, packed_B, k, values128);
+}
+
+template <>
+void unpack_B<block_iq2_xxs>(int8_t * RESTRICT tile, const void * RESTRICT packed_B, int k) {
+    static const __m512i values128 = load_iq_lut_values<block_iq2_xxs>();
+    unpack_B_iq_lut(tile, packed_B, k, values128);
+}
+
+template <>
+void unpack_B<block_iq3_xxs>(int8_t * RESTRICT tile, const void * RESTRICT packed_B, int k) {
+    static const __m512i values128 = load_iq_lut_values<block_iq3_xxs>();
+    unpack_B_iq_lut(tile, packed_B, k, values128);
+}
+
+template <>
+void unpack_B<block_iq3_s>(int8_t * RESTRICT tile, const void * RESTRICT packed_B, int k) {
+    static const __m512i values128 = load_iq_lut_values<block_iq3_s>();
+    unpack_B_iq_lut(tile, packed_B, k, values128);
+}
+
 template <typename TA, typename TB, bool is_acc>
 struct acc_C {};
 
@@ -1519,11 +1808,94 @@ struct acc_C<block_q8_K, block_iq4_xs, is_acc> {
     }
 };
 
+template <bool is_acc>
+struct acc_C<block_q8_K, block_q2_K, is_acc> {
+    static void apply(float * RESTRICT C, int ldc, const int32_t * RESTRICT tile, const block_q8_K * A, int lda, const void * packed_B, int nr) {
+        const uint8_t * scales = reinterpret_cast<const uint8_t *>((const char *)packed_B + (QK_K / 4) * TILE_N);
+        const uint8_t * mins = scales + 16 * TILE_N;
+        const ggml_half * d0 = reinterpret_cast<const ggml_half *>(mins + 16 * TILE_N);
+        const ggml_half * dmin = d0 + TILE_N;
+
+        const __m512 vd0 = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)d0));
+        const __m512 vdmin = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)dmin));
+
+        for (int m = 0; m < nr; ++m) {
+            const float d1 = A[m * lda].d;
+            const __m512 vd = _mm512_mul_ps(_mm512_set1_ps(d1), vd0);
+            const __m512 vdm = _mm512_mul_ps(_mm512_set1_ps(-d1), vdmin);
+            const __m512 vtile = _mm512_cvtepi32_ps(_mm512_loadu_si512(tile + m * TILE_N));
+
+            __m512 vsum;
+            if (is_acc) {
+                vsum = _mm512_loadu_ps(C + m * ldc);
+            } else {
+                vsum = _mm512_set1_ps(0.f);
+            }
+
+            // 16 bsums, one for each group
+            const __m512i q8s = _mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *)A[m * lda].bsums));
+
+            __m512i acc_m = _mm512_setzero_si512();
+            for (int k = 0; k < 8; ++k) {
+                __m512i vmask = _mm512_set1_epi32(k);
+                __m512i va = _mm512_permutexvar_epi32(vmask, q8s);
+                __m512i vb = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i *)(mins + k * 32)));
+                acc_m = _mm512_dpwssds_epi32(acc_m, va, vb);
+            }
+
+            vsum = _mm512_fmadd_ps(vtile, vd, vsum);
+            vsum = _mm512_fmadd_ps(_mm512_cvtepi32_ps(acc_m), vdm, vsum);
+            _mm512_storeu_ps(C + m * ldc, vsum);
+        }
+    }
+};
+
+template <bool is_acc>
+struct acc_C<block_q8_K, block_q3_K, is_acc> {
+    static void apply(float * RESTRICT C, int ldc, const int32_t * RESTRICT tile, const block_q8_K * A, int lda, const void * packed_B, int nr) {
+        const int8_t * scales = reinterpret_cast<const int8_t *>((const char *)packed_B + (QK_K / 4) * TILE_N + (QK_K / 8) * TILE_N);
+        const ggml_half * d0 = reinterpret_cast<const ggml_half *>(scales + 16 * TILE_N);
+
+        const __m512 vd0 = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)d0));
+
+        for (int m = 0; m < nr; ++m) {
+            const float d1 = A[m * lda].d;
+            const __m512 vd = _mm512_mul_ps(_mm512_set1_ps(d1), vd0);
+            const __m512 vtile = _mm512_cvtepi32_ps(_mm512_loadu_si512(tile + m * TILE_N));
+
+            __m512 vsum;
+            if (is_acc) {
+                vsum = _mm512_loadu_ps(C + m * ldc);
+            } else {
+                vsum = _mm512_set1_ps(0.f);
+            }
+
+            vsum = _mm512_fmadd_ps(vtile, vd, vsum);
+            _mm512_storeu_ps(C + m * ldc, vsum);
+        }
+    }
+};
+
+// iq types transcoded to the packed format of iq4_xs
+template <bool is_acc>
+struct acc_C<block_q8_K, block_iq2_xxs, is_acc> : acc_C<block_q8_K, block_iq4_xs, is_acc> {};
+
+template <bool is_acc>
+struct acc_C<block_q8_K, block_iq3_xxs, is_acc> : acc_C<block_q8_K, block_iq4_xs, is_acc> {};
+
+template <bool is_acc>
+struct acc_C<block_q8_K, block_iq3_s, is_acc> : acc_C<block_q8_K, block_iq4_xs, is_acc> {};
+
 template <typename TB> constexpr int get_quants_size();
+template <> constexpr int get_quants_size<block_q2_K>() { return (QK_K / 4) * TILE_N; }
+template <> constexpr int get_quants_size<block_q3_K>() { return (QK_K / 4) * TILE_N + (QK_K / 8) * TILE_N; }
 template <> constexpr int get_quants_size<block_q4_K>() { return (QK_K / 2) * TILE_N; }
 template <> constexpr int get_quants_size<block_q5_K>() { return (QK_K / 2) * TILE_N + (QK_K / 8) * TILE_N; }
 template <> constexpr int get_quants_size<block_q6_K>() { return (QK_K / 2) * TILE_N + (QK_K / 4) * TILE_N; }
 template <> constexpr int get_quants_size<block_iq4_xs>() { return (QK_K / 2) * TILE_N; }
+template <> constexpr int get_quants_size<block_iq2_xxs>() { return (QK_K / 2) * TILE_N; }
+template <> constexpr int get_quants_size<block_iq3_xxs>() { return (QK_K / 2) * TILE_N; }
+template <> constexpr int get_quants_size<block_iq3_s>() { return (QK_K / 2) * TILE_N; }
 
 // used for QKK format
 template <typename TB, bool is_acc,
@@ -2150,12 +2522,13 @@ struct tinygemm_kernel_vnni<block_q8_K, block_q6_K, float, BLOCK_M, BLOCK_N, BLO
     }
 };
 
-template <int BLOCK_M, int BLOCK_N, int BLOCK_K>
-struct tinygemm_kernel_vnni<block_q8_K, block_iq4_xs, float, BLOCK_M, BLOCK_N, BLOCK_K> {
+// shared by iq types in the packed format of iq4_xs
+template <typename TB, int BLOCK_N>
+struct tinygemm_kernel_vnni_iq_lut {
     static void apply(int KB, const void * RESTRICT _A, const void * RESTRICT _B, float * RESTRICT C, int ldc) {
 
         constexpr int COLS = BLOCK_N / 16;
-        const int TILE_SIZE = TILE_N * sizeof(block_iq4_xs) + TILE_N * 2;
+        const int TILE_SIZE = get_tile_size<TB>();
 
         const block_q8_K * RESTRICT A = static_cast<const block_q8_K *>(_A);
         const char * RESTRICT B = static_cast<const char *>(_B);
@@ -2175,12 +2548,7 @@ struct tinygemm_kernel_vnni<block_q8_K, block_iq4_xs, float, BLOCK_M, BLOCK_N, B
         const __m256i m128s = _mm256_set1_epi16(128);
         const __m512i lowMask = _mm512_set1_epi8(0xF);
 
-        const __m512i values128 = _mm512_set_epi8(
-            113, 89, 69, 53, 38, 25, 13, 1, -10, -22, -35, -49, -65, -83, -104, -127,
-            113, 89, 69, 53, 38, 25, 13, 1, -10, -22, -35, -49, -65, -83, -104, -127,
-            113, 89, 69, 53, 38, 25, 13, 1, -10, -22, -35, -49, -65, -83, -104, -127,
-            113, 89, 69, 53, 38, 25, 13, 1, -10, -22, -35, -49, -65, -83, -104, -127
-        );
+        const __m512i values128 = load_iq_lut_values<TB>();
         const __m512i off = _mm512_set1_epi8(static_cast<char>(0x80));
         const __m512i values256 = _mm512_add_epi8(values128, off);
 
@@ -2247,34 +2615,222 @@ struct tinygemm_kernel_vnni<block_q8_K, block_iq4_xs, float, BLOCK_M, BLOCK_N, B
     }
 };
 
-#define LAUNCH_TINYGEMM_KERNEL_VNNI(NB_SIZE)                                         \
-    tinygemm_kernel_vnni<vec_dot_type, type, float, 1, NB_SIZE, blck_size>::apply(   \
-        KB, (const char *)wdata + 0 * row_size_A,                                    \
-        (const char *)src0->data + PACKED_INDEX(nb * kTilesN, 0, KB, TILE_SIZE),     \
-        (float *) dst->data + 0 * N + nb_start, ldc)
+template <int BLOCK_M, int BLOCK_N, int BLOCK_K>
+struct tinygemm_kernel_vnni<block_q8_K, block_iq4_xs, float, BLOCK_M, BLOCK_N, BLOCK_K>
+    : tinygemm_kernel_vnni_iq_lut<block_iq4_xs, BLOCK_N> {};
 
-template <typename TA, typename TB, typename TC, int BLOCK_K,
-          typename std::enable_if<!is_type_qkk<TB>::value, int>::type = 0>
-void tinygemm_kernel_amx(int M, int N, int KB, const void * RESTRICT _A, const void * RESTRICT _B, TC * RESTRICT C, int ldc) {
-    using packed_B_t = packed_B_type<TB>;
-    const int TILE_SIZE = get_tile_size<TB>();
-    const bool need_unpack = do_unpack<TB>::value;
+template <int BLOCK_M, int BLOCK_N, int BLOCK_K>
+struct tinygemm_kernel_vnni<block_q8_K, block_iq2_xxs, float, BLOCK_M, BLOCK_N, BLOCK_K>
+    : tinygemm_kernel_vnni_iq_lut<block_iq2_xxs, BLOCK_N> {};
 
-    GGML_ASSERT(M <= 2 * TILE_M && N == 2 * TILE_N);
-    const TA * RESTRICT A = static_cast<const TA *>(_A);
-    const char * RESTRICT B = static_cast<const char *>(_B);
+template <int BLOCK_M, int BLOCK_N, int BLOCK_K>
+struct tinygemm_kernel_vnni<block_q8_K, block_iq3_xxs, float, BLOCK_M, BLOCK_N, BLOCK_K>
+    : tinygemm_kernel_vnni_iq_lut<block_iq3_xxs, BLOCK_N> {};
 
-    const int m0 = std::min(M, TILE_M);
-    const int m1 = std::max(M - TILE_M, 0);
-    const int lda = KB * sizeof(TA);
-    //const int ldb = KB * sizeof(TB);
+template <int BLOCK_M, int BLOCK_N, int BLOCK_K>
+struct tinygemm_kernel_vnni<block_q8_K, block_iq3_s, float, BLOCK_M, BLOCK_N, BLOCK_K>
+    : tinygemm_kernel_vnni_iq_lut<block_iq3_s, BLOCK_N> {};
 
-    static thread_local packed_B_t Tile0[TILE_N * TILE_K];
-    static thread_local packed_B_t Tile1[TILE_N * TILE_K];
-    static thread_local int8_t Tile23[TILE_M * TILE_K];
+template <int BLOCK_M, int BLOCK_N, int BLOCK_K>
+struct tinygemm_kernel_vnni<block_q8_K, block_q2_K, float, BLOCK_M, BLOCK_N, BLOCK_K> {
+    static void apply(int KB, const void * RESTRICT _A, const void * RESTRICT _B, float * RESTRICT C, int ldc) {
 
-    static thread_local int32_t TileC0[TILE_M * TILE_N * 4];
-    static thread_local int32_t TileC1[TILE_M * TILE_N * 4];
+        constexpr int COLS = BLOCK_N / 16;
+        const int TILE_SIZE = get_tile_size<block_q2_K>();
+
+        const block_q8_K * RESTRICT A = static_cast<const block_q8_K *>(_A);
+        const char * RESTRICT B = static_cast<const char *>(_B);
+
+        // load the 256 bytes from A to 4 avx512 vectors
+        __m512i va[4];
+        // a.bsum: 16 groups, 2 bytes each group (m256i)
+        __m512i va_bsum;
+        __m512 vc[COLS];
+        __m512 vd1;
+
+        // packed_B:
+        const int offset_scales = (QK_K / 4) * TILE_N;
+        const int offset_mins   = (QK_K / 4) * TILE_N + 16 * TILE_N;
+        const int offset_d0     = (QK_K / 4) * TILE_N + 32 * TILE_N;
+        const int offset_dmin   = (QK_K / 4) * TILE_N + 32 * TILE_N + TILE_N * sizeof(ggml_half);
+
+        const __m512i lowMask = _mm512_set1_epi8(0x3);
+
+        auto loadc = [&](auto col) {
+            vc[col] = _mm512_setzero_ps();
+        };
+        Unroll<COLS>{}(loadc);
+
+        auto compute = [&](auto col, auto i) {
+            if constexpr (col == 0) {
+                // load a
+                va[0] = _mm512_loadu_si512((const __m512i *)(A[0 * KB + i].qs +   0));
+                va[1] = _mm512_loadu_si512((const __m512i *)(A[0 * KB + i].qs +  64));
+                va[2] = _mm512_loadu_si512((const __m512i *)(A[0 * KB + i].qs + 128));
+                va[3] = _mm512_loadu_si512((const __m512i *)(A[0 * KB + i].qs + 192));
+                va_bsum = _mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *)A[0 * KB + i].bsums));
+                vd1 = _mm512_set1_ps(A[0 * KB + i].d);
+            }
+
+            // step 1: accumultate the quants
+            __m512i acc = _mm512_setzero_si512();
+            const char * b_ptr = B + PACKED_INDEX(col, i, KB, TILE_SIZE);
+            for (int k_group = 0; k_group < QK_K / 16; ++k_group) {
+                const __m512i bytes = _mm512_loadu_si512(b_ptr + k_group * 64);
+                const __m512i a = va[k_group >> 2];
+
+                __m512i vsum = _mm512_setzero_si512();
+                for (int k = 0; k < 4; ++k) {
+                    __m512i va0 = _mm512_permutexvar_epi32(_mm512_set1_epi32((k_group & 3) * 4 + k), a);
+                    __m512i vb = _mm512_and_si512(_mm512_srli_epi16(bytes, k * 2), lowMask);
+                    vsum = _mm512_dpbusd_epi32(vsum, vb, va0);
+                }
+                // vacc += scale * (q8 @ q2)
+                const __m512i vscale = _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i *)(b_ptr + offset_scales + k_group * TILE_N)));
+                acc = _mm512_add_epi32(acc, _mm512_mullo_epi32(vsum, vscale));
+            }
+            const __m512 vd0 = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(b_ptr + offset_d0)));
+            vc[col] = _mm512_fmadd_ps(_mm512_cvtepi32_ps(acc), _mm512_mul_ps(vd0, vd1), vc[col]);
+
+            // step 2: accumulate the mins
+            __m512i acc_m = _mm512_setzero_si512();
+            for (int k = 0; k < 8; ++k) {
+                __m512i vmask = _mm512_set1_epi32(k);
+                __m512i va = _mm512_permutexvar_epi32(vmask, va_bsum);
+                __m512i vb = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i *)(b_ptr + offset_mins + k * 32)));
+                acc_m = _mm512_dpwssds_epi32(acc_m, va, vb);
+            }
+            const __m512 vdmin = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(b_ptr + offset_dmin)));
+            vc[col] = _mm512_fnmadd_ps(_mm512_cvtepi32_ps(acc_m), _mm512_mul_ps(vdmin, vd1), vc[col]);
+        };
+
+        for (int i = 0; i < KB; ++i) {
+            Unroll<COLS>{}(compute, i);
+        }
+
+        //store to C
+        auto storec = [&](auto col) {
+            _mm512_storeu_ps((__m512i*)(C + 0 * ldc + col * 16), vc[col]);
+        };
+        Unroll<COLS>{}(storec);
+    }
+};
+
+template <int BLOCK_M, int BLOCK_N, int BLOCK_K>
+struct tinygemm_kernel_vnni<block_q8_K, block_q3_K, float, BLOCK_M, BLOCK_N, BLOCK_K> {
+    static void apply(int KB, const void * RESTRICT _A, const void * RESTRICT _B, float * RESTRICT C, int ldc) {
+
+        constexpr int COLS = BLOCK_N / 16;
+        const int TILE_SIZE = get_tile_size<block_q3_K>();
+
+        const block_q8_K * RESTRICT A = static_cast<const block_q8_K *>(_A);
+        const char * RESTRICT B = static_cast<const char *>(_B);
+
+        // load the 256 bytes from A to 4 avx512 vectors
+        __m512i va[4];
+        __m512 vc[COLS];
+        __m512 vd1;
+
+        // packed_B:
+        const int offset_qh     = (QK_K / 4) * TILE_N;
+        const int offset_scales = (QK_K / 4) * TILE_N + (QK_K / 8) * TILE_N;
+        const int offset_d0     = (QK_K / 4) * TILE_N + (QK_K / 8) * TILE_N + 16 * TILE_N;
+
+        // compensation
+        __m512i vcomp;
+
+        const __m512i m4s = _mm512_set1_epi32(4);
+        const __m512i off = _mm512_set1_epi8(4);
+        const __m512i lowMask = _mm512_set1_epi8(0x3);
+
+        auto loadc = [&](auto col) {
+            vc[col] = _mm512_setzero_ps();
+        };
+        Unroll<COLS>{}(loadc);
+
+        auto compute = [&](auto col, auto i) {
+            if constexpr (col == 0) {
+                // load a
+                va[0] = _mm512_loadu_si512((const __m512i *)(A[0 * KB + i].qs +   0));
+                va[1] = _mm512_loadu_si512((const __m512i *)(A[0 * KB + i].qs +  64));
+                va[2] = _mm512_loadu_si512((const __m512i *)(A[0 * KB + i].qs + 128));
+                va[3] = _mm512_loadu_si512((const __m512i *)(A[0 * KB + i].qs + 192));
+
+                // compensation: 4 * A
+                const __m256i q8sums = _mm256_loadu_si256((const __m256i *)A[0 * KB + i].bsums);
+                vcomp = _mm512_mullo_epi32(_mm512_cvtepi16_epi32(q8sums), m4s);
+                vd1 = _mm512_set1_ps(A[0 * KB + i].d);
+            }
+
+            // accmulate the quants
+            __m512i acc = _mm512_setzero_si512();
+            const char * b_ptr = B + PACKED_INDEX(col, i, KB, TILE_SIZE);
+            for (int k_group = 0; k_group < QK_K / 16; ++k_group) {
+                const __m512i bytes = _mm512_loadu_si512(b_ptr + k_group * 64);
+                const __m512i a = va[k_group >> 2];
+                uint64_t hbits[4];
+                memcpy(hbits, b_ptr + offset_qh + k_group * 32, sizeof(hbits));
+
+                __m512i vsum = _mm512_setzero_si512();
+                for (int k = 0; k < 4; ++k) {
+                    __m512i va0 = _mm512_permutexvar_epi32(_mm512_set1_epi32((k_group & 3) * 4 + k), a);
+                    // B + 4, in [0, 8)
+                    __m512i vb = _mm512_and_si512(_mm512_srli_epi16(bytes, k * 2), lowMask);
+                    vb = _mm512_mask_add_epi8(vb, _cvtu64_mask64(hbits[k]), vb, off);
+                    vsum = _mm512_dpbusd_epi32(vsum, vb, va0);
+                }
+                // (B + 4) * A - 4 * A
+                __m512i vmask = _mm512_set1_epi32(k_group);
+                vsum = _mm512_sub_epi32(vsum, _mm512_permutexvar_epi32(vmask, vcomp));
+
+                // vacc += scale * (q8 @ q3)
+                const __m512i vscale = _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i *)(b_ptr + offset_scales + k_group * TILE_N)));
+                acc = _mm512_add_epi32(acc, _mm512_mullo_epi32(vsum, vscale));
+            }
+            const __m512 vd0 = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(b_ptr + offset_d0)));
+            vc[col] = _mm512_fmadd_ps(_mm512_cvtepi32_ps(acc), _mm512_mul_ps(vd0, vd1), vc[col]);
+        };
+
+        for (int i = 0; i < KB; ++i) {
+            Unroll<COLS>{}(compute, i);
+        }
+
+        //store to C
+        auto storec = [&](auto col) {
+            _mm512_storeu_ps((__m512i*)(C + 0 * ldc + col * 16), vc[col]);
+        };
+        Unroll<COLS>{}(storec);
+    }
+};
+
+#define LAUNCH_TINYGEMM_KERNEL_VNNI(NB_SIZE)                                         \
+    tinygemm_kernel_vnni<vec_dot_type, type, float, 1, NB_SIZE, blck_size>::apply(   \
+        KB, (const char *)wdata + 0 * row_size_A,                                    \
+        (const char *)src0->data + PACKED_INDEX(nb * kTilesN, 0, KB, TILE_SIZE),     \
+        (float *) dst->data + 0 * N + nb_start, ldc)
+
+template <typename TA, typename TB, typename TC, int BLOCK_K,
+          typename std::enable_if<!is_type_qkk<TB>::value, int>::type = 0>
+void tinygemm_kernel_amx(int M, int N, int KB, const void * RESTRICT _A, const void * RESTRICT _B, TC * RESTRICT C, int ldc) {
+    using packed_B_t = packed_B_type<TB>;
+    const int TILE_SIZE = get_tile_size<TB>();
+    const bool need_unpack = do_unpack<TB>::value;
+
+    GGML_ASSERT(M <= 2 * TILE_M && N == 2 * TILE_N);
+    const TA * RESTRICT A = static_cast<const TA *>(_A);
+    const char * RESTRICT B = static_cast<const char *>(_B);
+
+    const int m0 = std::min(M, TILE_M);
+    const int m1 = std::max(M - TILE_M, 0);
+    const int lda = KB * sizeof(TA);
+    //const int ldb = KB * sizeof(TB);
+
+    static thread_local packed_B_t Tile0[TILE_N * TILE_K];
+    static thread_local packed_B_t Tile1[TILE_N * TILE_K];
+    static thread_local int8_t Tile23[TILE_M * TILE_K];
+
+    static thread_local int32_t TileC0[TILE_M * TILE_N * 4];
+    static thread_local int32_t TileC1[TILE_M * TILE_N * 4];
 
     // double buffering C to interleave avx512 and amx
     int32_t * C_cur = TileC0;
@@ -2307,7 +2863,7 @@ void tinygemm_kernel_amx(int M, int N, int KB, const void * RESTRICT _A, const v
         _tile_stored(TMM5, Tile5(C_pre), TILE_N * sizeof(int32_t));
 
         if (need_unpack) {
-            unpack_B<TB>(Tile1, B_blk0);
+            unpack_B<TB>(Tile1, B_blk1);
             _tile_loadd(TMM1, Tile1, TILE_N * VNNI_BLK);
         } else {
             _tile_loadd(TMM1, B_blk1, TILE_N * VNNI_BLK);
@@ -2467,7 +3023,7 @@ void tinygemm_kernel_amx(int M, int N, int KB, const void * RESTRICT _A, const v
     static thread_local int32_t Sumi6[TILE_M * TILE_N];
     static thread_local int32_t Sumi7[TILE_M * TILE_N];
 
-    const int k_group_size = std::is_same<TB, block_q6_K>::value ? 16 : 32;
+    const int k_group_size = is_type_qkk_g16<TB>::value ? 16 : 32;
     for (int i = 0; i < KB; ++i) {
         // step 1: accumulate the quants across 8 groups, each group with 32
         for (int k = 0; k < QK_K / k_group_size; ++k) {
@@ -2525,6 +3081,308 @@ void tinygemm_kernel_amx(int M, int N, int KB, const void * RESTRICT _A, const v
     return;
 }
 
+// Notes: avx512-vnni kernels for small M
+//
+// Decode batches of a few tokens end up with M in [2, 16]. The amx kernels
+// pay for a full {16, 64} tile per K block no matter how many rows are valid,
+// plus the tile stores and the tile config. For such M the dot products are
+// done with VPDPBUSD instead, keeping the unpacked B block in registers and
+// streaming all M rows of A over it, so each weight load is shared by M rows.
+//
+// The results are written in the same {m, TILE_N} int32 layout as `_tile_stored`,
+// so unpack_A/unpack_B/scale_C/acc_C are reused unchanged.
+//
+// VPDPBUSD is u8s8, the signed A is flipped by xor 0x80 and compensated with
+//    a * b = (a ^ 0x80) * b - 128 * b
+// `128 * b` is computed here from the unpacked block since B of most types
+// comes without a pre-computed compensation.
+//
+template <int BLOCK_K>
+inline void vnni_dot_tile2(int32_t * RESTRICT C0, int32_t * RESTRICT C1,
+        const int8_t * RESTRICT A, int lda, const void * RESTRICT B0, const void * RESTRICT B1, int nr) {
+    constexpr int ROWS = BLOCK_K / VNNI_BLK;
+    static_assert(BLOCK_K % VNNI_BLK == 0 && BLOCK_K <= TILE_K);
+
+    __m512i vb0[ROWS];
+    __m512i vb1[ROWS];
+    __m512i vcomp0 = _mm512_setzero_si512();
+    __m512i vcomp1 = _mm512_setzero_si512();
+    const __m512i off = _mm512_set1_epi8(static_cast<char>(0x80));
+
+    // B is in vnni format {BLOCK_K/4, TILE_N, 4}, each row is one zmm
+    auto loadb = [&](auto k) {
+        vb0[k] = _mm512_loadu_si512(static_cast<const char *>(B0) + k * TILE_N * VNNI_BLK);
+        vb1[k] = _mm512_loadu_si512(static_cast<const char *>(B1) + k * TILE_N * VNNI_BLK);
+        vcomp0 = _mm512_dpbusd_epi32(vcomp0, off, vb0[k]);
+        vcomp1 = _mm512_dpbusd_epi32(vcomp1, off, vb1[k]);
+    };
+    Unroll<ROWS>{}(loadb);
+
+    for (int m = 0; m < nr; ++m) {
+        const int32_t * a_ptr = reinterpret_cast<const int32_t *>(A + m * lda);
+        __m512i vc0 = _mm512_setzero_si512();
+        __m512i vc1 = _mm512_setzero_si512();
+        auto compute = [&](auto k) {
+            __m512i va = _mm512_xor_si512(_mm512_set1_epi32(a_ptr[k]), off);
+            vc0 = _mm512_dpbusd_epi32(vc0, va, vb0[k]);
+            vc1 = _mm512_dpbusd_epi32(vc1, va, vb1[k]);
+        };
+        Unroll<ROWS>{}(compute);
+        _mm512_storeu_si512(C0 + m * TILE_N, _mm512_sub_epi32(vc0, vcomp0));
+        _mm512_storeu_si512(C1 + m * TILE_N, _mm512_sub_epi32(vc1, vcomp1));
+    }
+}
+
+template <typename TA, typename TB, typename TC, int BLOCK_K,
+          typename std::enable_if<!is_type_qkk<TB>::value, int>::type = 0>
+void tinygemm_kernel_vnni_m(int M, int N, int KB, const void * RESTRICT _A, const void * RESTRICT _B, TC * RESTRICT C, int ldc) {
+    using packed_B_t = packed_B_type<TB>;
+    const int TILE_SIZE = get_tile_size<TB>();
+    const bool need_unpack = do_unpack<TB>::value;
+
+    GGML_ASSERT(M <= TILE_M && N == 2 * TILE_N);
+    const TA * RESTRICT A = static_cast<const TA *>(_A);
+    const char * RESTRICT B = static_cast<const char *>(_B);
+
+    const int lda = KB * sizeof(TA);
+
+    static thread_local packed_B_t Tile0[TILE_N * TILE_K];
+    static thread_local packed_B_t Tile1[TILE_N * TILE_K];
+    static thread_local int32_t Tile4[TILE_M * TILE_N];
+    static thread_local int32_t Tile6[TILE_M * TILE_N];
+
+    for (int i = 0; i < KB; ++i) {
+        const char * B_blk0 = B + PACKED_INDEX(0, i, KB, TILE_SIZE);
+        const char * B_blk1 = B + PACKED_INDEX(1, i, KB, TILE_SIZE);
+        if (need_unpack) {
+            unpack_B<TB>(Tile0, B_blk0);
+            unpack_B<TB>(Tile1, B_blk1);
+            vnni_dot_tile2<TILE_K>(Tile4, Tile6, (const int8_t *)A[i].qs, lda, Tile0, Tile1, M);
+        } else {
+            vnni_dot_tile2<TILE_K>(Tile4, Tile6, (const int8_t *)A[i].qs, lda, B_blk0, B_blk1, M);
+        }
+
+        GGML_DISPATCH_BOOL(i > 0, is_acc, [&] {
+            acc_C<TA, TB, is_acc>::apply(C,          ldc, Tile4, &A[i], KB, B_blk0, M);
+            acc_C<TA, TB, is_acc>::apply(C + TILE_N, ldc, Tile6, &A[i], KB, B_blk1, M);
+        });
+    }
+}
+
+template <typename TA, typename TB, typename TC, int BLOCK_K,
+          typename std::enable_if<is_type_qkk<TB>::value, int>::type = 0>
+void tinygemm_kernel_vnni_m(int M, int N, int KB, const void * RESTRICT _A, const void * RESTRICT _B, float * RESTRICT C, int ldc) {
+    static_assert(std::is_same<TA, block_q8_K>::value);
+    const int TILE_SIZE = get_tile_size<TB>();
+
+    GGML_ASSERT(M <= TILE_M && N == 2 * TILE_N);
+    const TA * RESTRICT A = static_cast<const TA *>(_A);
+    const char * RESTRICT B = static_cast<const char *>(_B);
+
+    static thread_local int8_t Tile0[TILE_N * TILE_K];
+    static thread_local int8_t Tile1[TILE_N * TILE_K];
+    static thread_local int8_t Tile23[TILE_M * TILE_K];
+    static thread_local int32_t Tile4[TILE_M * TILE_N];
+    static thread_local int32_t Tile6[TILE_M * TILE_N];
+    static thread_local int32_t Sumi4[TILE_M * TILE_N];
+    static thread_local int32_t Sumi6[TILE_M * TILE_N];
+
+    // groups of 16 only fill the first half of the unpacked blocks
+    constexpr int k_group_size = is_type_qkk_g16<TB>::value ? 16 : 32;
+    for (int i = 0; i < KB; ++i) {
+        const char * B_blk0 = B + PACKED_INDEX(0, i, KB, TILE_SIZE);
+        const char * B_blk1 = B + PACKED_INDEX(1, i, KB, TILE_SIZE);
+        for (int k = 0; k < QK_K / k_group_size; ++k) {
+            GGML_DISPATCH_BOOL(k > 0, is_acc, [&] {
+                unpack_B<TB>(Tile0, B_blk0, k);
+                unpack_B<TB>(Tile1, B_blk1, k);
+                unpack_A<TB>(Tile23, &A[i], KB, k, M);
+                vnni_dot_tile2<k_group_size>(Tile4, Tile6, Tile23, TILE_K, Tile0, Tile1, M);
+
+                scale_C<TB, is_acc>(Tile4, Sumi4, B_blk0, k, M);
+                scale_C<TB, is_acc>(Tile6, Sumi6, B_blk1, k, M);
+            });
+        }
+
+        GGML_DISPATCH_BOOL(i > 0, is_acc, [&] {
+            acc_C<TA, TB, is_acc>::apply(C,          ldc, Sumi4, &A[i], KB, B_blk0, M);
+            acc_C<TA, TB, is_acc>::apply(C + TILE_N, ldc, Sumi6, &A[i], KB, B_blk1, M);
+        });
+    }
+}
+
+// Notes: bf16 amx kernels
+//
+// TDPBF16PS multiplies A {16, 32} bf16 with B {32, 16} bf16 and accumulates
+// to C {16, 16} fp32. B is prepacked to vnni-2 format per {TILE_N, TILE_K} block:
+//    packed_B: from {n, k} to {k/2, n, 2}, viewed in 2d, we get {16, 64 bytes}
+//
+// f16 weights are converted to bf16 while packing, so both types share the
+// same kernels and take bf16 activations.
+//
+// Blocks are re-organized in the format {NB, KB, BF16_TILE_SIZE}, the same as
+// quantized weights, so PACKED_INDEX works for both.
+constexpr int BF16_VNNI_BLK = 2;
+constexpr int BF16_TILE_SIZE = TILE_N * TILE_K * sizeof(ggml_bf16_t);
+
+inline __m256i cvt_fp32_to_bf16(__m512 v) {
+#if defined(__AVX512BF16__)
+    return (__m256i)_mm512_cvtneps_pbh(v);
+#else
+    // round to nearest even
+    __m512i x = _mm512_castps_si512(v);
+    __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(x, 16), _mm512_set1_epi32(1));
+    __m512i r = _mm512_add_epi32(x, _mm512_add_epi32(lsb, _mm512_set1_epi32(0x7fff)));
+    return _mm512_cvtepi32_epi16(_mm512_srli_epi32(r, 16));
+#endif
+}
+
+// load TILE_K elements of one row of B as bf16
+inline void load_row_bf16(uint16_t * RESTRICT dst, const ggml_bf16_t * RESTRICT src) {
+    _mm512_storeu_si512((__m512i *)dst, _mm512_loadu_si512((const __m512i *)src));
+}
+
+inline void load_row_bf16(uint16_t * RESTRICT dst, const ggml_fp16_t * RESTRICT src) {
+    __m512 v0 = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)src));
+    __m512 v1 = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(src + 16)));
+    _mm256_storeu_si256((__m256i *)dst, cvt_fp32_to_bf16(v0));
+    _mm256_storeu_si256((__m256i *)(dst + 16), cvt_fp32_to_bf16(v1));
+}
+
+template <typename TB>
+void convert_B_packed_format_bf16(void * RESTRICT packed_B, const TB * RESTRICT B, int N, int K) {
+    const int NB = N / TILE_N;
+    const int KB = K / TILE_K;
+
+    alignas(64) uint16_t row[TILE_K];
+    for (int n = 0; n < NB; ++n) {
+        for (int k = 0; k < KB; ++k) {
+            uint16_t * tile = (uint16_t *)((char *)packed_B + PACKED_INDEX(n, k, KB, BF16_TILE_SIZE));
+            for (int nn = 0; nn < TILE_N; ++nn) {
+                load_row_bf16(row, B + (size_t)(n * TILE_N + nn) * K + k * TILE_K);
+                for (int kk = 0; kk < TILE_K; ++kk) {
+                    tile[(kk / BF16_VNNI_BLK) * TILE_N * BF16_VNNI_BLK + nn * BF16_VNNI_BLK + kk % BF16_VNNI_BLK] = row[kk];
+                }
+            }
+        }
+    }
+}
+
+#if defined(__AVX512BF16__)
+// single batch gemv with avx512-bf16, handles BLOCK_N / TILE_N tiles at a time
+// so that each broadcast of A is shared by several B tiles.
+template <int BLOCK_N>
+struct tinygemm_kernel_bf16_vnni {
+    static void apply(int KB, const ggml_bf16_t * RESTRICT A, const char * RESTRICT B, float * RESTRICT C) {
+        constexpr int COLS = BLOCK_N / TILE_N;
+
+        __m512 vc[COLS];
+        auto loadc = [&](auto col) {
+            vc[col] = _mm512_setzero_ps();
+        };
+        Unroll<COLS>{}(loadc);
+
+        for (int i = 0; i < KB; ++i) {
+            const int32_t * a = (const int32_t *)(A + i * TILE_K);
+            for (int kk = 0; kk < TILE_K / BF16_VNNI_BLK; ++kk) {
+                __m512bh va = (__m512bh)_mm512_set1_epi32(a[kk]);
+                auto compute = [&](auto col) {
+                    const char * b = B + PACKED_INDEX(col, i, KB, BF16_TILE_SIZE) + kk * TILE_N * BF16_VNNI_BLK * sizeof(ggml_bf16_t);
+                    __m512bh vb = (__m512bh)_mm512_loadu_si512((const __m512i *)b);
+                    vc[col] = _mm512_dpbf16_ps(vc[col], va, vb);
+                };
+                Unroll<COLS>{}(compute);
+            }
+        }
+
+        auto storec = [&](auto col) {
+            _mm512_storeu_ps(C + col * TILE_N, vc[col]);
+        };
+        Unroll<COLS>{}(storec);
+    }
+};
+#endif
+
+// handles a block of {M <= 2 * TILE_M, N = 2 * TILE_N} with 2-2-4 tile pattern,
+// A is {M, K} bf16 with row stride lda (in elements).
+void tinygemm_kernel_amx_bf16(int M, int N, int KB, const ggml_bf16_t * RESTRICT A, int lda,
+                              const char * RESTRICT B, float * RESTRICT C, int ldc) {
+    GGML_ASSERT(M <= 2 * TILE_M && N == 2 * TILE_N);
+
+    const int m0 = std::min(M, TILE_M);
+    const int m1 = std::max(M - TILE_M, 0);
+
+    // partial A tiles are copied to a 16-row buffer, rows beyond m only
+    // affect rows of C that are never written back.
+    alignas(64) static thread_local ggml_bf16_t Tile2[TILE_M * TILE_K];
+    alignas(64) static thread_local ggml_bf16_t Tile3[TILE_M * TILE_K];
+    alignas(64) static thread_local float TileC[TILE_M * TILE_N];
+
+    // returns the tile source of A and its stride in bytes
+    auto prepare_A = [&](ggml_bf16_t * tile, const ggml_bf16_t * a, int nr, int & stride) -> const void * {
+        if (nr == TILE_M) {
+            stride = lda * sizeof(ggml_bf16_t);
+            return a;
+        }
+        for (int m = 0; m < nr; ++m) {
+            _mm512_storeu_si512((__m512i *)(tile + m * TILE_K), _mm512_loadu_si512((const __m512i *)(a + m * lda)));
+        }
+        stride = TILE_K * sizeof(ggml_bf16_t);
+        return tile;
+    };
+
+    _tile_zero(TMM4);
+    _tile_zero(TMM6);
+    if (m1 != 0) {
+        _tile_zero(TMM5);
+        _tile_zero(TMM7);
+    }
+
+    for (int i = 0; i < KB; ++i) {
+        int stride;
+        _tile_loadd(TMM0, B + PACKED_INDEX(0, i, KB, BF16_TILE_SIZE), TILE_N * BF16_VNNI_BLK * sizeof(ggml_bf16_t));
+        _tile_loadd(TMM1, B + PACKED_INDEX(1, i, KB, BF16_TILE_SIZE), TILE_N * BF16_VNNI_BLK * sizeof(ggml_bf16_t));
+
+        const void * a0 = prepare_A(Tile2, A + i * TILE_K, m0, stride);
+        _tile_loadd(TMM2, a0, stride);
+        _tile_dpbf16ps(TMM4, TMM2, TMM0);
+        _tile_dpbf16ps(TMM6, TMM2, TMM1);
+
+        if (m1 != 0) {
+            const void * a1 = prepare_A(Tile3, A + TILE_M * lda + i * TILE_K, m1, stride);
+            _tile_loadd(TMM3, a1, stride);
+            _tile_dpbf16ps(TMM5, TMM3, TMM0);
+            _tile_dpbf16ps(TMM7, TMM3, TMM1);
+        }
+    }
+
+    // tile registers are named in the asm templates, so they can not be passed
+    // through a lambda; partial C tiles go through TileC instead.
+    auto copy_C = [&](float * c, int nr) {
+        for (int m = 0; m < nr; ++m) {
+            _mm512_storeu_ps(c + m * ldc, _mm512_loadu_ps(TileC + m * TILE_N));
+        }
+    };
+    if (m0 == TILE_M) {
+        _tile_stored(TMM4, C, ldc * sizeof(float));
+        _tile_stored(TMM6, C + TILE_N, ldc * sizeof(float));
+    } else {
+        _tile_stored(TMM4, TileC, TILE_N * sizeof(float));
+        copy_C(C, m0);
+        _tile_stored(TMM6, TileC, TILE_N * sizeof(float));
+        copy_C(C + TILE_N, m0);
+    }
+    if (m1 == TILE_M) {
+        _tile_stored(TMM5, C + TILE_M * ldc, ldc * sizeof(float));
+        _tile_stored(TMM7, C + TILE_M * ldc + TILE_N, ldc * sizeof(float));
+    } else if (m1 != 0) {
+        _tile_stored(TMM5, TileC, TILE_N * sizeof(float));
+        copy_C(C + TILE_M * ldc, m1);
+        _tile_stored(TMM7, TileC, TILE_N * sizeof(float));
+        copy_C(C + TILE_M * ldc + TILE_N, m1);
+    }
+}
+
 } // anonymous namespace
 
 // get the packed tensor size for quantized weights
@@ -2703,6 +3561,28 @@ void ggml_backend_amx_mul_mat(const ggml_compute_params * params, struct ggml_te
         return;
     }
 
+    // small batches from decoding, see "avx512-vnni kernels for small M"
+    if (M <= VNNI_MAX_M) {
+        constexpr int BLOCK_N = TILE_N * 2;
+        const int NB = div_up(N, BLOCK_N);
+
+        parallel_for_ggml(params, NB, [&](int begin, int end) {
+            GGML_DISPATCH_QTYPES(TYPE, [&] {
+                const int KB = K / blck_size;
+                const int TILE_SIZE = get_tile_size<type>();
+                for (int nb = begin; nb < end; ++nb) {
+                    int nb_start = nb * BLOCK_N;
+                    tinygemm_kernel_vnni_m<vec_dot_type, type, float, blck_size>(
+                        M, BLOCK_N, KB,
+                        wdata,
+                        (const char *)src0->data + PACKED_INDEX(nb * 2, 0, KB, TILE_SIZE),
+                        (float *) dst->data + nb_start, ldc);
+                }
+            });
+        });
+        return;
+    }
+
     // handle 4 tiles at a tile
     constexpr int BLOCK_M = TILE_M * 2;
     constexpr int BLOCK_N = TILE_N * 2;
@@ -2778,6 +3658,31 @@ size_t get_amx_packed_size(enum ggml_type type, int K, int N) {
                 row_size_B = get_row_size<block_iq4_xs, blck_size>(K);
                 break;
             }
+            case GGML_TYPE_Q2_K: {
+                constexpr int blck_size = QK_K;
+                row_size_B = get_row_size<block_q2_K, blck_size>(K);
+                break;
+            }
+            case GGML_TYPE_Q3_K: {
+                constexpr int blck_size = QK_K;
+                row_size_B = get_row_size<block_q3_K, blck_size>(K);
+                break;
+            }
+            case GGML_TYPE_IQ2_XXS: {
+                constexpr int blck_size = QK_K;
+                row_size_B = get_row_size<block_iq2_xxs, blck_size>(K);
+                break;
+            }
+            case GGML_TYPE_IQ3_XXS: {
+                constexpr int blck_size = QK_K;
+                row_size_B = get_row_size<block_iq3_xxs, blck_size>(K);
+                break;
+            }
+            case GGML_TYPE_IQ3_S: {
+                constexpr int blck_size = QK_K;
+                row_size_B = get_row_size<block_iq3_s, blck_size>(K);
+                break;
+            }
             default: 
                 return 0;
         }
@@ -2789,9 +3694,9 @@ size_t get_amx_packed_size(enum ggml_type type, int K, int N) {
     } else { 
         switch (type) {
             case GGML_TYPE_F16:
-                return N * K * sizeof(ggml_fp16_t);
             case GGML_TYPE_BF16:
-                return N * K * sizeof(ggml_bf16_t);
+                // packed to bf16 vnni-2 tiles
+                return (size_t)(N / TILE_N) * (K / TILE_K) * BF16_TILE_SIZE;
             default:
                 return N * K * sizeof(float);  
         }
@@ -2851,6 +3756,46 @@ void convert_weight_to_amx_format(
                 packed_data, (const block_iq4_xs*)original_data, N, K);
             break;
         }
+        case GGML_TYPE_Q2_K: {
+            constexpr int blck_size = QK_K;
+            convert_B_packed_format<block_q2_K, blck_size>(
+                packed_data, (const block_q2_K*)original_data, N, K);
+            break;
+        }
+        case GGML_TYPE_Q3_K: {
+            constexpr int blck_size = QK_K;
+            convert_B_packed_format<block_q3_K, blck_size>(
+                packed_data, (const block_q3_K*)original_data, N, K);
+            break;
+        }
+        case GGML_TYPE_IQ2_XXS: {
+            constexpr int blck_size = QK_K;
+            convert_B_packed_format<block_iq2_xxs, blck_size>(
+                packed_data, (const block_iq2_xxs*)original_data, N, K);
+            break;
+        }
+        case GGML_TYPE_IQ3_XXS: {
+            constexpr int blck_size = QK_K;
+            convert_B_packed_format<block_iq3_xxs, blck_size>(
+                packed_data, (const block_iq3_xxs*)original_data, N, K);
+            break;
+        }
+        case GGML_TYPE_IQ3_S: {
+            constexpr int blck_size = QK_K;
+            convert_B_packed_format<block_iq3_s, blck_size>(
+                packed_data, (const block_iq3_s*)original_data, N, K);
+            break;
+        }
+        case GGML_TYPE_F16: {
+            convert_B_packed_format_bf16<ggml_fp16_t>(
+                packed_data, (const ggml_fp16_t*)original_data, N, K);
+            break;
+        }
+        case GGML_TYPE_BF16: {
+            convert_B_packed_format_bf16<ggml_bf16_t>(
+                packed_data, (const ggml_bf16_t*)original_data, N, K);
+            break;
+        }
         default: 
             memcpy(packed_data, original_data, expected_size);
             break;
@@ -2863,7 +3808,7 @@ size_t get_amx_desired_workspace_size(
     int K,   
     int N   
 ) { 
-    const bool is_floating_type = (type == GGML_TYPE_F16);
+    const bool is_floating_type = (type == GGML_TYPE_F16 || type == GGML_TYPE_BF16);
     if (is_floating_type) {
         return 0;
     }
@@ -2913,7 +3858,12 @@ size_t get_amx_desired_workspace_size(
             desired_wsize = M * row_size_A;
             break;
         }
-        case GGML_TYPE_IQ4_XS: {
+        case GGML_TYPE_Q2_K:
+        case GGML_TYPE_Q3_K:
+        case GGML_TYPE_IQ4_XS:
+        case GGML_TYPE_IQ2_XXS:
+        case GGML_TYPE_IQ3_XXS:
+        case GGML_TYPE_IQ3_S: {
             constexpr int blck_size = QK_K;
             using vec_dot_type = block_q8_K;
             const size_t row_size_A = K / blck_size * sizeof(vec_dot_type);
@@ -2928,18 +3878,18 @@ size_t get_amx_desired_workspace_size(
     return desired_wsize;
 }
  
-#define LAUNCH_TINYGEMM_KERNEL_AVX_1(MB_SIZE, NB_SIZE)                                \
-    tinygemm_kernel_avx<float, type, float, MB_SIZE, NB_SIZE, blck_size>::apply(    \
-        K, (const float *)input_data + mb_start * K,                                \
-        (const type *)weight_data + nb_start * K,                                    \
-        (float *)output_data + mb_start * ldc + nb_start, ldc);
-
 #define LAUNCH_TINYGEMM_KERNEL_VNNI_1(NB_SIZE)                                         \
     tinygemm_kernel_vnni<vec_dot_type, type, float, 1, NB_SIZE, blck_size>::apply(   \
         KB, (const char *)input_data + 0 * row_size_A,                                    \
         (const char *)weight_data + PACKED_INDEX(nb * kTilesN, 0, KB, TILE_SIZE),     \
         (float *) output_data + 0 * N + nb_start, ldc)
 
+#define LAUNCH_TINYGEMM_KERNEL_BF16_VNNI(NB_SIZE)                                      \
+    tinygemm_kernel_bf16_vnni<NB_SIZE>::apply(                                         \
+        KB, (const ggml_bf16_t *)input_data,                                           \
+        (const char *)weight_data + PACKED_INDEX(nb * kTilesN, 0, KB, BF16_TILE_SIZE), \
+        output_data + nb_start)
+
 void amx_gemm_compute(
     enum ggml_type TYPE,
     const void* weight_data,    // {N, K}，VNNI
@@ -2951,42 +3901,55 @@ void amx_gemm_compute(
     int ldc
 
 ) {
-    // f16 only has avx512 kernels for now,
-    // amx kernels will be added once 6th gen xeon is released.
-    const bool is_floating_type = (TYPE == GGML_TYPE_F16);
-    if(is_floating_type){
-        constexpr int BLOCK_M = 4;
-        constexpr int BLOCK_N = 6;
-        const int MB = div_up(M, BLOCK_M);
-        const int NB = div_up(N, BLOCK_N);
- 
-        GGML_DISPATCH_FLOATING_TYPES(TYPE, [&] {
-            for (int i = 0; i < MB*NB; ++i) {
-                int mb = i / NB;
-                int nb = i % NB;
-
-                int mb_start = mb * BLOCK_M;
-                int mb_size = std::min(BLOCK_M, M - mb_start);
+    // f16 and bf16 weights are packed to bf16 and computed with TDPBF16PS,
+    // activations are bf16, see `get_amx_vec_dot_type`.
+    const bool is_floating_type = (TYPE == GGML_TYPE_F16 || TYPE == GGML_TYPE_BF16);
+    if (is_floating_type) {
+        const int KB = K / TILE_K;
+
+#if defined(__AVX512BF16__)
+        if (M == 1) {
+            constexpr int kTilesN = 4;
+            constexpr int BLOCK_N = TILE_N * kTilesN;
+            const int NB = div_up(N, BLOCK_N);
+            for (int nb = 0; nb < NB; ++nb) {
                 int nb_start = nb * BLOCK_N;
                 int nb_size = std::min(BLOCK_N, N - nb_start);
 
-                switch (mb_size << 4 | nb_size) {
-                    case 0x12: LAUNCH_TINYGEMM_KERNEL_AVX_1(1, 2); break;
-                    case 0x14: LAUNCH_TINYGEMM_KERNEL_AVX_1(1, 4); break;
-                    case 0x16: LAUNCH_TINYGEMM_KERNEL_AVX_1(1, 6); break;
-                    case 0x22: LAUNCH_TINYGEMM_KERNEL_AVX_1(2, 2); break;
-                    case 0x24: LAUNCH_TINYGEMM_KERNEL_AVX_1(2, 4); break;
-                    case 0x26: LAUNCH_TINYGEMM_KERNEL_AVX_1(2, 6); break;
-                    case 0x32: LAUNCH_TINYGEMM_KERNEL_AVX_1(3, 2); break;
-                    case 0x34: LAUNCH_TINYGEMM_KERNEL_AVX_1(3, 4); break;
-                    case 0x36: LAUNCH_TINYGEMM_KERNEL_AVX_1(3, 6); break;
-                    case 0x42: LAUNCH_TINYGEMM_KERNEL_AVX_1(4, 2); break;
-                    case 0x44: LAUNCH_TINYGEMM_KERNEL_AVX_1(4, 4); break;
-                    case 0x46: LAUNCH_TINYGEMM_KERNEL_AVX_1(4, 6); break;
-                    default: fprintf(stderr, "Unexpected block size!\n");
+                switch (nb_size) {
+                    case 64: LAUNCH_TINYGEMM_KERNEL_BF16_VNNI(64); break;
+                    case 48: LAUNCH_TINYGEMM_KERNEL_BF16_VNNI(48); break;
+                    case 32: LAUNCH_TINYGEMM_KERNEL_BF16_VNNI(32); break;
+                    case 16: LAUNCH_TINYGEMM_KERNEL_BF16_VNNI(16); break;
+                    default: fprintf(stderr, "Unexpected n block size!\n");
                 }
             }
-        }); 
+            return;
+        }
+#endif
+
+        amx_tile_config_bf16_init();
+
+        constexpr int BLOCK_M = TILE_M * 2;
+        constexpr int BLOCK_N = TILE_N * 2;
+        const int MB = div_up(M, BLOCK_M);
+        const int NB = div_up(N, BLOCK_N);
+        const ggml_bf16_t * A = static_cast<const ggml_bf16_t *>(input_data);
+
+        for (int i = 0; i < MB * NB; ++i) {
+            int mb = i / NB;
+            int nb = i % NB;
+
+            int mb_start = mb * BLOCK_M;
+            int mb_size = std::min(BLOCK_M, M - mb_start);
+            int nb_start = nb * BLOCK_N;
+
+            tinygemm_kernel_amx_bf16(
+                mb_size, BLOCK_N, KB,
+                A + (size_t)mb_start * K, K,
+                (const char *)weight_data + PACKED_INDEX(nb * 2, 0, KB, BF16_TILE_SIZE),
+                output_data + (size_t)mb_start * ldc + nb_start, ldc);
+        }
         return;
     }
 
@@ -3020,6 +3983,26 @@ void amx_gemm_compute(
         return;
     }
 
+    // small batches from decoding, see "avx512-vnni kernels for small M"
+    if (M <= VNNI_MAX_M) {
+        constexpr int BLOCK_N = TILE_N * 2;
+        const int NB = div_up(N, BLOCK_N);
+
+        GGML_DISPATCH_QTYPES(TYPE, [&] {
+            const int KB = K / blck_size;
+            const int TILE_SIZE = get_tile_size<type>();
+            for (int nb = 0; nb < NB; ++nb) {
+                int nb_start = nb * BLOCK_N;
+                tinygemm_kernel_vnni_m<vec_dot_type, type, float, blck_size>(
+                    M, BLOCK_N, KB,
+                    input_data,
+                    (const char *)weight_data + PACKED_INDEX(nb * 2, 0, KB, TILE_SIZE),
+                    output_data + nb_start, ldc);
+            }
+        });
+        return;
+    }
+
     // handle 4 tiles at a tile
     constexpr int BLOCK_M = TILE_M * 2;
     constexpr int BLOCK_N = TILE_N * 2;
@@ -3027,6 +4010,8 @@ void amx_gemm_compute(
     const int NB = div_up(N, BLOCK_N);
  
 
+    ggml_tile_config_init();
+
     GGML_DISPATCH_QTYPES(TYPE, [&] {
         const int KB = K / blck_size;
         const int TILE_SIZE = get_tile_size<type>();
@@ -3045,10 +4030,18 @@ void amx_gemm_compute(
                 mb_size, nb_size, KB,
                 (const char *)input_data + mb_start * row_size_A,
                 (const char *)weight_data + PACKED_INDEX(nb * 2, 0, KB, TILE_SIZE),
-                (float *) output_data + mb_start * N + nb_start, ldc);
+                (float *) output_data + mb_start * ldc + nb_start, ldc);
         }
     });
      
 }
 
 #endif // if defined(__AMX_INT8__) && defined(__AVX512VNNI__)
+
+#if defined(KTRANSFORMERS_CPU_DISPATCH)
+#undef __AVX512F__
+#undef __AVX512VNNI__
+#undef __AVX512BF16__
+#undef __AMX_INT8__
+#pragma GCC pop_options
+#endif
@@ -11,6 +11,7 @@
 #include <assert.h>
 #include <math.h>
 #include "llama.cpp/ggml-quants.h"
+#include "llama.cpp/ggml.h"
 
 #define TILE_M 16
 #define TILE_N 16
@@ -19,6 +20,10 @@
 
 #define AMX_BLK_SIZE 32
 
+// batches of up to one tile of rows skip the tile units, see
+// tinygemm_kernel_vnni_m
+#define VNNI_MAX_M TILE_M
+
 #define TMM0 0
 #define TMM1 1
 #define TMM2 2
@@ -39,7 +44,20 @@ struct tile_config_t{
     uint8_t rows[16] = {0};
 };
 
+// tile config for the int8 kernels (TDPBSSD), 16-16-32 pattern
 void ggml_tile_config_init(void);
+
+// tile config for the bf16 kernels (TDPBF16PS), 16-16-32 pattern
+void amx_tile_config_bf16_init(void);
+
+// activation type expected by `amx_gemm_compute` for a given weight type,
+// f16 and bf16 weights both consume bf16 activations.
+inline ggml_type get_amx_vec_dot_type(enum ggml_type type) {
+    if (type == GGML_TYPE_F16 || type == GGML_TYPE_BF16) {
+        return GGML_TYPE_BF16;
+    }
+    return ggml_internal_get_type_traits(type).vec_dot_type;
+}
  
 void convert_weight_to_amx_format(
     void* packed_data,
@@ -54,7 +72,7 @@ size_t get_amx_packed_size(enum ggml_type type, int K, int N);
 void amx_gemm_compute(
     enum ggml_type weight_type,
     const void* weight_data,    // {N, K}，VNNI
-    const void* input_data,    // {M, K}
+    const void* input_data,    // {M, K}, get_amx_vec_dot_type(weight_type)
     float* output_data,         // {M, N}
     int M,                      // batch
     int N,                      // output
@@ -102,12 +120,42 @@ void amx_gemm_compute(
                 constexpr int blck_size = QK_K;                                        \
                 return __VA_ARGS__();                                                  \
             }                                                                          \
+            case GGML_TYPE_Q2_K: {                                                     \
+                using type = block_q2_K;                                               \
+                using vec_dot_type = block_q8_K;                                       \
+                constexpr int blck_size = QK_K;                                        \
+                return __VA_ARGS__();                                                  \
+            }                                                                          \
+            case GGML_TYPE_Q3_K: {                                                     \
+                using type = block_q3_K;                                               \
+                using vec_dot_type = block_q8_K;                                       \
+                constexpr int blck_size = QK_K;                                        \
+                return __VA_ARGS__();                                                  \
+            }                                                                          \
             case GGML_TYPE_IQ4_XS: {                                                   \
                 using type = block_iq4_xs;                                             \
                 using vec_dot_type = block_q8_K;                                       \
                 constexpr int blck_size = QK_K;                                        \
                 return __VA_ARGS__();                                                  \
             }                                                                          \
+            case GGML_TYPE_IQ2_XXS: {                                                  \
+                using type = block_iq2_xxs;                                            \
+                using vec_dot_type = block_q8_K;                                       \
+                constexpr int blck_size = QK_K;                                        \
+                return __VA_ARGS__();                                                  \
+            }                                                                          \
+            case GGML_TYPE_IQ3_XXS: {                                                  \
+                using type = block_iq3_xxs;                                            \
+                using vec_dot_type = block_q8_K;                                       \
+                constexpr int blck_size = QK_K;                                        \
+                return __VA_ARGS__();                                                  \
+            }                                                                          \
+            case GGML_TYPE_IQ3_S: {                                                    \
+                using type = block_iq3_s;                                              \
+                using vec_dot_type = block_q8_K;                                       \
+                constexpr int blck_size = QK_K;                                        \
+                return __VA_ARGS__();                                                  \
+            }                                                                          \
             default:                                                                   \
                 fprintf(stderr, "Unsupported quantized data type: %d\n", int(TYPE));   \
         }                                                                              \
@@ -0,0 +1,92 @@
+/**
+ * @Description  : AMX MoE operators for unquantized BF16 expert weights.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+#include "amx_moe.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+AMX_MOE::AMX_MOE(AMX_MOEConfig config, ggml_type weight_type) {
+#if !defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+    throw std::runtime_error("cpuinfer_ext was built without the AMX kernels");
+#endif
+    config_ = config;
+    weight_type_ = weight_type;
+}
+
+AMX_MOE::~AMX_MOE() {}
+
+void AMX_MOE::load_weights(Backend* backend) {
+    void* gate_proj;
+    void* up_proj;
+    void* down_proj;
+    prepare_weights(&gate_proj, &up_proj, &down_proj);
+
+    MOEConfig config(config_.expert_num, config_.routed_expert_num, config_.hidden_size,
+                     config_.intermediate_size, 32, 10, config_.max_len,
+                     gate_proj, up_proj, down_proj,
+                     weight_type_, weight_type_, weight_type_, GGML_TYPE_BF16);
+    moe_ = std::make_unique<MOE>(config);
+
+    // MOE keeps its own numa-local packed copy
+    release_weights();
+}
+
+void AMX_MOE::warm_up(Backend* backend) {
+    if (!moe_) {
+        throw std::runtime_error("AMX_MOE::warm_up called before load_weights");
+    }
+    moe_->warm_up(backend);
+}
+
+void AMX_MOE::forward(int qlen, int k, const uint64_t* expert_ids, const float* weights, const void* input, void* output, int* batch_size_tensor, Backend* backend) {
+    if (!moe_) {
+        throw std::runtime_error("AMX_MOE::forward called before load_weights");
+    }
+    moe_->forward(qlen, k, expert_ids, weights, input, output, batch_size_tensor, backend);
+}
+
+void AMXBF16_MOE::prepare_weights(void** gate_proj, void** up_proj, void** down_proj) {
+    *gate_proj = config_.gate_proj;
+    *up_proj = config_.up_proj;
+    *down_proj = config_.down_proj;
+}
+
+void AMXInt8_MOE::prepare_weights(void** gate_proj, void** up_proj, void** down_proj) {
+    const int hidden_size = config_.hidden_size;
+    const int intermediate_size = config_.intermediate_size;
+    const size_t hidden_row_bytes = hidden_size * ggml_type_size(GGML_TYPE_Q8_0) / ggml_blck_size(GGML_TYPE_Q8_0);
+    const size_t inter_row_bytes = intermediate_size * ggml_type_size(GGML_TYPE_Q8_0) / ggml_blck_size(GGML_TYPE_Q8_0);
+
+    gate_q8_.resize((size_t)config_.expert_num * intermediate_size * hidden_row_bytes);
+    up_q8_.resize((size_t)config_.expert_num * intermediate_size * hidden_row_bytes);
+    down_q8_.resize((size_t)config_.expert_num * hidden_size * inter_row_bytes);
+
+    Backend_NUMA::getInstance().do_k_work_stealing_job(1, config_.expert_num, nullptr, [&](int expert_id) {
+        std::vector<float> row(std::max(hidden_size, intermediate_size));
+        for (int i = 0; i < intermediate_size; i++) {
+            size_t r = (size_t)expert_id * intermediate_size + i;
+            to_float((ggml_bf16_t*)config_.gate_proj + r * hidden_size, row.data(), hidden_size, GGML_TYPE_BF16);
+            from_float(row.data(), gate_q8_.data() + r * hidden_row_bytes, hidden_size, GGML_TYPE_Q8_0);
+            to_float((ggml_bf16_t*)config_.up_proj + r * hidden_size, row.data(), hidden_size, GGML_TYPE_BF16);
+            from_float(row.data(), up_q8_.data() + r * hidden_row_bytes, hidden_size, GGML_TYPE_Q8_0);
+        }
+        for (int i = 0; i < hidden_size; i++) {
+            size_t r = (size_t)expert_id * hidden_size + i;
+            to_float((ggml_bf16_t*)config_.down_proj + r * intermediate_size, row.data(), intermediate_size, GGML_TYPE_BF16);
+            from_float(row.data(), down_q8_.data() + r * inter_row_bytes, intermediate_size, GGML_TYPE_Q8_0);
+        }
+    }, nullptr);
+
+    *gate_proj = gate_q8_.data();
+    *up_proj = up_q8_.data();
+    *down_proj = down_q8_.data();
+}
+
+void AMXInt8_MOE::release_weights() {
+    std::vector<uint8_t>().swap(gate_q8_);
+    std::vector<uint8_t>().swap(up_q8_);
+    std::vector<uint8_t>().swap(down_q8_);
+}
@@ -0,0 +1,75 @@
+/**
+ * @Description  : AMX MoE operators for unquantized BF16 expert weights.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+#ifndef CPUINFER_OPERATOR_AMX_MOE_H
+#define CPUINFER_OPERATOR_AMX_MOE_H
+
+#include <memory>
+
+#include "moe.h"
+
+struct AMX_MOEConfig {
+    int expert_num;
+    int routed_expert_num;
+    int hidden_size;
+    int intermediate_size;
+    int max_len;
+    void* gate_proj;  // bf16 [expert_num, intermediate_size, hidden_size]
+    void* up_proj;    // bf16 [expert_num, intermediate_size, hidden_size]
+    void* down_proj;  // bf16 [expert_num, hidden_size, intermediate_size]
+
+    AMX_MOEConfig() {}
+
+    AMX_MOEConfig(int expert_num, int routed_expert_num, int hidden_size, int intermediate_size, int max_len, void* gate_proj, void* up_proj, void* down_proj)
+        : expert_num(expert_num), routed_expert_num(routed_expert_num), hidden_size(hidden_size), intermediate_size(intermediate_size), max_len(max_len), gate_proj(gate_proj), up_proj(up_proj), down_proj(down_proj) {}
+};
+
+// Weights are packed by `load_weights` instead of the constructor so the
+// repacking runs on the CPUInfer worker pool. On cpus without usable AMX the
+// same weights run on the llamafile kernels; a build without the AMX kernels
+// throws at construction, the classes are still exported for the imports.
+class AMX_MOE {
+   public:
+    AMX_MOE(AMX_MOEConfig config, ggml_type weight_type);
+    virtual ~AMX_MOE();
+    void load_weights(Backend* backend);
+    void warm_up(Backend* backend);
+    void forward(int qlen, int k, const uint64_t* expert_ids, const float* weights, const void* input, void* output, int* batch_size_tensor, Backend* backend);
+
+   protected:
+    // returns gate/up/down weights in `weight_type_`, called once from `load_weights`
+    virtual void prepare_weights(void** gate_proj, void** up_proj, void** down_proj) = 0;
+    virtual void release_weights() {}
+
+    AMX_MOEConfig config_;
+    ggml_type weight_type_;
+    std::unique_ptr<MOE> moe_;
+};
+
+// bf16 weights packed as-is and computed with TDPBF16PS
+class AMXBF16_MOE : public AMX_MOE {
+   public:
+    AMXBF16_MOE(AMX_MOEConfig config) : AMX_MOE(config, GGML_TYPE_BF16) {}
+
+   protected:
+    void prepare_weights(void** gate_proj, void** up_proj, void** down_proj) override;
+};
+
+// bf16 weights requantized to q8_0 and computed with TDPBSSD
+class AMXInt8_MOE : public AMX_MOE {
+   public:
+    AMXInt8_MOE(AMX_MOEConfig config) : AMX_MOE(config, GGML_TYPE_Q8_0) {}
+
+   protected:
+    void prepare_weights(void** gate_proj, void** up_proj, void** down_proj) override;
+    void release_weights() override;
+
+   private:
+    std::vector<uint8_t> gate_q8_;
+    std::vector<uint8_t> up_q8_;
+    std::vector<uint8_t> down_q8_;
+};
+
+#endif
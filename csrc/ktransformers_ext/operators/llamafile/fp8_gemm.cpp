@@ -0,0 +1,379 @@
+/**
+ * @Description  : FP8 (E4M3) block-scaled weights for the llamafile operators.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+#include "fp8_gemm.h"
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "../../cpu_backend/cpu_features.h"
+#if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+#include "amx_gemm.hpp"
+#endif
+
+// Notes: e4m3 to fp32
+//
+// Moving the 4 exponent and 3 mantissa bits to the top of an fp16 gives the
+// same number scaled by 2^-8 (exponent bias 15 instead of 7), subnormals
+// included, so the conversion is a shift and VCVTPH2PS. The 2^8 is folded into
+// the block scale. e4m3fn has no inf, the NaN encoding is not expected in weights.
+//
+#define FP8_TO_FP16_SCALE 256.0f
+
+static inline uint16_t fp8_to_fp16_bits(uint8_t x) {
+    return ((x & 0x7f) << 7) | ((x & 0x80) << 8);
+}
+
+static inline float bf16_to_fp32(ggml_bf16_t x) {
+    uint32_t u = (uint32_t)x.bits << 16;
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+#if defined(__AVX512F__)
+
+struct fp8_vec {
+    static constexpr int LANES = 16;
+    using vec_t = __m512;
+
+    static inline vec_t zero() { return _mm512_setzero_ps(); }
+    static inline vec_t set1(float x) { return _mm512_set1_ps(x); }
+    static inline vec_t load_fp8(const uint8_t* p, vec_t vscale) {
+        __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p));
+        __m256i h = _mm256_or_si256(
+            _mm256_slli_epi16(_mm256_and_si256(x, _mm256_set1_epi16(0x7f)), 7),
+            _mm256_slli_epi16(_mm256_and_si256(x, _mm256_set1_epi16(0x80)), 8));
+        return _mm512_mul_ps(_mm512_cvtph_ps(h), vscale);
+    }
+    static inline vec_t load_bf16(const ggml_bf16_t* p) {
+        __m512i x = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)p));
+        return _mm512_castsi512_ps(_mm512_slli_epi32(x, 16));
+    }
+    static inline vec_t fma(vec_t a, vec_t b, vec_t c) { return _mm512_fmadd_ps(a, b, c); }
+    static inline void store(float* p, vec_t x) { _mm512_storeu_ps(p, x); }
+    static inline float reduce(vec_t x) { return _mm512_reduce_add_ps(x); }
+};
+#define FP8_BLOCK_M 4
+#define FP8_BLOCK_N 4
+
+#elif defined(__AVX2__) && defined(__F16C__) && defined(__FMA__)
+
+struct fp8_vec {
+    static constexpr int LANES = 8;
+    using vec_t = __m256;
+
+    static inline vec_t zero() { return _mm256_setzero_ps(); }
+    static inline vec_t set1(float x) { return _mm256_set1_ps(x); }
+    static inline vec_t load_fp8(const uint8_t* p, vec_t vscale) {
+        __m128i x = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)p));
+        __m128i h = _mm_or_si128(
+            _mm_slli_epi16(_mm_and_si128(x, _mm_set1_epi16(0x7f)), 7),
+            _mm_slli_epi16(_mm_and_si128(x, _mm_set1_epi16(0x80)), 8));
+        return _mm256_mul_ps(_mm256_cvtph_ps(h), vscale);
+    }
+    static inline vec_t load_bf16(const ggml_bf16_t* p) {
+        __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p));
+        return _mm256_castsi256_ps(_mm256_slli_epi32(x, 16));
+    }
+    static inline vec_t fma(vec_t a, vec_t b, vec_t c) { return _mm256_fmadd_ps(a, b, c); }
+    static inline void store(float* p, vec_t x) { _mm256_storeu_ps(p, x); }
+    static inline float reduce(vec_t x) {
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_movehdup_ps(s));
+        return _mm_cvtss_f32(s);
+    }
+};
+// 16 ymm registers: 8 accumulators, 4 weight vectors and the activation
+#define FP8_BLOCK_M 2
+#define FP8_BLOCK_N 4
+
+#endif
+
+#if defined(FP8_BLOCK_M)
+
+// {BLOCK_M, BLOCK_N} block of C. Every dequantized weight vector is shared by
+// BLOCK_M rows of A and every activation vector by BLOCK_N rows of B.
+template <int BLOCK_M, int BLOCK_N>
+static void fp8_gemm_kernel(int KB, const block_fp8* B, const ggml_bf16_t* A, int lda, float* C, int ldc) {
+    using V = fp8_vec;
+    typename V::vec_t vc[BLOCK_M][BLOCK_N];
+    typename V::vec_t vb[BLOCK_N];
+    typename V::vec_t vscale[BLOCK_N];
+
+    for (int i = 0; i < BLOCK_M; ++i) {
+        for (int j = 0; j < BLOCK_N; ++j) {
+            vc[i][j] = V::zero();
+        }
+    }
+    for (int kb = 0; kb < KB; ++kb) {
+        for (int j = 0; j < BLOCK_N; ++j) {
+            vscale[j] = V::set1(B[j * KB + kb].d * FP8_TO_FP16_SCALE);
+        }
+        for (int kk = 0; kk < QK_FP8; kk += V::LANES) {
+            for (int j = 0; j < BLOCK_N; ++j) {
+                vb[j] = V::load_fp8(B[j * KB + kb].qs + kk, vscale[j]);
+            }
+            for (int i = 0; i < BLOCK_M; ++i) {
+                auto va = V::load_bf16(A + i * lda + kb * QK_FP8 + kk);
+                for (int j = 0; j < BLOCK_N; ++j) {
+                    vc[i][j] = V::fma(va, vb[j], vc[i][j]);
+                }
+            }
+        }
+    }
+    for (int i = 0; i < BLOCK_M; ++i) {
+        for (int j = 0; j < BLOCK_N; ++j) {
+            C[i * ldc + j] = V::reduce(vc[i][j]);
+        }
+    }
+}
+
+#define LAUNCH_FP8_GEMM_KERNEL(MB_SIZE, NB_SIZE)                         \
+    fp8_gemm_kernel<MB_SIZE, NB_SIZE>(KB, B + (size_t)nb_start * KB,      \
+        A + (size_t)mb_start * lda, lda, C + (size_t)mb_start * ldc + nb_start, ldc)
+
+static void fp8_gemm_vec(int m, int n, int k, const block_fp8* B, const ggml_bf16_t* A, int lda, float* C, int ldc) {
+    const int KB = k / QK_FP8;
+    // walk n in the outer loop so a block of B stays in cache for all of m
+    for (int nb_start = 0; nb_start < n; nb_start += FP8_BLOCK_N) {
+        const int nb_size = std::min(FP8_BLOCK_N, n - nb_start);
+        for (int mb_start = 0; mb_start < m; mb_start += FP8_BLOCK_M) {
+            const int mb_size = std::min(FP8_BLOCK_M, m - mb_start);
+            switch ((mb_size << 4) | nb_size) {
+                case 0x11: LAUNCH_FP8_GEMM_KERNEL(1, 1); break;
+                case 0x12: LAUNCH_FP8_GEMM_KERNEL(1, 2); break;
+                case 0x13: LAUNCH_FP8_GEMM_KERNEL(1, 3); break;
+                case 0x14: LAUNCH_FP8_GEMM_KERNEL(1, 4); break;
+                case 0x21: LAUNCH_FP8_GEMM_KERNEL(2, 1); break;
+                case 0x22: LAUNCH_FP8_GEMM_KERNEL(2, 2); break;
+                case 0x23: LAUNCH_FP8_GEMM_KERNEL(2, 3); break;
+                case 0x24: LAUNCH_FP8_GEMM_KERNEL(2, 4); break;
+#if FP8_BLOCK_M == 4
+                case 0x31: LAUNCH_FP8_GEMM_KERNEL(3, 1); break;
+                case 0x32: LAUNCH_FP8_GEMM_KERNEL(3, 2); break;
+                case 0x33: LAUNCH_FP8_GEMM_KERNEL(3, 3); break;
+                case 0x34: LAUNCH_FP8_GEMM_KERNEL(3, 4); break;
+                case 0x41: LAUNCH_FP8_GEMM_KERNEL(4, 1); break;
+                case 0x42: LAUNCH_FP8_GEMM_KERNEL(4, 2); break;
+                case 0x43: LAUNCH_FP8_GEMM_KERNEL(4, 3); break;
+                case 0x44: LAUNCH_FP8_GEMM_KERNEL(4, 4); break;
+#endif
+                default: throw std::logic_error("fp8_gemm: unexpected block size");
+            }
+        }
+    }
+}
+
+static void fp8_dequant_row(const block_fp8* x, float* y, int k) {
+    using V = fp8_vec;
+    for (int kb = 0; kb < k / QK_FP8; ++kb) {
+        auto vscale = V::set1(x[kb].d * FP8_TO_FP16_SCALE);
+        for (int kk = 0; kk < QK_FP8; kk += V::LANES) {
+            V::store(y + kb * QK_FP8 + kk, V::load_fp8(x[kb].qs + kk, vscale));
+        }
+    }
+}
+
+#else
+
+static float fp8_to_fp32(uint8_t x) {
+    return ggml_fp16_to_fp32(fp8_to_fp16_bits(x)) * FP8_TO_FP16_SCALE;
+}
+
+static void fp8_gemm_vec(int m, int n, int k, const block_fp8* B, const ggml_bf16_t* A, int lda, float* C, int ldc) {
+    const int KB = k / QK_FP8;
+    for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < m; ++i) {
+            float sum = 0;
+            for (int kb = 0; kb < KB; ++kb) {
+                const block_fp8* b = B + (size_t)j * KB + kb;
+                float sumb = 0;
+                for (int kk = 0; kk < QK_FP8; ++kk) {
+                    sumb += fp8_to_fp32(b->qs[kk]) * bf16_to_fp32(A[(size_t)i * lda + kb * QK_FP8 + kk]);
+                }
+                sum += sumb * b->d;
+            }
+            C[(size_t)i * ldc + j] = sum;
+        }
+    }
+}
+
+static void fp8_dequant_row(const block_fp8* x, float* y, int k) {
+    for (int kb = 0; kb < k / QK_FP8; ++kb) {
+        for (int kk = 0; kk < QK_FP8; ++kk) {
+            y[kb * QK_FP8 + kk] = fp8_to_fp32(x[kb].qs[kk]) * x[kb].d;
+        }
+    }
+}
+
+#endif
+
+// Round to nearest even, saturating to +-448 like the e4m3fn casts of torch
+static uint8_t fp32_to_fp8(float x) {
+    const uint8_t sign = std::signbit(x) ? 0x80 : 0;
+    const float a = std::fabs(x);
+    if (!(a < 448.0f)) {
+        return sign | 0x7e;
+    }
+    if (a < std::ldexp(1.0f, -6)) {
+        // subnormals are multiples of 2^-9, 8 of them is the smallest normal
+        return sign | (uint8_t)std::nearbyint(std::ldexp(a, 9));
+    }
+    int e;
+    std::frexp(a, &e);
+    e -= 1;
+    int m = (int)std::nearbyint(std::ldexp(a, 3 - e));
+    if (m == 16) {
+        m = 8;
+        e++;
+    }
+    return sign | (uint8_t)((e + 7) << 3) | (uint8_t)(m - 8);
+}
+
+void fp8_quantize_row(const float* x, block_fp8* y, int k) {
+    for (int kb = 0; kb < k / QK_FP8; ++kb) {
+        const float* xb = x + kb * QK_FP8;
+        float amax = 0;
+        for (int kk = 0; kk < QK_FP8; ++kk) {
+            amax = std::max(amax, std::fabs(xb[kk]));
+        }
+        const float d = amax / 448.0f;
+        const float id = d ? 1.0f / d : 0.0f;
+        y[kb].d = d;
+        for (int kk = 0; kk < QK_FP8; ++kk) {
+            y[kb].qs[kk] = fp32_to_fp8(xb[kk] * id);
+        }
+    }
+}
+
+void fp8_dequantize_row(const block_fp8* x, float* y, int k) { fp8_dequant_row(x, y, k); }
+
+void fp8_pack_rows(block_fp8* dst, const uint8_t* weight, const float* scale_inv, int64_t row_begin, int nrows, int k) {
+    const int KB = k / QK_FP8;
+    for (int r = 0; r < nrows; ++r) {
+        const int64_t row = row_begin + r;
+        const uint8_t* src = weight + row * k;
+        const float* scale = scale_inv + row / QK_FP8 * KB;
+        for (int kb = 0; kb < KB; ++kb) {
+            block_fp8* b = dst + (size_t)r * KB + kb;
+            b->d = scale[kb];
+            memcpy(b->qs, src + kb * QK_FP8, QK_FP8);
+        }
+    }
+}
+
+#if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+
+// Converting a {n, k} block of B to bf16 and packing it for TDPBF16PS costs about
+// as much as 32 rows of the avx512 kernel. It is paid once per block, the
+// threshold keeps decode batches from filling the cache for no gain.
+#define FP8_AMX_MIN_M 48
+
+// The weights do not change once loaded, so each block of B is converted the
+// first time it is seen and kept by address until fp8_gemm_release. Past
+// FP8_AMX_CACHE_MB of bf16 copies the remaining blocks are converted per call.
+#ifndef FP8_AMX_CACHE_MB
+#define FP8_AMX_CACHE_MB 8192
+#endif
+
+struct fp8_amx_block {
+    int n;
+    int k;
+    std::vector<uint8_t> packed;
+};
+
+static std::shared_mutex fp8_amx_cache_mutex;
+static std::map<const block_fp8*, std::unique_ptr<fp8_amx_block>> fp8_amx_cache;
+static size_t fp8_amx_cache_bytes = 0;
+
+static void fp8_pack_amx(uint8_t* dst, int n, int k, const block_fp8* B) {
+    static thread_local std::vector<float> row_fp32;
+    static thread_local std::vector<ggml_bf16_t> B_bf16;
+    row_fp32.resize(k);
+    B_bf16.resize((size_t)n * k);
+
+    const int KB = k / QK_FP8;
+    for (int j = 0; j < n; ++j) {
+        fp8_dequant_row(B + (size_t)j * KB, row_fp32.data(), k);
+        ggml_fp32_to_bf16_row(row_fp32.data(), B_bf16.data() + (size_t)j * k, k);
+    }
+    convert_weight_to_amx_format(dst, B_bf16.data(), GGML_TYPE_BF16, k, n);
+}
+
+static const uint8_t* fp8_amx_packed(int n, int k, const block_fp8* B) {
+    {
+        std::shared_lock<std::shared_mutex> lock(fp8_amx_cache_mutex);
+        auto it = fp8_amx_cache.find(B);
+        if (it != fp8_amx_cache.end() && it->second->n == n && it->second->k == k) {
+            return it->second->packed.data();
+        }
+    }
+    const size_t size = get_amx_packed_size(GGML_TYPE_BF16, k, n);
+    bool cache;
+    {
+        std::shared_lock<std::shared_mutex> lock(fp8_amx_cache_mutex);
+        cache = fp8_amx_cache_bytes + size <= ((size_t)FP8_AMX_CACHE_MB << 20) && !fp8_amx_cache.count(B);
+    }
+    if (!cache) {
+        static thread_local std::vector<uint8_t> B_packed;
+        B_packed.resize(size);
+        fp8_pack_amx(B_packed.data(), n, k, B);
+        return B_packed.data();
+    }
+    // convert outside the lock, a block packed by two threads at once keeps the first copy
+    auto block = std::make_unique<fp8_amx_block>();
+    block->n = n;
+    block->k = k;
+    block->packed.resize(size);
+    fp8_pack_amx(block->packed.data(), n, k, B);
+    std::unique_lock<std::shared_mutex> lock(fp8_amx_cache_mutex);
+    auto it = fp8_amx_cache.emplace(B, std::move(block));
+    if (it.second) {
+        fp8_amx_cache_bytes += size;
+    }
+    return it.first->second->packed.data();
+}
+
+static void fp8_gemm_amx(int m, int n, int k, const block_fp8* B, const ggml_bf16_t* A, float* C, int ldc) {
+    amx_gemm_compute(GGML_TYPE_BF16, fp8_amx_packed(n, k, B), A, C, m, n, k, ldc);
+}
+
+#endif
+
+void fp8_gemm(int m, int n, int k, const void* B, const ggml_bf16_t* A, int lda, float* C, int ldc) {
+    const block_fp8* Bq = static_cast<const block_fp8*>(B);
+#if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+    // the amx bf16 kernels take {32, 32} blocks of C and a dense A
+    if (m >= FP8_AMX_MIN_M && n % 32 == 0 && lda == k && get_cpu_features().amx) {
+        fp8_gemm_amx(m, n, k, Bq, A, C, ldc);
+        return;
+    }
+#endif
+    fp8_gemm_vec(m, n, k, Bq, A, lda, C, ldc);
+}
+
+void fp8_gemm_release(const void* begin, size_t bytes) {
+#if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+    const block_fp8* first = static_cast<const block_fp8*>(begin);
+    const block_fp8* last = reinterpret_cast<const block_fp8*>(static_cast<const uint8_t*>(begin) + bytes);
+    std::unique_lock<std::shared_mutex> lock(fp8_amx_cache_mutex);
+    auto it = fp8_amx_cache.lower_bound(first);
+    while (it != fp8_amx_cache.end() && it->first < last) {
+        fp8_amx_cache_bytes -= it->second->packed.size();
+        it = fp8_amx_cache.erase(it);
+    }
+#endif
+}
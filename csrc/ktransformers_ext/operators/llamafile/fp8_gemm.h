@@ -0,0 +1,52 @@
+/**
+ * @Description  : FP8 (E4M3) block-scaled weights for the llamafile operators.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+#ifndef CPUINFER_OPERATOR_FP8_GEMM_H
+#define CPUINFER_OPERATOR_FP8_GEMM_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "llama.cpp/ggml.h"
+
+// DeepSeek-V3/R1 and Kimi checkpoints store linear weights as e4m3 [n, k] with
+// an fp32 `weight_scale_inv` of [n / 128, k / 128]. The operators keep them as
+// rows of `block_fp8`, 128 values of one row sharing the scale of their 128x128
+// block, so a row is self-contained like the ggml block types and can be split
+// by `stride` rows without touching the scale tensor again.
+#define QK_FP8 128
+
+typedef struct {
+    float d;              // weight_scale_inv of the enclosing 128x128 block
+    uint8_t qs[QK_FP8];   // e4m3, 1 sign, 4 exponent (bias 7), 3 mantissa bits
+} block_fp8;
+static_assert(sizeof(block_fp8) == sizeof(float) + QK_FP8, "wrong fp8 block size/padding");
+
+// Not a ggml type: ggml has no fp8, so the value is picked from the unused top
+// of the enum's range and is only understood by the operators in this folder.
+// Python passes it as `proj_type` together with the scale tensor pointers.
+#define GGML_TYPE_FP8_E4M3 ((ggml_type)63)
+
+// Repack rows [row_begin, row_begin + nrows) of an e4m3 weight [*, k] with its
+// scale_inv [*, k / QK_FP8] into `nrows * k / QK_FP8` blocks. Rows of all experts
+// are numbered consecutively, the dimensions must be multiples of QK_FP8.
+void fp8_pack_rows(block_fp8* dst, const uint8_t* weight, const float* scale_inv, int64_t row_begin, int nrows, int k);
+
+// Quantize / dequantize `k` values to / from `k / QK_FP8` blocks, each block
+// scaled so its largest magnitude maps to the largest e4m3 value (448).
+void fp8_quantize_row(const float* x, block_fp8* y, int k);
+void fp8_dequantize_row(const block_fp8* x, float* y, int k);
+
+// C[m, n] = A[m, k] * B[n, k]^T, A is bf16 with `lda` elements per row and B is
+// `n` rows of `k / QK_FP8` fp8 blocks. Small m dequantizes B on the fly with
+// avx512/avx2; large m on AMX cpus converts B to bf16 once, keeps the packed
+// copy and reuses the AMX bf16 kernels.
+void fp8_gemm(int m, int n, int k, const void* B, const ggml_bf16_t* A, int lda, float* C, int ldc);
+
+// Drop the packed copies fp8_gemm keeps of blocks in [begin, begin + bytes),
+// to be called before weights passed to fp8_gemm are freed.
+void fp8_gemm_release(const void* begin, size_t bytes);
+
+#endif
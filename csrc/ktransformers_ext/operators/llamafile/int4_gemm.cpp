@@ -0,0 +1,309 @@
+/**
+ * @Description  : GPTQ/AWQ INT4 group-quantized weights for the llamafile operators.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+#include "int4_gemm.h"
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// q8_1 blocks of activations per int4 block of weights
+#define INT4_Q8_BLOCKS (QK_INT4 / QK8_1)
+
+static inline float fp16_to_fp32(ggml_fp16_t x) {
+#if defined(__F16C__)
+    return _cvtsh_ss(x);
+#else
+    return ggml_fp16_to_fp32(x);
+#endif
+}
+
+// Notes: int4 x q8_1
+//
+// With w = d * q - m for the 128 weights of a block and a = da_b * qa for the
+// 32 activations of each q8_1 block b inside it,
+//
+//   sum(w * a) = d * sum_b(da_b * sum(q * qa)) - m * sum_b(s_b)
+//
+// where s_b = da_b * sum(qa) is stored in the q8_1 block. q is unsigned and qa
+// signed, which is exactly the operand order of VPDPBUSD / VPMADDUBSW, and
+// |q * qa| <= 15 * 127 keeps the 16-bit pair sums of VPMADDUBSW from saturating.
+//
+
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+
+static inline __m512i dot_u4_s8(__m512i q, __m512i a) {
+#if defined(__AVX512VNNI__)
+    return _mm512_dpbusd_epi32(_mm512_setzero_si512(), q, a);
+#else
+    return _mm512_madd_epi16(_mm512_maddubs_epi16(q, a), _mm512_set1_epi16(1));
+#endif
+}
+
+// q8_1 scales of A repeated for the 8 int32 lanes of a dot product that cover
+// each q8_1 block
+#define INT4_ACT_SCALES 32
+
+// two consecutive q8_1 blocks in one register
+static inline __m512i load_q8_1_x2(const block_q8_1* a) {
+    return _mm512_inserti64x4(_mm512_castsi256_si512(_mm256_loadu_si256((const __m256i*)a[0].qs)),
+                              _mm256_loadu_si256((const __m256i*)a[1].qs), 1);
+}
+
+// {BLOCK_M, BLOCK_N} block of C. The low nibbles of a block_int4 are values
+// 0-63 and the high nibbles 64-127, one zmm each, matching two q8_1 blocks.
+template <int BLOCK_M, int BLOCK_N>
+static void int4_gemm_kernel(int KB, const block_int4* B, const block_q8_1* A, const float* S, const float* SA, int lda, float* C, int ldc) {
+    const __m512i lowMask = _mm512_set1_epi8(0xF);
+    __m512 vc[BLOCK_M][BLOCK_N];
+    float vm[BLOCK_M][BLOCK_N];
+    __m512i vlo[BLOCK_N];
+    __m512i vhi[BLOCK_N];
+
+    for (int i = 0; i < BLOCK_M; ++i) {
+        for (int j = 0; j < BLOCK_N; ++j) {
+            vc[i][j] = _mm512_setzero_ps();
+            vm[i][j] = 0;
+        }
+    }
+    for (int kb = 0; kb < KB; ++kb) {
+        for (int j = 0; j < BLOCK_N; ++j) {
+            const __m512i q = _mm512_loadu_si512((const __m512i*)B[j * KB + kb].qs);
+            vlo[j] = _mm512_and_si512(q, lowMask);
+            vhi[j] = _mm512_and_si512(_mm512_srli_epi16(q, 4), lowMask);
+        }
+        for (int i = 0; i < BLOCK_M; ++i) {
+            const __m512i va0 = load_q8_1_x2(A + i * lda + kb * INT4_Q8_BLOCKS);
+            const __m512i va1 = load_q8_1_x2(A + i * lda + kb * INT4_Q8_BLOCKS + 2);
+            const float* s = S + ((size_t)i * KB + kb) * INT4_ACT_SCALES;
+            const __m512 vs0 = _mm512_loadu_ps(s);
+            const __m512 vs1 = _mm512_loadu_ps(s + 16);
+            const float sa = SA[i * KB + kb];
+            for (int j = 0; j < BLOCK_N; ++j) {
+                const block_int4* b = B + j * KB + kb;
+                __m512 t = _mm512_mul_ps(_mm512_cvtepi32_ps(dot_u4_s8(vlo[j], va0)), vs0);
+                t = _mm512_fmadd_ps(_mm512_cvtepi32_ps(dot_u4_s8(vhi[j], va1)), vs1, t);
+                vc[i][j] = _mm512_fmadd_ps(t, _mm512_set1_ps(b->d), vc[i][j]);
+                vm[i][j] += b->m * sa;
+            }
+        }
+    }
+    for (int i = 0; i < BLOCK_M; ++i) {
+        for (int j = 0; j < BLOCK_N; ++j) {
+            C[i * ldc + j] = _mm512_reduce_add_ps(vc[i][j]) - vm[i][j];
+        }
+    }
+}
+#define INT4_BLOCK_M 4
+#define INT4_BLOCK_N 4
+
+#elif defined(__AVX2__) && defined(__FMA__)
+
+static inline __m256i dot_u4_s8(__m256i q, __m256i a) {
+    return _mm256_madd_epi16(_mm256_maddubs_epi16(q, a), _mm256_set1_epi16(1));
+}
+
+// one q8_1 scale per block, broadcast by the kernel
+#define INT4_ACT_SCALES INT4_Q8_BLOCKS
+
+static inline float hsum(__m256 x) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+// {BLOCK_M, 1} block of C, 16 ymm registers leave room for a single row of B:
+// the low nibbles of qs[0:32] and qs[32:64] are q8_1 blocks 0 and 1, the high
+// nibbles blocks 2 and 3.
+template <int BLOCK_M, int BLOCK_N>
+static void int4_gemm_kernel(int KB, const block_int4* B, const block_q8_1* A, const float* S, const float* SA, int lda, float* C, int ldc) {
+    static_assert(BLOCK_N == 1, "avx2 int4 kernel computes one row of B");
+    const __m256i lowMask = _mm256_set1_epi8(0xF);
+    __m256 vc[BLOCK_M];
+    float vm[BLOCK_M];
+    __m256i vb[INT4_Q8_BLOCKS];
+
+    for (int i = 0; i < BLOCK_M; ++i) {
+        vc[i] = _mm256_setzero_ps();
+        vm[i] = 0;
+    }
+    for (int kb = 0; kb < KB; ++kb) {
+        const block_int4* b = B + kb;
+        const __m256i q0 = _mm256_loadu_si256((const __m256i*)b->qs);
+        const __m256i q1 = _mm256_loadu_si256((const __m256i*)(b->qs + 32));
+        vb[0] = _mm256_and_si256(q0, lowMask);
+        vb[1] = _mm256_and_si256(q1, lowMask);
+        vb[2] = _mm256_and_si256(_mm256_srli_epi16(q0, 4), lowMask);
+        vb[3] = _mm256_and_si256(_mm256_srli_epi16(q1, 4), lowMask);
+        const __m256 vd = _mm256_set1_ps(b->d);
+        for (int i = 0; i < BLOCK_M; ++i) {
+            const block_q8_1* a = A + i * lda + kb * INT4_Q8_BLOCKS;
+            const float* s = S + ((size_t)i * KB + kb) * INT4_ACT_SCALES;
+            __m256 t = _mm256_setzero_ps();
+            for (int ib = 0; ib < INT4_Q8_BLOCKS; ++ib) {
+                const __m256i va = _mm256_loadu_si256((const __m256i*)a[ib].qs);
+                t = _mm256_fmadd_ps(_mm256_cvtepi32_ps(dot_u4_s8(vb[ib], va)), _mm256_broadcast_ss(s + ib), t);
+            }
+            vc[i] = _mm256_fmadd_ps(t, vd, vc[i]);
+            vm[i] += b->m * SA[i * KB + kb];
+        }
+    }
+    for (int i = 0; i < BLOCK_M; ++i) {
+        C[i * ldc] = hsum(vc[i]) - vm[i];
+    }
+}
+#define INT4_BLOCK_M 4
+#define INT4_BLOCK_N 1
+
+#endif
+
+#if defined(INT4_BLOCK_M)
+
+// Per int4 block of a row of A: the q8_1 scales, laid out as the kernel loads
+// them, and the sum of the four q8_1 block sums. Computed once per call
+// instead of once per block of B.
+static void int4_act_scales(int m, int KB, const block_q8_1* A, float* scales, float* sums) {
+    const int repeat = INT4_ACT_SCALES / INT4_Q8_BLOCKS;
+    for (int i = 0; i < m; ++i) {
+        for (int kb = 0; kb < KB; ++kb) {
+            const block_q8_1* a = A + ((size_t)i * KB + kb) * INT4_Q8_BLOCKS;
+            float* s = scales + ((size_t)i * KB + kb) * INT4_ACT_SCALES;
+            float sa = 0;
+            for (int ib = 0; ib < INT4_Q8_BLOCKS; ++ib) {
+                std::fill(s + ib * repeat, s + (ib + 1) * repeat, fp16_to_fp32(a[ib].d));
+                sa += fp16_to_fp32(a[ib].s);
+            }
+            sums[(size_t)i * KB + kb] = sa;
+        }
+    }
+}
+
+#define LAUNCH_INT4_GEMM_KERNEL(MB_SIZE, NB_SIZE)                                      \
+    int4_gemm_kernel<MB_SIZE, NB_SIZE>(KB, B + (size_t)nb_start * KB,                   \
+        A + (size_t)mb_start * lda, S + (size_t)mb_start * KB * INT4_ACT_SCALES,        \
+        SA + (size_t)mb_start * KB, lda, C + (size_t)mb_start * ldc + nb_start, ldc)
+
+void int4_gemm(int m, int n, int k, const void* Bv, const block_q8_1* A, float* C, int ldc) {
+    const block_int4* B = static_cast<const block_int4*>(Bv);
+    const int KB = k / QK_INT4;
+    const int lda = k / QK8_1;
+    static thread_local std::vector<float> act_scales;
+    static thread_local std::vector<float> act_sums;
+    act_scales.resize((size_t)m * KB * INT4_ACT_SCALES);
+    act_sums.resize((size_t)m * KB);
+    int4_act_scales(m, KB, A, act_scales.data(), act_sums.data());
+    const float* S = act_scales.data();
+    const float* SA = act_sums.data();
+    // walk n in the outer loop so a block of B stays in cache for all of m
+    for (int nb_start = 0; nb_start < n; nb_start += INT4_BLOCK_N) {
+        const int nb_size = std::min(INT4_BLOCK_N, n - nb_start);
+        for (int mb_start = 0; mb_start < m; mb_start += INT4_BLOCK_M) {
+            const int mb_size = std::min(INT4_BLOCK_M, m - mb_start);
+            switch ((mb_size << 4) | nb_size) {
+                case 0x11: LAUNCH_INT4_GEMM_KERNEL(1, 1); break;
+                case 0x21: LAUNCH_INT4_GEMM_KERNEL(2, 1); break;
+                case 0x31: LAUNCH_INT4_GEMM_KERNEL(3, 1); break;
+                case 0x41: LAUNCH_INT4_GEMM_KERNEL(4, 1); break;
+#if INT4_BLOCK_N == 4
+                case 0x12: LAUNCH_INT4_GEMM_KERNEL(1, 2); break;
+                case 0x13: LAUNCH_INT4_GEMM_KERNEL(1, 3); break;
+                case 0x14: LAUNCH_INT4_GEMM_KERNEL(1, 4); break;
+                case 0x22: LAUNCH_INT4_GEMM_KERNEL(2, 2); break;
+                case 0x23: LAUNCH_INT4_GEMM_KERNEL(2, 3); break;
+                case 0x24: LAUNCH_INT4_GEMM_KERNEL(2, 4); break;
+                case 0x32: LAUNCH_INT4_GEMM_KERNEL(3, 2); break;
+                case 0x33: LAUNCH_INT4_GEMM_KERNEL(3, 3); break;
+                case 0x34: LAUNCH_INT4_GEMM_KERNEL(3, 4); break;
+                case 0x42: LAUNCH_INT4_GEMM_KERNEL(4, 2); break;
+                case 0x43: LAUNCH_INT4_GEMM_KERNEL(4, 3); break;
+                case 0x44: LAUNCH_INT4_GEMM_KERNEL(4, 4); break;
+#endif
+                default: fprintf(stderr, "Unexpected block size!\n");
+            }
+        }
+    }
+}
+
+#else
+
+void int4_gemm(int m, int n, int k, const void* Bv, const block_q8_1* A, float* C, int ldc) {
+    const block_int4* B = static_cast<const block_int4*>(Bv);
+    const int KB = k / QK_INT4;
+    const int lda = k / QK8_1;
+    for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < m; ++i) {
+            float sum = 0;
+            for (int kb = 0; kb < KB; ++kb) {
+                const block_int4* b = B + (size_t)j * KB + kb;
+                const block_q8_1* a = A + (size_t)i * lda + kb * INT4_Q8_BLOCKS;
+                float sumb = 0;
+                float sa = 0;
+                for (int ib = 0; ib < INT4_Q8_BLOCKS; ++ib) {
+                    int sumi = 0;
+                    for (int kk = 0; kk < QK8_1; ++kk) {
+                        const int idx = ib * QK8_1 + kk;
+                        const int q = idx < QK_INT4 / 2 ? (b->qs[idx] & 0xF) : (b->qs[idx - QK_INT4 / 2] >> 4);
+                        sumi += q * a[ib].qs[kk];
+                    }
+                    sumb += sumi * fp16_to_fp32(a[ib].d);
+                    sa += fp16_to_fp32(a[ib].s);
+                }
+                sum += sumb * b->d - b->m * sa;
+            }
+            C[(size_t)i * ldc + j] = sum;
+        }
+    }
+}
+
+#endif
+
+// nibble of column n % 8 in an AWQ word
+static const int awq_shift[8] = {0, 16, 4, 20, 8, 24, 12, 28};
+
+static inline int int4_weight(ggml_type type, const int32_t* qweight, int64_t n, int64_t row, int k) {
+    if (type == GGML_TYPE_GPTQ_INT4) {
+        return ((uint32_t)qweight[(int64_t)(k / 8) * n + row] >> (4 * (k % 8))) & 0xF;
+    }
+    return ((uint32_t)qweight[(int64_t)k * (n / 8) + row / 8] >> awq_shift[row % 8]) & 0xF;
+}
+
+static inline int int4_zero(ggml_type type, const int32_t* qzeros, int64_t n, int64_t row, int group) {
+    const uint32_t word = qzeros[(int64_t)group * (n / 8) + row / 8];
+    if (type == GGML_TYPE_GPTQ_INT4) {
+        return ((word >> (4 * (row % 8))) & 0xF) + 1;
+    }
+    return (word >> awq_shift[row % 8]) & 0xF;
+}
+
+void int4_pack_rows(block_int4* dst, ggml_type type, const int32_t* qweight, const int32_t* qzeros, const ggml_fp16_t* scales,
+                    int group_size, int64_t n, int k, int64_t row_begin, int nrows) {
+    if (!is_int4_type(type)) {
+        throw std::invalid_argument("int4_pack_rows: not a GPTQ/AWQ weight type");
+    }
+    if (k % QK_INT4 != 0 || group_size <= 0 || group_size % QK_INT4 != 0 || k % group_size != 0 || n % 8 != 0) {
+        throw std::invalid_argument("int4_pack_rows: unsupported shape k=" + std::to_string(k) + " n=" + std::to_string(n) +
+                                    " group_size=" + std::to_string(group_size) + ", k and group_size must be multiples of " +
+                                    std::to_string(QK_INT4) + " and n of 8");
+    }
+    const int KB = k / QK_INT4;
+    for (int r = 0; r < nrows; ++r) {
+        const int64_t row = row_begin + r;
+        for (int kb = 0; kb < KB; ++kb) {
+            block_int4* b = dst + (size_t)r * KB + kb;
+            const int group = kb * QK_INT4 / group_size;
+            b->d = fp16_to_fp32(scales[(int64_t)group * n + row]);
+            b->m = b->d * int4_zero(type, qzeros, n, row, group);
+            for (int j = 0; j < QK_INT4 / 2; ++j) {
+                const int q0 = int4_weight(type, qweight, n, row, kb * QK_INT4 + j);
+                const int q1 = int4_weight(type, qweight, n, row, kb * QK_INT4 + QK_INT4 / 2 + j);
+                b->qs[j] = q0 | (q1 << 4);
+            }
+        }
+    }
+}
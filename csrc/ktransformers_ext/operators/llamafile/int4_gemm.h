@@ -0,0 +1,61 @@
+/**
+ * @Description  : GPTQ/AWQ INT4 group-quantized weights for the llamafile operators.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+#ifndef CPUINFER_OPERATOR_INT4_GEMM_H
+#define CPUINFER_OPERATOR_INT4_GEMM_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "llama.cpp/ggml-quants.h"
+#include "llama.cpp/ggml.h"
+
+// GPTQ and AWQ checkpoints store a linear weight [n, k] as 4-bit values packed
+// into int32 words, with an fp16 scale and a 4-bit zero point per group of
+// `group_size` input features:
+//
+//   GPTQ  qweight [k / 8, n]   8 consecutive k per word, low nibble first
+//         qzeros  [k / g, n / 8] 8 consecutive n per word, stored as zero - 1
+//         scales  [k / g, n]
+//   AWQ   qweight [k, n / 8]   8 n per word in the order 0 2 4 6 1 3 5 7
+//         qzeros  [k / g, n / 8] same order as qweight
+//         scales  [k / g, n]
+//
+// Both pack across output features, so the operators repack them into rows of
+// `block_int4` that can be split by `stride` rows like the ggml block types.
+// A block covers 128 values of one row, `group_size` must be a multiple of it
+// (128 or per-channel). Act-order checkpoints (GPTQ desc_act with a g_idx) are
+// not supported.
+#define QK_INT4 128
+
+typedef struct {
+    float d;                 // group scale
+    float m;                 // d * zero, the value is d * q - m
+    uint8_t qs[QK_INT4 / 2]; // byte j holds value j in the low and j + 64 in the high nibble
+} block_int4;
+static_assert(sizeof(block_int4) == 2 * sizeof(float) + QK_INT4 / 2, "wrong int4 block size/padding");
+
+// Not ggml types, see GGML_TYPE_FP8_E4M3. Python passes them as `proj_type`
+// with qweight as the weight and the qzeros/scales tensor pointers.
+#define GGML_TYPE_GPTQ_INT4 ((ggml_type)62)
+#define GGML_TYPE_AWQ_INT4 ((ggml_type)61)
+
+inline bool is_int4_type(ggml_type type) {
+    return type == GGML_TYPE_GPTQ_INT4 || type == GGML_TYPE_AWQ_INT4;
+}
+
+// Repack rows [row_begin, row_begin + nrows) of a GPTQ/AWQ weight with `n` rows
+// into `nrows * k / QK_INT4` blocks. Throws std::invalid_argument on shapes the
+// blocks can not represent.
+void int4_pack_rows(block_int4* dst, ggml_type type, const int32_t* qweight, const int32_t* qzeros, const ggml_fp16_t* scales,
+                    int group_size, int64_t n, int k, int64_t row_begin, int nrows);
+
+// C[m, n] = A[m, k] * B[n, k]^T, A is `m` rows of `k / QK8_1` q8_1 blocks and B
+// is `n` rows of `k / QK_INT4` int4 blocks. The integer dot products run on
+// avx512-vnni (or avx512bw/avx2 maddubs), the zero points are applied once per
+// block through the q8_1 block sums.
+void int4_gemm(int m, int n, int k, const void* B, const block_q8_1* A, float* C, int ldc);
+
+#endif
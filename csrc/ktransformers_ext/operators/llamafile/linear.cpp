@@ -9,16 +9,25 @@
  **/
 #include "linear.h"
 
+#include <stdexcept>
+#include <string>
+
 Linear::Linear(LinearConfig config) {
     config_ = config;
     proj_ = config_.proj;
+    #ifndef USE_NUMA
+    // without the per-node copies the weights are read as passed in by python
+    if (weight_needs_packing(config_.proj_type)) {
+        throw std::invalid_argument(std::string("Linear: ") + weight_type_name(config_.proj_type) + " weights need USE_NUMA");
+    }
+    #endif
     #ifdef USE_NUMA
     proj_numa_.resize(numa_nodes_); 
     proj_numa_size_.resize(numa_nodes_); 
     #endif
 
     int nth = config_.output_size / config_.stride;
-    stride_bytes_ = config_.stride * config_.input_size * ggml_type_size(config_.proj_type) / ggml_blck_size(config_.proj_type);
+    stride_bytes_ = weight_packed_bytes(config_.proj_type, config_.stride * config_.input_size);
  
     int base = nth / numa_nodes_;
     int remain = nth % numa_nodes_;
@@ -43,24 +52,24 @@ Linear::Linear(LinearConfig config) {
         int n_blocks = proj_blocks_[nid].num_blocks;
         for (int ib = 0; ib < n_blocks; ib++) {
             int ith = start_block + ib; 
-            void* proj_ptr = (uint8_t*)proj_ + ith * stride_bytes_;
             uint8_t* local_ptr = (uint8_t*)proj_numa_[nid] + ib * stride_bytes_;
-            memcpy(local_ptr, proj_ptr, stride_bytes_);
+            pack_weight_rows(local_ptr, proj_, config_.proj_scale, config_.proj_zeros, config_.group_size, config_.proj_type, config_.output_size, ith * config_.stride, config_.stride, config_.input_size);
           
         }
     } 
     input_fp32_ = (float*)allocate_aligned(sizeof(float) * config_.group_max_len * config_.input_size);
-    proj_input_ = (uint8_t*)allocate_aligned(config_.group_max_len * config_.input_size * ggml_type_size(ggml_internal_get_type_traits(config_.proj_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.proj_type).vec_dot_type));
+    proj_input_ = (uint8_t*)allocate_aligned(config_.group_max_len * config_.input_size * ggml_type_size(weight_vec_dot_type(config_.proj_type)) / ggml_blck_size(weight_vec_dot_type(config_.proj_type)));
     proj_output_ = (float*)allocate_aligned(sizeof(float) * config_.group_max_len * config_.output_size);
 
 }
 
 Linear::~Linear() {
     for (int nid = 0; nid < numa_nodes_; nid++) {  
+        fp8_gemm_release(proj_numa_[nid], proj_numa_size_[nid]);
         free_aligned_numa(proj_numa_[nid], proj_numa_size_[nid]);
     }
     free_aligned(input_fp32_ , sizeof(float) * config_.group_max_len * config_.input_size);
-    free_aligned(proj_input_ , config_.group_max_len * config_.input_size * ggml_type_size(ggml_internal_get_type_traits(config_.proj_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.proj_type).vec_dot_type));
+    free_aligned(proj_input_ , config_.group_max_len * config_.input_size * ggml_type_size(weight_vec_dot_type(config_.proj_type)) / ggml_blck_size(weight_vec_dot_type(config_.proj_type)));
     free_aligned(proj_output_ , sizeof(float) * config_.group_max_len * config_.output_size);
 }
 
@@ -79,30 +88,69 @@ void Linear::warm_up(Backend *backend) {
     forward_many(1, input.data(), output.data(), backend);
 }
 
+// Rows of the input per task. Long prompts are cut into blocks whose quantized
+// activations stay in L2 next to the weight block of the task, and finer when
+// there are fewer output blocks than threads. Decode keeps a single block.
+int Linear::m_block_size(int qlen, int nth) const {
+    const ggml_type vec_dot_type = weight_vec_dot_type(config_.proj_type);
+    const size_t row_bytes = config_.input_size * ggml_type_size(vec_dot_type) / ggml_blck_size(vec_dot_type);
+    int m_block = std::max<int>(LINEAR_M_BLOCK_MIN, LINEAR_M_BLOCK_BYTES / row_bytes);
+    const int threads = Backend_NUMA::getInstance().get_num_threads();
+    const int m_tasks = (threads + nth - 1) / nth;
+    m_block = std::min(m_block, (qlen + m_tasks - 1) / m_tasks);
+    m_block = (m_block + LINEAR_M_BLOCK_MIN - 1) / LINEAR_M_BLOCK_MIN * LINEAR_M_BLOCK_MIN;
+    return std::min(m_block, qlen);
+}
+
 void Linear::forward_many(int qlen, const void* input, void* output, Backend* backend) {
+    const ggml_type vec_dot_type = weight_vec_dot_type(config_.proj_type);
+    const size_t hidden_input_row_bytes = config_.input_size * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type);
+    const size_t proj_input_row_bytes = config_.input_size * ggml_type_size(vec_dot_type) / ggml_blck_size(vec_dot_type);
     const void* proj_input_ptr;
-    if (config_.hidden_type == ggml_internal_get_type_traits(config_.proj_type).vec_dot_type) {
+    if (config_.hidden_type == vec_dot_type) {
         proj_input_ptr = input;
-    } else {
+    } else if (qlen < LINEAR_M_BLOCK_MIN) {
         to_float(input, input_fp32_, qlen * config_.input_size, config_.hidden_type);
-        from_float(input_fp32_, proj_input_, qlen * config_.input_size, ggml_internal_get_type_traits(config_.proj_type).vec_dot_type);
+        from_float(input_fp32_, proj_input_, qlen * config_.input_size, vec_dot_type);
+        proj_input_ptr = proj_input_;
+    } else {
+        // prefill, one row per task
+        Backend_NUMA::getInstance().do_work(qlen, nullptr, [&](int i) {
+            float* input_fp32_ptr = input_fp32_ + (size_t)i * config_.input_size;
+            to_float((uint8_t*)input + i * hidden_input_row_bytes, input_fp32_ptr, config_.input_size, config_.hidden_type);
+            from_float(input_fp32_ptr, proj_input_ + i * proj_input_row_bytes, config_.input_size, vec_dot_type);
+        }, nullptr);
         proj_input_ptr = proj_input_;
     }
+    // {m_block, stride} tiles of the output; the tiles of one output block are
+    // consecutive tasks of the numa node owning its weights, so a thread keeps
+    // the weight block in cache while it walks the rows of the input
     int nth = config_.output_size / config_.stride;
-    Backend_NUMA::getInstance().do_k_work_stealing_job(1, nth, nullptr, [&](int task_id) {
+    int m_block = m_block_size(qlen, nth);
+    int mth = (qlen + m_block - 1) / m_block;
+    Backend_NUMA::getInstance().do_k_work_stealing_job(mth, nth, nullptr, [&](int task_id) {
         int nid = Backend_NUMA::numa_node_; 
-        int x = task_id - proj_blocks_[nid].start_block;
-        int offset = x % proj_blocks_[nid].num_blocks; 
+        int x = (task_id - proj_blocks_[nid].start_block * mth) % (proj_blocks_[nid].num_blocks * mth);
+        int offset = x / mth; 
         int ith = proj_blocks_[nid].start_block + offset; 
+        int m_begin = x % mth * m_block;
+        int m_len = std::min(m_block, qlen - m_begin);
         #ifdef USE_NUMA
-        void* proj_ptr = (uint8_t*)proj_numa_[nid] + offset * config_.stride * config_.input_size * ggml_type_size(config_.proj_type) / ggml_blck_size(config_.proj_type);
+        void* proj_ptr = (uint8_t*)proj_numa_[nid] + offset * stride_bytes_;
         #else
-        void* proj_ptr = (uint8_t*)proj_ + ith * config_.stride * config_.input_size * ggml_type_size(config_.proj_type) / ggml_blck_size(config_.proj_type);
+        void* proj_ptr = (uint8_t*)proj_ + weight_bytes(config_.proj_type, (size_t)ith * config_.stride * config_.input_size);
         #endif
-        float* proj_output_ptr = proj_output_ + ith * config_.stride;
-        llamafile_sgemm(config_.stride, qlen, config_.input_size / ggml_blck_size(config_.proj_type), proj_ptr, config_.input_size / ggml_blck_size(config_.proj_type), proj_input_ptr, config_.input_size / ggml_blck_size(config_.proj_type), proj_output_ptr, config_.output_size, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.proj_type, ggml_internal_get_type_traits(config_.proj_type).vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+        const void* input_ptr = (const uint8_t*)proj_input_ptr + m_begin * proj_input_row_bytes;
+        float* proj_output_ptr = proj_output_ + m_begin * config_.output_size + ith * config_.stride;
+        if (config_.proj_type == GGML_TYPE_FP8_E4M3) {
+            fp8_gemm(m_len, config_.stride, config_.input_size, proj_ptr, (const ggml_bf16_t*)input_ptr, config_.input_size, proj_output_ptr, config_.output_size);
+        } else if (is_int4_type(config_.proj_type)) {
+            int4_gemm(m_len, config_.stride, config_.input_size, proj_ptr, (const block_q8_1*)input_ptr, proj_output_ptr, config_.output_size);
+        } else {
+            llamafile_sgemm(config_.stride, m_len, config_.input_size / ggml_blck_size(config_.proj_type), proj_ptr, config_.input_size / ggml_blck_size(config_.proj_type), input_ptr, config_.input_size / ggml_blck_size(config_.proj_type), proj_output_ptr, config_.output_size, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.proj_type, vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+        }
         if (config_.stride % ggml_blck_size(config_.hidden_type) == 0) {
-            for (int i = 0; i < qlen; i++) {
+            for (int i = m_begin; i < m_begin + m_len; i++) {
                 float* output_fp32_ptr = proj_output_ + i * config_.output_size + ith * config_.stride;
                 void* output_ptr = (uint8_t*)output + i * config_.output_size * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type) + ith * config_.stride * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type);
                 from_float(output_fp32_ptr, output_ptr, config_.stride, config_.hidden_type);
@@ -115,10 +163,10 @@ void Linear::forward_many(int qlen, const void* input, void* output, Backend* ba
 }
 
 void Linear::forward(int qlen, const void* input, void* output, Backend* backend) {
-    if (qlen <= 0) {
-        return;
+    const size_t input_row_bytes = config_.input_size * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type);
+    const size_t output_row_bytes = config_.output_size * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type);
+    for (int begin = 0; begin < qlen; begin += config_.group_max_len) {
+        int forward_len = std::min(qlen - begin, config_.group_max_len);
+        forward_many(forward_len, (uint8_t*)input + begin * input_row_bytes, (uint8_t*)output + begin * output_row_bytes, backend);
     }
-    int forward_len = std::min(qlen, config_.group_max_len);
-    forward_many(forward_len, input, output, backend);
-    forward(qlen - forward_len, (uint8_t*)input + forward_len * config_.input_size * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type), (uint8_t*)output + forward_len * config_.output_size * ggml_type_size(config_.hidden_type) / ggml_blck_size(config_.hidden_type), backend);
-}
\ No newline at end of file
+}
@@ -24,6 +24,12 @@
 #include "llama.cpp/ggml-quants.h"
 #include "llama.cpp/ggml.h"
 #include "llamafile/sgemm.h"
+#include "weight_types.h"
+
+// Activation bytes per {m_block, stride} task of Linear::forward_many, about
+// half of a server core's L2, and the smallest m_block it splits a prompt into.
+#define LINEAR_M_BLOCK_BYTES (1 << 20)
+#define LINEAR_M_BLOCK_MIN 16
 
 struct LinearConfig {
     int input_size;
@@ -33,6 +39,12 @@ struct LinearConfig {
     void* proj;
     ggml_type proj_type;
     ggml_type hidden_type;
+    // fp32 weight_scale_inv of an fp8 (GGML_TYPE_FP8_E4M3) projection, fp16
+    // scales of a gptq/awq (GGML_TYPE_GPTQ_INT4/GGML_TYPE_AWQ_INT4) one
+    void* proj_scale = nullptr;
+    // int32 qzeros and group size of a gptq/awq projection, unused otherwise
+    void* proj_zeros = nullptr;
+    int group_size = 0;
 
     LinearConfig() {}
 
@@ -49,6 +61,8 @@ class Linear {
     void forward(int qlen, const void* input, void* output, Backend* backend);
 
    private:
+    int m_block_size(int qlen, int nth) const;
+
     LinearConfig config_;
     void* proj_;  // [output_size * input_size ( /32 if quantized)]
 
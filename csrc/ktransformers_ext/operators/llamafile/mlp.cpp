@@ -9,12 +9,24 @@
  **/
 #include "mlp.h"
 
+#include <stdexcept>
+#include <string>
+
 MLP::MLP(MLPConfig config) {
     config_ = config;
     gate_proj_ = config_.gate_proj;
     up_proj_ = config_.up_proj;
     down_proj_ = config_.down_proj; 
+    fuse_gate_up_ = config_.fuse_gate_up && config_.gate_type == config_.up_type;
     
+    #ifndef USE_NUMA
+    // without the per-node copies the weights are read as passed in by python
+    for (ggml_type type : {config_.gate_type, config_.up_type, config_.down_type}) {
+        if (weight_needs_packing(type)) {
+            throw std::invalid_argument(std::string("MLP: ") + weight_type_name(type) + " weights need USE_NUMA");
+        }
+    }
+    #endif
     #ifdef USE_NUMA
     gate_numa_.resize(numa_nodes_);
     up_numa_.resize(numa_nodes_);
@@ -24,8 +36,8 @@ MLP::MLP(MLPConfig config) {
     down_numa_size_.resize(numa_nodes_); 
     #endif
     int nth = config_.intermediate_size / config_.stride;
-    stride_gate_bytes_ = config_.stride * config_.hidden_size * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type);
-    stride_up_bytes_ = config_.stride * config_.hidden_size * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type);
+    stride_gate_bytes_ = weight_packed_bytes(config_.gate_type, config_.stride * config_.hidden_size);
+    stride_up_bytes_ = weight_packed_bytes(config_.up_type, config_.stride * config_.hidden_size);
     int base = nth / numa_nodes_;
     int remain = nth % numa_nodes_;
 
@@ -33,10 +45,17 @@ MLP::MLP(MLPConfig config) {
     int current_block = 0; 
     for (int nid = 0; nid < numa_nodes_; nid++) {   
         int n_blocks = (base + (nid < remain));
-        gate_numa_size_[nid] = n_blocks * stride_gate_bytes_;
-        up_numa_size_[nid] = n_blocks * stride_up_bytes_;
-        gate_numa_[nid] = allocate_aligned_numa(gate_numa_size_[nid], nid);
-        up_numa_[nid] = allocate_aligned_numa(up_numa_size_[nid], nid);
+        if (fuse_gate_up_) {
+            gate_numa_size_[nid] = n_blocks * (stride_gate_bytes_ + stride_up_bytes_);
+            up_numa_size_[nid] = 0;
+            gate_numa_[nid] = allocate_aligned_numa(gate_numa_size_[nid], nid);
+            up_numa_[nid] = nullptr;
+        } else {
+            gate_numa_size_[nid] = n_blocks * stride_gate_bytes_;
+            up_numa_size_[nid] = n_blocks * stride_up_bytes_;
+            gate_numa_[nid] = allocate_aligned_numa(gate_numa_size_[nid], nid);
+            up_numa_[nid] = allocate_aligned_numa(up_numa_size_[nid], nid);
+        }
         gate_up_blocks_[nid] = NumaBlock{
             .node_id = nid,
             .start_block = current_block,
@@ -48,7 +67,7 @@ MLP::MLP(MLPConfig config) {
     }
    
     nth = config_.hidden_size / config_.stride;
-    stride_down_bytes_ = config_.stride * config_.intermediate_size * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type);
+    stride_down_bytes_ = weight_packed_bytes(config_.down_type, config_.stride * config_.intermediate_size);
     size_t expert_down_bytes = nth * stride_down_bytes_;
     base = nth / numa_nodes_;
     remain = nth % numa_nodes_;
@@ -73,14 +92,15 @@ MLP::MLP(MLPConfig config) {
         for (int ib = 0; ib < n_blocks; ib++) {
             int ith = start_block + ib;
     
-            void* gate_ptr = (uint8_t*)gate_proj_ + ith * stride_gate_bytes_;
-            void* up_ptr = (uint8_t*)up_proj_ + ith * stride_up_bytes_;
-    
             uint8_t* local_gate_ptr = (uint8_t*)gate_numa_[nid]  + ib * stride_gate_bytes_;
             uint8_t* local_up_ptr = (uint8_t*)up_numa_[nid] + ib * stride_up_bytes_;
+            if (fuse_gate_up_) {
+                local_gate_ptr = (uint8_t*)gate_numa_[nid] + ib * (stride_gate_bytes_ + stride_up_bytes_);
+                local_up_ptr = local_gate_ptr + stride_gate_bytes_;
+            }
             
-            memcpy(local_gate_ptr, gate_ptr, stride_gate_bytes_);
-            memcpy(local_up_ptr, up_ptr, stride_up_bytes_);
+            pack_weight_rows(local_gate_ptr, gate_proj_, config_.gate_scale, config_.gate_zeros, config_.group_size, config_.gate_type, config_.intermediate_size, ith * config_.stride, config_.stride, config_.hidden_size);
+            pack_weight_rows(local_up_ptr, up_proj_, config_.up_scale, config_.up_zeros, config_.group_size, config_.up_type, config_.intermediate_size, ith * config_.stride, config_.stride, config_.hidden_size);
            
         }
     }
@@ -90,35 +110,39 @@ MLP::MLP(MLPConfig config) {
         int n_blocks = down_blocks_[nid].num_blocks;
         for (int ib = 0; ib < n_blocks; ib++) {
             int ith = start_block + ib; 
-            void* down_ptr = (uint8_t*)down_proj_ + ith * stride_down_bytes_;
             uint8_t* local_down_ptr = (uint8_t*)down_numa_[nid] + ib * stride_down_bytes_;
-            memcpy(local_down_ptr, down_ptr, stride_down_bytes_);
+            pack_weight_rows(local_down_ptr, down_proj_, config_.down_scale, config_.down_zeros, config_.group_size, config_.down_type, config_.hidden_size, ith * config_.stride, config_.stride, config_.intermediate_size);
           
         }
     } 
     input_fp32_ = (float*)allocate_aligned(sizeof(float) * config_.group_max_len * config_.hidden_size);
-    gate_input_ = (uint8_t*) allocate_aligned(config_.group_max_len * config_.hidden_size * ggml_type_size(ggml_internal_get_type_traits(config_.gate_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.gate_type).vec_dot_type));
-    up_input_ = (uint8_t*) allocate_aligned(config_.group_max_len * config_.hidden_size * ggml_type_size(ggml_internal_get_type_traits(config_.up_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.up_type).vec_dot_type));
-    gate_output_ = (float*)allocate_aligned(sizeof(float) * config_.group_max_len * config_.intermediate_size);
+    gate_input_ = (uint8_t*) allocate_aligned(config_.group_max_len * config_.hidden_size * ggml_type_size(weight_vec_dot_type(config_.gate_type)) / ggml_blck_size(weight_vec_dot_type(config_.gate_type)));
+    up_input_ = (uint8_t*) allocate_aligned(config_.group_max_len * config_.hidden_size * ggml_type_size(weight_vec_dot_type(config_.up_type)) / ggml_blck_size(weight_vec_dot_type(config_.up_type)));
+    gate_output_ = (float*)allocate_aligned((fuse_gate_up_ ? 2 : 1) * sizeof(float) * config_.group_max_len * config_.intermediate_size);
     up_output_ = (float*)allocate_aligned(sizeof(float) * config_.group_max_len * config_.intermediate_size);
     intermediate_fp32_ = (float*)allocate_aligned(sizeof(float) * config_.group_max_len * config_.intermediate_size);
-    down_input_ = (uint8_t*)allocate_aligned(config_.group_max_len * config_.intermediate_size * ggml_type_size(ggml_internal_get_type_traits(config_.down_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.down_type).vec_dot_type));
+    down_input_ = (uint8_t*)allocate_aligned(config_.group_max_len * config_.intermediate_size * ggml_type_size(weight_vec_dot_type(config_.down_type)) / ggml_blck_size(weight_vec_dot_type(config_.down_type)));
     down_output_ = (float*)allocate_aligned(sizeof(float) * config_.group_max_len * config_.hidden_size);
 }
 
 MLP::~MLP() {
     for (int nid = 0; nid < numa_nodes_; nid++) {  
+        fp8_gemm_release(gate_numa_[nid], gate_numa_size_[nid]);
         free_aligned_numa(gate_numa_[nid], gate_numa_size_[nid]);
-        free_aligned_numa(up_numa_[nid], up_numa_size_[nid]);
+        if (!fuse_gate_up_) {
+            fp8_gemm_release(up_numa_[nid], up_numa_size_[nid]);
+            free_aligned_numa(up_numa_[nid], up_numa_size_[nid]);
+        }
+        fp8_gemm_release(down_numa_[nid], down_numa_size_[nid]);
         free_aligned_numa(down_numa_[nid], down_numa_size_[nid]);
     }
     free_aligned(input_fp32_ , sizeof(float) * config_.group_max_len * config_.hidden_size);
-    free_aligned(gate_input_ , config_.group_max_len * config_.hidden_size * ggml_type_size(ggml_internal_get_type_traits(config_.gate_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.gate_type).vec_dot_type));
-    free_aligned(up_input_ , config_.group_max_len * config_.hidden_size * ggml_type_size(ggml_internal_get_type_traits(config_.up_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.up_type).vec_dot_type));
-    free_aligned(gate_output_ , sizeof(float) * config_.group_max_len * config_.intermediate_size);
+    free_aligned(gate_input_ , config_.group_max_len * config_.hidden_size * ggml_type_size(weight_vec_dot_type(config_.gate_type)) / ggml_blck_size(weight_vec_dot_type(config_.gate_type)));
+    free_aligned(up_input_ , config_.group_max_len * config_.hidden_size * ggml_type_size(weight_vec_dot_type(config_.up_type)) / ggml_blck_size(weight_vec_dot_type(config_.up_type)));
+    free_aligned(gate_output_ , (fuse_gate_up_ ? 2 : 1) * sizeof(float) * config_.group_max_len * config_.intermediate_size);
     free_aligned(up_output_,sizeof(float) * config_.group_max_len * config_.intermediate_size);
     free_aligned(intermediate_fp32_, sizeof(float) * config_.group_max_len * config_.intermediate_size);
-    free_aligned(down_input_, config_.group_max_len * config_.intermediate_size * ggml_type_size(ggml_internal_get_type_traits(config_.down_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.down_type).vec_dot_type));
+    free_aligned(down_input_, config_.group_max_len * config_.intermediate_size * ggml_type_size(weight_vec_dot_type(config_.down_type)) / ggml_blck_size(weight_vec_dot_type(config_.down_type)));
     free_aligned(down_output_ ,sizeof(float) * config_.group_max_len * config_.hidden_size);
  
 }
@@ -140,25 +164,38 @@ void MLP::warm_up(Backend *backend) {
 
 static float act_fn(float x) { return x / (1.0f + expf(-x)); }
 
+// output[m, n] = input[m, k] * proj[n, k]^T
+static void gemm(ggml_type type, const void* proj, const void* input, float* output, int m, int n, int k, int ldc) {
+    if (type == GGML_TYPE_FP8_E4M3) {
+        fp8_gemm(m, n, k, proj, (const ggml_bf16_t*)input, k, output, ldc);
+        return;
+    }
+    if (is_int4_type(type)) {
+        int4_gemm(m, n, k, proj, (const block_q8_1*)input, output, ldc);
+        return;
+    }
+    llamafile_sgemm(n, m, k / ggml_blck_size(type), proj, k / ggml_blck_size(type), input, k / ggml_blck_size(type), output, ldc, 0, 1, GGML_TASK_TYPE_COMPUTE, type, weight_vec_dot_type(type), GGML_TYPE_F32, GGML_PREC_DEFAULT);
+}
+
 void MLP::forward_many(int qlen, const void* input, void* output, Backend* backend) {
     const void* gate_input_ptr;
     const void* up_input_ptr;
-    if (config_.hidden_type == ggml_internal_get_type_traits(config_.gate_type).vec_dot_type && config_.hidden_type == ggml_internal_get_type_traits(config_.up_type).vec_dot_type) {
+    if (config_.hidden_type == weight_vec_dot_type(config_.gate_type) && config_.hidden_type == weight_vec_dot_type(config_.up_type)) {
         gate_input_ptr = up_input_ptr = input;
     } else {
         to_float(input, input_fp32_, qlen * config_.hidden_size, config_.hidden_type);
-        if (ggml_internal_get_type_traits(config_.gate_type).vec_dot_type == ggml_internal_get_type_traits(config_.up_type).vec_dot_type) {
-            from_float(input_fp32_, gate_input_, qlen * config_.hidden_size, ggml_internal_get_type_traits(config_.gate_type).vec_dot_type);
+        if (weight_vec_dot_type(config_.gate_type) == weight_vec_dot_type(config_.up_type)) {
+            from_float(input_fp32_, gate_input_, qlen * config_.hidden_size, weight_vec_dot_type(config_.gate_type));
             gate_input_ptr = up_input_ptr = gate_input_;
         } else {
-            if (config_.hidden_type != ggml_internal_get_type_traits(config_.gate_type).vec_dot_type) {
-                from_float(input_fp32_, gate_input_, qlen * config_.hidden_size, ggml_internal_get_type_traits(config_.gate_type).vec_dot_type);
+            if (config_.hidden_type != weight_vec_dot_type(config_.gate_type)) {
+                from_float(input_fp32_, gate_input_, qlen * config_.hidden_size, weight_vec_dot_type(config_.gate_type));
                 gate_input_ptr = gate_input_;
             } else {
                 gate_input_ptr = input;
             }
-            if (config_.hidden_type != ggml_internal_get_type_traits(config_.up_type).vec_dot_type) {
-                from_float(input_fp32_, up_input_, qlen * config_.hidden_size, ggml_internal_get_type_traits(config_.up_type).vec_dot_type);
+            if (config_.hidden_type != weight_vec_dot_type(config_.up_type)) {
+                from_float(input_fp32_, up_input_, qlen * config_.hidden_size, weight_vec_dot_type(config_.up_type));
                 up_input_ptr = up_input_;
             } else {
                 up_input_ptr = input;
@@ -171,34 +208,54 @@ void MLP::forward_many(int qlen, const void* input, void* output, Backend* backe
         int x = task_id - gate_up_blocks_[nid].start_block;
         int offset = x % gate_up_blocks_[nid].num_blocks; 
         int ith = gate_up_blocks_[nid].start_block + offset;
+        if (fuse_gate_up_) {
+            // gate and up of the block in one gemm, then the activation on each
+            // row while it is still in cache
+            void* gate_up_proj_ptr = (uint8_t*)gate_numa_[nid] + offset * (stride_gate_bytes_ + stride_up_bytes_);
+            float* gate_up_output_ptr = gate_output_ + 2 * ith * config_.stride;
+            gemm(config_.gate_type, gate_up_proj_ptr, gate_input_ptr, gate_up_output_ptr, qlen, 2 * config_.stride, config_.hidden_size, 2 * config_.intermediate_size);
+            for (int i = 0; i < qlen; i++) {
+                float* gate_row_ptr = gate_up_output_ptr + i * 2 * config_.intermediate_size;
+                float* up_row_ptr = gate_row_ptr + config_.stride;
+                float* intermediate_fp32_ptr = intermediate_fp32_ + i * config_.intermediate_size + ith * config_.stride;
+                for (int j = 0; j < config_.stride; j++) {
+                    intermediate_fp32_ptr[j] = act_fn(gate_row_ptr[j]) * up_row_ptr[j];
+                }
+                if (config_.stride % ggml_blck_size(weight_vec_dot_type(config_.down_type)) == 0) {
+                    void* down_input_ptr = (uint8_t*)down_input_ + i * config_.intermediate_size * ggml_type_size(weight_vec_dot_type(config_.down_type)) / ggml_blck_size(weight_vec_dot_type(config_.down_type)) + ith * config_.stride * ggml_type_size(weight_vec_dot_type(config_.down_type)) / ggml_blck_size(weight_vec_dot_type(config_.down_type));
+                    from_float(intermediate_fp32_ptr, down_input_ptr, config_.stride, weight_vec_dot_type(config_.down_type));
+                }
+            }
+            return;
+        }
         #ifdef USE_NUMA
-        void* gate_proj_ptr = (uint8_t*)gate_numa_[nid] +  offset * config_.stride * config_.hidden_size * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type);
+        void* gate_proj_ptr = (uint8_t*)gate_numa_[nid] + offset * stride_gate_bytes_;
         #else
-        void* gate_proj_ptr = (uint8_t*)gate_proj_ + ith * config_.stride * config_.hidden_size * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type);
+        void* gate_proj_ptr = (uint8_t*)gate_proj_ + weight_bytes(config_.gate_type, (size_t)ith * config_.stride * config_.hidden_size);
         #endif
         float* gate_output_ptr = gate_output_ + ith * config_.stride;
-        llamafile_sgemm(config_.stride, qlen, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_proj_ptr, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_input_ptr, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_output_ptr, config_.intermediate_size, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.gate_type, ggml_internal_get_type_traits(config_.gate_type).vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+        gemm(config_.gate_type, gate_proj_ptr, gate_input_ptr, gate_output_ptr, qlen, config_.stride, config_.hidden_size, config_.intermediate_size);
         
         #ifdef USE_NUMA
-        void* up_proj_ptr = (uint8_t*)up_numa_[nid] +  offset * config_.stride * config_.hidden_size * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type);
+        void* up_proj_ptr = (uint8_t*)up_numa_[nid] + offset * stride_up_bytes_;
         #else
-        void* up_proj_ptr = (uint8_t*)up_proj_ + ith * config_.stride * config_.hidden_size * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type);
+        void* up_proj_ptr = (uint8_t*)up_proj_ + weight_bytes(config_.up_type, (size_t)ith * config_.stride * config_.hidden_size);
         #endif
         float* up_output_ptr = up_output_ + ith * config_.stride;
-        llamafile_sgemm(config_.stride, qlen, config_.hidden_size / ggml_blck_size(config_.up_type), up_proj_ptr, config_.hidden_size / ggml_blck_size(config_.up_type), up_input_ptr, config_.hidden_size / ggml_blck_size(config_.up_type), up_output_ptr, config_.intermediate_size, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.up_type, ggml_internal_get_type_traits(config_.up_type).vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+        gemm(config_.up_type, up_proj_ptr, up_input_ptr, up_output_ptr, qlen, config_.stride, config_.hidden_size, config_.intermediate_size);
         for (int i = 0; i < qlen; i++) {
             for (int j = ith * config_.stride; j < (ith + 1) * config_.stride; j++) {
                 intermediate_fp32_[i * config_.intermediate_size + j] = act_fn(gate_output_[i * config_.intermediate_size + j]) * up_output_[i * config_.intermediate_size + j];
             }
-            if (config_.stride % ggml_blck_size(ggml_internal_get_type_traits(config_.down_type).vec_dot_type) == 0) {
+            if (config_.stride % ggml_blck_size(weight_vec_dot_type(config_.down_type)) == 0) {
                 float* intermediate_fp32_ptr = intermediate_fp32_ + i * config_.intermediate_size + ith * config_.stride;
-                void* down_input_ptr = (uint8_t*)down_input_ + i * config_.intermediate_size * ggml_type_size(ggml_internal_get_type_traits(config_.down_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.down_type).vec_dot_type) + ith * config_.stride * ggml_type_size(ggml_internal_get_type_traits(config_.down_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(config_.down_type).vec_dot_type);
-                from_float(intermediate_fp32_ptr, down_input_ptr, config_.stride, ggml_internal_get_type_traits(config_.down_type).vec_dot_type);
+                void* down_input_ptr = (uint8_t*)down_input_ + i * config_.intermediate_size * ggml_type_size(weight_vec_dot_type(config_.down_type)) / ggml_blck_size(weight_vec_dot_type(config_.down_type)) + ith * config_.stride * ggml_type_size(weight_vec_dot_type(config_.down_type)) / ggml_blck_size(weight_vec_dot_type(config_.down_type));
+                from_float(intermediate_fp32_ptr, down_input_ptr, config_.stride, weight_vec_dot_type(config_.down_type));
             }
         }
     }, nullptr);
-    if (config_.stride % ggml_blck_size(ggml_internal_get_type_traits(config_.down_type).vec_dot_type) != 0) {
-        from_float(intermediate_fp32_, down_input_, qlen * config_.intermediate_size, ggml_internal_get_type_traits(config_.down_type).vec_dot_type);
+    if (config_.stride % ggml_blck_size(weight_vec_dot_type(config_.down_type)) != 0) {
+        from_float(intermediate_fp32_, down_input_, qlen * config_.intermediate_size, weight_vec_dot_type(config_.down_type));
     }
     nth = config_.hidden_size / config_.stride;
     Backend_NUMA::getInstance().do_k_work_stealing_job(1, nth, nullptr, [&](int task_id) {
@@ -207,12 +264,12 @@ void MLP::forward_many(int qlen, const void* input, void* output, Backend* backe
         int offset = x % down_blocks_[nid].num_blocks; 
         int ith = down_blocks_[nid].start_block + offset; 
         #ifdef USE_NUMA
-        void* down_proj_ptr = (uint8_t*)down_numa_[nid] + offset * config_.stride * config_.intermediate_size * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type);
+        void* down_proj_ptr = (uint8_t*)down_numa_[nid] + offset * stride_down_bytes_;
         #else
-        void* down_proj_ptr = (uint8_t*)down_proj_ + ith * config_.stride * config_.intermediate_size * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type);
+        void* down_proj_ptr = (uint8_t*)down_proj_ + weight_bytes(config_.down_type, (size_t)ith * config_.stride * config_.intermediate_size);
         #endif
         float* down_output_ptr = down_output_ + ith * config_.stride;
-        llamafile_sgemm(config_.stride, qlen, config_.intermediate_size / ggml_blck_size(config_.down_type), down_proj_ptr, config_.intermediate_size / ggml_blck_size(config_.down_type), down_input_, config_.intermediate_size / ggml_blck_size(config_.down_type), down_output_ptr, config_.hidden_size, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.down_type, ggml_internal_get_type_traits(config_.down_type).vec_dot_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+        gemm(config_.down_type, down_proj_ptr, down_input_, down_output_ptr, qlen, config_.stride, config_.intermediate_size, config_.hidden_size);
         if (config_.stride % ggml_blck_size(config_.hidden_type) == 0) {
             for (int i = 0; i < qlen; i++) {
                 float* output_fp32_ptr = down_output_ + i * config_.hidden_size + ith * config_.stride;
@@ -24,6 +24,7 @@
 #include "llama.cpp/ggml-quants.h"
 #include "llama.cpp/ggml.h"
 #include "llamafile/sgemm.h"
+#include "weight_types.h"
 
 struct MLPConfig {
     int hidden_size;
@@ -37,6 +38,19 @@ struct MLPConfig {
     ggml_type up_type;
     ggml_type down_type;
     ggml_type hidden_type;
+    // fp32 weight_scale_inv of fp8 (GGML_TYPE_FP8_E4M3) projections, fp16
+    // scales of gptq/awq (GGML_TYPE_GPTQ_INT4/GGML_TYPE_AWQ_INT4) ones
+    void* gate_scale = nullptr;
+    void* up_scale = nullptr;
+    void* down_scale = nullptr;
+    // int32 qzeros and group size of gptq/awq projections, unused otherwise
+    void* gate_zeros = nullptr;
+    void* up_zeros = nullptr;
+    void* down_zeros = nullptr;
+    int group_size = 0;
+    // opt-in: pack gate and up of each stride block next to each other and
+    // compute them with one gemm, only taken when gate_type == up_type
+    bool fuse_gate_up = false;
 
     MLPConfig() {}
 
@@ -61,14 +75,14 @@ class MLP {
     float* input_fp32_;         // [group_max_len * hidden_size]
     uint8_t* gate_input_;       // [group_max_len * hidden_size * ggml_type_size(ggml_internal_get_type_traits(gate_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(gate_type).vec_dot_type)]
     uint8_t* up_input_;         // [group_max_len * hidden_size * ggml_type_size(ggml_internal_get_type_traits(up_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(up_type).vec_dot_type)]
-    float* gate_output_;        // [group_max_len * intermediate_size]
+    float* gate_output_;        // [group_max_len * intermediate_size], x2 when fused
     float* up_output_;          // [group_max_len * intermediate_size]
     float* intermediate_fp32_;  // [group_max_len * intermediate_size]
     uint8_t* down_input_;       // [group_max_len * intermediate_size * ggml_type_size(ggml_internal_get_type_traits(down_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(down_type).vec_dot_type)]
     float* down_output_;        // [group_max_len * hidden_size]
     #ifdef USE_NUMA
-    std::vector<void*> gate_numa_;  // [numa_num, nth * stride * expert_num * hidden_size ( /32 if quantized)]
-    std::vector<void*> up_numa_;    // [numa_num, nth * stride * expert_num * hidden_size ( /32 if quantized)]
+    std::vector<void*> gate_numa_;  // [numa_num, nth * stride * expert_num * hidden_size ( /32 if quantized)], [gate stride | up stride] blocks when fused
+    std::vector<void*> up_numa_;    // [numa_num, nth * stride * expert_num * hidden_size ( /32 if quantized)], unused when fused
     std::vector<void*> down_numa_;  // [numa_num, nth * stride * expert_num *  intermediate_size ( /32 if quantized)]
     std::vector<size_t> gate_numa_size_;
     std::vector<size_t> up_numa_size_;
@@ -84,6 +98,7 @@ class MLP {
     std::vector<NumaBlock> gate_up_blocks_;
     std::vector<NumaBlock> down_blocks_;
     #endif
+    bool fuse_gate_up_;  // see MLPConfig::fuse_gate_up
 };
 
 #endif
\ No newline at end of file
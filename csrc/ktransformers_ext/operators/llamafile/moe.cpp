@@ -9,6 +9,7 @@
  **/
 #include "moe.h"
 #include <iostream>
+#include <algorithm>
 #include <cstdint>
 
 #ifdef USE_NUMA
@@ -25,24 +26,27 @@ MOE::MOE(MOEConfig config) {
 
     config_.stride = 32;
     use_fp32_buffer_ = false;
-    #if defined(__AMX_INT8__) && defined(__AVX512VNNI__)
-    std::cout << "AMX enabled ...... " << std::endl;
-    if(config_.gate_type == GGML_TYPE_F16){
-        use_fp32_buffer_ = true;
-        if(config_.up_type != GGML_TYPE_F16 || config_.down_type != GGML_TYPE_F16){
-            std::cout << "GGML_TYPE_F16 not same with gate,up,down ...... " << std::endl;
-            throw std::runtime_error("GGML_TYPE_F16 not same with gate,up,down");
-        }
-    }    
+    use_amx_ = false;
+    #if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+    use_amx_ = get_cpu_features().amx;
     #endif
+    std::cout << "cpu isa: " << get_cpu_isa_name() << std::endl;
+    if (use_amx_) {
+        std::cout << "AMX enabled ...... " << std::endl;
+    }
     if(config_.up_type == GGML_TYPE_BF16 && config_.hidden_type == GGML_TYPE_BF16){
-        #if defined(__AMX_INT8__) || defined(__AVX512VNNI__) || defined(__AVX512BF16__) || defined(__AVX512F__)
-
-
+        // llamafile only has bf16 kernels in its avx512 variants
+        #if defined(KTRANSFORMERS_CPU_DISPATCH)
+        bool has_bf16_kernels = use_amx_ || get_cpu_features().avx512f;
+        #elif defined(__AMX_INT8__) || defined(__AVX512VNNI__) || defined(__AVX512BF16__) || defined(__AVX512F__)
+        bool has_bf16_kernels = true;
         #else
+        bool has_bf16_kernels = false;
+        #endif
+        if (!has_bf16_kernels) {
             use_fp32_buffer_ = true;
             std::cout << "convert input bf16 to float32 ...... " << std::endl;
-        #endif
+        }
     }
 
     gate_proj_ = config_.gate_proj;
@@ -53,25 +57,40 @@ MOE::MOE(MOEConfig config) {
     hidden_blk_size = ggml_blck_size(config_.hidden_type);
     hidden_bytes = config_.hidden_size * hidden_type_size / hidden_blk_size;
 
-    gate_vec_type = ggml_internal_get_type_traits(config_.gate_type).vec_dot_type;
+    gate_vec_type = weight_vec_dot_type(config_.gate_type);
+    #if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+    if (packs_amx(config_.gate_type)) {
+        gate_vec_type = get_amx_vec_dot_type(config_.gate_type);
+    }
+    #endif
     gate_type_size = ggml_type_size(gate_vec_type);
     gate_blk_size = ggml_blck_size(gate_vec_type); 
     gate_bytes = config_.hidden_size * gate_type_size / gate_blk_size;
 
-    up_vec_type = ggml_internal_get_type_traits(config_.up_type).vec_dot_type;
+    up_vec_type = weight_vec_dot_type(config_.up_type);
+    #if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+    if (packs_amx(config_.up_type)) {
+        up_vec_type = get_amx_vec_dot_type(config_.up_type);
+    }
+    #endif
     up_type_size = ggml_type_size(up_vec_type);
     up_blk_size = ggml_blck_size(up_vec_type); 
     up_bytes = config_.hidden_size * up_type_size / up_blk_size;
 
-    down_vec_type = ggml_internal_get_type_traits(config_.down_type).vec_dot_type;
+    down_vec_type = weight_vec_dot_type(config_.down_type);
+    #if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+    if (packs_amx(config_.down_type)) {
+        down_vec_type = get_amx_vec_dot_type(config_.down_type);
+    }
+    #endif
     down_type_size = ggml_type_size(down_vec_type);
     down_blk_size = ggml_blck_size(down_vec_type); 
     down_bytes = config_.intermediate_size * down_type_size / down_blk_size;
     std::cout << "config_.stride : " << config_.stride << " down_blk_size :" << down_blk_size << " hidden_blk_size :" << hidden_blk_size << std::endl;
     std::cout << "config_.hidden_type : " << ggml_internal_get_type_traits(config_.hidden_type).type_name << std::endl;
-    std::cout << "config_.gate_type : " << ggml_internal_get_type_traits(config_.gate_type).type_name << std::endl;
-    std::cout << "config_.up_type : " << ggml_internal_get_type_traits(config_.up_type).type_name << std::endl;
-    std::cout << "config_.down_type : " << ggml_internal_get_type_traits(config_.down_type).type_name << std::endl; 
+    std::cout << "config_.gate_type : " << weight_type_name(config_.gate_type) << std::endl;
+    std::cout << "config_.up_type : " << weight_type_name(config_.up_type) << std::endl;
+    std::cout << "config_.down_type : " << weight_type_name(config_.down_type) << std::endl; 
     std::cout << "gate_type_size: " << gate_type_size << std::endl;
     std::cout << "gate_blk_size: " << gate_blk_size << std::endl;
     std::cout << "gate_bytes: " << gate_bytes << std::endl;
@@ -93,13 +112,28 @@ MOE::MOE(MOEConfig config) {
     up_numa_size_.resize(numa_nodes_);
     down_numa_size_.resize(numa_nodes_);  
 
+    // both halves of a fused block are computed by the gate kernel on the gate input
+    fuse_gate_up_ = config_.fuse_gate_up && config_.gate_type == config_.up_type && gate_vec_type == up_vec_type;
+    std::cout << "fuse gate/up: " << fuse_gate_up_ << std::endl;
+
     int nth = config_.intermediate_size / config_.stride;
-    stride_gate_bytes_ = config_.stride * config_.hidden_size * ggml_type_size(config_.gate_type) / ggml_blck_size(config_.gate_type);
-    stride_up_bytes_ = config_.stride * config_.hidden_size * ggml_type_size(config_.up_type) / ggml_blck_size(config_.up_type);
-    
-    #if defined(__AMX_INT8__) && defined(__AVX512VNNI__)
-    amx_stride_gate_bytes_ = get_amx_packed_size(config_.gate_type, config_.hidden_size, config_.stride);
-    amx_stride_up_bytes_ = get_amx_packed_size(config_.up_type, config_.hidden_size, config_.stride);
+    stride_gate_bytes_ = weight_bytes(config_.gate_type, config_.stride * config_.hidden_size);
+    stride_up_bytes_ = weight_bytes(config_.up_type, config_.stride * config_.hidden_size);
+    packed_stride_gate_bytes_ = weight_packed_bytes(config_.gate_type, config_.stride * config_.hidden_size);
+    packed_stride_up_bytes_ = weight_packed_bytes(config_.up_type, config_.stride * config_.hidden_size);
+    #if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+    if (packs_amx(config_.gate_type)) {
+        packed_stride_gate_bytes_ = get_amx_packed_size(config_.gate_type, config_.hidden_size, config_.stride);
+    }
+    if (packs_amx(config_.up_type)) {
+        packed_stride_up_bytes_ = get_amx_packed_size(config_.up_type, config_.hidden_size, config_.stride);
+    }
+    #endif
+    packed_stride_gate_up_bytes_ = packed_stride_gate_bytes_ + packed_stride_up_bytes_;
+    #if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+    if (packs_amx(config_.gate_type)) {
+        packed_stride_gate_up_bytes_ = get_amx_packed_size(config_.gate_type, config_.hidden_size, 2 * config_.stride);
+    }
     #endif
     int base = nth / numa_nodes_;
     int remain = nth % numa_nodes_;
@@ -108,13 +142,13 @@ MOE::MOE(MOEConfig config) {
     int current_block = 0; 
     for (int nid = 0; nid < numa_nodes_; nid++) {
         int n_blocks = (base + (nid < remain));
-        #if defined(__AMX_INT8__) && defined(__AVX512VNNI__)
-        gate_numa_size_[nid] = config_.expert_num * n_blocks * amx_stride_gate_bytes_;
-        up_numa_size_[nid] = config_.expert_num * n_blocks * amx_stride_up_bytes_;
-        #else
-        gate_numa_size_[nid] = config_.expert_num * n_blocks * stride_gate_bytes_;
-        up_numa_size_[nid] = config_.expert_num * n_blocks * stride_up_bytes_;
-        #endif
+        if (fuse_gate_up_) {
+            gate_numa_size_[nid] = config_.expert_num * n_blocks * packed_stride_gate_up_bytes_;
+            up_numa_size_[nid] = 0;
+        } else {
+            gate_numa_size_[nid] = config_.expert_num * n_blocks * packed_stride_gate_bytes_;
+            up_numa_size_[nid] = config_.expert_num * n_blocks * packed_stride_up_bytes_;
+        }
         gate_up_blocks_[nid] = NumaBlock{
             .node_id = nid,
             .start_block = current_block,
@@ -130,7 +164,9 @@ MOE::MOE(MOEConfig config) {
         if (num_blocks == 0) return;
         assert(nid == task_id);
         gate_numa_[nid] = allocate_aligned_numa(gate_numa_size_[nid], nid);
-        up_numa_[nid] = allocate_aligned_numa(up_numa_size_[nid], nid);
+        if (!fuse_gate_up_) {
+            up_numa_[nid] = allocate_aligned_numa(up_numa_size_[nid], nid);
+        }
     }, nullptr);
    
      Backend_NUMA::getInstance().do_k_work_stealing_job(config_.expert_num, nth, nullptr, [&](int task_id) {
@@ -149,36 +185,68 @@ MOE::MOE(MOEConfig config) {
         void* gate_ptr = (uint8_t*)gate_proj_ + (expert_id * nth + ith) * stride_gate_bytes_;
         void* up_ptr = (uint8_t*)up_proj_ +  (expert_id * nth + ith) * stride_up_bytes_;
       
-#if defined(__AMX_INT8__) && defined(__AVX512VNNI__) 
-        uint8_t* local_gate_ptr = (uint8_t*)gate_numa_[nid] + (expert_id * num_blocks + offset) * amx_stride_gate_bytes_;
-        uint8_t* local_up_ptr = (uint8_t*)up_numa_[nid] + (expert_id * num_blocks + offset) * amx_stride_up_bytes_;
-        convert_weight_to_amx_format(
-            local_gate_ptr,
-            gate_ptr,
-            config_.gate_type,
-            config_.hidden_size,
-            config_.stride
-        );
-        convert_weight_to_amx_format(
-            local_up_ptr,
-            up_ptr,
-            config_.up_type,
-            config_.hidden_size,
-            config_.stride
-        ); 
-#else
-        void* local_gate_ptr = (uint8_t*)gate_numa_[nid] + (expert_id * num_blocks + offset) * stride_gate_bytes_;
-        void* local_up_ptr = (uint8_t*)up_numa_[nid] + (expert_id * num_blocks + offset) * stride_up_bytes_;
-        memcpy(local_gate_ptr, gate_ptr, stride_gate_bytes_);
-        memcpy(local_up_ptr, up_ptr, stride_up_bytes_);
+        int64_t row_begin = (int64_t)(expert_id * nth + ith) * config_.stride;
+        if (fuse_gate_up_) {
+            uint8_t* local_gate_up_ptr = (uint8_t*)gate_numa_[nid] + (expert_id * num_blocks + offset) * packed_stride_gate_up_bytes_;
+#if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+            if (packs_amx(config_.gate_type)) {
+                // pack the 2 * stride rows as one weight so a single kernel call
+                // covers both
+                std::vector<uint8_t> gate_up_rows(stride_gate_bytes_ + stride_up_bytes_);
+                memcpy(gate_up_rows.data(), gate_ptr, stride_gate_bytes_);
+                memcpy(gate_up_rows.data() + stride_gate_bytes_, up_ptr, stride_up_bytes_);
+                convert_weight_to_amx_format(
+                    local_gate_up_ptr,
+                    gate_up_rows.data(),
+                    config_.gate_type,
+                    config_.hidden_size,
+                    2 * config_.stride
+                );
+                return;
+            }
+#endif
+            pack_weight_rows(local_gate_up_ptr, gate_proj_, config_.gate_scale, config_.gate_type, row_begin, config_.stride, config_.hidden_size);
+            pack_weight_rows(local_gate_up_ptr + packed_stride_gate_bytes_, up_proj_, config_.up_scale, config_.up_type, row_begin, config_.stride, config_.hidden_size);
+            return;
+        }
+
+        uint8_t* local_gate_ptr = (uint8_t*)gate_numa_[nid] + (expert_id * num_blocks + offset) * packed_stride_gate_bytes_;
+        uint8_t* local_up_ptr = (uint8_t*)up_numa_[nid] + (expert_id * num_blocks + offset) * packed_stride_up_bytes_;
+#if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+        if (packs_amx(config_.gate_type)) {
+            convert_weight_to_amx_format(
+                local_gate_ptr,
+                gate_ptr,
+                config_.gate_type,
+                config_.hidden_size,
+                config_.stride
+            );
+        }
+        if (packs_amx(config_.up_type)) {
+            convert_weight_to_amx_format(
+                local_up_ptr,
+                up_ptr,
+                config_.up_type,
+                config_.hidden_size,
+                config_.stride
+            );
+        }
 #endif
+        if (!packs_amx(config_.gate_type)) {
+            pack_weight_rows(local_gate_ptr, gate_proj_, config_.gate_scale, config_.gate_type, row_begin, config_.stride, config_.hidden_size);
+        }
+        if (!packs_amx(config_.up_type)) {
+            pack_weight_rows(local_up_ptr, up_proj_, config_.up_scale, config_.up_type, row_begin, config_.stride, config_.hidden_size);
+        }
     }, nullptr);
 
     nth = config_.hidden_size / config_.stride;
-    stride_down_bytes_ = config_.stride * config_.intermediate_size * ggml_type_size(config_.down_type) / ggml_blck_size(config_.down_type);
-    
-    #if defined(__AMX_INT8__) && defined(__AVX512VNNI__) 
-    amx_stride_down_bytes_ = get_amx_packed_size(config_.down_type, config_.intermediate_size, config_.stride);
+    stride_down_bytes_ = weight_bytes(config_.down_type, config_.stride * config_.intermediate_size);
+    packed_stride_down_bytes_ = weight_packed_bytes(config_.down_type, config_.stride * config_.intermediate_size);
+    #if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+    if (packs_amx(config_.down_type)) {
+        packed_stride_down_bytes_ = get_amx_packed_size(config_.down_type, config_.intermediate_size, config_.stride);
+    }
     #endif
   
     base = nth / numa_nodes_;
@@ -187,11 +255,7 @@ MOE::MOE(MOEConfig config) {
     current_block = 0;
     for (int nid = 0; nid < numa_nodes_; nid++) { 
         int n_blocks = (base + (nid < remain));
-        #if defined(__AMX_INT8__) && defined(__AVX512VNNI__) 
-        down_numa_size_[nid] = config_.expert_num * n_blocks * amx_stride_down_bytes_;
-        #else
-        down_numa_size_[nid] = config_.expert_num * n_blocks * stride_down_bytes_;
-        #endif
+        down_numa_size_[nid] = config_.expert_num * n_blocks * packed_stride_down_bytes_;
         down_blocks_[nid] = NumaBlock{
             .node_id = nid,
             .start_block = current_block,
@@ -228,24 +292,24 @@ MOE::MOE(MOEConfig config) {
         
         void* down_ptr = (uint8_t*)down_proj_ + (expert_id * nth + ith) * stride_down_bytes_;  
 
-#if defined(__AMX_INT8__) && defined(__AVX512VNNI__)  
-        uint8_t* local_down_ptr = (uint8_t*)down_numa_[nid] + (expert_id * num_blocks + offset) * amx_stride_down_bytes_;
-        
-        convert_weight_to_amx_format(
-            local_down_ptr,
-            down_ptr,
-            config_.down_type,
-            config_.intermediate_size,
-            config_.stride
-        );
-#else  
-        void* local_down_ptr = (uint8_t*)down_numa_[nid] + (expert_id * num_blocks + offset) * stride_down_bytes_;
-        memcpy(local_down_ptr, down_ptr, stride_down_bytes_);
+        uint8_t* local_down_ptr = (uint8_t*)down_numa_[nid] + (expert_id * num_blocks + offset) * packed_stride_down_bytes_;
+#if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+        if (packs_amx(config_.down_type)) {
+            convert_weight_to_amx_format(
+                local_down_ptr,
+                down_ptr,
+                config_.down_type,
+                config_.intermediate_size,
+                config_.stride
+            );
+            return;
+        }
 #endif
+        pack_weight_rows(local_down_ptr, down_proj_, config_.down_scale, config_.down_type, (int64_t)(expert_id * nth + ith) * config_.stride, config_.stride, config_.intermediate_size);
     }, nullptr);
     
     s_input_fp32_ = (float*)allocate_aligned(sizeof(float) * config_.hidden_size);
-    s_gate_output_ = (float*)allocate_aligned(config_.routed_expert_num * sizeof(float) * config_.intermediate_size);
+    s_gate_output_ = (float*)allocate_aligned(gate_output_width() * config_.routed_expert_num * sizeof(float) * config_.intermediate_size);
     s_up_output_ = (float*)allocate_aligned(config_.routed_expert_num * sizeof(float) * config_.intermediate_size); 
     s_down_output_ = (float*)allocate_aligned(config_.routed_expert_num * sizeof(float) * config_.hidden_size);
     if(!use_fp32_buffer_){
@@ -256,7 +320,7 @@ MOE::MOE(MOEConfig config) {
     
  
     input_fp32_ = (float*)allocate_aligned(config_.group_max_len * sizeof(float) * config_.hidden_size);
-    gate_output_ = (float*)allocate_aligned(config_.group_max_len * config_.routed_expert_num * sizeof(float) * config_.intermediate_size);
+    gate_output_ = (float*)allocate_aligned(gate_output_width() * config_.group_max_len * config_.routed_expert_num * sizeof(float) * config_.intermediate_size);
     up_output_ = (float*)allocate_aligned(config_.group_max_len * config_.routed_expert_num * sizeof(float) * config_.intermediate_size);
     down_output_ = (float*)allocate_aligned(config_.group_max_len * config_.routed_expert_num * sizeof(float) * config_.hidden_size);
     output_fp32_ = (float*)allocate_aligned(config_.group_max_len * sizeof(float) * config_.hidden_size);  
@@ -279,12 +343,17 @@ MOE::MOE(MOEConfig config) {
 
 MOE::~MOE() {
     for (int nid = 0; nid < numa_nodes_; nid++) {  
+        fp8_gemm_release(gate_numa_[nid], gate_numa_size_[nid]);
         free_aligned_numa(gate_numa_[nid], gate_numa_size_[nid]);
-        free_aligned_numa(up_numa_[nid], up_numa_size_[nid]);
+        if (!fuse_gate_up_) {
+            fp8_gemm_release(up_numa_[nid], up_numa_size_[nid]);
+            free_aligned_numa(up_numa_[nid], up_numa_size_[nid]);
+        }
+        fp8_gemm_release(down_numa_[nid], down_numa_size_[nid]);
         free_aligned_numa(down_numa_[nid], down_numa_size_[nid]);
     }  
     free_aligned(s_input_fp32_, sizeof(float) * config_.hidden_size);
-    free_aligned(s_gate_output_, config_.group_max_len * sizeof(float) * config_.intermediate_size);
+    free_aligned(s_gate_output_, gate_output_width() * config_.routed_expert_num * sizeof(float) * config_.intermediate_size);
     free_aligned(s_up_output_, config_.group_max_len * sizeof(float) * config_.intermediate_size); 
     free_aligned(s_down_output_, config_.group_max_len * sizeof(float) * config_.hidden_size);
     if(!use_fp32_buffer_){
@@ -294,7 +363,7 @@ MOE::~MOE() {
     }
 
     free_aligned(input_fp32_, config_.group_max_len * sizeof(float) * config_.hidden_size);
-    free_aligned(gate_output_, config_.group_max_len * config_.routed_expert_num * sizeof(float) * config_.intermediate_size);
+    free_aligned(gate_output_, gate_output_width() * config_.group_max_len * config_.routed_expert_num * sizeof(float) * config_.intermediate_size);
     free_aligned(up_output_, config_.group_max_len * config_.routed_expert_num * sizeof(float) * config_.intermediate_size);
     free_aligned(down_output_, config_.group_max_len * config_.routed_expert_num * sizeof(float) * config_.hidden_size);
     free_aligned(output_fp32_, config_.group_max_len * sizeof(float) * config_.hidden_size); 
@@ -378,13 +447,31 @@ static void act_fn(float* up, float* gate, int n) {
 #endif
 }
 
+bool MOE::packs_amx(ggml_type type) const {
+    return use_amx_ && type != GGML_TYPE_FP8_E4M3;
+}
+
+void MOE::gemm(ggml_type type, ggml_type vec_type, const void* proj, const void* input, size_t input_em, float* output, int m, int n, int k, int ldc) {
+    if (type == GGML_TYPE_FP8_E4M3) {
+        fp8_gemm(m, n, k, proj, (const ggml_bf16_t*)input, input_em, output, ldc);
+        return;
+    }
+#if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
+    if (use_amx_) {
+        amx_gemm_compute(type, proj, input, output, m, n, k, ldc);
+        return;
+    }
+#endif
+    llamafile_sgemm(n, m, k / ggml_blck_size(type), proj, k / ggml_blck_size(type), input, input_em, output, ldc, 0, 1, GGML_TASK_TYPE_COMPUTE, type, use_fp32_buffer_ ? GGML_TYPE_F32 : vec_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
+}
+
 void MOE::forward_one(int k, const uint64_t* expert_ids, const float* weights, const void* input, void* output, Backend* backend) {
     
     const void* gate_input_ptr;
     const void* up_input_ptr;
-    size_t gate_input_em = config_.hidden_size / ggml_blck_size(config_.gate_type);
-    size_t up_input_em = config_.hidden_size / ggml_blck_size(config_.up_type);
-    size_t down_input_em = config_.intermediate_size / ggml_blck_size(config_.down_type);
+    size_t gate_input_em = config_.hidden_size / weight_blck_size(config_.gate_type);
+    size_t up_input_em = config_.hidden_size / weight_blck_size(config_.up_type);
+    size_t down_input_em = config_.intermediate_size / weight_blck_size(config_.down_type);
 
     if(use_fp32_buffer_){
         to_float(input, s_input_fp32_, config_.hidden_size, config_.hidden_type);
@@ -433,24 +520,22 @@ void MOE::forward_one(int k, const uint64_t* expert_ids, const float* weights, c
 
         size_t offsets_i = expert_idx * config_.intermediate_size;
         
-        float* gate_output_ptr = s_gate_output_ + offsets_i + ith * config_.stride;
-        #if defined(__AMX_INT8__) && defined(__AVX512VNNI__)
-        uint8_t* gate_proj_ptr = (uint8_t*)gate_numa_[nid] +  (expert_id * num_blocks + offset) * amx_stride_gate_bytes_; 
-        amx_gemm_compute(config_.gate_type, gate_proj_ptr, gate_input_ptr, gate_output_ptr, 1, n_stride, config_.hidden_size, n_stride);
-        #else
-        void* gate_proj_ptr = (uint8_t*)gate_numa_[nid] +  (expert_id * num_blocks + offset) * stride_gate_bytes_;
-        bool is_supported = llamafile_sgemm(n_stride, 1, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_proj_ptr, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_input_ptr, gate_input_em, gate_output_ptr, n_stride, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.gate_type, use_fp32_buffer_ ? GGML_TYPE_F32 : gate_vec_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
-        #endif
-        
         float* up_output_ptr = s_up_output_ + offsets_i + ith * config_.stride;
-        #if defined(__AMX_INT8__) && defined(__AVX512VNNI__) 
-        uint8_t* up_proj_ptr = (uint8_t*)up_numa_[nid] +  (expert_id * num_blocks  + offset) * amx_stride_up_bytes_;
-        amx_gemm_compute(config_.up_type, up_proj_ptr, up_input_ptr, up_output_ptr, 1, n_stride, config_.hidden_size, n_stride);
-        #else
-        void* up_proj_ptr = (uint8_t*)up_numa_[nid] +  (expert_id * num_blocks  + offset) * stride_up_bytes_;
-        llamafile_sgemm(n_stride, 1, config_.hidden_size / ggml_blck_size(config_.up_type), up_proj_ptr, config_.hidden_size / ggml_blck_size(config_.up_type), up_input_ptr, up_input_em, up_output_ptr, n_stride, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.up_type, use_fp32_buffer_ ? GGML_TYPE_F32 : up_vec_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
-        #endif
-        act_fn(up_output_ptr, gate_output_ptr , n_stride);  
+        if (fuse_gate_up_) {
+            float* gate_up_output_ptr = s_gate_output_ + 2 * (offsets_i + ith * config_.stride);
+            void* gate_up_proj_ptr = (uint8_t*)gate_numa_[nid] +  (expert_id * num_blocks + offset) * packed_stride_gate_up_bytes_;
+            gemm(config_.gate_type, gate_vec_type, gate_up_proj_ptr, gate_input_ptr, gate_input_em, gate_up_output_ptr, 1, 2 * n_stride, config_.hidden_size, 2 * n_stride);
+            act_fn(gate_up_output_ptr + n_stride, gate_up_output_ptr, n_stride);
+            memcpy(up_output_ptr, gate_up_output_ptr + n_stride, n_stride * sizeof(float));
+        } else {
+            float* gate_output_ptr = s_gate_output_ + offsets_i + ith * config_.stride;
+            void* gate_proj_ptr = (uint8_t*)gate_numa_[nid] +  (expert_id * num_blocks + offset) * packed_stride_gate_bytes_;
+            gemm(config_.gate_type, gate_vec_type, gate_proj_ptr, gate_input_ptr, gate_input_em, gate_output_ptr, 1, n_stride, config_.hidden_size, n_stride);
+
+            void* up_proj_ptr = (uint8_t*)up_numa_[nid] +  (expert_id * num_blocks  + offset) * packed_stride_up_bytes_;
+            gemm(config_.up_type, up_vec_type, up_proj_ptr, up_input_ptr, up_input_em, up_output_ptr, 1, n_stride, config_.hidden_size, n_stride);
+            act_fn(up_output_ptr, gate_output_ptr , n_stride);  
+        }
         if (config_.stride % down_blk_size == 0 && !use_fp32_buffer_) {
             void* down_input_ptr = s_down_input_ + (offsets_i + ith * config_.stride) * down_type_size / down_blk_size;
             from_float(up_output_ptr, down_input_ptr, n_stride, down_vec_type);
@@ -485,13 +570,8 @@ void MOE::forward_one(int k, const uint64_t* expert_ids, const float* weights, c
             down_input_ptr = s_down_input_ + expert_idx * config_.intermediate_size * down_type_size / down_blk_size; 
         }
         float* down_output_ptr = s_down_output_ + expert_idx * config_.hidden_size + ith * config_.stride;
-        #if defined(__AMX_INT8__) && defined(__AVX512VNNI__) 
-        uint8_t* down_proj_ptr = (uint8_t*)down_numa_[nid] + (expert_id * num_blocks  + offset) * amx_stride_down_bytes_;
-        amx_gemm_compute(config_.down_type, down_proj_ptr, down_input_ptr, down_output_ptr, 1, config_.stride, config_.intermediate_size, n_stride);    
-        #else
-        void* down_proj_ptr = (uint8_t*)down_numa_[nid] + (expert_id * num_blocks  + offset) * stride_down_bytes_;
-        llamafile_sgemm(n_stride, 1, config_.intermediate_size / ggml_blck_size(config_.down_type), down_proj_ptr, config_.intermediate_size / ggml_blck_size(config_.down_type), down_input_ptr, down_input_em, down_output_ptr, n_stride, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.down_type, use_fp32_buffer_ ? GGML_TYPE_F32 : down_vec_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
-        #endif
+        void* down_proj_ptr = (uint8_t*)down_numa_[nid] + (expert_id * num_blocks  + offset) * packed_stride_down_bytes_;
+        gemm(config_.down_type, down_vec_type, down_proj_ptr, down_input_ptr, down_input_em, down_output_ptr, 1, n_stride, config_.intermediate_size, n_stride);
     }, nullptr); 
     nth = config_.hidden_size / config_.stride;  
     
@@ -512,9 +592,9 @@ void MOE::forward_one(int k, const uint64_t* expert_ids, const float* weights, c
     }, nullptr);
 }
 void MOE::forward_many_m(int qlen, int k, const uint64_t* expert_ids, const float* weights, const void* input, void* output, Backend* backend) {
-    size_t gate_input_em = config_.hidden_size / ggml_blck_size(config_.gate_type);
-    size_t up_input_em = config_.hidden_size / ggml_blck_size(config_.up_type);
-    size_t down_input_em = config_.intermediate_size / ggml_blck_size(config_.down_type);
+    size_t gate_input_em = config_.hidden_size / weight_blck_size(config_.gate_type);
+    size_t up_input_em = config_.hidden_size / weight_blck_size(config_.up_type);
+    size_t down_input_em = config_.intermediate_size / weight_blck_size(config_.down_type);
     if(use_fp32_buffer_){ 
         gate_input_em = up_input_em = config_.hidden_size;
         down_input_em = config_.intermediate_size;
@@ -534,10 +614,15 @@ void MOE::forward_many_m(int qlen, int k, const uint64_t* expert_ids, const floa
     }
 
     uint64_t reorder_offset = 0;
+    int max_selected_num = 0;
     for (int i = 0; i < config_.expert_num; i++) {
         expert_reorder_offset[i] = reorder_offset;
         reorder_offset += expert_selected_num[i]; 
+        max_selected_num = std::max(max_selected_num, expert_selected_num[i]);
     }
+    // the tokens of an expert are split into MOE_M_BLOCK row blocks, each one
+    // a task of its own next to the stride blocks
+    int m_block_num = std::max(1, (max_selected_num + MOE_M_BLOCK - 1) / MOE_M_BLOCK);
 
     
     int nth = config_.hidden_size / config_.stride; 
@@ -610,22 +695,23 @@ void MOE::forward_many_m(int qlen, int k, const uint64_t* expert_ids, const floa
    
      
     nth = config_.intermediate_size / config_.stride; 
-    Backend_NUMA::getInstance().do_k_work_stealing_job(config_.expert_num, nth, nullptr, [&](int task_id) {
+    Backend_NUMA::getInstance().do_k_work_stealing_job(config_.expert_num * m_block_num, nth, nullptr, [&](int task_id) {
         int nid = Backend_NUMA::numa_node_; 
         int start_block = gate_up_blocks_[nid].start_block;
         int num_blocks = gate_up_blocks_[nid].num_blocks;
 
         if (num_blocks == 0) return;
 
-        int x = task_id - start_block * config_.expert_num;
-        int expert_id = x / num_blocks; 
-        if(expert_selected_num[expert_id] == 0) return;
+        int x = task_id - start_block * config_.expert_num * m_block_num;
+        int expert_id = x / num_blocks / m_block_num; 
+        int m_begin = x / num_blocks % m_block_num * MOE_M_BLOCK;
+        if(expert_selected_num[expert_id] <= m_begin) return;
 
         int offset = x % num_blocks;
         int ith = start_block + offset;
 
-        int expert_offsets = expert_reorder_offset[expert_id];
-        int n = expert_selected_num[expert_id];
+        int expert_offsets = expert_reorder_offset[expert_id] + m_begin;
+        int n = std::min(MOE_M_BLOCK, expert_selected_num[expert_id] - m_begin);
         size_t n_stride = config_.stride;
         void* gate_input_ptr;
         if(use_fp32_buffer_){
@@ -634,15 +720,28 @@ void MOE::forward_many_m(int qlen, int k, const uint64_t* expert_ids, const floa
             gate_input_ptr = (uint8_t*)m_gate_input_ + expert_offsets * gate_bytes;
         }
 
-        
+        float* up_output_ptr = up_output_ + expert_offsets * config_.intermediate_size + ith * config_.stride;
+        if (fuse_gate_up_) {
+            // one pass over the expert's tokens for both halves, the activation
+            // runs on each row while it is still in cache
+            float* gate_up_output_ptr = gate_output_ + 2 * (expert_offsets * config_.intermediate_size + ith * config_.stride);
+            void* gate_up_proj_ptr = (uint8_t*)gate_numa_[nid] +  (expert_id * num_blocks + offset) * packed_stride_gate_up_bytes_;
+            gemm(config_.gate_type, gate_vec_type, gate_up_proj_ptr, gate_input_ptr, gate_input_em, gate_up_output_ptr, n, 2 * n_stride, config_.hidden_size, 2 * config_.intermediate_size);
+            for (int i = 0; i < n; i++) {
+                float* row_ptr = gate_up_output_ptr + i * 2 * config_.intermediate_size;
+                act_fn(row_ptr + n_stride, row_ptr, n_stride);
+                memcpy(up_output_ptr + i * config_.intermediate_size, row_ptr + n_stride, n_stride * sizeof(float));
+                if (!use_fp32_buffer_ && config_.stride % down_blk_size == 0) {
+                    void* down_input_ptr = down_input_ + ((expert_offsets + i) * config_.intermediate_size + ith * config_.stride) * down_type_size / down_blk_size;
+                    from_float(row_ptr + n_stride, down_input_ptr, n_stride, down_vec_type);
+                }
+            }
+            return;
+        }
+
         float* gate_output_ptr = gate_output_ + expert_offsets * config_.intermediate_size + ith * config_.stride;
-        #if defined(__AMX_INT8__) && defined(__AVX512VNNI__) 
-        void* gate_proj_ptr = (uint8_t*)gate_numa_[nid] +  (expert_id * num_blocks + offset) * amx_stride_gate_bytes_;
-        amx_gemm_compute(config_.gate_type, gate_proj_ptr, gate_input_ptr, gate_output_ptr, n, config_.stride, config_.hidden_size, config_.intermediate_size);
-        #else
-        void* gate_proj_ptr = (uint8_t*)gate_numa_[nid] +  (expert_id * num_blocks + offset) * stride_gate_bytes_;
-        llamafile_sgemm(n_stride, n, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_proj_ptr, config_.hidden_size / ggml_blck_size(config_.gate_type), gate_input_ptr, gate_input_em, gate_output_ptr, config_.intermediate_size, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.gate_type, use_fp32_buffer_ ? GGML_TYPE_F32 : gate_vec_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
-        #endif  
+        void* gate_proj_ptr = (uint8_t*)gate_numa_[nid] +  (expert_id * num_blocks + offset) * packed_stride_gate_bytes_;
+        gemm(config_.gate_type, gate_vec_type, gate_proj_ptr, gate_input_ptr, gate_input_em, gate_output_ptr, n, n_stride, config_.hidden_size, config_.intermediate_size);
         void* up_input_ptr;
         if(use_fp32_buffer_){
             up_input_ptr = gate_input_ptr;
@@ -652,14 +751,8 @@ void MOE::forward_many_m(int qlen, int k, const uint64_t* expert_ids, const floa
                     : (uint8_t*)m_up_input_ + expert_offsets * up_bytes;
         }  
          
-        float* up_output_ptr = up_output_ + expert_offsets * config_.intermediate_size + ith * config_.stride;
-        #if defined(__AMX_INT8__) && defined(__AVX512VNNI__) 
-        void* up_proj_ptr = (uint8_t*)up_numa_[nid] +  (expert_id * num_blocks + offset) * amx_stride_up_bytes_;
-        amx_gemm_compute(config_.up_type, up_proj_ptr, up_input_ptr, up_output_ptr, n, config_.stride, config_.hidden_size, config_.intermediate_size);
-        #else
-        void* up_proj_ptr = (uint8_t*)up_numa_[nid] +  (expert_id * num_blocks + offset) * stride_up_bytes_;
-        llamafile_sgemm(n_stride, n, config_.hidden_size / ggml_blck_size(config_.up_type), up_proj_ptr, config_.hidden_size / ggml_blck_size(config_.up_type), up_input_ptr, up_input_em, up_output_ptr, config_.intermediate_size, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.up_type, use_fp32_buffer_ ? GGML_TYPE_F32 : up_vec_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
-        #endif
+        void* up_proj_ptr = (uint8_t*)up_numa_[nid] +  (expert_id * num_blocks + offset) * packed_stride_up_bytes_;
+        gemm(config_.up_type, up_vec_type, up_proj_ptr, up_input_ptr, up_input_em, up_output_ptr, n, n_stride, config_.hidden_size, config_.intermediate_size);
 
         for(int i=0; i<n; i++){
             act_fn(up_output_ptr + i*config_.intermediate_size, gate_output_ptr+ i*config_.intermediate_size , n_stride); 
@@ -688,22 +781,23 @@ void MOE::forward_many_m(int qlen, int k, const uint64_t* expert_ids, const floa
         }    
     }
     nth = config_.hidden_size / config_.stride;  
-    Backend_NUMA::getInstance().do_k_work_stealing_job(config_.expert_num, nth, nullptr, [&](int task_id) {
+    Backend_NUMA::getInstance().do_k_work_stealing_job(config_.expert_num * m_block_num, nth, nullptr, [&](int task_id) {
         int nid = Backend_NUMA::numa_node_; 
         int start_block = down_blocks_[nid].start_block;
         int num_blocks = down_blocks_[nid].num_blocks;
 
         if (num_blocks == 0) return;
  
-        int x = task_id - start_block * config_.expert_num;
-        int expert_id = x / num_blocks; 
-        if(expert_selected_num[expert_id] == 0) return;
+        int x = task_id - start_block * config_.expert_num * m_block_num;
+        int expert_id = x / num_blocks / m_block_num; 
+        int m_begin = x / num_blocks % m_block_num * MOE_M_BLOCK;
+        if(expert_selected_num[expert_id] <= m_begin) return;
 
         int offset = x % num_blocks;
         int ith = start_block + offset;
 
-        int expert_offsets = expert_reorder_offset[expert_id];
-        int n = expert_selected_num[expert_id];
+        int expert_offsets = expert_reorder_offset[expert_id] + m_begin;
+        int n = std::min(MOE_M_BLOCK, expert_selected_num[expert_id] - m_begin);
         size_t n_stride = config_.stride;
         void* down_input_ptr;
         if(use_fp32_buffer_){
@@ -712,13 +806,8 @@ void MOE::forward_many_m(int qlen, int k, const uint64_t* expert_ids, const floa
             down_input_ptr = down_input_ + expert_offsets * config_.intermediate_size * down_type_size / down_blk_size;
         }
         float* down_output_ptr = down_output_  + expert_offsets * config_.hidden_size + ith * config_.stride;
-        #if defined(__AMX_INT8__) && defined(__AVX512VNNI__) 
-        uint8_t* down_proj_ptr = (uint8_t*)down_numa_[nid] + (expert_id * num_blocks + offset) * amx_stride_down_bytes_;
-        amx_gemm_compute(config_.down_type, down_proj_ptr, down_input_ptr, down_output_ptr, n, n_stride, config_.intermediate_size, config_.hidden_size);
-        #else
-        void* down_proj_ptr = (uint8_t*)down_numa_[nid] + (expert_id * num_blocks + offset) * stride_down_bytes_;
-        llamafile_sgemm(n_stride, n, config_.intermediate_size / down_blk_size, down_proj_ptr, config_.intermediate_size / down_blk_size, down_input_ptr, down_input_em, down_output_ptr, config_.hidden_size, 0, 1, GGML_TASK_TYPE_COMPUTE, config_.down_type, use_fp32_buffer_ ? GGML_TYPE_F32 : down_vec_type, GGML_TYPE_F32, GGML_PREC_DEFAULT);
-        #endif    
+        void* down_proj_ptr = (uint8_t*)down_numa_[nid] + (expert_id * num_blocks + offset) * packed_stride_down_bytes_;
+        gemm(config_.down_type, down_vec_type, down_proj_ptr, down_input_ptr, down_input_em, down_output_ptr, n, n_stride, config_.intermediate_size, config_.hidden_size);
     }, nullptr);
       Backend_NUMA::getInstance().do_k_work_stealing_job(qlen, nth, nullptr, [&](int task_id) {
         int nid = Backend_NUMA::numa_node_; 
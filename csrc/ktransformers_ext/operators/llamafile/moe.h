@@ -18,17 +18,21 @@
 
 #include "../../cpu_backend/backend.h"
 #include "../../cpu_backend/backend_numa.h"
+#include "../../cpu_backend/cpu_features.h"
 #include "../../cpu_backend/shared_mem_buffer.h"
 #include "conversion.h"
 #include "llama.cpp/ggml-impl.h"
 #include "llama.cpp/ggml-quants.h"
 #include "llama.cpp/ggml.h"
 #include "llamafile/sgemm.h"
-// #define __AMX_INT8__ 1
-// #define __AVX512VNNI__ 1
-#if defined(__AMX_INT8__) && defined(__AVX512VNNI__)
+#include "weight_types.h"
+#if defined(KTRANSFORMERS_HAS_AMX_KERNELS)
     #include "amx_gemm.hpp"
 #endif
+
+// tokens of one expert per gate/up or down task, the row blocks of a larger
+// expert batch run as separate tasks rather than one after another in a gemm
+#define MOE_M_BLOCK 64
  
 struct MOEConfig {
     int expert_num;
@@ -45,6 +49,13 @@ struct MOEConfig {
     ggml_type up_type;
     ggml_type down_type;
     ggml_type hidden_type;
+    // fp32 weight_scale_inv of fp8 (GGML_TYPE_FP8_E4M3) projections, unused otherwise
+    void* gate_scale = nullptr;
+    void* up_scale = nullptr;
+    void* down_scale = nullptr;
+    // opt-in: pack gate and up of each stride block next to each other and
+    // compute them with one gemm, only taken when gate_type == up_type
+    bool fuse_gate_up = false;
 
     MOEConfig() {}
 
@@ -65,6 +76,12 @@ class MOE {
     void forward_one_numa(int k, const uint64_t* expert_ids, const float* weights, const void* input, void* output, Backend* backend);
     void forward_many_numa(int qlen, int k, const uint64_t* expert_ids, const float* weights, const void* input, void* output, Backend* backend);
     void forward_many_m(int qlen, int k, const uint64_t* expert_ids, const float* weights, const void* input, void* output, Backend* backend);
+    // output[m, n] = input[m, k] * proj[n, k]^T, on the kernels matching the weight layout
+    void gemm(ggml_type type, ggml_type vec_type, const void* proj, const void* input, size_t input_em, float* output, int m, int n, int k, int ldc);
+    // whether weights of this type are kept in the amx packed layout, fp8 has its own
+    bool packs_amx(ggml_type type) const;
+    // gate outputs are [gate stride | up stride] per stride block when fused
+    int gate_output_width() const { return fuse_gate_up_ ? 2 : 1; }
     using ForwardOneImpl = void (MOE::*)(int, const uint64_t*, const float*, const void*, void*, Backend*);
     using ForwardManyImpl = void (MOE::*)(int, int, const uint64_t*, const float*, const void*, void*, Backend*);
     ForwardOneImpl forward_one_impl;
@@ -74,8 +91,8 @@ class MOE {
     void* up_proj_;    // [expert_num * intermediate_size * hidden_size ( /32 if quantized)]
     void* down_proj_;  // [expert_num * hidden_size * intermediate_size ( /32 if quantized)]
  
-    std::vector<void*> gate_numa_;  // [numa_num, nth * stride * expert_num * hidden_size ( /32 if quantized)]
-    std::vector<void*> up_numa_;    // [numa_num, nth * stride * expert_num * hidden_size ( /32 if quantized)]
+    std::vector<void*> gate_numa_;  // [numa_num, nth * stride * expert_num * hidden_size ( /32 if quantized)], x2 holding up too when fused
+    std::vector<void*> up_numa_;    // [numa_num, nth * stride * expert_num * hidden_size ( /32 if quantized)], unused when fused
     std::vector<void*> down_numa_;  // [numa_num, nth * stride * expert_num *  intermediate_size ( /32 if quantized)]
     std::vector<size_t> gate_numa_size_;
     std::vector<size_t> up_numa_size_;
@@ -83,9 +100,10 @@ class MOE {
     size_t stride_gate_bytes_;
     size_t stride_up_bytes_; 
     size_t stride_down_bytes_;
-    size_t amx_stride_gate_bytes_;
-    size_t amx_stride_up_bytes_; 
-    size_t amx_stride_down_bytes_;
+    size_t packed_stride_gate_bytes_;  // stride bytes in the numa-local copy, amx packed or plain
+    size_t packed_stride_up_bytes_;
+    size_t packed_stride_down_bytes_;
+    size_t packed_stride_gate_up_bytes_;  // gate rows then up rows of one stride block, when fused
     struct NumaBlock {
         int node_id;
         int start_block;
@@ -95,7 +113,7 @@ class MOE {
     std::vector<NumaBlock> down_blocks_;
 
     float* s_input_fp32_;                      // [hidden_size]
-    float* s_gate_output_;        // [routed_expert_num, intermediate_size]
+    float* s_gate_output_;        // [routed_expert_num, intermediate_size], x2 when fused
     float* s_up_output_;          // [routed_expert_num, intermediate_size]
     float* s_down_output_;        // [routed_expert_num, hidden_size] 
     uint8_t* s_gate_input_;                    // [hidden_size * ggml_type_size(ggml_internal_get_type_traits(gate_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(gate_type).vec_dot_type)]
@@ -126,7 +144,7 @@ class MOE {
     float* input_fp32_;        //[ group_max_len * hidden_size]
     uint8_t* gate_input_;      //[ group_max_len * hidden_size * ggml_type_size(ggml_internal_get_type_traits(gate_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(gate_type).vec_dot_type)]
     uint8_t* up_input_;        //[ group_max_len * hidden_size * ggml_type_size(ggml_internal_get_type_traits(up_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(up_type).vec_dot_type)]
-    float* gate_output_;       //[ group_max_len * routed_expert_num * intermediate_size]
+    float* gate_output_;       //[ group_max_len * routed_expert_num * intermediate_size], x2 when fused
     float* up_output_;         //[ group_max_len * routed_expert_num * intermediate_size]
     uint8_t* down_input_;      //[ group_max_len * routed_expert_num * intermediate_size * ggml_type_size(ggml_internal_get_type_traits(down_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(down_type).vec_dot_type)]
     float* down_output_;       //[ group_max_len * routed_expert_num * hidden_size]
@@ -135,6 +153,8 @@ class MOE {
     void* m_gate_input_;      //[ group_max_len * routed_expert_num * hidden_size //* ggml_type_size(ggml_internal_get_type_traits(gate_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(gate_type).vec_dot_type)]
     void* m_up_input_;        //[ group_max_len * routed_expert_num * hidden_size //* ggml_type_size(ggml_internal_get_type_traits(up_type).vec_dot_type) / ggml_blck_size(ggml_internal_get_type_traits(up_type).vec_dot_type)]
     bool use_fp32_buffer_;
+    bool use_amx_;  // weights are in amx packed layout, chosen from the detected isa
+    bool fuse_gate_up_;  // gate_numa_ holds [gate stride | up stride] blocks, see MOEConfig::fuse_gate_up
  
 };
 
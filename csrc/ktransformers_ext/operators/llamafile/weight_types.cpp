@@ -0,0 +1,88 @@
+/**
+ * @Description  : Weight types of the llamafile operators, ggml types plus the
+ *                 checkpoint formats ggml has no type for.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+#include "weight_types.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+size_t weight_bytes(ggml_type type, size_t n) {
+    if (type == GGML_TYPE_FP8_E4M3) {
+        return n;
+    }
+    if (is_int4_type(type)) {
+        return n / 2;
+    }
+    return n * ggml_type_size(type) / ggml_blck_size(type);
+}
+
+size_t weight_packed_bytes(ggml_type type, size_t n) {
+    if (type == GGML_TYPE_FP8_E4M3) {
+        return n / QK_FP8 * sizeof(block_fp8);
+    }
+    if (is_int4_type(type)) {
+        return n / QK_INT4 * sizeof(block_int4);
+    }
+    return n * ggml_type_size(type) / ggml_blck_size(type);
+}
+
+bool weight_needs_packing(ggml_type type) { return type == GGML_TYPE_FP8_E4M3 || is_int4_type(type); }
+
+int weight_blck_size(ggml_type type) {
+    if (type == GGML_TYPE_FP8_E4M3) {
+        return 1;
+    }
+    if (is_int4_type(type)) {
+        return QK_INT4;
+    }
+    return ggml_blck_size(type);
+}
+
+ggml_type weight_vec_dot_type(ggml_type type) {
+    if (type == GGML_TYPE_FP8_E4M3) {
+        return GGML_TYPE_BF16;
+    }
+    if (is_int4_type(type)) {
+        return GGML_TYPE_Q8_1;
+    }
+    return ggml_internal_get_type_traits(type).vec_dot_type;
+}
+
+const char* weight_type_name(ggml_type type) {
+    if (type == GGML_TYPE_FP8_E4M3) {
+        return "fp8_e4m3";
+    }
+    if (type == GGML_TYPE_GPTQ_INT4) {
+        return "gptq_int4";
+    }
+    if (type == GGML_TYPE_AWQ_INT4) {
+        return "awq_int4";
+    }
+    return ggml_internal_get_type_traits(type).type_name;
+}
+
+void pack_weight_rows(void* dst, const void* weight, const void* scale, ggml_type type, int64_t row_begin, int nrows, int k) {
+    if (is_int4_type(type)) {
+        throw std::invalid_argument(std::string(weight_type_name(type)) + " weights need their zeros and group size");
+    }
+    if (type == GGML_TYPE_FP8_E4M3) {
+        fp8_pack_rows((block_fp8*)dst, (const uint8_t*)weight, (const float*)scale, row_begin, nrows, k);
+        return;
+    }
+    const size_t row_bytes = weight_bytes(type, k);
+    memcpy(dst, (const uint8_t*)weight + row_begin * row_bytes, nrows * row_bytes);
+}
+
+void pack_weight_rows(void* dst, const void* weight, const void* scale, const void* zeros, int group_size, ggml_type type,
+                      int64_t n, int64_t row_begin, int nrows, int k) {
+    if (is_int4_type(type)) {
+        int4_pack_rows((block_int4*)dst, type, (const int32_t*)weight, (const int32_t*)zeros, (const ggml_fp16_t*)scale,
+                       group_size, n, k, row_begin, nrows);
+        return;
+    }
+    pack_weight_rows(dst, weight, scale, type, row_begin, nrows, k);
+}
@@ -0,0 +1,50 @@
+/**
+ * @Description  : Weight types of the llamafile operators, ggml types plus the
+ *                 checkpoint formats ggml has no type for.
+ * @Version      : 1.0.0
+ * @Copyright (c) 2025 by KVCache.AI, All Rights Reserved.
+ **/
+#ifndef CPUINFER_OPERATOR_WEIGHT_TYPES_H
+#define CPUINFER_OPERATOR_WEIGHT_TYPES_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "fp8_gemm.h"
+#include "int4_gemm.h"
+#include "llama.cpp/ggml.h"
+
+// bytes of `n` weights of the given type as passed in by python (one byte per
+// value for fp8 and half a byte for gptq/awq, whose scales and zeros come in
+// separate tensors)
+size_t weight_bytes(ggml_type type, size_t n);
+
+// bytes of `n` weights once repacked for the operators, `n` must be a multiple
+// of QK_FP8 / QK_INT4 for fp8 / gptq/awq
+size_t weight_packed_bytes(ggml_type type, size_t n);
+
+// true for the types the operators only compute on once repacked, fp8 and
+// gptq/awq
+bool weight_needs_packing(ggml_type type);
+
+// elements per block as passed in by python, 1 for fp8 and QK_INT4 for the
+// repacked gptq/awq blocks
+int weight_blck_size(ggml_type type);
+
+// activation type the weight type is multiplied with, fp8 runs on bf16 and
+// gptq/awq on q8_1
+ggml_type weight_vec_dot_type(ggml_type type);
+
+const char* weight_type_name(ggml_type type);
+
+// Copy rows [row_begin, row_begin + nrows) of a [*, k] weight as passed in by
+// python to `dst` in the layout the operators compute on: memcpy for ggml types,
+// `fp8_pack_rows` with `scale` for fp8.
+void pack_weight_rows(void* dst, const void* weight, const void* scale, ggml_type type, int64_t row_begin, int nrows, int k);
+
+// Same for weights that may be gptq/awq, which pack across all `n` rows of the
+// tensor and take their `zeros` and `group_size` on top of `scale`.
+void pack_weight_rows(void* dst, const void* weight, const void* scale, const void* zeros, int group_size, ggml_type type,
+                      int64_t n, int64_t row_begin, int nrows, int k);
+
+#endif
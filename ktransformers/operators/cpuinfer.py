@@ -44,6 +44,7 @@ class CPUInferKVCache:
         max_thread_num: int = 32,
         max_batch_size: int = 4,
         max_block_num: int = 512,
+        kv_lora_rank: int = 0,
     ):
 
         if anchor_type == "FIXED":
@@ -68,6 +69,8 @@ class CPUInferKVCache:
             kv_type = cpuinfer_ext.kvcache.ggml_type.Q4_0
         elif kv_type == "Q8_0":
             kv_type = cpuinfer_ext.kvcache.ggml_type.Q8_0
+        elif kv_type == "FP8_E4M3":
+            kv_type = cpuinfer_ext.kvcache.ggml_type.FP8_E4M3
         else:
             raise ValueError(f"Unknown kv type: {kv_type}")
 
@@ -94,6 +97,7 @@ class CPUInferKVCache:
             max_block_num,
             max_batch_size,
             max_thread_num,
+            kv_lora_rank,
         )
         self.kvcache = cpuinfer_ext.kvcache.KVCache(self.config)
 
@@ -136,6 +140,69 @@ class CPUInferKVCache:
         assert cache_total_len > 0, "cache_total_len: {}".format(cache_total_len)
         self.kvcache.update_cache_total_len(cache_total_len)
 
+    # The block pool below is updated synchronously, sync the CPUInfer queue
+    # before touching the block tables of queued tasks.
+    def alloc_block(self) -> int:
+        return self.kvcache.alloc_block()
+
+    def fork_block_table(
+        self, src_table: torch.Tensor, dst_table: torch.Tensor, block_num: int
+    ):
+        # dst_table shares the first block_num blocks of src_table, a shared
+        # block is copied on the first append through either table
+        self.kvcache.fork_block_table(
+            src_table.data_ptr(), dst_table.data_ptr(), block_num
+        )
+
+    def free_block_table(self, block_table: torch.Tensor, block_num: int):
+        self.kvcache.free_block_table(block_table.data_ptr(), block_num)
+
+    # block_table: (bsz, max_block_num), cache_seqlens: (bsz,), both int32 and
+    # updated in place
+    # spill_table: (bsz, spill_block_num), the evicted blocks of highest
+    # importance that are kept out of the pool, -1 past the spilled ones
+    # Returns a CPUInfer task like attn_prefill, the tables are updated once
+    # it ran.
+    def evict_window(
+        self,
+        block_table: torch.Tensor,
+        cache_seqlens: torch.Tensor,
+        sink_block_num: int,
+        window_block_num: int,
+        spill_table: torch.Tensor | None = None,
+    ):
+        # keeps the sink blocks and the recent window of every sequence, new
+        # tokens take their rotary position from cache_seqlens afterwards
+        for name, table in (
+            ("block_table", block_table),
+            ("cache_seqlens", cache_seqlens),
+            ("spill_table", spill_table),
+        ):
+            if table is None:
+                continue
+            assert (
+                table.dtype == torch.int32
+                and table.is_contiguous()
+                and table.device == torch.device("cpu")
+            ), "{} dtype: {}, contiguous: {}, device: {}".format(
+                name, table.dtype, table.is_contiguous(), table.device
+            )
+        assert block_table.dim() == 2 and cache_seqlens.dim() == 1
+        batch_size, max_block_num = block_table.shape
+        assert cache_seqlens.size(0) == batch_size
+        spill_block_num = 0 if spill_table is None else spill_table.shape[1]
+        assert spill_table is None or spill_table.size(0) == batch_size
+        return self.kvcache.evict_window(
+            block_table.data_ptr(),
+            cache_seqlens.data_ptr(),
+            batch_size,
+            max_block_num,
+            sink_block_num,
+            window_block_num,
+            0 if spill_table is None else spill_table.data_ptr(),
+            spill_block_num,
+        )
+
     # q_in: (bsz, q_len, q_head_num, head_dim)
     # output: (bsz, q_len, q_head_num, head_dim)
     # attn_lse: (bsz, q_len, q_head_num)
@@ -701,6 +768,70 @@ class CPUInferKVCache:
             local,
         )
 
+    def attn_prefill(
+        self,
+        q_in: torch.Tensor,
+        k_in: torch.Tensor,
+        v_in: torch.Tensor,
+        output: torch.Tensor,
+        attn_lse: torch.Tensor,
+        layer_idx: int,
+        block_table: torch.Tensor,
+        cache_seqlens: torch.Tensor,
+    ):
+        # causal attention of q_in against the cached prefix and the chunk
+        # itself, k_in/v_in are appended to the cache after cache_seqlens
+        batch_size = block_table.size(0)
+        max_block_num = block_table.size(1)
+        q_len = q_in.size(1)
+
+        return self.kvcache.attn_prefill(
+            q_in.data_ptr(),
+            k_in.data_ptr(),
+            v_in.data_ptr(),
+            output.data_ptr(),
+            attn_lse.data_ptr(),
+            layer_idx,
+            q_len,
+            batch_size,
+            max_block_num,
+            block_table.data_ptr(),
+            cache_seqlens.data_ptr(),
+        )
+
+    def attn_mla(
+        self,
+        q_in: torch.Tensor,
+        kv_in: torch.Tensor,
+        output: torch.Tensor,
+        attn_lse: torch.Tensor,
+        softmax_scale: float,
+        layer_idx: int,
+        block_table: torch.Tensor,
+        cache_seqlens: torch.Tensor,
+    ):
+        # q_in [bsz, q_len, q_head_num, kv_lora_rank + rope dim] is the absorbed
+        # query (q_nope @ W_UK, q_pe), kv_in [bsz, q_len, kv_lora_rank + rope
+        # dim] the new compressed_kv and k_pe rows (None if already cached),
+        # output [bsz, q_len, q_head_num, kv_lora_rank] still needs W_UV
+        batch_size = block_table.size(0)
+        max_block_num = block_table.size(1)
+        q_len = q_in.size(1)
+
+        return self.kvcache.attn_mla(
+            q_in.data_ptr(),
+            kv_in.data_ptr() if kv_in is not None else 0,
+            output.data_ptr(),
+            attn_lse.data_ptr(),
+            softmax_scale,
+            layer_idx,
+            q_len,
+            batch_size,
+            max_block_num,
+            block_table.data_ptr(),
+            cache_seqlens.data_ptr(),
+        )
+
     def get_all_kvcache_one_layer(
         self, k_in: torch.Tensor, v_in: torch.Tensor, layer_id: int
     ):
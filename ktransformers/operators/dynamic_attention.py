@@ -62,10 +62,13 @@ class DynamicScaledDotProductAttention:
         elif anchor_type != "FIXED" and anchor_type != "DYNAMIC":
             assert anchor_num == 1
 
-        valid_kv_types = ["FP16", "FP32", "Q4_0", "Q8_0"]
+        valid_kv_types = ["FP16", "FP32", "Q4_0", "Q8_0", "FP8_E4M3"]
         assert kv_type in valid_kv_types
         if kv_type != "FP16" and kv_type != "FP32":
             assert block_size % 32 == 0
+        if kv_type == "FP8_E4M3":
+            # fp8 blocks hold 128 values along head_dim (K) and tokens (V)
+            assert block_size % 128 == 0
 
         valid_block_selection_modes = ["SHARED", "SEPARATE"]  # individual
         assert block_selection_mode in valid_block_selection_modes
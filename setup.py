@@ -96,10 +96,12 @@ class CpuInstructInfo:
     FANCY = "FANCY"
     AVX512 = "AVX512"
     AVX2 = "AVX2"
+    DISPATCH = "DISPATCH"
     CMAKE_NATIVE = "-DLLAMA_NATIVE=ON"
     CMAKE_FANCY = "-DLLAMA_NATIVE=OFF -DLLAMA_FMA=ON -DLLAMA_F16C=ON -DLLAMA_AVX=ON -DLLAMA_AVX2=ON -DLLAMA_AVX512=ON -DLLAMA_AVX512_FANCY_SIMD=ON"
     CMAKE_AVX512 = "-DLLAMA_NATIVE=OFF -DLLAMA_FMA=ON -DLLAMA_F16C=ON -DLLAMA_AVX=ON -DLLAMA_AVX2=ON -DLLAMA_AVX512=ON"
     CMAKE_AVX2 = "-DLLAMA_NATIVE=OFF -DLLAMA_FMA=ON -DLLAMA_F16C=ON -DLLAMA_AVX=ON -DLLAMA_AVX2=ON"
+    CMAKE_DISPATCH = "-DLLAMA_NATIVE=OFF -DKTRANSFORMERS_CPU_DISPATCH=ON"
 
 class VersionInfo:
     THIS_DIR = os.path.dirname(os.path.abspath(__file__))
@@ -215,6 +217,8 @@ class VersionInfo:
             return "avx512"
         elif CpuInstructInfo.CPU_INSTRUCT == CpuInstructInfo.AVX2:
             return "avx2"
+        elif CpuInstructInfo.CPU_INSTRUCT == CpuInstructInfo.DISPATCH:
+            return "dispatch"
         else:
             print("Using native cpu instruct")
         if sys.platform.startswith("linux"):
@@ -566,6 +570,8 @@ class CMakeBuild(BuildExtension):
             cpu_args = CpuInstructInfo.CMAKE_AVX512
         elif CpuInstructInfo.CPU_INSTRUCT == CpuInstructInfo.AVX2:
             cpu_args = CpuInstructInfo.CMAKE_AVX2
+        elif CpuInstructInfo.CPU_INSTRUCT == CpuInstructInfo.DISPATCH:
+            cpu_args = CpuInstructInfo.CMAKE_DISPATCH
         else:
             cpu_args = CpuInstructInfo.CMAKE_NATIVE
 
@@ -29,6 +29,11 @@
 #include <cassert>
 // #include "llamafile.h"
 
+#if defined(KTRANSFORMERS_CPU_DISPATCH)
+// cpuid and xgetbv checks are done by the compiler runtime
+#define X86_HAVE(x) __builtin_cpu_supports(#x)
+#endif
+
 static const struct GemmFuncs {
     bool (*sgemm)(long, long, long, const void*, long, const void*, long, void*, long, int, int, int, int, int, int, int);
     bool (*mixmul)(const struct ggml_compute_params*, const struct ggml_tensor*, const struct ggml_tensor*, const struct ggml_tensor*, struct ggml_tensor*);
@@ -90,7 +95,39 @@ static const struct GemmFuncs {
         //     mixmul = llamafile_mixmul_unsupported;
         // }
 
-#if defined(__AVX__)
+#if defined(KTRANSFORMERS_CPU_DISPATCH)
+        // Each variant is compiled with its own -m flags and the rest of the
+        // module targets AVX2/FMA/F16C, so only the wider ones are checked.
+        __builtin_cpu_init();
+        if (X86_HAVE(avx512f)) {
+            if (X86_HAVE(avx512vl) &&    //
+                X86_HAVE(avx512bw) &&    //
+                X86_HAVE(avx512dq) &&    //
+                X86_HAVE(avx512vnni) &&  //
+                X86_HAVE(avx512bf16)) {
+                // AMD Zen4+ (2023-), Intel Sapphire Rapids+ (2023-)
+                sgemm = llamafile_sgemm_amd_zen4;
+                mixmul = llamafile_mixmul_amd_zen4;
+                iqk_mixmul = iqk_mul_mat_moe_zen4;
+            } else {
+                // Intel Xeon Skylake+ (2015-)
+                sgemm = llamafile_sgemm_amd_avx512f;
+                mixmul = llamafile_mixmul_amd_avx512f;
+                iqk_mixmul = iqk_mul_mat_moe;
+            }
+        } else if (X86_HAVE(avxvnni)) {
+            // Intel Alderlake (2021-)
+            sgemm = llamafile_sgemm_amd_avxvnni;
+            mixmul = llamafile_mixmul_amd_avxvnni;
+            iqk_mixmul = iqk_mul_mat_moe;
+        } else {
+            // Intel Haswell/Broadwell/Skylake (2013-2020)
+            // AMD Excavator (2015-2022)
+            sgemm = llamafile_sgemm_amd_avx2;
+            mixmul = llamafile_mixmul_amd_avx2;
+            iqk_mixmul = iqk_mul_mat_moe;
+        }
+#elif defined(__AVX__)
 #if defined(__FMA__) || (defined(_MSC_VER) && (defined(__AVX2__) || defined(__AVX512F__)))
 #if defined(__AVX2__)
 #if defined(__AVX512F__)
@@ -0,0 +1,40 @@
+// Copyright(c) 2025 by KVCache.AI, All Rights Reserved.
+
+// Included by the ISA variant files before their kernels, with one of
+// TINYBLAS_DISPATCH_AVXVNNI, TINYBLAS_DISPATCH_AVX512F or TINYBLAS_DISPATCH_ZEN4
+// defined. In a KTRANSFORMERS_CPU_DISPATCH build the shared headers are
+// included here at the baseline ISA and only the kernels that follow are
+// compiled for the variant with a target pragma. With -m flags for the whole
+// file, an inline function or template of those headers could be emitted with
+// AVX512 code and kept by the linker for the baseline callers. g++ does not
+// define the ISA macros for a target pragma, the ones the kernels test are
+// defined here and undefined by tinyblas_cpu_dispatch_end.h.
+
+#if defined(KTRANSFORMERS_CPU_DISPATCH)
+#include <array>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include "llama.cpp/ggml-impl.h"
+#include "llama.cpp/ggml-quants.h"
+#include "flags.h"
+#include "sgemm.h"
+
+#pragma GCC push_options
+#if defined(TINYBLAS_DISPATCH_AVXVNNI)
+#pragma GCC target("avxvnni")
+#define __AVXVNNI__ 1
+#elif defined(TINYBLAS_DISPATCH_AVX512F)
+#pragma GCC target("avx512f,avx512cd")
+#define __AVX512F__ 1
+#elif defined(TINYBLAS_DISPATCH_ZEN4)
+#pragma GCC target("avx512f,avx512cd,avx512vl,avx512bw,avx512dq,avx512vnni,avx512bf16")
+#define __AVX512F__ 1
+#define __AVX512VL__ 1
+#define __AVX512BW__ 1
+#define __AVX512DQ__ 1
+#define __AVX512VNNI__ 1
+#define __AVX512BF16__ 1
+#endif
+#endif  // KTRANSFORMERS_CPU_DISPATCH
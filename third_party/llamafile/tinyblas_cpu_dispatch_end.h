@@ -0,0 +1,19 @@
+// Copyright(c) 2025 by KVCache.AI, All Rights Reserved.
+
+// Closes tinyblas_cpu_dispatch_begin.h.
+
+#if defined(KTRANSFORMERS_CPU_DISPATCH)
+#if defined(TINYBLAS_DISPATCH_AVXVNNI)
+#undef __AVXVNNI__
+#elif defined(TINYBLAS_DISPATCH_AVX512F)
+#undef __AVX512F__
+#elif defined(TINYBLAS_DISPATCH_ZEN4)
+#undef __AVX512F__
+#undef __AVX512VL__
+#undef __AVX512BW__
+#undef __AVX512DQ__
+#undef __AVX512VNNI__
+#undef __AVX512BF16__
+#endif
+#pragma GCC pop_options
+#endif  // KTRANSFORMERS_CPU_DISPATCH
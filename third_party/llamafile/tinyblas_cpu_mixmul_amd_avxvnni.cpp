@@ -4,6 +4,9 @@
 // Copyright(c) 2024 by KVCache.AI, All Rights Reserved.
 
 #if defined(__x86_64__) || defined(_M_X64)
+#define TINYBLAS_DISPATCH_AVXVNNI
+#include "tinyblas_cpu_dispatch_begin.h"
 #define llamafile_mixmul llamafile_mixmul_amd_avxvnni
 #include "tinyblas_cpu_mixmul.inc"
+#include "tinyblas_cpu_dispatch_end.h"
 #endif  // __x86_64__
@@ -4,6 +4,9 @@
 // Copyright(c) 2024 by KVCache.AI, All Rights Reserved.
 
 #if defined(__x86_64__) || defined(_M_X64)
+#define TINYBLAS_DISPATCH_AVX512F
+#include "tinyblas_cpu_dispatch_begin.h"
 #define llamafile_sgemm llamafile_sgemm_amd_avx512f
 #include "tinyblas_cpu_sgemm.inc"
+#include "tinyblas_cpu_dispatch_end.h"
 #endif  // __x86_64__
@@ -4,7 +4,10 @@
 // Copyright(c) 2024 by KVCache.AI, All Rights Reserved.
 
 #if defined(__x86_64__) || defined(_M_X64)
+#define TINYBLAS_DISPATCH_ZEN4
+#include "tinyblas_cpu_dispatch_begin.h"
 #define llamafile_sgemm llamafile_sgemm_amd_zen4
 #define iqk_mul_mat iqk_mul_mat_zen4
 #include "tinyblas_cpu_sgemm.inc"
+#include "tinyblas_cpu_dispatch_end.h"
 #endif  // __x86_64__